@@ -0,0 +1,259 @@
+// Benchmarks the engine in-process. For every table size, a fresh table is
+// loaded with bulk inserts and each workload runs its statements through
+// run_command, like lines typed at the prompt. Throughput and latency
+// percentiles are written to stdout as JSON.
+#define DB_NO_MAIN
+#include "main.c"
+
+#ifndef BENCH_FLAGS
+#define BENCH_FLAGS ""
+#endif
+
+#define BENCH_SCHEMA_FILENAME DIR_PREFIX "bench.schema"
+#define BENCH_MIN_ROWS 1000
+#define BENCH_DEFAULT_MAX_ROWS 10000000
+#define BENCH_INSERT_BATCH 1000
+#define BENCH_RANGE_ROWS 100
+#define BENCH_MAX_OPS 10000
+#define BENCH_MIN_OPS 5
+// A workload stops after this long once it has run BENCH_MIN_OPS statements
+#define BENCH_TIME_BUDGET_NS (2 * 1000000000ULL)
+#define BENCH_STATEMENT_SIZE (BENCH_INSERT_BATCH * 64)
+
+// Writes the statement of a workload's op-th run into sql
+typedef void (*BenchStatement)(char* sql, uint32_t op, uint32_t num_rows);
+
+typedef struct {
+  const char* name;
+  BenchStatement statement;
+  // The most rows a statement returns or changes
+  uint32_t rows_per_op;
+} BenchWorkload;
+
+typedef struct {
+  uint64_t* latencies;
+  uint32_t num_ops;
+  uint64_t elapsed_ns;
+} BenchResult;
+
+// Spreads the ops of a workload over the table. 7919 is prime, so the
+// first num_rows ops hit distinct rows.
+uint32_t bench_row_id(uint32_t op, uint32_t num_rows) {
+  return (uint32_t)(((uint64_t)op * 7919) % num_rows) + 1;
+}
+
+void bench_insert(char* sql, uint32_t op, uint32_t num_rows) {
+  char* end = sql + sprintf(sql, "insert into bench values ");
+  uint32_t first = op * BENCH_INSERT_BATCH + 1;
+  uint32_t last = first + BENCH_INSERT_BATCH - 1;
+  if (last > num_rows) {
+    last = num_rows;
+  }
+  for (uint32_t id = first; id <= last; id++) {
+    end += sprintf(end, "%s(%u, user%u, person%u@example.com)",
+                   id == first ? "" : ", ", id, id % 100, id);
+  }
+}
+
+void bench_point_select(char* sql, uint32_t op, uint32_t num_rows) {
+  sprintf(sql, "select * from bench where id = %u",
+          bench_row_id(op, num_rows));
+}
+
+void bench_range_select(char* sql, uint32_t op, uint32_t num_rows) {
+  uint32_t id = bench_row_id(op, num_rows);
+  sprintf(sql, "select * from bench where id >= %u and id < %u", id,
+          id + BENCH_RANGE_ROWS);
+}
+
+void bench_varchar_scan(char* sql, uint32_t op, uint32_t num_rows) {
+  sprintf(sql, "select id from bench where email = 'person%u@example.com'",
+          bench_row_id(op, num_rows));
+}
+
+void bench_update(char* sql, uint32_t op, uint32_t num_rows) {
+  sprintf(sql, "update bench set username = 'updated' where id = %u",
+          bench_row_id(op, num_rows));
+}
+
+void bench_delete(char* sql, uint32_t op, uint32_t num_rows) {
+  sprintf(sql, "delete from bench where id = %u", bench_row_id(op, num_rows));
+}
+
+// Deletes come last, after every other workload has seen all the rows
+BenchWorkload bench_workloads[] = {
+    {"point_select", bench_point_select, 1},
+    {"range_select", bench_range_select, BENCH_RANGE_ROWS},
+    {"varchar_scan", bench_varchar_scan, 1},
+    {"update", bench_update, 1},
+    {"delete", bench_delete, 1},
+};
+
+int compare_latencies(const void* a, const void* b) {
+  uint64_t x = *(const uint64_t*)a;
+  uint64_t y = *(const uint64_t*)b;
+  return (x > y) - (x < y);
+}
+
+// Runs statements until max_ops have run, or until the time budget is
+// spent once a few have
+BenchResult bench_run(Session* session, BenchStatement statement,
+                      uint32_t num_rows, uint32_t max_ops, bool timed) {
+  BenchResult result = {malloc(max_ops * sizeof(uint64_t)), 0, 0};
+  InputBuffer input_buffer = {malloc(BENCH_STATEMENT_SIZE), 0,
+                              BENCH_STATEMENT_SIZE};
+  uint64_t start = now_ns();
+  while (result.num_ops < max_ops) {
+    statement(input_buffer.buffer, result.num_ops, num_rows);
+    input_buffer.input_length = strlen(input_buffer.buffer);
+    uint64_t op_start = now_ns();
+    run_command(session, &input_buffer);
+    uint64_t op_end = now_ns();
+    result.latencies[result.num_ops++] = op_end - op_start;
+    result.elapsed_ns += op_end - op_start;
+    if (timed && result.num_ops >= BENCH_MIN_OPS &&
+        op_end - start > BENCH_TIME_BUDGET_NS) {
+      break;
+    }
+  }
+  free(input_buffer.buffer);
+  qsort(result.latencies, result.num_ops, sizeof(uint64_t), compare_latencies);
+  return result;
+}
+
+void bench_print(const char* name, uint32_t num_rows, uint32_t rows_per_op,
+                 BenchResult* result, bool first) {
+  double seconds = result->elapsed_ns / 1e9;
+  uint64_t p50 = result->latencies[result->num_ops / 2];
+  uint64_t p99 = result->latencies[(uint64_t)result->num_ops * 99 / 100];
+  printf("%s\n    {\"workload\": \"%s\", \"rows\": %u, \"ops\": %u, "
+         "\"rows_per_op\": %u, \"seconds\": %.6f, \"ops_per_sec\": %.1f, "
+         "\"p50_us\": %.1f, \"p99_us\": %.1f}",
+         first ? "" : ",", name, num_rows, result->num_ops, rows_per_op,
+         seconds, result->num_ops / seconds, p50 / 1e3, p99 / 1e3);
+  free(result->latencies);
+}
+
+void bench_remove_files() {
+  unlink(DIR_PREFIX "bench.table");
+  unlink(DIR_PREFIX "bench.index");
+  unlink(DIR_PREFIX "bench.overflow");
+  unlink(DIR_PREFIX "bench.zones");
+  unlink(TABLE_CATALOG_FILENAME);
+  unlink(WAL_FILENAME);
+}
+
+int main(int argc, char* argv[]) {
+  uint64_t buffer_pool_size = DEFAULT_BUFFER_POOL_SIZE;
+  uint32_t sync_window_ms = WAL_DEFAULT_SYNC_WINDOW_MS;
+  uint32_t max_rows = BENCH_DEFAULT_MAX_ROWS;
+  bool use_mmap = false;
+  uint32_t new_page_size = DEFAULT_PAGE_SIZE;
+  const char* directory = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--max-rows") == 0 && i + 1 < argc) {
+      max_rows = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--buffer-pool") == 0 && i + 1 < argc) {
+      buffer_pool_size = parse_size(argv[++i]);
+    } else if (strcmp(argv[i], "--wal-sync-window") == 0 && i + 1 < argc) {
+      sync_window_ms = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--mmap") == 0) {
+      use_mmap = true;
+    } else if (strcmp(argv[i], "--page-size") == 0 && i + 1 < argc) {
+      uint64_t size = parse_size(argv[++i]);
+      new_page_size = size <= MAX_PAGE_SIZE ? size : UINT32_MAX;
+    } else if (strcmp(argv[i], "--dir") == 0 && i + 1 < argc) {
+      directory = argv[++i];
+    } else {
+      printf("Usage: %s [--max-rows <n>] [--buffer-pool <size>] "
+             "[--wal-sync-window <ms>] [--mmap] [--page-size <size>] "
+             "[--dir <directory>]\n",
+             argv[0]);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (!page_size_valid(new_page_size)) {
+    printf("Page size must be a power of two from %u to %u bytes\n",
+           MIN_PAGE_SIZE, MAX_PAGE_SIZE);
+    exit(EXIT_FAILURE);
+  }
+
+  // Tables are created in a scratch directory made by the bench itself,
+  // inside --dir when given, so the bench never touches the files of an
+  // existing database
+  if (directory != NULL && chdir(directory) < 0) {
+    printf("Unable to use bench directory %s: %d\n", directory, errno);
+    exit(EXIT_FAILURE);
+  }
+  char scratch[] = "bench.XXXXXX";
+  if (mkdtemp(scratch) == NULL || chdir(scratch) < 0 ||
+      mkdir(DIR_PREFIX, 0755) < 0) {
+    printf("Unable to create bench directory: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  FILE* schema_file = fopen(BENCH_SCHEMA_FILENAME, "w");
+  fprintf(schema_file,
+          "1\nbench;3;id:4:int,username:32:varchar,email:255:varchar\n");
+  fclose(schema_file);
+
+  filter_kernels_init();
+  long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (num_threads > MAX_THREADS) {
+    num_threads = MAX_THREADS;
+  }
+  if (num_threads > (long)(buffer_pool_size / new_page_size / 4)) {
+    num_threads = buffer_pool_size / new_page_size / 4;
+  }
+  thread_pool = thread_pool_new(num_threads > 1 ? num_threads : 1);
+
+  FILE* out = fopen("/dev/null", "w");
+  setvbuf(out, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+  printf("{\n  \"flags\": \"%s\",\n  \"compiler\": \"%s\",\n"
+         "  \"wal_sync_window_ms\": %u,\n  \"mmap\": %s,\n"
+         "  \"page_size\": %u,\n  \"results\": [",
+         BENCH_FLAGS, __VERSION__, sync_window_ms, use_mmap ? "true" : "false",
+         new_page_size);
+  bool first = true;
+  for (uint64_t num_rows = BENCH_MIN_ROWS; num_rows <= max_rows;
+       num_rows *= 10) {
+    bench_remove_files();
+    Schema* schema = db_open(BENCH_SCHEMA_FILENAME, buffer_pool_size,
+                             sync_window_ms, use_mmap, new_page_size);
+    Session session = {schema, plan_cache_new(), {out, OUTPUT_TEXT},
+                       arena_new(), false, NULL};
+
+    uint32_t num_batches =
+        (num_rows + BENCH_INSERT_BATCH - 1) / BENCH_INSERT_BATCH;
+    BenchResult result =
+        bench_run(&session, bench_insert, num_rows, num_batches, false);
+    bench_print("bulk_insert", num_rows, BENCH_INSERT_BATCH, &result, first);
+    first = false;
+
+    for (uint32_t i = 0; i < sizeof(bench_workloads) / sizeof(BenchWorkload);
+         i++) {
+      uint32_t max_ops = num_rows < BENCH_MAX_OPS ? num_rows : BENCH_MAX_OPS;
+      BenchWorkload* workload = &bench_workloads[i];
+      result = bench_run(&session, workload->statement, num_rows, max_ops,
+                         true);
+      uint32_t rows_per_op =
+          workload->rows_per_op < num_rows ? workload->rows_per_op : num_rows;
+      bench_print(workload->name, num_rows, rows_per_op, &result, false);
+    }
+    fflush(stdout);
+
+    plan_cache_free(session.plan_cache);
+    arena_free(session.arena);
+    db_close(schema);
+  }
+  printf("\n  ]\n}\n");
+
+  bench_remove_files();
+  unlink(BENCH_SCHEMA_FILENAME);
+  rmdir(DIR_PREFIX);
+  chdir("..");
+  rmdir(scratch);
+  fclose(out);
+  thread_pool_free(thread_pool);
+  return 0;
+}
@@ -1,26 +1,200 @@
+// For fallocate
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <arpa/inet.h>
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
+
+// Build with -DDB_NO_IO_URING to read and write pages with plain system
+// calls only
+#if defined(__linux__) && !defined(DB_NO_IO_URING) && \
+    __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define HAVE_IO_URING
+#endif
+
 #define size_of_attribute(Struct, Attribute) sizeof(((Struct*)0)->Attribute)
 
 #define DIR_PREFIX "data/"
 
-#define TABLE_MAX_PAGES 100
+#define PAGER_INITIAL_PAGES 16
+#define PLAN_CACHE_CAPACITY 1024
+#define IMPORT_BATCH_ROWS 16384
+#define MORSEL_PAGES 16
+#define PARALLEL_SCAN_MIN_PAGES (2 * MORSEL_PAGES)
+#define MAX_THREADS 64
+#define OUTPUT_BUFFER_SIZE (1024 * 1024)
+#define SERVER_WORKERS 16
+#define MAX_PROFILE_OPERATORS 8
+#define HLL_BITS 12
+#define HISTOGRAM_BUCKETS 16
+#define STATISTICS_SAMPLE_SIZE 16384
+// Planner costs, in units of one page read in file order
+#define RANDOM_PAGE_COST 4.0
+#define CPU_ROW_COST 0.01
+#define INDEX_PROBE_COST 0.05
+// Guesses for tables that have not been analyzed
+#define DEFAULT_ROWS_PER_KEY 10
+#define DEFAULT_RANGE_SELECTIVITY 0.25
+#define ARENA_BLOCK_SIZE 4096
+#define ARENA_MAX_BLOCK_SIZE (1024 * 1024)
+// Address space reserved for a memory-mapped file, so pages never move
+#define PAGER_MMAP_RESERVE (64ULL << 30)
+// A compressed file is rewritten at a checkpoint once stale records take
+// more than half of it and at least this much
+#define PAGER_COMPACT_MIN_BYTES (1024 * 1024)
+#define INVALID_PAGE_NUM UINT32_MAX
+#define INVALID_FRAME_NUM UINT32_MAX
+// Secondary indexes get file ids from here on, past those of the tables
+#define SECONDARY_INDEX_FILE_ID 0x80000000u
+
+#define DEFAULT_BUFFER_POOL_SIZE (64 * 1024 * 1024)
+// Memory an order by sorts in before it spills runs to temporary files
+#define DEFAULT_SORT_MEMORY (16 * 1024 * 1024)
+// Runs merged at once. More are first merged into longer runs.
+#define SORT_MERGE_WAYS 16
+#define SORT_RUN_BUFFER_SIZE (64 * 1024)
+#define MIN_BUFFER_POOL_FRAMES 16
+// Pages a sequential scan reads ahead of the one it is on, at most a
+// quarter of the buffer pool
+#define READAHEAD_PAGES 32
+#define IO_RING_ENTRIES 64
+// Files are grown in extents of this size, or of an eighth of the file
+// once that is larger, up to PAGER_MAX_EXTENT_SIZE
+#define PAGER_EXTENT_SIZE (1024 * 1024)
+#define PAGER_MAX_EXTENT_SIZE (64 * 1024 * 1024)
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+#define WAL_FILENAME DIR_PREFIX "db.wal"
+#define CATALOG_FILENAME DIR_PREFIX "db.catalog"
+#define STATISTICS_FILENAME DIR_PREFIX "db.stats"
+#define TABLE_CATALOG_FILENAME DIR_PREFIX "db.tables"
+#define TABLE_CATALOG_MAGIC 0x54515343
+#define TABLE_CATALOG_VERSION 3
+#define WAL_DEFAULT_SYNC_WINDOW_MS 10
+#define WAL_CHECKPOINT_SIZE (32 * 1024 * 1024)
 
 #define MAX_LINE_LENGTH 1024
 #define MAX_NAME_LENGTH 256
-#define PAGE_SIZE 4096
+// Every file of a database has pages of the same size, a power of two
+// chosen when the database is created
+#define DEFAULT_PAGE_SIZE 4096
+#define MIN_PAGE_SIZE 4096
+#define MAX_PAGE_SIZE (64 * 1024)
+
+/*
+ * Index node layout. Every node starts with a small header holding its type,
+ * its number of cells and either the next leaf (leaf nodes) or the right-most
+ * child (internal nodes). Leaf cells are (key, row_num) entries. Internal
+ * cells are (child, entry) pairs where entry is the largest one stored under
+ * child; entries larger than every cell live under the right-most child.
+ */
+#define NODE_TYPE_OFFSET 0
+#define NODE_NUM_CELLS_OFFSET 4
+#define LEAF_NODE_NEXT_LEAF_OFFSET 8
+#define INTERNAL_NODE_RIGHT_CHILD_OFFSET 8
+#define NODE_HEADER_SIZE 12
+
+#define INDEX_ENTRY_SIZE (sizeof(IndexKey) + sizeof(uint32_t))
+#define LEAF_NODE_CELL_SIZE INDEX_ENTRY_SIZE
+#define LEAF_NODE_MAX_CELLS \
+  ((page_size - NODE_HEADER_SIZE) / LEAF_NODE_CELL_SIZE)
+#define INTERNAL_NODE_CELL_SIZE (sizeof(uint32_t) + INDEX_ENTRY_SIZE)
+#define INTERNAL_NODE_MAX_CELLS \
+  ((page_size - NODE_HEADER_SIZE) / INTERNAL_NODE_CELL_SIZE)
+
+/*
+ * Table file layout. Page 0 is a header holding the number of row slots in
+ * use, the number of live rows and the first page of the free list. Every
+ * other page starts with a small header and a bitmap with one bit per slot
+ * telling whether the slot holds a live row, followed by the rows. Pages
+ * with deleted slots are chained into the free list so inserts reuse them.
+ * Rows are stored either whole, one after another, or in the PAX layout,
+ * where each column of a page's rows is stored contiguously in a minipage.
+ */
+#define TABLE_HEADER_MAGIC 0x4C515343
+#define TABLE_HEADER_MAGIC_OFFSET 0
+#define TABLE_HEADER_NUM_ROWS_OFFSET 4
+#define TABLE_HEADER_NUM_LIVE_ROWS_OFFSET 8
+#define TABLE_HEADER_FREE_PAGE_OFFSET 12
+#define TABLE_HEADER_LAYOUT_OFFSET 16
+#define TABLE_HEADER_VERSION_OFFSET 20
+// Zero in files written before the page size could be chosen
+#define TABLE_HEADER_PAGE_SIZE_OFFSET 24
+#define TABLE_FORMAT_VERSION 2
+
+#define DATA_PAGE_NEXT_FREE_PAGE_OFFSET 0
+#define DATA_PAGE_IN_FREE_LIST_OFFSET 4
+#define DATA_PAGE_NUM_LIVE_ROWS_OFFSET 6
+#define DATA_PAGE_HEADER_SIZE 8
+
+/*
+ * VARCHAR columns declared longer than a cell are stored in VARCHAR_CELL_SIZE
+ * bytes: a uint16_t length followed by the string when it fits, or by its
+ * first bytes and the offset of the whole string in the table's overflow
+ * file. That file starts with a page holding the number of bytes in use;
+ * strings are appended after it one after another and may cross pages.
+ */
+#define VARCHAR_CELL_SIZE 32
+#define VARCHAR_LENGTH_SIZE 2
+#define VARCHAR_INLINE_SIZE (VARCHAR_CELL_SIZE - VARCHAR_LENGTH_SIZE)
+#define VARCHAR_OVERFLOW_OFFSET (VARCHAR_CELL_SIZE - 8)
+#define VARCHAR_PREFIX_SIZE (VARCHAR_OVERFLOW_OFFSET - VARCHAR_LENGTH_SIZE)
+#define VARCHAR_MAX_SIZE UINT16_MAX
+#define OVERFLOW_HEADER_USED_OFFSET 0
+
+/*
+ * A compressed table file starts with COMPRESSED_FILE_HEADER_SIZE bytes
+ * holding its magic number and how much of it was on disk at the last
+ * checkpoint, followed by page records appended in the order they were
+ * written. Each is a PageRecordHeader and the page compressed in
+ * the LZ4 block format, or stored as is when that is not shorter. The last
+ * record of a page is its current contents.
+ */
+#define COMPRESSED_FILE_MAGIC 0x5A515343
+#define COMPRESSED_FILE_HEADER_SIZE 16
+#define COMPRESSED_FILE_SYNCED_OFFSET 8
+
+#define LZ4_MIN_MATCH 4
+#define LZ4_HASH_BITS 12
+// Matches must start this many bytes before the end of a block and end
+// before its last literals
+#define LZ4_MATCH_LIMIT 12
+#define LZ4_LAST_LITERALS 5
 
 typedef enum {
   META_COMMAND_SUCCESS,
+  META_COMMAND_EXIT,
   META_COMMAND_UNRECOGNIZED_COMMAND
 } MetaCommandResult;
 
@@ -31,16 +205,34 @@ typedef enum {
   PREPARE_SYNTAX_ERROR,
   PREPARE_UNRECOGNIZED_STATEMENT,
   PREPARE_TABLE_NOT_FOUND,
+  PREPARE_STATEMENT_NOT_FOUND,
+  PREPARE_AMBIGUOUS_COLUMN,
   PREPARE_INTERNAL_ERROR
 } PrepareResult;
 
-typedef enum { EXECUTE_SUCCESS, EXECUTE_TABLE_FULL } ExecuteResult;
+typedef enum {
+  EXECUTE_SUCCESS,
+  EXECUTE_TABLE_FULL,
+  EXECUTE_INDEX_EXISTS,
+  EXECUTE_TABLE_EXISTS,
+  EXECUTE_TRANSACTION_OPEN,
+  EXECUTE_NO_TRANSACTION,
+  EXECUTE_IN_TRANSACTION,
+  EXECUTE_COMPRESSED_SERVED
+} ExecuteResult;
 
 typedef enum {
   STATEMENT_INSERT,
   STATEMENT_UPDATE,
   STATEMENT_DELETE,
-  STATEMENT_SELECT
+  STATEMENT_SELECT,
+  STATEMENT_CREATE_INDEX,
+  STATEMENT_CREATE_TABLE,
+  STATEMENT_ANALYZE,
+  STATEMENT_PREPARE,
+  STATEMENT_BEGIN,
+  STATEMENT_COMMIT,
+  STATEMENT_ROLLBACK
 } StatementType;
 
 typedef enum { INTEGER, VARCHAR, REAL } ColumnType;
@@ -59,59 +251,465 @@ typedef struct {
   int length;
 } Bytes;
 
+typedef struct Pager Pager;
+typedef struct Transaction Transaction;
+
 typedef struct {
   char* name;
   uint32_t size;
+  // Offset in a serialized row
   uint32_t offset;
+  // The value in slot s of a page is at rows + page_offset + s * stride,
+  // and takes cell_size bytes
+  uint32_t page_offset;
+  uint32_t stride;
+  uint32_t cell_size;
   ColumnType type;
+  // The overflow file of a VARCHAR column stored in a short cell
+  Pager* overflow;
+  // Where the minimum and maximum of an int or real column are in a zone
+  // map entry
+  uint32_t zone_offset;
 } ColumnDefinition;
 
+typedef enum { LAYOUT_ROWS, LAYOUT_PAX } TableLayout;
+
+typedef enum {
+  WAL_RECORD_PAGE = 1,
+  WAL_RECORD_COMMIT = 2,
+  WAL_RECORD_UNDO = 3
+} WalRecordType;
+
+/*
+ * Every record in the write-ahead log starts with this header. A page record
+ * holds a file id, a page number and the full page image; a commit record
+ * has no body. Page records only take effect once a commit record follows
+ * them. An undo record is laid out like a page record, with the image of the
+ * page before the open transaction changed it, and takes effect when no
+ * commit record follows it.
+ */
+typedef struct {
+  uint32_t type;
+  uint32_t length;
+  uint32_t checksum;
+} WalRecordHeader;
+
+/*
+ * Records are appended to an in-memory buffer and made durable in batches.
+ * With a sync window, a writer thread fsyncs the log for the committers,
+ * which wait for the fsync that covers their commit record. While several
+ * are waiting, it fsyncs whatever accumulated during the window, so many
+ * commits share one fsync. LSNs are byte offsets in the log.
+ * Positions count the bytes logged since open and keep growing when the log
+ * is truncated, so a commit can still be waited for after a checkpoint.
+ */
+typedef struct {
+  int file_descriptor;
+  char* buffer;
+  uint64_t buffer_length;
+  uint64_t buffer_capacity;
+  uint64_t end_lsn;
+  uint64_t flushed_lsn;
+  // Position of the first byte in the log file
+  uint64_t base_position;
+  uint32_t sync_window_ms;
+  // Committers blocked in wal_sync
+  uint32_t num_waiting;
+
+  pthread_mutex_t lock;
+  pthread_mutex_t flush_lock;
+  pthread_cond_t pending;
+  pthread_cond_t flushed;
+  pthread_t writer;
+  bool stopping;
+} Wal;
+
+typedef struct {
+  void* data;
+  Pager* pager;
+  uint32_t page_num;
+  uint32_t pin_count;
+  bool dirty;
+  bool referenced;
+  bool unlogged;
+  // Being read ahead through the I/O ring, which holds a pin until the
+  // read completes
+  bool reading;
+  uint64_t lsn;
+} Frame;
+
+// An io_uring set up through the raw system calls, NULL when the kernel
+// does not offer one. Reads and writes are queued as submission entries,
+// and each completion names its frame in user_data.
+typedef struct {
+  int fd;
+  uint32_t entries;
+  uint32_t* sq_head;
+  uint32_t* sq_tail;
+  uint32_t* sq_mask;
+  uint32_t* sq_array;
+  void* sqes;
+  uint32_t* cq_head;
+  uint32_t* cq_tail;
+  uint32_t* cq_mask;
+  void* cqes;
+  void* sq_ring;
+  size_t sq_ring_size;
+  void* cq_ring;
+  size_t cq_ring_size;
+  size_t sqes_size;
+  // Entries filled in but not yet submitted, and submitted but not reaped
+  uint32_t num_queued;
+  uint32_t num_pending;
+} IoRing;
+
+/*
+ * A fixed number of page frames shared by every pager of a schema. Pages are
+ * replaced with the CLOCK algorithm; pinned frames are never evicted and
+ * dirty frames are written back to their file before being reused.
+ */
+typedef struct {
+  Frame* frames;
+  uint32_t num_frames;
+  uint32_t num_used_frames;
+  uint32_t clock_hand;
+
+  // Frames changed since they were last written to the log
+  uint32_t* unlogged_frames;
+  uint32_t num_unlogged_frames;
+  uint32_t unlogged_capacity;
+  Wal* wal;
+  // The open transaction, whose saved pages are logged before the pages
+  // they were saved from are written back
+  Transaction* transaction;
+
+  // Taken by pager_pin and pager_unpin, so parallel scans can share the pool
+  pthread_mutex_t lock;
+  IoRing* io_ring;
+} BufferPool;
+
+typedef void (*MorselTask)(void* context, uint32_t worker, uint32_t morsel);
+
+// A worker's share of the morsels. The worker takes them from the front,
+// and idle workers steal them from the back.
+typedef struct {
+  pthread_mutex_t lock;
+  uint32_t next;
+  uint32_t end;
+} MorselQueue;
+
+typedef struct ThreadPool ThreadPool;
+
+typedef struct {
+  ThreadPool* pool;
+  uint32_t worker;
+} PoolThread;
+
+/*
+ * Runs a task over a range of morsels. Worker 0 is the thread that calls
+ * thread_pool_run, the other workers are threads that wait for tasks.
+ */
+struct ThreadPool {
+  uint32_t num_workers;
+  PoolThread* threads;
+  pthread_t* thread_ids;
+  MorselQueue* queues;
+
+  // Held by the thread whose task the workers are running
+  pthread_mutex_t run_lock;
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t done;
+  uint64_t generation;
+  uint32_t num_busy;
+  MorselTask task;
+  void* context;
+};
+
 typedef struct {
-  void* pages[TABLE_MAX_PAGES];
+  uint32_t page_num;
+  uint32_t length;
+  uint32_t checksum;
+} PageRecordHeader;
+
+// Where the current record of a page is; pages without one are zero
+typedef struct {
+  uint64_t offset;
+  uint32_t length;
+} PageRecord;
+
+struct Pager {
+  BufferPool* pool;
+  uint32_t file_id;
+  bool logged_since_commit;
+  uint32_t* page_frames;
+  uint32_t pages_capacity;
   int file_descriptor;
-  uint32_t file_length;
-} Pager;
+  uint64_t file_length;
+  // Disk space reserved for the file, which can go past its end
+  uint64_t allocated_length;
+  uint32_t num_pages;
+  // Sequential scans in progress, and the first page not yet read ahead
+  uint32_t sequential_scans;
+  uint32_t readahead_next;
+
+  // In mmap mode pages live in the mapping instead of the buffer pool, and
+  // page_frames only tells which pages are in dirty_pages
+  bool mmapped;
+  void* map;
+  uint64_t mapped_length;
+  uint32_t* dirty_pages;
+  uint32_t num_dirty_pages;
+  uint32_t dirty_capacity;
+
+  // Compressed pagers append pages to the file as records. records has
+  // pages_capacity entries, and live_bytes counts the current records.
+  bool compressed;
+  char* filename;
+  PageRecord* records;
+  uint64_t live_bytes;
+};
+
+// A secondary index, a B+tree over one column of a table. Its definition
+// is kept in the catalog file.
+typedef struct {
+  char* name;
+  ColumnDefinition* column;
+  char* filename;
+  uint32_t file_id;
+  // NULL until its table is opened
+  Pager* pager;
+} Index;
+
+// What analyze found out about a column. The range, histogram and
+// correlation are only kept for int and real columns.
+typedef struct {
+  double num_distinct;
+  bool has_range;
+  // 1 when the values ascend in table order, -1 when they descend and 0
+  // when they are shuffled. Rows found through an index on a column close
+  // to 1 or -1 are on pages visited in file order.
+  double correlation;
+  // Equi-depth histogram: each bucket holds the same share of the rows.
+  // bounds[0] and bounds[HISTOGRAM_BUCKETS] are the minimum and maximum.
+  double bounds[HISTOGRAM_BUCKETS + 1];
+} ColumnStatistics;
+
+typedef struct {
+  uint32_t num_rows;
+  ColumnStatistics* columns;
+} TableStatistics;
+
+// The options a table is defined with, as kept in the table catalog
+typedef enum {
+  TABLE_FLAG_MMAP = 1,
+  TABLE_FLAG_COMPRESSED = 2,
+  // Made by create table rather than listed in the schema file
+  TABLE_FLAG_CREATED = 4
+} TableFlag;
 
 typedef struct {
   ColumnDefinition* columns;
   char* filename;
   char* table_name;
+  // The files of a table are opened when a statement first uses it. Until
+  // then its pagers are NULL.
   Pager* pager;
+  bool opened;
+  // The first of the table's file ids
+  uint32_t file_id;
+  uint32_t flags;
+  // Open-addressing map from column names to 1 + their index, 0 when empty
+  uint32_t* column_slots;
+  uint32_t column_capacity;
+
+  ColumnDefinition* key_column;
+  char* index_filename;
+  Pager* index_pager;
+  char* overflow_filename;
+  Pager* overflow_pager;
+  Index* indexes;
+  uint32_t num_indexes;
+  // Zone maps of the int and real columns, NULL when there are none
+  char* zone_filename;
+  Pager* zone_pager;
+  uint32_t zone_entry_size;
 
   uint32_t num_rows;
+  uint32_t num_live_rows;
+  uint32_t free_page_head;
   uint32_t num_columns;
+  TableLayout layout;
+  bool mmapped;
+  // Compressed tables keep their pages in the buffer pool even in mmap mode
+  bool compressed;
   uint32_t row_size;
   uint32_t rows_per_page;
+  uint32_t rows_offset;
   uint32_t max_rows;
+  // Set by analyze, NULL until the table is analyzed
+  TableStatistics* statistics;
+
+  // Held shared by selects and exclusively by statements that write
+  pthread_rwlock_t lock;
 } Table;
 
+// Memory for things that are freed together, such as everything parsed
+// for one statement. Allocations are carved out of blocks one after
+// another, and the blocks are freed or reused all at once.
+typedef struct ArenaBlock {
+  struct ArenaBlock* next;
+  size_t size;
+  size_t used;
+  max_align_t data[];
+} ArenaBlock;
+
+typedef struct {
+  // The block allocations are carved from, followed by the full ones and
+  // the ones holding a single large allocation
+  ArenaBlock* head;
+} Arena;
+
+typedef struct PlanCache PlanCache;
+
 typedef struct {
-  Table* tables;
+  // Holds the tables and everything else that lives as long as the schema
+  Arena* arena;
+  Table** tables;
   uint32_t num_tables;
+  // Open-addressing map from table names to tables, kept at most half full
+  Table** table_slots;
+  uint32_t table_capacity;
+  // The tables whose files are open, in the order they were opened
+  Table** open_tables;
+  uint32_t num_open_tables;
+  // Tables by file id / 4. File ids are recorded in the table catalog and
+  // never reused, so the log names the same files after the schema changes.
+  Table** file_tables;
+  uint32_t file_tables_capacity;
+  uint32_t next_file_id;
+  uint32_t num_indexes;
+  // The schema file the table catalog was made from
+  uint64_t schema_size;
+  int64_t schema_mtime_ns;
+  // Set by --mmap, for tables made with create table too
+  bool use_mmap;
+  // Set while serving --listen, which refuses compressed tables and
+  // .import, so clients cannot read the server's files
+  bool serving;
+  BufferPool* buffer_pool;
+  Wal* wal;
+  // Serializes writers, which share the buffer pool and the log
+  pthread_mutex_t commit_lock;
+  // Held shared to look a table up by name and exclusively to add one
+  pthread_rwlock_t catalog_lock;
 } Schema;
 
+typedef enum { OUTPUT_TEXT, OUTPUT_BINARY } OutputMode;
+
+// Where results go, set with .mode text or .mode binary
+typedef struct {
+  FILE* file;
+  OutputMode mode;
+} Output;
+
+// The state of a page before the open transaction first changed it
+typedef struct {
+  Pager* pager;
+  uint32_t page_num;
+  void* data;
+  // Whether it is in the log as an undo record
+  bool logged;
+} UndoPage;
+
+// Statements between begin and commit. It holds the commit lock and the
+// locks of the tables it changed until it ends, and rollback writes the
+// saved pages back. page_slots map a pager and page number to 1 + the
+// index of its page, or 0.
+struct Transaction {
+  Arena* arena;
+  UndoPage* pages;
+  uint32_t num_pages;
+  uint32_t* page_slots;
+  uint32_t slots_capacity;
+  Table** tables;
+  uint32_t num_tables;
+  uint32_t tables_capacity;
+};
+
+// A client of the database. Each has its own plan cache, since cached
+// plans are bound in place, and its own output. Statements that are not
+// cached are parsed into its arena, which is reset after each one.
+typedef struct {
+  Schema* schema;
+  PlanCache* plan_cache;
+  Output out;
+  Arena* arena;
+  // Set by .timer on
+  bool timer;
+  // Set by begin until commit or rollback
+  Transaction* transaction;
+} Session;
+
+typedef struct WhereClause WhereClause;
+
 typedef struct {
   Table* table;
   uint32_t row_num;
   bool end_of_table;
+  uint32_t pinned_page_num;
+  bool sequential;
+  // A full scan passes over the pages whose zone maps rule this out
+  WhereClause* zone_filter;
 } Cursor;
 
 typedef Bytes Row;
 
+typedef int64_t IndexKey;
+
+typedef struct {
+  IndexKey key;
+  uint32_t row_num;
+} IndexEntry;
+
+typedef enum { NODE_INTERNAL, NODE_LEAF } NodeType;
+
+typedef struct {
+  Pager* pager;
+  uint32_t page_num;
+  uint32_t cell_num;
+  bool end_of_index;
+} IndexCursor;
+
 typedef struct {
   char* buffer;
   ssize_t input_length;
   size_t buffer_length;
 } InputBuffer;
 
-typedef struct {
+// A where clause is compiled into a predicate on the raw row bytes
+typedef bool (*RowPredicate)(void* rows, uint32_t slot,
+                             WhereClause* where_clause);
+
+struct WhereClause {
+  RowPredicate matches;
   ColumnDefinition* column;
   Operator op;
   Bytes value;
-} WhereClause;
+  // Decoded constant of a comparison and where the column is in a page
+  uint32_t offset;
+  uint32_t stride;
+  int int_value;
+  double real_value;
+  // Operands of an and/or
+  WhereClause* left;
+  WhereClause* right;
+};
 
 typedef struct {
-  Row row_to_insert;
+  // The rows are stored one after another, row_size bytes each
+  Row rows;
+  uint32_t num_rows;
 } InsertStatement;
 
 typedef struct {
@@ -124,21 +722,367 @@ typedef struct {
   WhereClause* where_clause;
 } DeleteStatement;
 
+typedef struct {
+  char* name;
+  ColumnDefinition* column;
+} CreateIndexStatement;
+
+typedef enum {
+  AGGREGATE_NONE,
+  AGGREGATE_COUNT,
+  AGGREGATE_SUM,
+  AGGREGATE_MIN,
+  AGGREGATE_MAX,
+  AGGREGATE_AVG
+} AggregateFunction;
+
+typedef struct {
+  AggregateFunction function;
+  // The group by column a plain column of the select list is printed from
+  uint32_t group_column;
+} Aggregate;
+
 typedef struct {
   ColumnDefinition* columns;
   uint32_t num_columns;
   bool is_select_all;
   WhereClause* where_clause;
+  // Set when the select list has aggregates or there is a group by, one
+  // entry per column of the select list
+  Aggregate* aggregates;
+  ColumnDefinition* group_by;
+  uint32_t num_group_by;
+  // Set for "from <table> join <table> on <column> = <column>"
+  Table* join_table;
+  ColumnDefinition* left_key;
+  ColumnDefinition* right_key;
+  // The columns of both tables, as one row of the left columns and then the
+  // right ones. Columns and the where clause refer to this table.
+  Table* joined;
+  // Set for "order by <column> [asc|desc]". Sorted rows are copied out of
+  // their pages into whole rows, which sorted describes like joined, and
+  // are printed through sorted_columns.
+  ColumnDefinition* order_by;
+  bool descending;
+  Table* sorted;
+  ColumnDefinition* sorted_columns;
+  // Set by "limit <n> [offset <m>]", UINT32_MAX without a limit
+  uint32_t limit;
+  uint32_t offset;
 } SelectStatement;
 
+// Where the value of a ? in a statement goes when it is bound
+typedef enum { PARAMETER_ROW, PARAMETER_VALUE, PARAMETER_WHERE } ParameterKind;
+
+typedef struct {
+  ParameterKind kind;
+  ColumnDefinition* column;
+  void* target;
+} Parameter;
+
 typedef struct {
   Table* table;
   void* statementDetail;
   StatementType type;
+  Parameter* params;
+  uint32_t num_params;
+  // Where everything the statement points to is allocated
+  Arena* arena;
 } Statement;
 
-char* str_to_lower(const char* str) {
-  char* lower = strdup(str);
+// Parsed statements, keyed on their text with the literals replaced by ?.
+// Each plan has its own arena holding the statement and its key.
+typedef struct {
+  char* key;
+  Statement statement;
+} CachedPlan;
+
+typedef struct {
+  char* name;
+  Statement statement;
+} NamedPlan;
+
+struct PlanCache {
+  CachedPlan* plans;
+  uint32_t capacity;
+  uint32_t num_plans;
+  NamedPlan* named_plans;
+  uint32_t num_named_plans;
+};
+
+// Counters of the work done by statements, printed by .stats. Every
+// thread adds to them, so they are only changed with atomic adds.
+typedef struct {
+  uint64_t statements;
+  uint64_t rows_scanned;
+  uint64_t rows_matched;
+  uint64_t pages_fetched;
+  uint64_t page_hits;
+  uint64_t page_misses;
+  // Pages a scan passed over because of their zone map entry
+  uint64_t pages_skipped;
+  uint64_t bytes_read;
+  uint64_t bytes_written;
+  // Pages read before a sequential scan asked for them
+  uint64_t pages_prefetched;
+  // Sorted runs an order by wrote to temporary files
+  uint64_t sort_runs;
+} Stats;
+
+// One step of a statement's plan, as reported by explain analyze
+typedef struct {
+  const char* name;
+  const char* table_name;
+  uint64_t rows;
+  uint64_t start_ns;
+  uint64_t elapsed_ns;
+} ProfileOperator;
+
+// What one statement did, collected while explain analyze runs it
+typedef struct {
+  Stats stats;
+  ProfileOperator operators[MAX_PROFILE_OPERATORS];
+  uint32_t num_operators;
+} Profile;
+
+Stats stats;
+// Page size of the open database, kept in its table catalog
+uint32_t page_size = DEFAULT_PAGE_SIZE;
+// Set with --sort-memory
+uint64_t sort_memory = DEFAULT_SORT_MEMORY;
+// The profile of the statement the thread works for, if it is explained.
+// Workers of a parallel scan take on the profile of the scan.
+__thread Profile* current_profile = NULL;
+// The transaction of the session the thread runs a statement for
+__thread Transaction* current_transaction = NULL;
+
+#define STATS_ADD(counter, n)                                       \
+  do {                                                              \
+    __atomic_fetch_add(&stats.counter, (n), __ATOMIC_RELAXED);      \
+    if (current_profile != NULL) {                                  \
+      __atomic_fetch_add(&current_profile->stats.counter, (n),      \
+                         __ATOMIC_RELAXED);                         \
+    }                                                               \
+  } while (0)
+
+void* get_page(Pager* pager, uint32_t page_num);
+void pager_reserve(Pager* pager, uint32_t page_num);
+Pager* index_pager_open(Table* table, const char* filename, uint32_t file_id);
+void index_open(Table* table);
+void index_close(Table* table);
+void index_build(Table* table, ColumnDefinition* column, Pager* pager);
+void zone_build(Table* table);
+bool zone_skip_page(Table* table, WhereClause* where_clause,
+                    uint32_t page_num);
+bool where_and(void* rows, uint32_t slot, WhereClause* where_clause);
+bool where_or(void* rows, uint32_t slot, WhereClause* where_clause);
+void zone_add_row(Table* table, void* rows, uint32_t slot, uint32_t page_num);
+void catalog_load(Schema* schema);
+void statistics_load(Schema* schema);
+void table_statistics_free(TableStatistics* statistics);
+uint32_t hash_bytes(const void* data, uint32_t length);
+uint32_t hash_continue(uint32_t hash, const void* data, uint32_t length);
+uint32_t hash_string(const char* str);
+void serialize_row(Row* source, void* rows, uint32_t slot, Table* table);
+ExecuteResult table_insert_rows(Table* table, char* rows, uint32_t num_rows);
+Table* schema_find_table(Schema* schema, const char* table_name);
+Table* schema_open_table(Schema* schema, const char* table_name);
+ColumnDefinition* table_find_column(Table* table, const char* name);
+PrepareResult copy_value_into_row(ColumnDefinition* column, char* row,
+                                  char* value);
+
+Arena* arena_new() {
+  Arena* arena = malloc(sizeof(Arena));
+  if (arena == NULL) {
+    printf("Memory allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  arena->head = NULL;
+  return arena;
+}
+
+ArenaBlock* arena_new_block(size_t size) {
+  ArenaBlock* block = malloc(sizeof(ArenaBlock) + size);
+  if (block == NULL) {
+    printf("Memory allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  block->next = NULL;
+  block->size = size;
+  block->used = 0;
+  return block;
+}
+
+void* arena_alloc(Arena* arena, size_t size) {
+  size = (size + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+  ArenaBlock* head = arena->head;
+  if (head != NULL && head->used + size <= head->size) {
+    void* data = (char*)head->data + head->used;
+    head->used += size;
+    return data;
+  }
+
+  // Large allocations get a block of their own behind the head, so the
+  // head keeps its free space and stays the block that is reused
+  if (size > ARENA_MAX_BLOCK_SIZE / 2) {
+    if (head == NULL) {
+      head = arena_new_block(ARENA_BLOCK_SIZE);
+      arena->head = head;
+    }
+    ArenaBlock* block = arena_new_block(size);
+    block->used = size;
+    block->next = head->next;
+    head->next = block;
+    return block->data;
+  }
+
+  size_t block_size = head != NULL ? 2 * head->size : ARENA_BLOCK_SIZE;
+  while (block_size < size) {
+    block_size *= 2;
+  }
+  if (block_size > ARENA_MAX_BLOCK_SIZE) {
+    block_size = ARENA_MAX_BLOCK_SIZE;
+  }
+  ArenaBlock* block = arena_new_block(block_size);
+  block->next = head;
+  block->used = size;
+  arena->head = block;
+  return block->data;
+}
+
+void* arena_calloc(Arena* arena, size_t count, size_t size) {
+  void* data = arena_alloc(arena, count * size);
+  memset(data, 0, count * size);
+  return data;
+}
+
+// Grows an allocation, in place when it is the last one of the head block
+void* arena_realloc(Arena* arena, void* data, size_t old_size,
+                    size_t new_size) {
+  size_t aligned_old = (old_size + sizeof(max_align_t) - 1) &
+                       ~(sizeof(max_align_t) - 1);
+  size_t aligned_new = (new_size + sizeof(max_align_t) - 1) &
+                       ~(sizeof(max_align_t) - 1);
+  ArenaBlock* head = arena->head;
+  if (data != NULL && head != NULL &&
+      (char*)data + aligned_old == (char*)head->data + head->used &&
+      head->used - aligned_old + aligned_new <= head->size) {
+    head->used = head->used - aligned_old + aligned_new;
+    return data;
+  }
+  void* grown = arena_alloc(arena, new_size);
+  if (data != NULL) {
+    memcpy(grown, data, old_size < new_size ? old_size : new_size);
+  }
+  return grown;
+}
+
+char* arena_strndup(Arena* arena, const char* str, size_t length) {
+  char* copy = arena_alloc(arena, length + 1);
+  memcpy(copy, str, length);
+  copy[length] = '\0';
+  return copy;
+}
+
+char* arena_strdup(Arena* arena, const char* str) {
+  return arena_strndup(arena, str, strlen(str));
+}
+
+// Frees everything allocated from the arena, keeping the head block for
+// the allocations that follow
+void arena_reset(Arena* arena) {
+  ArenaBlock* head = arena->head;
+  if (head == NULL) {
+    return;
+  }
+  ArenaBlock* block = head->next;
+  while (block != NULL) {
+    ArenaBlock* next = block->next;
+    free(block);
+    block = next;
+  }
+  head->next = NULL;
+  head->used = 0;
+}
+
+void arena_free(Arena* arena) {
+  if (arena == NULL) {
+    return;
+  }
+  arena_reset(arena);
+  free(arena->head);
+  free(arena);
+}
+
+uint32_t undo_page_hash(Pager* pager, uint32_t page_num) {
+  return hash_continue(hash_bytes(&pager, sizeof(pager)), &page_num,
+                       sizeof(page_num));
+}
+
+UndoPage* transaction_find_page(Transaction* transaction, Pager* pager,
+                                uint32_t page_num) {
+  if (transaction->slots_capacity == 0) {
+    return NULL;
+  }
+  uint32_t mask = transaction->slots_capacity - 1;
+  for (uint32_t slot = undo_page_hash(pager, page_num) & mask;
+       transaction->page_slots[slot] != 0; slot = (slot + 1) & mask) {
+    UndoPage* undo = &transaction->pages[transaction->page_slots[slot] - 1];
+    if (undo->pager == pager && undo->page_num == page_num) {
+      return undo;
+    }
+  }
+  return NULL;
+}
+
+// Copies the page the first time the transaction changes it, returning the
+// copy then and NULL after
+UndoPage* transaction_save_page(Transaction* transaction, Pager* pager,
+                                uint32_t page_num, const void* data) {
+  if (transaction_find_page(transaction, pager, page_num) != NULL) {
+    return NULL;
+  }
+  uint32_t mask = transaction->slots_capacity - 1;
+
+  // The slots are kept at most half full
+  if (2 * (transaction->num_pages + 1) > transaction->slots_capacity) {
+    uint32_t capacity = transaction->slots_capacity == 0
+                            ? 64
+                            : transaction->slots_capacity * 2;
+    transaction->pages = arena_realloc(
+        transaction->arena, transaction->pages,
+        transaction->slots_capacity / 2 * sizeof(UndoPage),
+        capacity / 2 * sizeof(UndoPage));
+    transaction->page_slots =
+        arena_calloc(transaction->arena, capacity, sizeof(uint32_t));
+    transaction->slots_capacity = capacity;
+    mask = capacity - 1;
+    for (uint32_t i = 0; i < transaction->num_pages; i++) {
+      UndoPage* undo = &transaction->pages[i];
+      uint32_t slot = undo_page_hash(undo->pager, undo->page_num) & mask;
+      while (transaction->page_slots[slot] != 0) {
+        slot = (slot + 1) & mask;
+      }
+      transaction->page_slots[slot] = i + 1;
+    }
+  }
+
+  uint32_t slot = undo_page_hash(pager, page_num) & mask;
+  while (transaction->page_slots[slot] != 0) {
+    slot = (slot + 1) & mask;
+  }
+  transaction->page_slots[slot] = ++transaction->num_pages;
+  UndoPage* undo = &transaction->pages[transaction->num_pages - 1];
+  undo->pager = pager;
+  undo->page_num = page_num;
+  undo->data = arena_alloc(transaction->arena, page_size);
+  undo->logged = false;
+  memcpy(undo->data, data, page_size);
+  return undo;
+}
+
+char* str_to_lower(Arena* arena, const char* str) {
+  char* lower = arena_strdup(arena, str);
   for (char* p = lower; *p; p++) {
     *p = tolower(*p);
   }
@@ -164,1343 +1108,8940 @@ ColumnType string_to_column_type(const char* str) {
   exit(1);
 }
 
-void free_table(Table* table) {
-  if (!table) {
+void free_schema(Schema* schema) {
+  if (!schema) {
     return;
   }
 
-  free(table->table_name);
-  free(table->filename);
-  if (!table->columns) {
-    return;
+  arena_free(schema->arena);
+  free(schema);
+}
+
+uint32_t crc32_update(uint32_t crc, const void* data, size_t length) {
+  static uint32_t table[256];
+  if (table[1] == 0) {
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; k++) {
+        c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+      }
+      table[i] = c;
+    }
   }
 
-  for (uint32_t j = 0; j < table->num_columns; j++) {
-    free(table->columns[j].name);
+  const uint8_t* bytes = data;
+  crc = ~crc;
+  for (size_t i = 0; i < length; i++) {
+    crc = table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
   }
-  free(table->columns);
+  return ~crc;
 }
 
-void free_schema(Schema* schema) {
-  if (!schema) {
-    return;
+uint32_t lz4_hash(const uint8_t* data) {
+  uint32_t value;
+  memcpy(&value, data, sizeof(uint32_t));
+  return (value * 2654435761u) >> (32 - LZ4_HASH_BITS);
+}
+
+uint8_t* lz4_write_length(uint8_t* out, uint32_t length) {
+  while (length >= 255) {
+    *out++ = 255;
+    length -= 255;
   }
+  *out++ = length;
+  return out;
+}
 
-  if (schema->tables) {
-    for (uint32_t i = 0; i < schema->num_tables; i++) {
-      free_table(&schema->tables[i]);
-    }
-    free(schema->tables);
+// Writes a sequence of literals and, when match_length is not 0, the match
+// that follows them. Returns NULL when it does not fit before out_end.
+uint8_t* lz4_write_sequence(uint8_t* out, uint8_t* out_end,
+                            const uint8_t* literals, uint32_t literal_length,
+                            uint32_t match_offset, uint32_t match_length) {
+  uint32_t extra = match_length > 0 ? match_length - LZ4_MIN_MATCH : 0;
+  if ((uint64_t)(out_end - out) <
+      1 + literal_length / 255 + 1 + literal_length + 2 + extra / 255 + 1) {
+    return NULL;
   }
-  free(schema);
+  uint8_t* token = out++;
+  *token = (literal_length < 15 ? literal_length : 15) << 4;
+  if (literal_length >= 15) {
+    out = lz4_write_length(out, literal_length - 15);
+  }
+  memcpy(out, literals, literal_length);
+  out += literal_length;
+  if (match_length == 0) {
+    return out;
+  }
+  *out++ = match_offset & 0xFF;
+  *out++ = match_offset >> 8;
+  *token |= extra < 15 ? extra : 15;
+  if (extra >= 15) {
+    out = lz4_write_length(out, extra - 15);
+  }
+  return out;
 }
 
-Pager* pager_open(const char* filename) {
-  int fd = open(filename, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
-  if (fd < 0) {
-    printf("Unable to open file\n");
-    exit(EXIT_FAILURE);
+// Compresses a block in the LZ4 block format, greedily taking the match
+// found through a hash of the next 4 bytes. Returns 0 when the result does
+// not fit in capacity.
+uint32_t lz4_compress(const uint8_t* source, uint32_t length,
+                      uint8_t* destination, uint32_t capacity) {
+  uint32_t positions[1 << LZ4_HASH_BITS];
+  memset(positions, 0, sizeof(positions));
+  const uint8_t* end = source + length;
+  const uint8_t* match_limit =
+      length > LZ4_MATCH_LIMIT ? end - LZ4_MATCH_LIMIT : source;
+  const uint8_t* in = source;
+  const uint8_t* anchor = source;
+  uint8_t* out = destination;
+  uint8_t* out_end = destination + capacity;
+  while (in < match_limit) {
+    uint32_t hash = lz4_hash(in);
+    const uint8_t* candidate = source + positions[hash];
+    positions[hash] = in - source;
+    if (candidate >= in || in - candidate > UINT16_MAX ||
+        memcmp(candidate, in, LZ4_MIN_MATCH) != 0) {
+      in++;
+      continue;
+    }
+
+    uint32_t match_length = LZ4_MIN_MATCH;
+    while (in + match_length < end - LZ4_LAST_LITERALS &&
+           candidate[match_length] == in[match_length]) {
+      match_length++;
+    }
+    out = lz4_write_sequence(out, out_end, anchor, in - anchor,
+                             in - candidate, match_length);
+    if (out == NULL) {
+      return 0;
+    }
+    in += match_length;
+    anchor = in;
   }
+  out = lz4_write_sequence(out, out_end, anchor, end - anchor, 0, 0);
+  return out == NULL ? 0 : out - destination;
+}
 
-  off_t file_length = lseek(fd, 0, SEEK_END);
+uint32_t lz4_read_length(const uint8_t** in, const uint8_t* end,
+                         uint32_t length) {
+  uint8_t byte = 255;
+  while (byte == 255 && *in < end) {
+    byte = *(*in)++;
+    length += byte;
+  }
+  return length;
+}
 
-  Pager* pager = malloc(sizeof(Pager));
-  pager->file_descriptor = fd;
-  pager->file_length = file_length;
+// Returns the length of the decompressed block, or -1 when it is corrupt
+int64_t lz4_decompress(const uint8_t* source, uint32_t length,
+                       uint8_t* destination, uint32_t capacity) {
+  const uint8_t* in = source;
+  const uint8_t* end = source + length;
+  uint8_t* out = destination;
+  uint8_t* out_end = destination + capacity;
+  while (in < end) {
+    uint8_t token = *in++;
+    uint32_t literal_length = token >> 4;
+    if (literal_length == 15) {
+      literal_length = lz4_read_length(&in, end, literal_length);
+    }
+    if (literal_length > (uint64_t)(end - in) ||
+        literal_length > (uint64_t)(out_end - out)) {
+      return -1;
+    }
+    memcpy(out, in, literal_length);
+    in += literal_length;
+    out += literal_length;
+    // The last sequence has no match
+    if (in == end) {
+      break;
+    }
 
-  for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-    pager->pages[i] = NULL;
+    if (end - in < 2) {
+      return -1;
+    }
+    uint32_t match_offset = in[0] | in[1] << 8;
+    in += 2;
+    uint32_t match_length = (token & 15) + LZ4_MIN_MATCH;
+    if ((token & 15) == 15) {
+      match_length = lz4_read_length(&in, end, match_length);
+    }
+    if (match_offset == 0 || match_offset > (uint64_t)(out - destination) ||
+        match_length > (uint64_t)(out_end - out)) {
+      return -1;
+    }
+    // Matches may overlap the bytes they produce
+    const uint8_t* match = out - match_offset;
+    if (match_offset >= match_length) {
+      memcpy(out, match, match_length);
+    } else {
+      for (uint32_t i = 0; i < match_length; i++) {
+        out[i] = match[i];
+      }
+    }
+    out += match_length;
   }
+  return out - destination;
+}
 
-  return pager;
+void write_all(int fd, const void* data, size_t length) {
+  while (length > 0) {
+    ssize_t bytes_written = write(fd, data, length);
+    if (bytes_written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      printf("Error writing: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+    data += bytes_written;
+    length -= bytes_written;
+  }
 }
 
-void pager_flush(Pager* pager, uint32_t page_num, uint32_t size) {
-  if (pager->pages[page_num] == NULL) {
-    printf("Tried to flush null page\n");
-    exit(EXIT_FAILURE);
+void sleep_ms(uint32_t ms) {
+  struct timespec duration = {ms / 1000, (ms % 1000) * 1000000L};
+  while (nanosleep(&duration, &duration) < 0 && errno == EINTR) {
   }
+}
 
-  off_t offset = lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
-  if (offset < 0) {
-    printf("Error seeking: %d\n", errno);
-    exit(EXIT_FAILURE);
+uint64_t now_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// Starts timing a step of the statement being explained. Returns NULL
+// when no statement is, and the step to pass to profile_end otherwise.
+ProfileOperator* profile_begin(const char* name, Table* table) {
+  Profile* profile = current_profile;
+  if (profile == NULL || profile->num_operators == MAX_PROFILE_OPERATORS) {
+    return NULL;
   }
+  ProfileOperator* step = &profile->operators[profile->num_operators++];
+  step->name = name;
+  step->table_name = table != NULL ? table->table_name : NULL;
+  step->rows = 0;
+  step->elapsed_ns = 0;
+  step->start_ns = now_ns();
+  return step;
+}
 
-  ssize_t bytes_written =
-      write(pager->file_descriptor, pager->pages[page_num], size);
-  if (bytes_written < 0) {
-    printf("Error writing: %d\n", errno);
-    exit(EXIT_FAILURE);
+// Ends a step, recording how many rows it passed on
+void profile_end(ProfileOperator* step, uint64_t rows) {
+  if (step == NULL) {
+    return;
   }
+  step->rows = rows;
+  step->elapsed_ns = now_ns() - step->start_ns;
 }
 
-Schema* schema_open(const char* filename) {
-  FILE* file = fopen(filename, "r");
-  if (file == NULL) {
-    printf("Error opening schema file\n");
+// Writes and fsyncs the log up to at least lsn
+void wal_flush(Wal* wal, uint64_t lsn) {
+  pthread_mutex_lock(&wal->flush_lock);
+  pthread_mutex_lock(&wal->lock);
+  if (lsn > wal->end_lsn) {
+    lsn = wal->end_lsn;
+  }
+  if (wal->flushed_lsn >= lsn) {
+    pthread_mutex_unlock(&wal->lock);
+    pthread_mutex_unlock(&wal->flush_lock);
+    return;
   }
 
-  Schema* schema = malloc(sizeof(Schema));
-  if (schema == NULL) {
-    printf("Memory allocation error\n");
-    fclose(file);
+  write_all(wal->file_descriptor, wal->buffer, wal->buffer_length);
+  wal->buffer_length = 0;
+  uint64_t target_lsn = wal->end_lsn;
+  pthread_mutex_unlock(&wal->lock);
+
+  if (fdatasync(wal->file_descriptor) < 0) {
+    printf("Error syncing log: %d\n", errno);
     exit(EXIT_FAILURE);
   }
 
-  schema->tables = NULL;
-  schema->num_tables = 0;
+  pthread_mutex_lock(&wal->lock);
+  wal->flushed_lsn = target_lsn;
+  pthread_cond_broadcast(&wal->flushed);
+  pthread_mutex_unlock(&wal->lock);
+  pthread_mutex_unlock(&wal->flush_lock);
+}
 
-  char line[MAX_LINE_LENGTH];
-  if (fgets(line, sizeof(line), file) == NULL) {
-    printf("Error reading number of tables\n");
-    fclose(file);
-    free_schema(schema);
-    exit(EXIT_FAILURE);
+void* wal_writer(void* arg) {
+  Wal* wal = arg;
+  pthread_mutex_lock(&wal->lock);
+  while (!wal->stopping) {
+    if (wal->end_lsn == wal->flushed_lsn) {
+      pthread_cond_wait(&wal->pending, &wal->lock);
+      continue;
+    }
+    // A lone committer is synced at once. When others wait too, more
+    // commits are likely on the way, so let those arriving during the
+    // window share one fsync.
+    bool concurrent = wal->num_waiting > 1;
+    pthread_mutex_unlock(&wal->lock);
+
+    if (concurrent) {
+      sleep_ms(wal->sync_window_ms);
+    }
+    wal_flush(wal, UINT64_MAX);
+
+    pthread_mutex_lock(&wal->lock);
   }
+  pthread_mutex_unlock(&wal->lock);
+  return NULL;
+}
 
-  schema->num_tables = atoi(line);
-  schema->tables = malloc(schema->num_tables * sizeof(Table));
-  if (schema->tables == NULL) {
-    printf("Memory allocation error\n");
-    fclose(file);
-    free_schema(schema);
+Wal* wal_open(const char* filename, uint32_t sync_window_ms) {
+  int fd = open(filename, O_RDWR | O_CREAT | O_APPEND, S_IWUSR | S_IRUSR);
+  if (fd < 0) {
+    printf("Unable to open log file\n");
     exit(EXIT_FAILURE);
   }
 
-  for (uint32_t i = 0; i < schema->num_tables; i++) {
-    schema->tables[i].table_name = NULL;
-    schema->tables[i].columns = NULL;
-    schema->tables[i].num_columns = 0;
+  Wal* wal = malloc(sizeof(Wal));
+  wal->file_descriptor = fd;
+  wal->buffer_capacity = 1024 * 1024;
+  wal->buffer = malloc(wal->buffer_capacity);
+  wal->buffer_length = 0;
+  wal->end_lsn = lseek(fd, 0, SEEK_END);
+  wal->flushed_lsn = wal->end_lsn;
+  wal->base_position = 0;
+  wal->num_waiting = 0;
+  wal->sync_window_ms = sync_window_ms;
+  wal->stopping = false;
+  pthread_mutex_init(&wal->lock, NULL);
+  pthread_mutex_init(&wal->flush_lock, NULL);
+  pthread_cond_init(&wal->pending, NULL);
+  pthread_cond_init(&wal->flushed, NULL);
+
+  if (sync_window_ms > 0) {
+    pthread_create(&wal->writer, NULL, wal_writer, wal);
   }
 
-  for (uint32_t i = 0; i < schema->num_tables; i++) {
-    if (fgets(line, sizeof(line), file) == NULL) {
-      printf("Error reading table definition\n");
-      fclose(file);
-      free_schema(schema);
-      exit(EXIT_FAILURE);
-    }
+  return wal;
+}
 
-    size_t len = strlen(line);
-    if (len > 0 && line[len - 1] == '\n') {
-      line[len - 1] = '\0';
-    }
+void wal_close(Wal* wal) {
+  if (wal->sync_window_ms > 0) {
+    pthread_mutex_lock(&wal->lock);
+    wal->stopping = true;
+    pthread_cond_signal(&wal->pending);
+    pthread_mutex_unlock(&wal->lock);
+    pthread_join(wal->writer, NULL);
+  }
 
-    Table* table = &schema->tables[i];
-    char* token;
+  wal_flush(wal, UINT64_MAX);
+  close(wal->file_descriptor);
+  pthread_mutex_destroy(&wal->lock);
+  pthread_mutex_destroy(&wal->flush_lock);
+  pthread_cond_destroy(&wal->pending);
+  pthread_cond_destroy(&wal->flushed);
+  free(wal->buffer);
+  free(wal);
+}
 
-    token = strtok(line, ";");
-    table->table_name = strdup(token);
-    if (table->table_name == NULL) {
-      printf("Memory allocation error\n");
-      fclose(file);
-      free_schema(schema);
-      exit(EXIT_FAILURE);
+// Appends a record made of a small prefix and a body; returns its end LSN
+uint64_t wal_append(Wal* wal, WalRecordType type, const void* prefix,
+                    uint32_t prefix_length, const void* body,
+                    uint32_t body_length) {
+  WalRecordHeader header;
+  header.type = type;
+  header.length = prefix_length + body_length;
+  header.checksum = crc32_update(0, &header.type, sizeof(uint32_t) * 2);
+  header.checksum = crc32_update(header.checksum, prefix, prefix_length);
+  header.checksum = crc32_update(header.checksum, body, body_length);
+
+  uint64_t record_length = sizeof(header) + header.length;
+
+  pthread_mutex_lock(&wal->lock);
+  if (wal->buffer_length + record_length > wal->buffer_capacity) {
+    while (wal->buffer_length + record_length > wal->buffer_capacity) {
+      wal->buffer_capacity *= 2;
     }
+    wal->buffer = realloc(wal->buffer, wal->buffer_capacity);
+  }
 
-    token = strtok(NULL, ";");
-    table->num_columns = atoi(token);
+  char* destination = wal->buffer + wal->buffer_length;
+  memcpy(destination, &header, sizeof(header));
+  memcpy(destination + sizeof(header), prefix, prefix_length);
+  memcpy(destination + sizeof(header) + prefix_length, body, body_length);
+  wal->buffer_length += record_length;
+  wal->end_lsn += record_length;
+  uint64_t lsn = wal->end_lsn;
+  pthread_mutex_unlock(&wal->lock);
 
-    table->columns = malloc(table->num_columns * sizeof(ColumnDefinition));
-    if (table->columns == NULL) {
-      printf("Memory allocation error\n");
-      fclose(file);
-      free_schema(schema);
-      exit(EXIT_FAILURE);
-    }
+  return lsn;
+}
 
-    char* outer_ptr = NULL;
-    char* inner_ptr = NULL;
-
-    char* column_defs = strtok(NULL, ";");
-    char* column_defs_cpy = strdup(column_defs);
-    for (uint32_t j = 0; j < table->num_columns; j++) {
-      char* column_def =
-          strtok_r(j == 0 ? column_defs_cpy : NULL, ",", &outer_ptr);
-      if (column_def == NULL) {
-        printf("Error parsing column definition\n");
-        fclose(file);
-        free_schema(schema);
-        exit(EXIT_FAILURE);
-      }
+// Returns the position of an LSN in the current log file
+uint64_t wal_position(Wal* wal, uint64_t lsn) {
+  pthread_mutex_lock(&wal->lock);
+  uint64_t position = wal->base_position + lsn;
+  pthread_mutex_unlock(&wal->lock);
+  return position;
+}
 
-      char* column_name = strtok_r(column_def, ":", &inner_ptr);
-      char* column_size = strtok_r(NULL, ":", &inner_ptr);
-      char* column_type = strtok_r(NULL, ":", &inner_ptr);
+// Returns once the log is durable up to position. With a sync window the
+// writer thread does the fsync, shared with the commits of the same window.
+void wal_sync(Wal* wal, uint64_t position) {
+  if (wal->sync_window_ms == 0) {
+    wal_flush(wal, UINT64_MAX);
+    return;
+  }
 
-      table->columns[j].name = strdup(column_name);
-      if (table->columns[j].name == NULL) {
-        fprintf(stderr, "Memory allocation error\n");
-        fclose(file);
-        free_schema(schema);
-        exit(EXIT_FAILURE);
-      }
-      table->columns[j].size = atoi(column_size);
-      table->columns[j].type = string_to_column_type(column_type);
-    }
+  pthread_mutex_lock(&wal->lock);
+  wal->num_waiting++;
+  pthread_cond_signal(&wal->pending);
+  while (wal->base_position + wal->flushed_lsn < position) {
+    pthread_cond_wait(&wal->flushed, &wal->lock);
   }
+  wal->num_waiting--;
+  pthread_mutex_unlock(&wal->lock);
+}
 
-  fclose(file);
-  return schema;
+// Empties the log once everything in it is reflected in the data files
+void wal_reset(Wal* wal) {
+  wal_flush(wal, UINT64_MAX);
+
+  pthread_mutex_lock(&wal->lock);
+  if (ftruncate(wal->file_descriptor, 0) < 0 ||
+      fdatasync(wal->file_descriptor) < 0) {
+    printf("Error truncating log: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  wal->base_position += wal->end_lsn;
+  wal->end_lsn = 0;
+  wal->flushed_lsn = 0;
+  pthread_cond_broadcast(&wal->flushed);
+  pthread_mutex_unlock(&wal->lock);
 }
 
-void schema_fill(Schema* schema) {
-  for (uint32_t i = 0; i < schema->num_tables; i++) {
-    Table* table = &schema->tables[i];
-    uint32_t row_size = 0;
-    for (uint32_t j = 0; j < table->num_columns; j++) {
-      table->columns[j].offset = row_size;
-      row_size += table->columns[j].size;
-    }
+void wal_append_page(Wal* wal, Frame* frame) {
+  uint32_t prefix[2] = {frame->pager->file_id, frame->page_num};
+  frame->lsn = wal_append(wal, WAL_RECORD_PAGE, prefix, sizeof(prefix),
+                          frame->data, page_size);
+  frame->unlogged = false;
+  frame->pager->logged_since_commit = true;
+}
 
-    uint32_t rows_per_page = PAGE_SIZE / row_size;
-    uint32_t table_max_rows = rows_per_page * TABLE_MAX_PAGES;
+// Logs the image a page had before the open transaction changed it
+uint64_t wal_append_undo(Wal* wal, UndoPage* undo) {
+  uint32_t prefix[2] = {undo->pager->file_id, undo->page_num};
+  undo->logged = true;
+  return wal_append(wal, WAL_RECORD_UNDO, prefix, sizeof(prefix), undo->data,
+                    page_size);
+}
 
-    char* filename = malloc(strlen(table->table_name) + strlen(DIR_PREFIX) + 7);
-    if (filename == NULL) {
-      printf("Memory allocation error\n");
-      free_schema(schema);
-      return;
-    }
-    sprintf(filename, "%s%s.table", DIR_PREFIX, table->table_name);
-    table->filename = filename;
+// Completions of writes have this bit set in user_data, next to the frame
+#define IO_RING_WRITE (1ULL << 32)
 
-    Pager* pager = pager_open(table->filename);
-    uint32_t num_pages = pager->file_length / PAGE_SIZE;
-    uint32_t bytes_remaining = pager->file_length % PAGE_SIZE;
-    uint32_t num_rows =
-        (num_pages * rows_per_page) + (bytes_remaining / row_size);
+IoRing* io_ring_new(uint32_t entries) {
+#ifdef HAVE_IO_URING
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  int fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (fd < 0) {
+    return NULL;
+  }
 
-    table->pager = pager;
-    table->row_size = row_size;
-    table->rows_per_page = rows_per_page;
-    table->max_rows = table_max_rows;
-    table->num_rows = num_rows;
+  IoRing* ring = calloc(1, sizeof(IoRing));
+  ring->fd = fd;
+  ring->entries = params.sq_entries;
+  ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+  ring->cq_ring_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED ||
+      ring->sqes == MAP_FAILED) {
+    if (ring->sq_ring != MAP_FAILED) {
+      munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    if (ring->cq_ring != MAP_FAILED) {
+      munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sqes != MAP_FAILED) {
+      munmap(ring->sqes, ring->sqes_size);
+    }
+    close(fd);
+    free(ring);
+    return NULL;
   }
+
+  ring->sq_head = ring->sq_ring + params.sq_off.head;
+  ring->sq_tail = ring->sq_ring + params.sq_off.tail;
+  ring->sq_mask = ring->sq_ring + params.sq_off.ring_mask;
+  ring->sq_array = ring->sq_ring + params.sq_off.array;
+  ring->cq_head = ring->cq_ring + params.cq_off.head;
+  ring->cq_tail = ring->cq_ring + params.cq_off.tail;
+  ring->cq_mask = ring->cq_ring + params.cq_off.ring_mask;
+  ring->cqes = ring->cq_ring + params.cq_off.cqes;
+  return ring;
+#else
+  (void)entries;
+  return NULL;
+#endif
 }
 
-Schema* db_open(const char* filename) {
-  Schema* schema = schema_open(filename);
-  if (schema == NULL) {
-    printf("Error opening schema\n");
-    exit(EXIT_FAILURE);
+void io_ring_free(IoRing* ring) {
+  if (ring == NULL) {
+    return;
   }
-  schema_fill(schema);
-
-  return schema;
+  munmap(ring->sqes, ring->sqes_size);
+  munmap(ring->cq_ring, ring->cq_ring_size);
+  munmap(ring->sq_ring, ring->sq_ring_size);
+  close(ring->fd);
+  free(ring);
 }
 
-void table_close(Table* table) {
-  Pager* pager = table->pager;
-  uint32_t num_full_pages = table->num_rows / table->rows_per_page;
+// Fills in a submission entry, which the kernel sees at the next
+// io_ring_enter. The caller keeps room for it in the ring.
+void io_ring_queue(IoRing* ring, bool write, int fd, void* buffer,
+                   uint32_t length, uint64_t offset, uint64_t user_data) {
+#ifdef HAVE_IO_URING
+  uint32_t tail = *ring->sq_tail;
+  uint32_t index = tail & *ring->sq_mask;
+  struct io_uring_sqe* sqe = (struct io_uring_sqe*)ring->sqes + index;
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t)(uintptr_t)buffer;
+  sqe->len = length;
+  sqe->off = offset;
+  sqe->user_data = user_data;
+  ring->sq_array[index] = index;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ring->num_queued++;
+#else
+  (void)ring, (void)write, (void)fd, (void)buffer, (void)length;
+  (void)offset, (void)user_data;
+#endif
+}
 
-  for (uint32_t i = 0; i < num_full_pages; i++) {
-    if (pager->pages[i] == NULL) {
-      continue;
+// Submits the queued entries and waits until min_complete of the submitted
+// ones have completed
+void io_ring_enter(IoRing* ring, uint32_t min_complete) {
+#ifdef HAVE_IO_URING
+  while (ring->num_queued > 0 || min_complete > 0) {
+    int submitted =
+        syscall(__NR_io_uring_enter, ring->fd, ring->num_queued, min_complete,
+                min_complete > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (submitted < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      printf("Error submitting I/O: %d\n", errno);
+      exit(EXIT_FAILURE);
     }
-    pager_flush(pager, i, PAGE_SIZE);
-    free(pager->pages[i]);
-    pager->pages[i] = NULL;
-  }
-
-  // There may be a partial page to write to the end of the file
-  uint32_t num_additional_rows = table->num_rows % table->rows_per_page;
-  if (num_additional_rows > 0) {
-    uint32_t page_num = num_full_pages;
-    if (pager->pages[page_num] != NULL) {
-      pager_flush(pager, page_num, num_additional_rows * table->row_size);
-      free(pager->pages[page_num]);
-      pager->pages[page_num] = NULL;
+    ring->num_queued -= submitted;
+    ring->num_pending += submitted;
+    if (ring->num_queued == 0) {
+      return;
     }
   }
+#else
+  (void)ring, (void)min_complete;
+#endif
+}
 
-  int result = close(pager->file_descriptor);
-  if (result < 0) {
-    printf("Error closing db file.\n");
-    exit(EXIT_FAILURE);
+BufferPool* buffer_pool_new(uint64_t size) {
+  BufferPool* pool = malloc(sizeof(BufferPool));
+  uint64_t num_frames = size / page_size;
+  if (num_frames < MIN_BUFFER_POOL_FRAMES) {
+    num_frames = MIN_BUFFER_POOL_FRAMES;
+  }
+  if (num_frames > UINT32_MAX - 1) {
+    num_frames = UINT32_MAX - 1;
   }
 
-  for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-    void* page = pager->pages[i];
-    if (page) {
-      free(page);
-      pager->pages[i] = NULL;
-    }
+  // Frame memory is only allocated once a frame is first used
+  pool->num_frames = num_frames;
+  pool->frames = calloc(num_frames, sizeof(Frame));
+  pool->num_used_frames = 0;
+  pool->clock_hand = 0;
+  pool->unlogged_capacity = 64;
+  pool->unlogged_frames = malloc(pool->unlogged_capacity * sizeof(uint32_t));
+  pool->num_unlogged_frames = 0;
+  pool->wal = NULL;
+  pool->transaction = NULL;
+  pthread_mutex_init(&pool->lock, NULL);
+  pool->io_ring = io_ring_new(IO_RING_ENTRIES);
+  if (pool->frames == NULL) {
+    printf("Memory allocation error\n");
+    exit(EXIT_FAILURE);
   }
 
-  free(pager);
+  return pool;
 }
 
-void db_close(Schema* schema) {
-  for (uint32_t i = 0; i < schema->num_tables; i++) {
-    Table* table = &(schema->tables[i]);
-    table_close(table);
+void buffer_pool_free(BufferPool* pool) {
+  for (uint32_t i = 0; i < pool->num_used_frames; i++) {
+    free(pool->frames[i].data);
   }
+  free(pool->frames);
+  free(pool->unlogged_frames);
+  pthread_mutex_destroy(&pool->lock);
+  io_ring_free(pool->io_ring);
+  free(pool);
+}
 
-  free(schema->tables);
-  free(schema);
+ThreadPool* thread_pool = NULL;
+
+bool thread_pool_next(ThreadPool* pool, uint32_t worker, uint32_t* morsel) {
+  for (uint32_t i = 0; i < pool->num_workers; i++) {
+    MorselQueue* queue = &pool->queues[(worker + i) % pool->num_workers];
+    pthread_mutex_lock(&queue->lock);
+    bool found = queue->next < queue->end;
+    if (found) {
+      *morsel = i == 0 ? queue->next++ : --queue->end;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    if (found) {
+      return true;
+    }
+  }
+  return false;
 }
 
-void* get_page(Pager* pager, uint32_t page_num) {
-  if (page_num > TABLE_MAX_PAGES) {
-    printf("Tried to fetch page number out of bounds. %d > %d\n", page_num,
-           TABLE_MAX_PAGES);
-    exit(EXIT_FAILURE);
+void thread_pool_work(ThreadPool* pool, uint32_t worker) {
+  uint32_t morsel;
+  while (thread_pool_next(pool, worker, &morsel)) {
+    pool->task(pool->context, worker, morsel);
   }
+}
 
-  if (pager->pages[page_num] == NULL) {
-    // Cache miss. Allocate memory and load from file.
-    void* page = malloc(PAGE_SIZE);
+void* thread_pool_main(void* arg) {
+  PoolThread* thread = arg;
+  ThreadPool* pool = thread->pool;
+  uint64_t generation = 0;
+  pthread_mutex_lock(&pool->lock);
+  while (true) {
+    while (pool->generation == generation) {
+      pthread_cond_wait(&pool->work, &pool->lock);
+    }
+    generation = pool->generation;
+    if (pool->task == NULL) {
+      break;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    thread_pool_work(pool, thread->worker);
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->num_busy == 0) {
+      pthread_cond_signal(&pool->done);
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
 
-    uint32_t num_pages = pager->file_length / PAGE_SIZE;
-    if (pager->file_length % PAGE_SIZE) {
-      // We might save a partial page at the end of the file
-      num_pages += 1;
+ThreadPool* thread_pool_new(uint32_t num_workers) {
+  ThreadPool* pool = calloc(1, sizeof(ThreadPool));
+  pool->num_workers = num_workers;
+  pool->threads = malloc(num_workers * sizeof(PoolThread));
+  pool->thread_ids = malloc(num_workers * sizeof(pthread_t));
+  pool->queues = malloc(num_workers * sizeof(MorselQueue));
+  pthread_mutex_init(&pool->run_lock, NULL);
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->work, NULL);
+  pthread_cond_init(&pool->done, NULL);
+  for (uint32_t i = 0; i < num_workers; i++) {
+    pthread_mutex_init(&pool->queues[i].lock, NULL);
+    pool->threads[i].pool = pool;
+    pool->threads[i].worker = i;
+    if (i > 0 && pthread_create(&pool->thread_ids[i], NULL, thread_pool_main,
+                                &pool->threads[i]) != 0) {
+      printf("Unable to start worker thread\n");
+      exit(EXIT_FAILURE);
     }
+  }
+  return pool;
+}
 
-    if (page_num <= num_pages) {
-      lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
-      ssize_t bytes_read = read(pager->file_descriptor, page, PAGE_SIZE);
-      if (bytes_read < 0) {
-        printf("Error reading file: %d\n", errno);
-        exit(EXIT_FAILURE);
-      }
+void thread_pool_free(ThreadPool* pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->task = NULL;
+  pool->generation++;
+  pthread_cond_broadcast(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
+  for (uint32_t i = 1; i < pool->num_workers; i++) {
+    pthread_join(pool->thread_ids[i], NULL);
+  }
+  for (uint32_t i = 0; i < pool->num_workers; i++) {
+    pthread_mutex_destroy(&pool->queues[i].lock);
+  }
+  pthread_mutex_destroy(&pool->run_lock);
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->work);
+  pthread_cond_destroy(&pool->done);
+  free(pool->queues);
+  free(pool->thread_ids);
+  free(pool->threads);
+  free(pool);
+}
+
+// Runs task over morsels [0, num_morsels) on every worker and returns when
+// all of them are done. Each worker starts with an equal share of the range.
+// While the workers run another thread's task, the caller runs every morsel
+// itself as worker 0.
+void thread_pool_run(ThreadPool* pool, MorselTask task, void* context,
+                     uint32_t num_morsels) {
+  if (pthread_mutex_trylock(&pool->run_lock) != 0) {
+    for (uint32_t morsel = 0; morsel < num_morsels; morsel++) {
+      task(context, 0, morsel);
     }
+    return;
+  }
 
-    pager->pages[page_num] = page;
+  for (uint32_t i = 0; i < pool->num_workers; i++) {
+    pool->queues[i].next = (uint64_t)num_morsels * i / pool->num_workers;
+    pool->queues[i].end = (uint64_t)num_morsels * (i + 1) / pool->num_workers;
   }
 
-  return pager->pages[page_num];
-}
+  pthread_mutex_lock(&pool->lock);
+  pool->task = task;
+  pool->context = context;
+  pool->num_busy = pool->num_workers - 1;
+  pool->generation++;
+  pthread_cond_broadcast(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
 
-Cursor* table_start(Table* table) {
-  Cursor* cursor = malloc(sizeof(Cursor));
-  cursor->table = table;
-  cursor->row_num = 0;
-  cursor->end_of_table = (table->num_rows == 0);
+  thread_pool_work(pool, 0);
 
-  return cursor;
+  pthread_mutex_lock(&pool->lock);
+  while (pool->num_busy > 0) {
+    pthread_cond_wait(&pool->done, &pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  pthread_mutex_unlock(&pool->run_lock);
 }
 
-Cursor* table_end(Table* table) {
-  Cursor* cursor = malloc(sizeof(Cursor));
-  cursor->table = table;
-  cursor->row_num = table->num_rows;
-  cursor->end_of_table = true;
+Pager* pager_open(BufferPool* pool, const char* filename) {
+  int fd = open(filename, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+  if (fd < 0) {
+    printf("Unable to open file\n");
+    exit(EXIT_FAILURE);
+  }
 
-  return cursor;
-}
+  off_t file_length = lseek(fd, 0, SEEK_END);
 
-void* cursor_value(Cursor* cursor) {
-  uint32_t row_num = cursor->row_num;
-  uint32_t page_num = row_num / cursor->table->rows_per_page;
-  void* page = get_page(cursor->table->pager, page_num);
-  uint32_t row_offset = row_num % cursor->table->rows_per_page;
-  uint32_t byte_offset = row_offset * cursor->table->row_size;
-  return page + byte_offset;
-}
+  Pager* pager = malloc(sizeof(Pager));
+  pager->pool = pool;
+  pager->file_id = 0;
+  pager->logged_since_commit = false;
+  pager->file_descriptor = fd;
+  pager->file_length = file_length;
+  pager->allocated_length = file_length;
+  pager->sequential_scans = 0;
+  pager->readahead_next = 0;
+  pager->num_pages = file_length / page_size;
+  if (file_length % page_size) {
+    pager->num_pages += 1;
+  }
 
-void cursor_advance(Cursor* cursor) {
-  cursor->row_num += 1;
-  if (cursor->row_num >= cursor->table->num_rows) {
-    cursor->end_of_table = true;
+  pager->pages_capacity = PAGER_INITIAL_PAGES;
+  while (pager->pages_capacity < pager->num_pages) {
+    pager->pages_capacity *= 2;
   }
-}
+  pager->page_frames = malloc(pager->pages_capacity * sizeof(uint32_t));
+  for (uint32_t i = 0; i < pager->pages_capacity; i++) {
+    pager->page_frames[i] = INVALID_FRAME_NUM;
+  }
+
+  pager->mmapped = false;
+  pager->map = NULL;
+  pager->mapped_length = 0;
+  pager->dirty_pages = NULL;
+  pager->num_dirty_pages = 0;
+  pager->dirty_capacity = 0;
+
+  pager->compressed = false;
+  pager->filename = NULL;
+  pager->records = NULL;
+  pager->live_bytes = 0;
 
-void serialize_row(Row* source, void* destination, Table* table) {
-  memcpy(destination, source->data, table->row_size);
+  return pager;
 }
 
-void deserialize_row(void* source, Row* destination, Table* table) {
-  destination->data = malloc(table->row_size);
-  for (uint32_t i = 0; i < table->num_columns; i++) {
-    ColumnDefinition column = table->columns[i];
-    memcpy(destination->data + column.offset, source + column.offset,
-           column.size);
+// Reserves disk space for the file up to length, a whole extent at a time,
+// so that pages appended one by one are laid out contiguously. The space
+// is kept past the end of the file, which only grows as pages are written.
+void pager_allocate(Pager* pager, uint64_t length) {
+  if (length <= pager->allocated_length) {
+    return;
   }
+  uint64_t extent = pager->allocated_length / 8;
+  if (extent < PAGER_EXTENT_SIZE) {
+    extent = PAGER_EXTENT_SIZE;
+  }
+  if (extent > PAGER_MAX_EXTENT_SIZE) {
+    extent = PAGER_MAX_EXTENT_SIZE;
+  }
+  uint64_t end = (length + extent - 1) / extent * extent;
+#ifdef FALLOC_FL_KEEP_SIZE
+  // File systems without fallocate get the file grown by its writes
+  if (fallocate(pager->file_descriptor, FALLOC_FL_KEEP_SIZE,
+                pager->allocated_length, end - pager->allocated_length) < 0 &&
+      errno != EOPNOTSUPP && errno != ENOSYS) {
+    printf("Error allocating db file: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+#endif
+  pager->allocated_length = end;
 }
 
-InputBuffer* new_input_buffer() {
-  InputBuffer* input_buffer = malloc(sizeof(InputBuffer));
-  input_buffer->buffer = NULL;
-  input_buffer->buffer_length = 0;
-  input_buffer->input_length = 0;
+// Maps the first length bytes of the file, growing or cutting the file to
+// match. The rest of the reservation stays inaccessible.
+void pager_map_resize(Pager* pager, uint64_t length) {
+  if (length > PAGER_MMAP_RESERVE) {
+    printf("File too large for mmap mode\n");
+    exit(EXIT_FAILURE);
+  }
+  pager_allocate(pager, length);
+  if (ftruncate(pager->file_descriptor, length) < 0) {
+    printf("Error resizing db file: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
 
-  return input_buffer;
+  void* result = pager->map;
+  if (length > pager->mapped_length) {
+    result = mmap(pager->map + pager->mapped_length,
+                  length - pager->mapped_length, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_FIXED, pager->file_descriptor,
+                  pager->mapped_length);
+  } else if (length < pager->mapped_length) {
+    result = mmap(pager->map + length, pager->mapped_length - length,
+                  PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE |
+                  MAP_FIXED, -1, 0);
+  }
+  if (result == MAP_FAILED) {
+    printf("Error mapping db file: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  pager->mapped_length = length;
+  pager->file_length = length;
+  // Cutting the file also frees the space reserved past its end
+  if (pager->allocated_length > length) {
+    pager->allocated_length = length;
+  }
 }
 
-void read_input(InputBuffer* input_buffer) {
-  ssize_t bytes_read =
-      getline(&(input_buffer->buffer), &(input_buffer->buffer_length), stdin);
-
-  if (bytes_read <= 0) {
-    printf("Error reading input\n");
+// Switches the pager to addressing pages directly in a mapping of the file
+void pager_use_mmap(Pager* pager) {
+  pager->map = mmap(NULL, PAGER_MMAP_RESERVE, PROT_NONE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (pager->map == MAP_FAILED) {
+    printf("Error reserving address space: %d\n", errno);
     exit(EXIT_FAILURE);
   }
+  pager->mmapped = true;
+  pager->dirty_capacity = PAGER_INITIAL_PAGES;
+  pager->dirty_pages = malloc(pager->dirty_capacity * sizeof(uint32_t));
 
-  // Ignore trailing newline
-  input_buffer->input_length = bytes_read - 1;
-  input_buffer->buffer[bytes_read - 1] = 0;
+  pager_map_resize(pager, (uint64_t)pager->num_pages * page_size);
 }
 
-MetaCommandResult do_meta_cmd(InputBuffer* input_buffer, Schema* schema) {
-  if (strcmp(input_buffer->buffer, ".exit") == 0) {
-    db_close(schema);
-    exit(EXIT_SUCCESS);
-  } else {
-    return META_COMMAND_UNRECOGNIZED_COMMAND;
-  }
+uint32_t page_record_checksum(PageRecordHeader* header, const void* data) {
+  uint32_t checksum =
+      crc32_update(0, &header->page_num, sizeof(uint32_t) * 2);
+  return crc32_update(checksum, data, header->length);
 }
 
-Operator string_to_operator(char* str_op) {
-  if (strcmp(str_op, "=") == 0) {
-    return OP_EQUAL;
-  } else if (strcmp(str_op, "!=") == 0) {
-    return OP_NOT_EQUAL;
-  } else if (strcmp(str_op, ">") == 0) {
-    return OP_GREATER_THAN;
-  } else if (strcmp(str_op, "<") == 0) {
-    return OP_LESS_THAN;
-  } else if (strcmp(str_op, ">=") == 0) {
-    return OP_GREATER_THAN_OR_EQUAL;
-  } else if (strcmp(str_op, "<=") == 0) {
-    return OP_LESS_THAN_OR_EQUAL;
-  } else {
-    return -1;
-  }
+bool compressed_file_write_header(int fd, uint64_t synced_length) {
+  char header[COMPRESSED_FILE_HEADER_SIZE] = {0};
+  uint32_t magic = COMPRESSED_FILE_MAGIC;
+  memcpy(header, &magic, sizeof(uint32_t));
+  memcpy(header + COMPRESSED_FILE_SYNCED_OFFSET, &synced_length,
+         sizeof(uint64_t));
+  return pwrite(fd, header, sizeof(header), 0) == sizeof(header);
 }
 
-PrepareResult copy_value_into_bytes(ColumnDefinition* column, Bytes* bytes,
-                                    char* value) {
-  switch (column->type) {
-    case INTEGER: {
-      int int_value = atoi(value);
-      bytes->length = column->size;
-      bytes->data = malloc(bytes->length);
-      memcpy(bytes->data, &int_value, bytes->length);
-      return PREPARE_SUCCESS;
-    }
-    case VARCHAR: {
-      if (value[0] != '\'' || value[strlen(value) - 1] != '\'') {
-        return PREPARE_SYNTAX_ERROR;
-      }
+// Switches the pager to compressed page records and finds the current
+// record of every page
+void pager_use_compression(Pager* pager, const char* filename) {
+  pager->compressed = true;
+  pager->filename = strdup(filename);
+  pager->records = calloc(pager->pages_capacity, sizeof(PageRecord));
+  pager->num_pages = 0;
+  if (pager->file_length == 0) {
+    return;
+  }
 
-      value[strlen(value) - 1] = '\0';
-      value++;
+  char file_header[COMPRESSED_FILE_HEADER_SIZE];
+  uint32_t magic = 0;
+  uint64_t synced_length = 0;
+  if (pread(pager->file_descriptor, file_header, sizeof(file_header), 0) ==
+      sizeof(file_header)) {
+    memcpy(&magic, file_header, sizeof(uint32_t));
+    memcpy(&synced_length, file_header + COMPRESSED_FILE_SYNCED_OFFSET,
+           sizeof(uint64_t));
+  }
+  if (magic != COMPRESSED_FILE_MAGIC) {
+    printf("Unsupported table file format: %s\n", filename);
+    exit(EXIT_FAILURE);
+  }
 
-      bytes->length = column->size;
-      bytes->data = malloc(bytes->length);
-      memcpy(bytes->data, value, bytes->length);
+  // Only the records written since the last checkpoint need their
+  // checksums verified
+  char data[page_size];
+  uint64_t offset = COMPRESSED_FILE_HEADER_SIZE;
+  while (offset + sizeof(PageRecordHeader) <= pager->file_length) {
+    PageRecordHeader header;
+    if (pread(pager->file_descriptor, &header, sizeof(header), offset) !=
+            sizeof(header) ||
+        header.length == 0 || header.length > page_size ||
+        offset + sizeof(header) + header.length > pager->file_length) {
+      break;
+    }
+    if (offset >= synced_length &&
+        (pread(pager->file_descriptor, data, header.length,
+               offset + sizeof(header)) != header.length ||
+         page_record_checksum(&header, data) != header.checksum)) {
+      break;
+    }
 
-      return PREPARE_SUCCESS;
+    pager_reserve(pager, header.page_num);
+    PageRecord* record = &pager->records[header.page_num];
+    if (record->length > 0) {
+      pager->live_bytes -= sizeof(PageRecordHeader) + record->length;
     }
-    case REAL: {
-      double real_value = atof(value);
-      bytes->length = column->size;
-      bytes->data = malloc(bytes->length);
-      memcpy(bytes->data, &real_value, bytes->length);
+    record->offset = offset;
+    record->length = header.length;
+    pager->live_bytes += sizeof(PageRecordHeader) + header.length;
+    if (header.page_num >= pager->num_pages) {
+      pager->num_pages = header.page_num + 1;
+    }
+    offset += sizeof(PageRecordHeader) + header.length;
+  }
 
-      return PREPARE_SUCCESS;
+  // A record torn by a crash was written after the last checkpoint, so the
+  // log still holds its page
+  if (offset < pager->file_length) {
+    if (ftruncate(pager->file_descriptor, offset) < 0) {
+      printf("Error truncating db file: %d\n", errno);
+      exit(EXIT_FAILURE);
     }
+    pager->file_length = offset;
+    pager->allocated_length = offset;
   }
 }
 
-PrepareResult parse_where_clause(char* where_part, WhereClause* where_clause,
-                                 Table* table) {
-  char* outer_ptr = NULL;
-  char* inner_ptr = NULL;
+void pager_write_record(Pager* pager, uint32_t page_num, const void* page) {
+  if (pager->file_length == 0) {
+    if (!compressed_file_write_header(pager->file_descriptor, 0)) {
+      printf("Error writing: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+    pager->file_length = COMPRESSED_FILE_HEADER_SIZE;
+  }
 
-  char* column_name = strtok_r(where_part, " ", &outer_ptr);
-  char* op = strtok_r(NULL, " ", &outer_ptr);
-  char* value = strtok_r(NULL, " ", &outer_ptr);
+  char record[sizeof(PageRecordHeader) + page_size];
+  PageRecordHeader header;
+  header.page_num = page_num;
+  header.length = lz4_compress(page, page_size,
+                               (uint8_t*)record + sizeof(PageRecordHeader),
+                               page_size - 1);
+  if (header.length == 0) {
+    header.length = page_size;
+    memcpy(record + sizeof(PageRecordHeader), page, page_size);
+  }
+  header.checksum =
+      page_record_checksum(&header, record + sizeof(PageRecordHeader));
+  memcpy(record, &header, sizeof(PageRecordHeader));
+
+  uint32_t record_length = sizeof(PageRecordHeader) + header.length;
+  pager_allocate(pager, pager->file_length + record_length);
+  if (pwrite(pager->file_descriptor, record, record_length,
+             pager->file_length) != record_length) {
+    printf("Error writing: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  STATS_ADD(bytes_written, record_length);
 
-  for (uint32_t i = 0; i < table->num_columns; i++) {
-    if (strcmp(column_name, table->columns[i].name) == 0) {
-      where_clause->column = &table->columns[i];
-      break;
-    }
+  pager_reserve(pager, page_num);
+  PageRecord* current = &pager->records[page_num];
+  if (current->length > 0) {
+    pager->live_bytes -= sizeof(PageRecordHeader) + current->length;
   }
+  current->offset = pager->file_length;
+  current->length = header.length;
+  pager->live_bytes += record_length;
+  pager->file_length += record_length;
+}
 
-  if (where_clause->column == NULL) {
-    return PREPARE_SYNTAX_ERROR;
+// Reads and decompresses a page, returning the number of bytes filled in
+uint32_t pager_read_record(Pager* pager, uint32_t page_num, void* page) {
+  if (page_num >= pager->pages_capacity ||
+      pager->records[page_num].length == 0) {
+    return 0;
+  }
+  PageRecord* record = &pager->records[page_num];
+  char data[page_size];
+  uint64_t offset = record->offset + sizeof(PageRecordHeader);
+  if (pread(pager->file_descriptor, data, record->length, offset) !=
+      record->length) {
+    printf("Error reading file: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  STATS_ADD(bytes_read, record->length);
+  if (record->length == page_size) {
+    memcpy(page, data, page_size);
+    return page_size;
   }
+  int64_t length = lz4_decompress((uint8_t*)data, record->length, page,
+                                  page_size);
+  if (length < 0) {
+    printf("Corrupt page %u in %s\n", page_num, pager->filename);
+    exit(EXIT_FAILURE);
+  }
+  return length;
+}
 
-  where_clause->op = string_to_operator(op);
-  if (where_clause->op == -1) {
-    return PREPARE_SYNTAX_ERROR;
+// Rewrites a compressed file with only the current record of each page.
+// The new file replaces the old one once it is on disk.
+void pager_compact(Pager* pager) {
+  char* filename = malloc(strlen(pager->filename) + 5);
+  sprintf(filename, "%s.tmp", pager->filename);
+  int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR);
+  if (fd < 0) {
+    printf("Unable to open file\n");
+    exit(EXIT_FAILURE);
   }
 
-  if (where_clause->column->type == VARCHAR) {
-    if (value[0] != '\'' || value[strlen(value) - 1] != '\'') {
-      return PREPARE_SYNTAX_ERROR;
+  uint64_t length = COMPRESSED_FILE_HEADER_SIZE;
+  bool failed = false;
+  char record[sizeof(PageRecordHeader) + page_size];
+  for (uint32_t page_num = 0; page_num < pager->pages_capacity && !failed;
+       page_num++) {
+    PageRecord* current = &pager->records[page_num];
+    if (current->length == 0) {
+      continue;
     }
+    uint32_t record_length = sizeof(PageRecordHeader) + current->length;
+    failed = pread(pager->file_descriptor, record, record_length,
+                   current->offset) != record_length ||
+             pwrite(fd, record, record_length, length) != record_length;
+    current->offset = length;
+    length += record_length;
   }
-
-  PrepareResult copy_result =
-      copy_value_into_bytes(where_clause->column, &where_clause->value, value);
-  if (copy_result != PREPARE_SUCCESS) {
-    return copy_result;
+  failed = failed || !compressed_file_write_header(fd, length);
+  if (failed || fdatasync(fd) < 0 || rename(filename, pager->filename) < 0) {
+    printf("Error compacting db file: %d\n", errno);
+    exit(EXIT_FAILURE);
   }
+  free(filename);
 
-  return PREPARE_SUCCESS;
+  close(pager->file_descriptor);
+  pager->file_descriptor = fd;
+  pager->file_length = length;
+  pager->allocated_length = length;
 }
 
-PrepareResult prepare_delete(InputBuffer* input_buffer, Statement* statement,
-                             Schema* schema) {
-  statement->type = STATEMENT_DELETE;
-  DeleteStatement* delete_statement = malloc(sizeof(DeleteStatement));
-  if (delete_statement == NULL) {
-    return PREPARE_INTERNAL_ERROR;
+void pager_advise(Pager* pager, int advice) {
+  if (pager->mmapped && pager->mapped_length > 0) {
+    madvise(pager->map, pager->mapped_length, advice);
   }
+}
 
-  memset(delete_statement, 0, sizeof(DeleteStatement));
-
-  char* cpy = strdup(input_buffer->buffer);
-  if (!cpy) {
-    free(delete_statement);
-    return PREPARE_INTERNAL_ERROR;
+// Scans tell the pager when they read it front to back, so pages can be
+// read ahead of them
+void pager_begin_scan(Pager* pager) {
+  if (__atomic_fetch_add(&pager->sequential_scans, 1, __ATOMIC_RELAXED) > 0) {
+    return;
   }
+  pager_advise(pager, MADV_SEQUENTIAL);
+  if (!pager->mmapped && !pager->compressed) {
+    posix_fadvise(pager->file_descriptor, 0, 0, POSIX_FADV_SEQUENTIAL);
+  }
+}
 
-  trim(cpy);
-  char* lower_sql = str_to_lower(cpy);
-
-  if (strncmp(lower_sql, "delete from", 11) != 0) {
-    free(cpy);
-    free(lower_sql);
-    free(delete_statement);
-    return PREPARE_SYNTAX_ERROR;
+void pager_end_scan(Pager* pager) {
+  if (__atomic_sub_fetch(&pager->sequential_scans, 1, __ATOMIC_RELAXED) > 0) {
+    return;
   }
+  pager_advise(pager, MADV_NORMAL);
+  if (!pager->mmapped && !pager->compressed) {
+    posix_fadvise(pager->file_descriptor, 0, 0, POSIX_FADV_NORMAL);
+  }
+}
 
-  char* where_pos = strstr(lower_sql, " where ");
-  if (!where_pos) {
-    free(cpy);
-    free(lower_sql);
-    free(delete_statement);
-    return PREPARE_SYNTAX_ERROR;
+// Grows the page directory so that page_num has a slot
+void pager_reserve(Pager* pager, uint32_t page_num) {
+  if (page_num < pager->pages_capacity) {
+    return;
   }
 
-  size_t table_name_length = where_pos - (lower_sql + 12);
-  char* table_name = malloc(table_name_length + 1);
-  strncpy(table_name, cpy + 12, table_name_length);
-  table_name[table_name_length] = '\0';
-  trim(table_name);
+  uint64_t new_capacity = pager->pages_capacity;
+  while (new_capacity <= page_num) {
+    new_capacity *= 2;
+  }
+  if (new_capacity > UINT32_MAX) {
+    new_capacity = UINT32_MAX;
+  }
 
-  // check if table exists
-  Table* table = NULL;
-  for (uint32_t i = 0; i < schema->num_tables; i++) {
-    if (strcmp(schema->tables[i].table_name, table_name) == 0) {
-      table = &(schema->tables[i]);
-      break;
-    }
+  uint32_t* page_frames =
+      realloc(pager->page_frames, new_capacity * sizeof(uint32_t));
+  if (page_frames == NULL) {
+    printf("Memory allocation error\n");
+    exit(EXIT_FAILURE);
   }
-  if (table == NULL) {
-    free(cpy);
-    free(lower_sql);
-    free(table_name);
-    free(delete_statement);
-    return PREPARE_TABLE_NOT_FOUND;
+  for (uint64_t i = pager->pages_capacity; i < new_capacity; i++) {
+    page_frames[i] = INVALID_FRAME_NUM;
   }
+  if (pager->compressed) {
+    pager->records =
+        realloc(pager->records, new_capacity * sizeof(PageRecord));
+    memset(pager->records + pager->pages_capacity, 0,
+           (new_capacity - pager->pages_capacity) * sizeof(PageRecord));
+  }
+  pager->page_frames = page_frames;
+  pager->pages_capacity = new_capacity;
+}
 
-  statement->table = table;
-
-  char* where_part = where_pos + 7;
-  WhereClause* where_clause = malloc(sizeof(WhereClause));
-  if (where_clause == NULL) {
-    free(cpy);
-    free(lower_sql);
-    free(table_name);
-    free(delete_statement);
-    return PREPARE_INTERNAL_ERROR;
+Frame* pager_frame(Pager* pager, uint32_t page_num) {
+  if (page_num >= pager->pages_capacity ||
+      pager->page_frames[page_num] == INVALID_FRAME_NUM) {
+    return NULL;
   }
+  return &pager->pool->frames[pager->page_frames[page_num]];
+}
 
-  PrepareResult prepare_result =
-      parse_where_clause(where_part, where_clause, table);
-  if (prepare_result != PREPARE_SUCCESS) {
-    free(cpy);
-    free(lower_sql);
-    free(table_name);
-    free(delete_statement);
-    return prepare_result;
+// Writes back a whole page, growing the file by an extent when the page
+// lies past the space reserved for it
+void pager_flush(Pager* pager, uint32_t page_num) {
+  Frame* frame = pager_frame(pager, page_num);
+  if (frame == NULL) {
+    printf("Tried to flush null page\n");
+    exit(EXIT_FAILURE);
+  }
+  if (pager->compressed) {
+    pager_write_record(pager, page_num, frame->data);
+    frame->dirty = false;
+    return;
   }
 
-  delete_statement->where_clause = where_clause;
-  statement->statementDetail = delete_statement;
+  uint64_t offset = (uint64_t)page_num * page_size;
+  pager_allocate(pager, offset + page_size);
+  ssize_t bytes_written =
+      pwrite(pager->file_descriptor, frame->data, page_size, offset);
+  if (bytes_written != page_size) {
+    printf("Error writing: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  STATS_ADD(bytes_written, bytes_written);
 
-  return PREPARE_SUCCESS;
+  if (offset + page_size > pager->file_length) {
+    pager->file_length = offset + page_size;
+  }
+  frame->dirty = false;
 }
 
-PrepareResult prepare_update(InputBuffer* input_buffer, Statement* statement,
-                             Schema* schema) {
-  statement->type = STATEMENT_UPDATE;
-  UpdateStatement* update_statement = malloc(sizeof(UpdateStatement));
-  if (update_statement == NULL) {
-    return PREPARE_INTERNAL_ERROR;
+// Reads a page that is not compressed, zeroing what lies past the end of
+// the file
+void pager_read_page(Pager* pager, uint32_t page_num, void* data) {
+  ssize_t bytes_read = 0;
+  uint64_t offset = (uint64_t)page_num * page_size;
+  while (bytes_read < page_size && offset + bytes_read < pager->file_length) {
+    ssize_t result = pread(pager->file_descriptor, data + bytes_read,
+                           page_size - bytes_read, offset + bytes_read);
+    if (result < 0) {
+      printf("Error reading file: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+    if (result == 0) {
+      break;
+    }
+    bytes_read += result;
   }
+  STATS_ADD(bytes_read, bytes_read);
+  // We might save a partial page at the end of the file
+  memset(data + bytes_read, 0, page_size - bytes_read);
+}
 
-  memset(update_statement, 0, sizeof(UpdateStatement));
+// Finishes the I/O a completion reports. Reads and writes the kernel
+// refused or cut short are done again with plain system calls.
+void buffer_pool_complete(BufferPool* pool, uint64_t user_data,
+                          int32_t result) {
+  Frame* frame = &pool->frames[(uint32_t)user_data];
+  Pager* pager = frame->pager;
+  uint64_t offset = (uint64_t)frame->page_num * page_size;
+  if (result < 0 && result != -EINVAL && result != -EOPNOTSUPP &&
+      result != -EAGAIN && result != -EINTR) {
+    printf("Error %s file: %d\n",
+           user_data & IO_RING_WRITE ? "writing" : "reading", -result);
+    exit(EXIT_FAILURE);
+  }
 
-  char* cpy = strdup(input_buffer->buffer);
-  if (!cpy) {
-    free(update_statement);
-    printf("strdup cpy\n");
-    return PREPARE_INTERNAL_ERROR;
+  if (user_data & IO_RING_WRITE) {
+    if (result != page_size) {
+      pager_flush(pager, frame->page_num);
+      return;
+    }
+    STATS_ADD(bytes_written, result);
+    if (offset + page_size > pager->file_length) {
+      pager->file_length = offset + page_size;
+    }
+    frame->dirty = false;
+    return;
   }
 
-  trim(cpy);
-  char* lower_sql = str_to_lower(cpy);
+  if (result < page_size && offset + (result > 0 ? result : 0) <
+                                pager->file_length) {
+    pager_read_page(pager, frame->page_num, frame->data);
+  } else {
+    STATS_ADD(bytes_read, result);
+    memset(frame->data + result, 0, page_size - result);
+  }
+  frame->reading = false;
+  frame->pin_count -= 1;
+}
 
-  if (strncmp(lower_sql, "update", 6) != 0) {
-    free(cpy);
-    free(lower_sql);
-    free(update_statement);
-    printf("update\n");
-    return PREPARE_SYNTAX_ERROR;
+// Submits queued I/O, waits for min_complete completions and finishes all
+// that have arrived
+void buffer_pool_reap(BufferPool* pool, uint32_t min_complete) {
+#ifdef HAVE_IO_URING
+  IoRing* ring = pool->io_ring;
+  io_ring_enter(ring, min_complete);
+  uint32_t head = *ring->cq_head;
+  while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe* cqe =
+        (struct io_uring_cqe*)ring->cqes + (head & *ring->cq_mask);
+    uint64_t user_data = cqe->user_data;
+    int32_t result = cqe->res;
+    head++;
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    ring->num_pending--;
+    buffer_pool_complete(pool, user_data, result);
   }
+#else
+  (void)pool, (void)min_complete;
+#endif
+}
 
-  char* set_pos = strstr(lower_sql, " set ");
-  if (!set_pos) {
-    free(cpy);
-    free(lower_sql);
-    free(update_statement);
-    printf("set_pos\n");
-    return PREPARE_SYNTAX_ERROR;
+// Waits for all I/O in flight
+void buffer_pool_drain(BufferPool* pool) {
+  IoRing* ring = pool->io_ring;
+  while (ring != NULL && ring->num_queued + ring->num_pending > 0) {
+    buffer_pool_reap(pool, ring->num_queued + ring->num_pending);
   }
+}
 
-  char* where_pos = strstr(lower_sql, " where ");
-  if (!where_pos) {
-    free(cpy);
-    free(lower_sql);
-    free(update_statement);
-    printf("where_pos\n");
-    return PREPARE_SYNTAX_ERROR;
+// Queues a read or write of the frame's page, making room in the ring
+// first if it is full
+void buffer_pool_queue(BufferPool* pool, uint32_t frame_num, bool write) {
+  IoRing* ring = pool->io_ring;
+  if (ring->num_queued + ring->num_pending >= ring->entries) {
+    buffer_pool_reap(pool, 1);
   }
+  Frame* frame = &pool->frames[frame_num];
+  io_ring_queue(ring, write, frame->pager->file_descriptor, frame->data,
+                page_size, (uint64_t)frame->page_num * page_size,
+                frame_num | (write ? IO_RING_WRITE : 0));
+}
 
-  size_t table_name_length = set_pos - (lower_sql + 7);
-  char* table_name = malloc(table_name_length + 1);
-  strncpy(table_name, cpy + 7, table_name_length);
-  table_name[table_name_length] = '\0';
-  trim(table_name);
+// Detaches a frame from its page, writing the page back if it changed
+void buffer_pool_evict(BufferPool* pool, uint32_t frame_num) {
+  Frame* frame = &pool->frames[frame_num];
+  if (frame->pager == NULL) {
+    return;
+  }
 
-  // check if table exists
-  Table* table = NULL;
-  for (uint32_t i = 0; i < schema->num_tables; i++) {
-    if (strcmp(schema->tables[i].table_name, table_name) == 0) {
-      table = &(schema->tables[i]);
-      break;
+  if (frame->dirty) {
+    // The log must cover a page before the page itself reaches the disk,
+    // and hold its old image if the open transaction changed it
+    if (pool->wal != NULL) {
+      uint64_t lsn = 0;
+      UndoPage* undo =
+          pool->transaction == NULL
+              ? NULL
+              : transaction_find_page(pool->transaction, frame->pager,
+                                      frame->page_num);
+      if (undo != NULL && !undo->logged) {
+        lsn = wal_append_undo(pool->wal, undo);
+      }
+      if (frame->unlogged) {
+        wal_append_page(pool->wal, frame);
+      }
+      wal_flush(pool->wal, frame->lsn > lsn ? frame->lsn : lsn);
     }
+    pager_flush(frame->pager, frame->page_num);
   }
-  if (table == NULL) {
-    free(cpy);
-    free(lower_sql);
-    free(table_name);
-    free(update_statement);
-    return PREPARE_TABLE_NOT_FOUND;
-  }
-
-  statement->table = table;
-
-  char* set_part = set_pos + 5;
-  char* where_part = where_pos + 7;
-
-  // assume only update one column
-  char* column_name = strtok(set_part, " = ");
-  char* value = strtok(NULL, " = ");
+  frame->unlogged = false;
+  frame->pager->page_frames[frame->page_num] = INVALID_FRAME_NUM;
+  frame->pager = NULL;
+}
 
-  ColumnDefinition* column = NULL;
-  for (uint32_t i = 0; i < table->num_columns; i++) {
-    if (strcmp(table->columns[i].name, column_name) == 0) {
-      column = &table->columns[i];
-      break;
+uint32_t buffer_pool_claim(BufferPool* pool) {
+  if (pool->num_used_frames < pool->num_frames) {
+    uint32_t frame_num = pool->num_used_frames++;
+    pool->frames[frame_num].data = malloc(page_size);
+    if (pool->frames[frame_num].data == NULL) {
+      printf("Memory allocation error\n");
+      exit(EXIT_FAILURE);
     }
+    return frame_num;
   }
 
-  if (column == NULL) {
-    free(cpy);
-    free(lower_sql);
-    free(table_name);
-    free(update_statement);
-    printf("column\n");
-    return PREPARE_SYNTAX_ERROR;
-  }
+  // Two sweeps clear every reference bit, so a victim is found unless all
+  // frames are pinned
+  for (uint64_t i = 0; i <= 2 * (uint64_t)pool->num_frames; i++) {
+    uint32_t frame_num = pool->clock_hand;
+    Frame* frame = &pool->frames[frame_num];
+    pool->clock_hand = (pool->clock_hand + 1) % pool->num_frames;
 
-  update_statement->column = column;
+    if (frame->pager == NULL) {
+      return frame_num;
+    }
+    if (frame->pin_count > 0) {
+      continue;
+    }
+    if (frame->referenced) {
+      frame->referenced = false;
+      continue;
+    }
 
-  WhereClause* where_clause = malloc(sizeof(WhereClause));
-  if (where_clause == NULL) {
-    free(cpy);
-    free(lower_sql);
-    free(table_name);
-    free(update_statement);
-    return PREPARE_INTERNAL_ERROR;
+    buffer_pool_evict(pool, frame_num);
+    return frame_num;
   }
 
-  PrepareResult prepare_result =
-      parse_where_clause(where_part, where_clause, table);
-  if (prepare_result != PREPARE_SUCCESS) {
-    free(cpy);
-    free(lower_sql);
-    free(table_name);
-    free(update_statement);
-    return prepare_result;
+  // Frames being read ahead are unpinned once their reads complete
+  IoRing* ring = pool->io_ring;
+  if (ring != NULL && ring->num_queued + ring->num_pending > 0) {
+    buffer_pool_reap(pool, 1);
+    return buffer_pool_claim(pool);
   }
+  printf("Buffer pool exhausted: all %u frames are pinned\n", pool->num_frames);
+  exit(EXIT_FAILURE);
+}
 
-  update_statement->where_clause = where_clause;
-
-  PrepareResult copy_result =
-      copy_value_into_bytes(column, &update_statement->value, value);
-  if (copy_result != PREPARE_SUCCESS) {
-    free(cpy);
-    free(lower_sql);
-    free(table_name);
-    free(update_statement);
-    return copy_result;
+// Pages are marked before they are changed, so the open transaction can
+// keep them as they were
+void pager_mark_dirty(Pager* pager, uint32_t page_num) {
+  if (pager->mmapped) {
+    // The kernel may write a mapped page back at any time, so its old
+    // image goes to the log before it changes
+    UndoPage* undo =
+        current_transaction == NULL
+            ? NULL
+            : transaction_save_page(
+                  current_transaction, pager, page_num,
+                  (char*)pager->map + (size_t)page_num * page_size);
+    if (undo != NULL) {
+      Wal* wal = pager->pool->wal;
+      wal_flush(wal, wal_append_undo(wal, undo));
+    }
+    if (pager->page_frames[page_num] == INVALID_FRAME_NUM) {
+      pager->page_frames[page_num] = 0;
+      if (pager->num_dirty_pages == pager->dirty_capacity) {
+        pager->dirty_capacity *= 2;
+        pager->dirty_pages = realloc(pager->dirty_pages,
+                                     pager->dirty_capacity * sizeof(uint32_t));
+      }
+      pager->dirty_pages[pager->num_dirty_pages++] = page_num;
+    }
+    return;
   }
 
-  statement->statementDetail = update_statement;
+  Frame* frame = pager_frame(pager, page_num);
+  if (frame == NULL) {
+    printf("Tried to mark a page that is not in memory dirty\n");
+    exit(EXIT_FAILURE);
+  }
+  if (current_transaction != NULL) {
+    transaction_save_page(current_transaction, pager, page_num, frame->data);
+  }
+  frame->dirty = true;
+
+  if (!frame->unlogged) {
+    BufferPool* pool = pager->pool;
+    frame->unlogged = true;
+    if (pool->num_unlogged_frames == pool->unlogged_capacity) {
+      pool->unlogged_capacity *= 2;
+      pool->unlogged_frames = realloc(
+          pool->unlogged_frames, pool->unlogged_capacity * sizeof(uint32_t));
+    }
+    pool->unlogged_frames[pool->num_unlogged_frames++] = frame - pool->frames;
+  }
+}
 
-  return PREPARE_SUCCESS;
+int compare_page_nums(const void* a, const void* b) {
+  uint32_t x = *(const uint32_t*)a;
+  uint32_t y = *(const uint32_t*)b;
+  return (x > y) - (x < y);
 }
 
-PrepareResult prepare_insert(InputBuffer* input_buffer, Statement* statement,
-                             Schema* schema) {
-  statement->type = STATEMENT_INSERT;
-  InsertStatement* insert_statement = malloc(sizeof(InsertStatement));
-  if (insert_statement == NULL) {
-    return PREPARE_INTERNAL_ERROR;
+// Writes back every dirty page of the pager that is still in memory
+void pager_flush_all(Pager* pager) {
+  if (pager->mmapped) {
+    if (pager->mapped_length > 0 &&
+        msync(pager->map, pager->mapped_length, MS_SYNC) < 0) {
+      printf("Error syncing mapping: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+    return;
   }
 
-  memset(insert_statement, 0, sizeof(InsertStatement));
-
-  char* cpy = strdup(input_buffer->buffer);
-  if (!cpy) {
-    free(insert_statement);
-    return PREPARE_INTERNAL_ERROR;
+  BufferPool* pool = pager->pool;
+  if (pager->compressed) {
+    for (uint32_t i = 0; i < pool->num_used_frames; i++) {
+      Frame* frame = &pool->frames[i];
+      if (frame->pager == pager && frame->dirty) {
+        pager_flush(pager, frame->page_num);
+      }
+    }
+    return;
   }
 
-  trim(cpy);
-  char* lower_sql = str_to_lower(cpy);
-
-  if (strncmp(lower_sql, "insert into", 11) != 0) {
-    free(cpy);
-    free(lower_sql);
-    free(insert_statement);
-    return PREPARE_SYNTAX_ERROR;
+  // Pages are written in file order, all at once through the I/O ring or
+  // with one pwritev per run of adjacent pages
+  uint32_t num_dirty = 0;
+  uint32_t* dirty = malloc((pool->num_used_frames + 1) * sizeof(uint32_t));
+  for (uint32_t i = 0; i < pool->num_used_frames; i++) {
+    Frame* frame = &pool->frames[i];
+    if (frame->pager == pager && frame->dirty) {
+      dirty[num_dirty++] = frame->page_num;
+    }
   }
-
-  char* values_pos = strstr(lower_sql, " values ");
-  if (!values_pos) {
-    free(cpy);
-    free(lower_sql);
-    free(insert_statement);
-    return PREPARE_SYNTAX_ERROR;
+  qsort(dirty, num_dirty, sizeof(uint32_t), compare_page_nums);
+  if (num_dirty > 0) {
+    pager_allocate(pager, ((uint64_t)dirty[num_dirty - 1] + 1) * page_size);
+  }
+  for (uint32_t i = 0; i < num_dirty; i++) {
+    dirty[i] = pager->page_frames[dirty[i]];
   }
 
-  size_t table_name_length = values_pos - (lower_sql + 12);
-  char* table_name = malloc(table_name_length + 1);
-  strncpy(table_name, cpy + 12, table_name_length);
-  table_name[table_name_length] = '\0';
-  trim(table_name);
-
-  // check if table exists
-  Table* table = NULL;
-  for (uint32_t i = 0; i < schema->num_tables; i++) {
-    if (strcmp(schema->tables[i].table_name, table_name) == 0) {
-      table = &(schema->tables[i]);
-      break;
+  if (pool->io_ring != NULL) {
+    for (uint32_t i = 0; i < num_dirty; i++) {
+      buffer_pool_queue(pool, dirty[i], true);
     }
-  }
-  if (table == NULL) {
-    free(cpy);
-    free(lower_sql);
-    free(insert_statement);
-    return PREPARE_SYNTAX_ERROR;
+    buffer_pool_drain(pool);
+    free(dirty);
+    return;
   }
 
-  statement->table = table;
+  struct iovec iov[IOV_MAX];
+  for (uint32_t i = 0; i < num_dirty;) {
+    uint32_t first_page = pool->frames[dirty[i]].page_num;
+    uint32_t num_pages = 0;
+    while (i + num_pages < num_dirty && num_pages < IOV_MAX &&
+           pool->frames[dirty[i + num_pages]].page_num ==
+               first_page + num_pages) {
+      iov[num_pages].iov_base = pool->frames[dirty[i + num_pages]].data;
+      iov[num_pages].iov_len = page_size;
+      num_pages++;
+    }
 
-  char* values_start = strchr(values_pos, '(');
-  char* values_end = strrchr(values_pos, ')');
-  if (!values_start || !values_end || values_end <= values_start) {
-    free(cpy);
-    free(lower_sql);
-    free(table_name);
-    free(insert_statement);
-    return PREPARE_SYNTAX_ERROR;
+    uint64_t offset = (uint64_t)first_page * page_size;
+    ssize_t bytes_written =
+        pwritev(pager->file_descriptor, iov, num_pages, offset);
+    if (bytes_written < 0) {
+      printf("Error writing: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+    STATS_ADD(bytes_written, bytes_written);
+    if (bytes_written < (ssize_t)num_pages * page_size) {
+      // Pages the call cut short are written one by one
+      for (uint32_t j = bytes_written / page_size; j < num_pages; j++) {
+        pager_flush(pager, first_page + j);
+      }
+    }
+    if (offset + bytes_written > pager->file_length) {
+      pager->file_length = offset + bytes_written;
+    }
+    for (uint32_t j = 0; j < num_pages; j++) {
+      pool->frames[dirty[i + j]].dirty = false;
+    }
+    i += num_pages;
   }
+  free(dirty);
+}
 
-  size_t values_length = values_end - (values_start + 1);
-  char* values_part = malloc(values_length + 1);
-  strncpy(values_part, values_start + 1, values_length);
-  values_part[values_length] = '\0';
+// Reads the pages after page_num into the buffer pool while a sequential
+// scan works on the ones before. The window is refilled once the scan has
+// used half of it.
+void pager_read_ahead(Pager* pager, uint32_t page_num) {
+  BufferPool* pool = pager->pool;
+  uint32_t window = pool->num_frames / 4;
+  if (window > READAHEAD_PAGES) {
+    window = READAHEAD_PAGES;
+  }
+  uint64_t file_pages = (pager->file_length + page_size - 1) / page_size;
+  uint64_t end = (uint64_t)page_num + 1 + window;
+  if (end > file_pages) {
+    end = file_pages;
+  }
+  // The scan started over or jumped ahead
+  if (pager->readahead_next > end || pager->readahead_next <= page_num) {
+    pager->readahead_next = page_num + 1;
+  }
+  if (pager->readahead_next >= end ||
+      pager->readahead_next > page_num + 1 + window / 2) {
+    return;
+  }
 
-  char* value = strtok(values_part, ",");
-  int num_values = 0;
-  char** values = NULL;
-  while (value) {
-    num_values++;
-    values = realloc(values, sizeof(char*) * num_values);
-    values[num_values - 1] = strdup(value);
-    trim(values[num_values - 1]);
-    value = strtok(NULL, ",");
+  uint32_t first = pager->readahead_next;
+  pager->readahead_next = end;
+  if (pool->io_ring == NULL) {
+    posix_fadvise(pager->file_descriptor, (off_t)first * page_size,
+                  (off_t)(end - first) * page_size, POSIX_FADV_WILLNEED);
+    STATS_ADD(pages_prefetched, end - first);
+    return;
   }
 
-  free(cpy);
-  free(lower_sql);
-  free(table_name);
-  free(values_part);
+  pager_reserve(pager, end - 1);
+  for (uint32_t i = first; i < end; i++) {
+    if (pager_frame(pager, i) != NULL) {
+      continue;
+    }
+    // Each frame is taken before the next claim, so none is handed out twice
+    uint32_t frame_num = buffer_pool_claim(pool);
+    Frame* frame = &pool->frames[frame_num];
+    frame->pager = pager;
+    frame->page_num = i;
+    frame->pin_count = 1;
+    frame->dirty = false;
+    frame->referenced = true;
+    frame->unlogged = false;
+    frame->reading = true;
+    frame->lsn = 0;
+    pager->page_frames[i] = frame_num;
+    buffer_pool_queue(pool, frame_num, false);
+    STATS_ADD(pages_prefetched, 1);
+  }
+  io_ring_enter(pool->io_ring, 0);
+}
 
-  // check whether the number of values matches the number of columns
-  if (num_values != table->num_columns) {
-    for (int i = 0; i < num_values; i++) {
-      free(values[i]);
+// Releases the pager's frames without writing them back
+void pager_drop(Pager* pager) {
+  BufferPool* pool = pager->pool;
+  buffer_pool_drain(pool);
+  for (uint32_t i = 0; i < pool->num_used_frames; i++) {
+    Frame* frame = &pool->frames[i];
+    if (frame->pager == pager) {
+      pager->page_frames[frame->page_num] = INVALID_FRAME_NUM;
+      frame->pager = NULL;
+      frame->dirty = false;
+      frame->unlogged = false;
+      frame->pin_count = 0;
     }
-    free(values);
-    free(insert_statement);
-    return PREPARE_SYNTAX_ERROR;
   }
+}
 
-  Row row;
-  row.data = malloc(table->row_size);
-  memset(row.data, 0, table->row_size);
-  for (int i = 0; i < num_values; i++) {
-    ColumnDefinition column = table->columns[i];
-    char* value = values[i];
-    if (column.type == INTEGER) {
-      int int_value = atoi(value);
-      if (int_value <= 0 && strcmp(column.name, "id") == 0) {
-        for (int i = 0; i < num_values; i++) {
-          free(values[i]);
-        }
-        free(values);
-        free(insert_statement);
-        return PREPARE_NEGATIVE_ID;
+// Cuts the file, and in mmap mode the spare mapped space, down to length
+void pager_truncate(Pager* pager, uint64_t length) {
+  if (pager->compressed) {
+    bool dropped = false;
+    for (uint64_t page_num = length / page_size;
+         page_num < pager->pages_capacity; page_num++) {
+      PageRecord* record = &pager->records[page_num];
+      if (record->length > 0) {
+        pager->live_bytes -= sizeof(PageRecordHeader) + record->length;
+        record->length = 0;
+        dropped = true;
       }
+    }
+    // Records of dropped pages would come back when the file is reopened
+    if (dropped || pager->file_length > 2 * pager->live_bytes +
+                                            PAGER_COMPACT_MIN_BYTES) {
+      pager_compact(pager);
+    }
+    return;
+  }
+  if (pager->mmapped) {
+    if (pager->mapped_length > length) {
+      pager_map_resize(pager, length);
+    }
+    return;
+  }
+  if (pager->file_length > length) {
+    if (ftruncate(pager->file_descriptor, length) < 0) {
+      printf("Error truncating db file: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+    pager->file_length = length;
+    pager->allocated_length = length;
+  }
+}
 
-      memcpy(row.data + column.offset, &int_value, column.size);
-    } else if (column.type == VARCHAR) {
-      int length = strlen(value);
-      if (length > column.size) {
-        for (int i = 0; i < num_values; i++) {
-          free(values[i]);
-        }
-        free(values);
-        free(insert_statement);
-        return PREPARE_STRING_TOO_LONG;
-      }
+void pager_close(Pager* pager) {
+  pager_flush_all(pager);
+  pager_drop(pager);
 
-      memcpy(row.data + column.offset, value, strlen(value));
-    } else if (column.type == REAL) {
-      float real_value = atof(value);
+  if (pager->mmapped) {
+    munmap(pager->map, PAGER_MMAP_RESERVE);
+  }
 
-      memcpy(row.data + column.offset, &real_value, column.size);
-    }
+  int result = close(pager->file_descriptor);
+  if (result < 0) {
+    printf("Error closing db file.\n");
+    exit(EXIT_FAILURE);
   }
 
-  insert_statement->row_to_insert = row;
-  statement->statementDetail = insert_statement;
+  free(pager->page_frames);
+  free(pager->dirty_pages);
+  free(pager->filename);
+  free(pager->records);
+  free(pager);
+}
 
-  return PREPARE_SUCCESS;
+char* table_file_name(Arena* arena, const char* table_name,
+                      const char* extension) {
+  char* filename = arena_alloc(
+      arena, strlen(DIR_PREFIX) + strlen(table_name) + strlen(extension) + 1);
+  sprintf(filename, "%s%s%s", DIR_PREFIX, table_name, extension);
+  return filename;
 }
 
-PrepareResult prepare_select(InputBuffer* input_buffer, Statement* statement,
-                             Schema* schema) {
-  statement->type = STATEMENT_SELECT;
-  SelectStatement* select_statement = malloc(sizeof(SelectStatement));
-  if (select_statement == NULL) {
-    return PREPARE_INTERNAL_ERROR;
+// Works out where each column lives in a row, in a page and in a zone map
+// entry. Returns false when a row does not fit in a page.
+bool table_define_layout(Table* table) {
+  uint32_t row_size = 0;
+  // Rows take less space in a page when long strings overflow
+  uint32_t page_row_size = 0;
+  for (uint32_t j = 0; j < table->num_columns; j++) {
+    ColumnDefinition* column = &table->columns[j];
+    column->cell_size = column->size;
+    if (column->type == VARCHAR && column->size > VARCHAR_CELL_SIZE) {
+      column->cell_size = VARCHAR_CELL_SIZE;
+    }
+    column->offset = row_size;
+    row_size += column->size;
+    page_row_size += column->cell_size;
   }
 
-  memset(select_statement, 0, sizeof(SelectStatement));
-
-  char* cpy = strdup(input_buffer->buffer);
-  if (!cpy) {
-    free(select_statement);
-    return PREPARE_INTERNAL_ERROR;
+  // Fit as many rows as possible next to their bitmap, keeping the rows
+  // 8-byte aligned
+  uint32_t rows_per_page =
+      (page_size - DATA_PAGE_HEADER_SIZE) * 8 / (page_row_size * 8 + 1);
+  uint32_t rows_offset;
+  while (true) {
+    rows_offset = DATA_PAGE_HEADER_SIZE + (rows_per_page + 7) / 8;
+    rows_offset = (rows_offset + 7) & ~7u;
+    if (rows_offset + rows_per_page * page_row_size <= page_size) {
+      break;
+    }
+    rows_per_page--;
   }
-
-  trim(cpy);
-  char* lower_sql = str_to_lower(cpy);
-
-  if (strncmp(lower_sql, "select", 6) != 0) {
-    free(cpy);
-    free(lower_sql);
-    free(select_statement);
-    return PREPARE_SYNTAX_ERROR;
+  if (rows_per_page == 0) {
+    return false;
   }
 
-  char* from_pos = strstr(lower_sql, " from ");
-  if (!from_pos) {
-    free(cpy);
-    free(lower_sql);
-    free(select_statement);
-    return PREPARE_SYNTAX_ERROR;
+  uint32_t minipage_offset = 0;
+  uint32_t cell_offset = 0;
+  for (uint32_t j = 0; j < table->num_columns; j++) {
+    ColumnDefinition* column = &table->columns[j];
+    if (table->layout == LAYOUT_PAX) {
+      column->page_offset = minipage_offset;
+      column->stride = column->cell_size;
+      minipage_offset += column->cell_size * rows_per_page;
+    } else {
+      column->page_offset = cell_offset;
+      column->stride = page_row_size;
+    }
+    cell_offset += column->cell_size;
   }
 
-  size_t columns_length = from_pos - (lower_sql + 7);
-  char* columns_part = malloc(columns_length + 1);
-  strncpy(columns_part, cpy + 7, columns_length);
-  columns_part[columns_length] = '\0';
-  trim(columns_part);
+  table->row_size = row_size;
+  table->rows_per_page = rows_per_page;
+  table->rows_offset = rows_offset;
+  // Row numbers are 32-bit; pages are allocated on demand up to that limit
+  table->max_rows = UINT32_MAX;
 
-  char** columns = NULL;
-  uint32_t num_columns = 0;
-  if (strcmp(columns_part, "*") == 0) {
-    select_statement->is_select_all = true;
-  } else {
-    select_statement->is_select_all = false;
-    char* column = strtok(columns_part, ",");
-    while (column) {
-      num_columns++;
-      columns = realloc(columns, sizeof(char*) * num_columns);
-      columns[num_columns - 1] = strdup(column);
-      trim(columns[num_columns - 1]);
-      column = strtok(NULL, ",");
+  // A zone map entry starts with whether it has been written
+  table->zone_entry_size = sizeof(uint64_t);
+  for (uint32_t j = 0; j < table->num_columns; j++) {
+    if (table->columns[j].type != VARCHAR) {
+      table->columns[j].zone_offset = table->zone_entry_size;
+      table->zone_entry_size += 2 * sizeof(double);
     }
   }
+  return true;
+}
 
-  // parse where clause
-  char* where_pos = strstr(lower_sql, " where ");
-  size_t table_name_length = 0;
-  // char* table_name = NULL;
-  if (where_pos) {
-    table_name_length = where_pos - (from_pos + 6);
-  } else {
-    table_name_length = strlen(from_pos + 6);
+void table_map_columns(Arena* arena, Table* table) {
+  uint32_t capacity = 4;
+  while (capacity < 2 * table->num_columns) {
+    capacity *= 2;
   }
-
-  char* table_name = malloc(table_name_length + 1);
-  strncpy(table_name, from_pos + 6, table_name_length);
-  table_name[table_name_length] = '\0';
-  trim(table_name);
-
-  Table* table = NULL;
-  for (uint32_t i = 0; i < schema->num_tables; i++) {
-    if (strcmp(schema->tables[i].table_name, table_name) == 0) {
-      table = &(schema->tables[i]);
-      break;
+  table->column_slots = arena_calloc(arena, capacity, sizeof(uint32_t));
+  table->column_capacity = capacity;
+  for (uint32_t j = 0; j < table->num_columns; j++) {
+    uint32_t slot = hash_string(table->columns[j].name) & (capacity - 1);
+    while (table->column_slots[slot] != 0) {
+      slot = (slot + 1) & (capacity - 1);
     }
+    table->column_slots[slot] = j + 1;
   }
-  if (table == NULL) {
-    for (uint32_t i = 0; i < num_columns; i++) {
-      free(columns[i]);
+}
+
+// Gives a table the file ids from file_id to file_id + 3
+void schema_set_file_id(Schema* schema, Table* table, uint32_t file_id) {
+  uint32_t number = file_id / 4;
+  if (number >= schema->file_tables_capacity) {
+    uint32_t capacity = schema->file_tables_capacity == 0
+                            ? 16
+                            : schema->file_tables_capacity;
+    while (capacity <= number) {
+      capacity *= 2;
     }
-    free(columns);
-    free(cpy);
-    free(lower_sql);
-    free(columns_part);
-    free(select_statement);
-    return PREPARE_TABLE_NOT_FOUND;
+    Table** file_tables = arena_calloc(schema->arena, capacity, sizeof(Table*));
+    memcpy(file_tables, schema->file_tables,
+           schema->file_tables_capacity * sizeof(Table*));
+    schema->file_tables = file_tables;
+    schema->file_tables_capacity = capacity;
   }
+  if (schema->file_tables_capacity > 0 &&
+      schema->file_tables[table->file_id / 4] == table) {
+    schema->file_tables[table->file_id / 4] = NULL;
+  }
+  schema->file_tables[number] = table;
+  table->file_id = file_id;
+  if (file_id >= schema->next_file_id) {
+    schema->next_file_id = file_id + 4;
+  }
+}
+
+// Adds a table to the schema, copying its definition into the schema's
+// arena. Its files are opened when a statement first uses it. A new table
+// gets the next unused file ids.
+Table* schema_add_table(Schema* schema, Table* definition) {
+  Arena* arena = schema->arena;
+  Table* table = arena_calloc(arena, 1, sizeof(Table));
+  table->table_name = arena_strdup(arena, definition->table_name);
+  table->num_columns = definition->num_columns;
+  table->columns =
+      arena_alloc(arena, table->num_columns * sizeof(ColumnDefinition));
+  for (uint32_t j = 0; j < table->num_columns; j++) {
+    table->columns[j] = definition->columns[j];
+    table->columns[j].name = arena_strdup(arena, definition->columns[j].name);
+    table->columns[j].overflow = NULL;
+  }
+  if (definition->key_column != NULL) {
+    table->key_column =
+        &table->columns[definition->key_column - definition->columns];
+  }
+  // Without an explicit key, an integer "id" column is the primary key
+  for (uint32_t j = 0; table->key_column == NULL && j < table->num_columns;
+       j++) {
+    if (table->columns[j].type == INTEGER &&
+        strcmp(table->columns[j].name, "id") == 0) {
+      table->key_column = &table->columns[j];
+    }
+  }
+  table->layout = definition->layout;
+  table->flags = definition->flags;
+  table->mmapped = (table->flags & TABLE_FLAG_MMAP) || schema->use_mmap;
+  table->compressed = table->flags & TABLE_FLAG_COMPRESSED;
+  if (!table_define_layout(table)) {
+    printf("Row of table %s does not fit in a page\n", table->table_name);
+    exit(EXIT_FAILURE);
+  }
+
+  table->filename = table_file_name(arena, table->table_name, ".table");
+  if (table->key_column != NULL) {
+    table->index_filename =
+        table_file_name(arena, table->table_name, ".index");
+  }
+  for (uint32_t j = 0; j < table->num_columns; j++) {
+    if (table->columns[j].cell_size < table->columns[j].size) {
+      table->overflow_filename =
+          table_file_name(arena, table->table_name, ".overflow");
+      break;
+    }
+  }
+  if (table->zone_entry_size > sizeof(uint64_t)) {
+    table->zone_filename =
+        table_file_name(arena, table->table_name, ".zones");
+  }
+  pthread_rwlock_init(&table->lock, NULL);
+  table_map_columns(arena, table);
+
+  pthread_rwlock_wrlock(&schema->catalog_lock);
+  if (2 * (schema->num_tables + 1) > schema->table_capacity) {
+    uint32_t capacity =
+        schema->table_capacity == 0 ? 16 : 2 * schema->table_capacity;
+    Table** slots = arena_calloc(arena, capacity, sizeof(Table*));
+    for (uint32_t i = 0; i < schema->num_tables; i++) {
+      uint32_t slot =
+          hash_string(schema->tables[i]->table_name) & (capacity - 1);
+      while (slots[slot] != NULL) {
+        slot = (slot + 1) & (capacity - 1);
+      }
+      slots[slot] = schema->tables[i];
+    }
+    schema->table_slots = slots;
+    schema->table_capacity = capacity;
+    // The list of tables grows with the map, which is never more than half
+    // full
+    schema->tables = arena_realloc(arena, schema->tables,
+                                   schema->num_tables * sizeof(Table*),
+                                   capacity / 2 * sizeof(Table*));
+  }
+  uint32_t slot =
+      hash_string(table->table_name) & (schema->table_capacity - 1);
+  while (schema->table_slots[slot] != NULL) {
+    slot = (slot + 1) & (schema->table_capacity - 1);
+  }
+  schema->table_slots[slot] = table;
+  schema->tables[schema->num_tables++] = table;
+  schema_set_file_id(schema, table, schema->next_file_id);
+  pthread_rwlock_unlock(&schema->catalog_lock);
+  return table;
+}
+
+// Adds the tables of a text schema file: the number of tables, then a line
+// per table, <name>;<number of columns>;<columns>[;<option>...], where each
+// column is <name>:<size>:<type>[:key]
+void schema_parse(Schema* schema, FILE* file) {
+  // Holds the definitions until they are copied into the schema
+  Arena* arena = arena_new();
+
+  char line[MAX_LINE_LENGTH];
+  if (fgets(line, sizeof(line), file) == NULL) {
+    printf("Error reading number of tables\n");
+    fclose(file);
+    free_schema(schema);
+    exit(EXIT_FAILURE);
+  }
+
+  uint32_t num_tables = atoi(line);
+  for (uint32_t i = 0; i < num_tables; i++) {
+    if (fgets(line, sizeof(line), file) == NULL) {
+      printf("Error reading table definition\n");
+      fclose(file);
+      free_schema(schema);
+      exit(EXIT_FAILURE);
+    }
+
+    size_t len = strlen(line);
+    if (len > 0 && line[len - 1] == '\n') {
+      line[len - 1] = '\0';
+    }
+
+    Table definition = {0};
+    Table* table = &definition;
+    char* token;
+
+    token = strtok(line, ";");
+    table->table_name = arena_strdup(arena, token);
+
+    token = strtok(NULL, ";");
+    table->num_columns = atoi(token);
+
+    table->columns =
+        arena_calloc(arena, table->num_columns, sizeof(ColumnDefinition));
+
+    char* outer_ptr = NULL;
+    char* inner_ptr = NULL;
+
+    char* column_defs = strtok(NULL, ";");
+    table->layout = LAYOUT_ROWS;
+    for (char* option = strtok(NULL, ";"); option != NULL;
+         option = strtok(NULL, ";")) {
+      if (strcmp(option, "rows") == 0) {
+        table->layout = LAYOUT_ROWS;
+      } else if (strcmp(option, "pax") == 0) {
+        table->layout = LAYOUT_PAX;
+      } else if (strcmp(option, "mmap") == 0) {
+        table->flags |= TABLE_FLAG_MMAP;
+      } else if (strcmp(option, "compressed") == 0) {
+        table->flags |= TABLE_FLAG_COMPRESSED;
+      } else {
+        printf("Unknown option for table %s: %s\n", table->table_name, option);
+        fclose(file);
+        free_schema(schema);
+        exit(EXIT_FAILURE);
+      }
+    }
+    char* column_defs_cpy = arena_strdup(arena, column_defs);
+    for (uint32_t j = 0; j < table->num_columns; j++) {
+      char* column_def =
+          strtok_r(j == 0 ? column_defs_cpy : NULL, ",", &outer_ptr);
+      if (column_def == NULL) {
+        printf("Error parsing column definition\n");
+        fclose(file);
+        free_schema(schema);
+        exit(EXIT_FAILURE);
+      }
+
+      char* column_name = strtok_r(column_def, ":", &inner_ptr);
+      char* column_size = strtok_r(NULL, ":", &inner_ptr);
+      char* column_type = strtok_r(NULL, ":", &inner_ptr);
+      char* column_flag = strtok_r(NULL, ":", &inner_ptr);
+
+      table->columns[j].name = arena_strdup(arena, column_name);
+      table->columns[j].size = atoi(column_size);
+      table->columns[j].type = string_to_column_type(column_type);
+
+      // Values are read from pages as a C int or double
+      if ((table->columns[j].type == INTEGER &&
+           table->columns[j].size != sizeof(int)) ||
+          (table->columns[j].type == REAL &&
+           table->columns[j].size != sizeof(double)) ||
+          table->columns[j].size == 0 ||
+          table->columns[j].size > VARCHAR_MAX_SIZE) {
+        printf("Invalid size for column %s\n", column_name);
+        fclose(file);
+        free_schema(schema);
+        exit(EXIT_FAILURE);
+      }
+
+      if (column_flag != NULL && strcmp(column_flag, "key") == 0) {
+        table->key_column = &table->columns[j];
+      }
+    }
+
+    if (table->key_column != NULL && table->key_column->type != INTEGER) {
+      printf("Key column must be an int: %s\n", table->key_column->name);
+      fclose(file);
+      free_schema(schema);
+      exit(EXIT_FAILURE);
+    }
+    if (schema_find_table(schema, table->table_name) != NULL) {
+      printf("Table %s is defined twice\n", table->table_name);
+      exit(EXIT_FAILURE);
+    }
+    schema_add_table(schema, table);
+  }
+  arena_free(arena);
+}
+
+/*
+ * The table catalog is a binary copy of the schema, read at startup instead
+ * of the text schema file for as long as that file is unchanged. After its
+ * header come the tables, each one as:
+ *   name length (u16), name, layout (u8), flags (u8), key column (u32,
+ *   UINT32_MAX when there is none), file id (u32), number of columns (u32),
+ * followed by a name length (u16), name, size (u32) and type (u8) per
+ * column. Tables made with create table exist only in the catalog, and are
+ * kept when the schema file changes. Tables keep their file ids too, so a
+ * log written before the change is replayed into the same tables. The
+ * catalog also records the page size of the database, which is fixed once
+ * the catalog has been written.
+ */
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  // Size and modification time of the schema file the catalog was made from
+  uint64_t schema_size;
+  int64_t schema_mtime_ns;
+  uint32_t num_tables;
+  uint32_t page_size;
+  // Above every file id given to a table so far
+  uint32_t next_file_id;
+  // CRC32 of the tables that follow
+  uint32_t checksum;
+} TableCatalogHeader;
+
+char* catalog_put(char* out, const void* data, size_t length) {
+  memcpy(out, data, length);
+  return out + length;
+}
+
+void catalog_put_name(char** out, const char* name) {
+  uint16_t length = strlen(name);
+  *out = catalog_put(*out, &length, sizeof(length));
+  *out = catalog_put(*out, name, length);
+}
+
+// Writes the table catalog to a new file, which replaces the old one once
+// it is on disk
+void table_catalog_save(Schema* schema) {
+  size_t length = sizeof(TableCatalogHeader);
+  for (uint32_t i = 0; i < schema->num_tables; i++) {
+    Table* table = schema->tables[i];
+    length += sizeof(uint16_t) + strlen(table->table_name) + 2 +
+              3 * sizeof(uint32_t);
+    for (uint32_t j = 0; j < table->num_columns; j++) {
+      length += sizeof(uint16_t) + strlen(table->columns[j].name) +
+                sizeof(uint32_t) + 1;
+    }
+  }
+
+  char* buffer = malloc(length);
+  char* out = buffer + sizeof(TableCatalogHeader);
+  for (uint32_t i = 0; i < schema->num_tables; i++) {
+    Table* table = schema->tables[i];
+    catalog_put_name(&out, table->table_name);
+    uint8_t options[2] = {table->layout, table->flags};
+    out = catalog_put(out, options, sizeof(options));
+    uint32_t key = table->key_column != NULL
+                       ? (uint32_t)(table->key_column - table->columns)
+                       : UINT32_MAX;
+    out = catalog_put(out, &key, sizeof(key));
+    out = catalog_put(out, &table->file_id, sizeof(uint32_t));
+    out = catalog_put(out, &table->num_columns, sizeof(uint32_t));
+    for (uint32_t j = 0; j < table->num_columns; j++) {
+      ColumnDefinition* column = &table->columns[j];
+      catalog_put_name(&out, column->name);
+      out = catalog_put(out, &column->size, sizeof(uint32_t));
+      uint8_t type = column->type;
+      out = catalog_put(out, &type, sizeof(type));
+    }
+  }
+  TableCatalogHeader header = {
+      TABLE_CATALOG_MAGIC, TABLE_CATALOG_VERSION, schema->schema_size,
+      schema->schema_mtime_ns, schema->num_tables, page_size,
+      schema->next_file_id,
+      crc32_update(0, buffer + sizeof(header), length - sizeof(header))};
+  memcpy(buffer, &header, sizeof(header));
+
+  int fd = open(TABLE_CATALOG_FILENAME ".tmp", O_WRONLY | O_CREAT | O_TRUNC,
+                S_IWUSR | S_IRUSR);
+  if (fd < 0) {
+    printf("Unable to open table catalog\n");
+    exit(EXIT_FAILURE);
+  }
+  write_all(fd, buffer, length);
+  if (fsync(fd) < 0 ||
+      rename(TABLE_CATALOG_FILENAME ".tmp", TABLE_CATALOG_FILENAME) < 0) {
+    printf("Error syncing table catalog: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  close(fd);
+  free(buffer);
+}
+
+bool catalog_get(char** in, char* end, void* data, size_t length) {
+  if ((size_t)(end - *in) < length) {
+    return false;
+  }
+  memcpy(data, *in, length);
+  *in += length;
+  return true;
+}
+
+char* catalog_get_name(char** in, char* end, Arena* arena) {
+  uint16_t length;
+  if (!catalog_get(in, end, &length, sizeof(length)) ||
+      (size_t)(end - *in) < length || length == 0) {
+    return NULL;
+  }
+  char* name = arena_strndup(arena, *in, length);
+  *in += length;
+  return name;
+}
+
+bool page_size_valid(uint64_t size) {
+  return size >= MIN_PAGE_SIZE && size <= MAX_PAGE_SIZE &&
+         (size & (size - 1)) == 0;
+}
+
+// Reads and checks the table catalog. Returns NULL when there is none.
+char* table_catalog_read(size_t* length) {
+  int fd = open(TABLE_CATALOG_FILENAME, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct stat file_stat;
+  fstat(fd, &file_stat);
+  *length = file_stat.st_size;
+  char* catalog = malloc(*length);
+  if (pread(fd, catalog, *length, 0) != (ssize_t)*length) {
+    printf("Error reading table catalog: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  close(fd);
+
+  TableCatalogHeader header;
+  if (*length >= sizeof(header)) {
+    memcpy(&header, catalog, sizeof(header));
+  }
+  if (*length < sizeof(header) || header.magic != TABLE_CATALOG_MAGIC ||
+      header.version != TABLE_CATALOG_VERSION ||
+      !page_size_valid(header.page_size) ||
+      header.checksum != crc32_update(0, catalog + sizeof(header),
+                                      *length - sizeof(header))) {
+    printf("Corrupt table catalog\n");
+    exit(EXIT_FAILURE);
+  }
+  return catalog;
+}
+
+// Adds the tables of the table catalog, or only those made with create
+// table when the others come from the schema file. Tables of the schema
+// file that the catalog already had get their file ids back.
+void table_catalog_add(Schema* schema, char* catalog, size_t length,
+                       bool created_only) {
+  TableCatalogHeader header;
+  memcpy(&header, catalog, sizeof(header));
+  // Tables added here get their ids from the catalog, not new ones
+  uint32_t next_file_id = schema->next_file_id > header.next_file_id
+                              ? schema->next_file_id
+                              : header.next_file_id;
+  schema->next_file_id = next_file_id;
+  Arena* arena = arena_new();
+  char* in = catalog + sizeof(header);
+  char* end = catalog + length;
+  for (uint32_t i = 0; i < header.num_tables; i++) {
+    Table definition = {0};
+    uint8_t options[2];
+    uint32_t key;
+    uint32_t file_id;
+    definition.table_name = catalog_get_name(&in, end, arena);
+    if (definition.table_name == NULL ||
+        !catalog_get(&in, end, options, sizeof(options)) ||
+        !catalog_get(&in, end, &key, sizeof(key)) ||
+        !catalog_get(&in, end, &file_id, sizeof(file_id)) ||
+        file_id % 4 != 0 || file_id >= SECONDARY_INDEX_FILE_ID ||
+        !catalog_get(&in, end, &definition.num_columns, sizeof(uint32_t)) ||
+        definition.num_columns > length) {
+      printf("Corrupt table catalog\n");
+      exit(EXIT_FAILURE);
+    }
+    definition.layout = options[0];
+    definition.flags = options[1];
+    definition.columns =
+        arena_calloc(arena, definition.num_columns, sizeof(ColumnDefinition));
+    for (uint32_t j = 0; j < definition.num_columns; j++) {
+      ColumnDefinition* column = &definition.columns[j];
+      uint8_t type;
+      column->name = catalog_get_name(&in, end, arena);
+      if (column->name == NULL ||
+          !catalog_get(&in, end, &column->size, sizeof(uint32_t)) ||
+          !catalog_get(&in, end, &type, sizeof(type))) {
+        printf("Corrupt table catalog\n");
+        exit(EXIT_FAILURE);
+      }
+      column->type = type;
+    }
+    if (key < definition.num_columns) {
+      definition.key_column = &definition.columns[key];
+    }
+
+    Table* table = schema_find_table(schema, definition.table_name);
+    if (created_only && !(definition.flags & TABLE_FLAG_CREATED)) {
+      if (table != NULL) {
+        schema_set_file_id(schema, table, file_id);
+      }
+      continue;
+    }
+    if (table != NULL) {
+      printf("Table %s is defined twice\n", definition.table_name);
+      exit(EXIT_FAILURE);
+    }
+    table = schema_add_table(schema, &definition);
+    schema_set_file_id(schema, table, file_id);
+  }
+  schema->next_file_id = next_file_id;
+  arena_free(arena);
+}
+
+// Reads the tables from the table catalog, or from the schema file when it
+// has changed since the catalog was written. A new database gets pages of
+// new_page_size bytes, or DEFAULT_PAGE_SIZE when it is 0.
+Schema* schema_open(const char* filename, bool use_mmap,
+                    uint32_t new_page_size) {
+  struct stat schema_stat;
+  if (stat(filename, &schema_stat) < 0) {
+    printf("Error opening schema file\n");
+    exit(EXIT_FAILURE);
+  }
+  if (new_page_size != 0 && !page_size_valid(new_page_size)) {
+    printf("Page size must be a power of two from %u to %u bytes\n",
+           MIN_PAGE_SIZE, MAX_PAGE_SIZE);
+    exit(EXIT_FAILURE);
+  }
+
+  Schema* schema = calloc(1, sizeof(Schema));
+  if (schema == NULL) {
+    printf("Memory allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  schema->arena = arena_new();
+  schema->use_mmap = use_mmap;
+  schema->schema_size = schema_stat.st_size;
+  schema->schema_mtime_ns =
+      schema_stat.st_mtim.tv_sec * 1000000000LL + schema_stat.st_mtim.tv_nsec;
+  pthread_rwlock_init(&schema->catalog_lock, NULL);
+
+  size_t length = 0;
+  char* catalog = table_catalog_read(&length);
+  TableCatalogHeader header = {0};
+  if (catalog != NULL) {
+    memcpy(&header, catalog, sizeof(header));
+    if (new_page_size != 0 && new_page_size != header.page_size) {
+      printf("Database has %u byte pages\n", header.page_size);
+      exit(EXIT_FAILURE);
+    }
+    page_size = header.page_size;
+    // Tables new to a changed schema file get ids the catalog never gave
+    schema->next_file_id = header.next_file_id;
+  } else {
+    page_size = new_page_size != 0 ? new_page_size : DEFAULT_PAGE_SIZE;
+  }
+  bool current = catalog != NULL &&
+                 header.schema_size == schema->schema_size &&
+                 header.schema_mtime_ns == schema->schema_mtime_ns;
+  if (!current) {
+    FILE* file = fopen(filename, "r");
+    if (file == NULL) {
+      printf("Error opening schema file\n");
+      exit(EXIT_FAILURE);
+    }
+    schema_parse(schema, file);
+    fclose(file);
+  }
+  if (catalog != NULL) {
+    table_catalog_add(schema, catalog, length, !current);
+    free(catalog);
+  }
+  if (!current) {
+    table_catalog_save(schema);
+  }
+  return schema;
+}
+
+void table_write_header(Table* table) {
+  void* header = get_page(table->pager, 0);
+  pager_mark_dirty(table->pager, 0);
+  uint32_t magic = TABLE_HEADER_MAGIC;
+  memcpy(header + TABLE_HEADER_MAGIC_OFFSET, &magic, sizeof(uint32_t));
+  memcpy(header + TABLE_HEADER_NUM_ROWS_OFFSET, &table->num_rows,
+         sizeof(uint32_t));
+  memcpy(header + TABLE_HEADER_NUM_LIVE_ROWS_OFFSET, &table->num_live_rows,
+         sizeof(uint32_t));
+  memcpy(header + TABLE_HEADER_FREE_PAGE_OFFSET, &table->free_page_head,
+         sizeof(uint32_t));
+  uint32_t layout = table->layout;
+  memcpy(header + TABLE_HEADER_LAYOUT_OFFSET, &layout, sizeof(uint32_t));
+  uint32_t version = TABLE_FORMAT_VERSION;
+  memcpy(header + TABLE_HEADER_VERSION_OFFSET, &version, sizeof(uint32_t));
+  memcpy(header + TABLE_HEADER_PAGE_SIZE_OFFSET, &page_size, sizeof(uint32_t));
+}
+
+// Reads back the counts table_write_header keeps in the header page
+void table_read_header(Table* table) {
+  void* header = get_page(table->pager, 0);
+  memcpy(&table->num_rows, header + TABLE_HEADER_NUM_ROWS_OFFSET,
+         sizeof(uint32_t));
+  memcpy(&table->num_live_rows, header + TABLE_HEADER_NUM_LIVE_ROWS_OFFSET,
+         sizeof(uint32_t));
+  memcpy(&table->free_page_head, header + TABLE_HEADER_FREE_PAGE_OFFSET,
+         sizeof(uint32_t));
+}
+
+void table_load_header(Table* table) {
+  bool new_file = table->pager->file_length == 0;
+  void* header = get_page(table->pager, 0);
+  uint32_t magic;
+  memcpy(&magic, header + TABLE_HEADER_MAGIC_OFFSET, sizeof(uint32_t));
+  if (magic == 0 && new_file) {
+    table_write_header(table);
+    return;
+  }
+  uint32_t version;
+  memcpy(&version, header + TABLE_HEADER_VERSION_OFFSET, sizeof(uint32_t));
+  if (magic != TABLE_HEADER_MAGIC || version != TABLE_FORMAT_VERSION) {
+    printf("Unsupported table file format: %s\n", table->filename);
+    exit(EXIT_FAILURE);
+  }
+  uint32_t layout;
+  memcpy(&layout, header + TABLE_HEADER_LAYOUT_OFFSET, sizeof(uint32_t));
+  if (layout != table->layout) {
+    printf("Table %s is stored in a different layout\n", table->table_name);
+    exit(EXIT_FAILURE);
+  }
+  uint32_t file_page_size;
+  memcpy(&file_page_size, header + TABLE_HEADER_PAGE_SIZE_OFFSET,
+         sizeof(uint32_t));
+  if (file_page_size == 0) {
+    file_page_size = DEFAULT_PAGE_SIZE;
+  }
+  if (file_page_size != page_size) {
+    printf("Table %s has %u byte pages\n", table->table_name, file_page_size);
+    exit(EXIT_FAILURE);
+  }
+  table_read_header(table);
+}
+
+uint32_t table_num_pages(Table* table) {
+  return 1 + (table->num_rows + table->rows_per_page - 1) / table->rows_per_page;
+}
+
+// Writes back a table's dirty pages and makes its files durable
+void table_flush(Table* table) {
+  Pager* pager = table->pager;
+  pager_flush_all(pager);
+
+  // Drop the pages freed by .vacuum
+  pager_truncate(pager, (uint64_t)table_num_pages(table) * page_size);
+  if (fdatasync(pager->file_descriptor) < 0) {
+    printf("Error syncing db file: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  // The next sync makes this durable; until then the older length holds
+  if (pager->compressed && pager->file_length > 0 &&
+      !compressed_file_write_header(pager->file_descriptor,
+                                    pager->file_length)) {
+    printf("Error writing: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+
+  if (table->overflow_pager != NULL) {
+    pager_flush_all(table->overflow_pager);
+    pager_truncate(table->overflow_pager,
+                   (uint64_t)table->overflow_pager->num_pages * page_size);
+    if (fdatasync(table->overflow_pager->file_descriptor) < 0) {
+      printf("Error syncing overflow file: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (table->zone_pager != NULL) {
+    pager_flush_all(table->zone_pager);
+    pager_truncate(table->zone_pager,
+                   (uint64_t)table->zone_pager->num_pages * page_size);
+    if (fdatasync(table->zone_pager->file_descriptor) < 0) {
+      printf("Error syncing zone map file: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  for (int32_t i = -1; i < (int32_t)table->num_indexes; i++) {
+    Pager* index_pager = i < 0 ? table->index_pager : table->indexes[i].pager;
+    if (index_pager == NULL) {
+      continue;
+    }
+    pager_flush_all(index_pager);
+
+    pager_truncate(index_pager, (uint64_t)index_pager->num_pages * page_size);
+    if (fdatasync(index_pager->file_descriptor) < 0) {
+      printf("Error syncing index file: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+// Logs the pages of a memory-mapped pager changed since the last commit
+void pager_log_dirty(Pager* pager, Wal* wal) {
+  for (uint32_t i = 0; i < pager->num_dirty_pages; i++) {
+    uint32_t page_num = pager->dirty_pages[i];
+    uint32_t prefix[2] = {pager->file_id, page_num};
+    wal_append(wal, WAL_RECORD_PAGE, prefix, sizeof(prefix),
+               pager->map + (uint64_t)page_num * page_size, page_size);
+    pager->page_frames[page_num] = INVALID_FRAME_NUM;
+    pager->logged_since_commit = true;
+  }
+  pager->num_dirty_pages = 0;
+}
+
+// Writes every change back to the table files so the log can be emptied
+void db_checkpoint(Schema* schema) {
+  wal_flush(schema->wal, UINT64_MAX);
+  for (uint32_t i = 0; i < schema->num_open_tables; i++) {
+    table_flush(schema->open_tables[i]);
+  }
+  wal_reset(schema->wal);
+}
+
+// Table i has file ids 4i to 4i + 3, for its rows, primary-key index,
+// overflow file and zone map, and its secondary indexes follow
+uint32_t table_num_files(Table* table) { return 4 + table->num_indexes; }
+
+Pager* table_file(Table* table, uint32_t i) {
+  switch (i) {
+    case 0:
+      return table->pager;
+    case 1:
+      return table->index_pager;
+    case 2:
+      return table->overflow_pager;
+    case 3:
+      return table->zone_pager;
+    default:
+      return table->indexes[i - 4].pager;
+  }
+}
+
+// Table files have the ids recorded in the table catalog, and secondary
+// indexes are numbered from SECONDARY_INDEX_FILE_ID in index catalog order,
+// so adding a table or an index, or changing the schema file, never
+// renumbers a file. The files of a table that is not open have no pager.
+Pager* schema_pager(Schema* schema, uint32_t file_id) {
+  if (file_id < SECONDARY_INDEX_FILE_ID) {
+    Table* table = file_id / 4 < schema->file_tables_capacity
+                       ? schema->file_tables[file_id / 4]
+                       : NULL;
+    return table != NULL ? table_file(table, file_id % 4) : NULL;
+  }
+  for (uint32_t i = 0; i < schema->num_tables; i++) {
+    Table* table = schema->tables[i];
+    for (uint32_t j = 0; j < table->num_indexes; j++) {
+      if (table->indexes[j].file_id == file_id) {
+        return table->indexes[j].pager;
+      }
+    }
+  }
+  return NULL;
+}
+
+// Logs the pages changed by the last statement and commits them. Returns the
+// log position to pass to wal_sync before the commit is reported, which can
+// happen after the commit lock is released.
+uint64_t db_commit(Schema* schema) {
+  BufferPool* pool = schema->buffer_pool;
+  Wal* wal = schema->wal;
+
+  for (uint32_t i = 0; i < pool->num_unlogged_frames; i++) {
+    Frame* frame = &pool->frames[pool->unlogged_frames[i]];
+    if (frame->unlogged) {
+      wal_append_page(wal, frame);
+    }
+  }
+  pool->num_unlogged_frames = 0;
+
+  for (uint32_t i = 0; i < schema->num_open_tables; i++) {
+    Table* table = schema->open_tables[i];
+    for (uint32_t j = 0; j < table_num_files(table); j++) {
+      Pager* pager = table_file(table, j);
+      if (pager != NULL) {
+        pager_log_dirty(pager, wal);
+      }
+    }
+  }
+
+  bool changed = false;
+  for (uint32_t i = 0; i < schema->num_open_tables; i++) {
+    Table* table = schema->open_tables[i];
+    for (uint32_t j = 0; j < table_num_files(table); j++) {
+      Pager* pager = table_file(table, j);
+      if (pager != NULL) {
+        changed = changed || pager->logged_since_commit;
+        pager->logged_since_commit = false;
+      }
+    }
+  }
+
+  uint64_t position = 0;
+  if (changed) {
+    uint64_t lsn = wal_append(wal, WAL_RECORD_COMMIT, NULL, 0, NULL, 0);
+    position = wal_position(wal, lsn);
+  }
+
+  if (wal->end_lsn > WAL_CHECKPOINT_SIZE) {
+    db_checkpoint(schema);
+  }
+  return position;
+}
+
+// Runs a write outside begin and commit as a transaction of its own. The
+// pages it changes are saved and logged as undo records before they can
+// reach the files, so if the process dies before the write commits,
+// recovery takes back what it did. The caller holds the commit lock.
+Transaction* implicit_transaction_begin(Schema* schema) {
+  Transaction* transaction = calloc(1, sizeof(Transaction));
+  transaction->arena = arena_new();
+  current_transaction = transaction;
+  schema->buffer_pool->transaction = transaction;
+  return transaction;
+}
+
+// Commits an implicit transaction and returns the position to pass to
+// wal_sync
+uint64_t implicit_transaction_commit(Schema* schema,
+                                     Transaction* transaction) {
+  current_transaction = NULL;
+  uint64_t position = db_commit(schema);
+  schema->buffer_pool->transaction = NULL;
+  arena_free(transaction->arena);
+  free(transaction);
+  return position;
+}
+
+// Copies the image of a page or undo record into its page
+void wal_apply_page(Schema* schema, const char* body) {
+  uint32_t file_id;
+  uint32_t page_num;
+  memcpy(&file_id, body, sizeof(uint32_t));
+  memcpy(&page_num, body + sizeof(uint32_t), sizeof(uint32_t));
+  Pager* pager = schema_pager(schema, file_id);
+  if (pager == NULL) {
+    return;
+  }
+  memcpy(get_page(pager, page_num), body + 2 * sizeof(uint32_t), page_size);
+  if (!pager->mmapped) {
+    pager_frame(pager, page_num)->dirty = true;
+  }
+}
+
+// Replays the committed records of the log into the table files, then
+// takes back what an uncommitted transaction wrote to them
+void wal_recover(Schema* schema) {
+  Wal* wal = schema->wal;
+  uint64_t log_length = wal->end_lsn;
+  if (log_length == 0) {
+    return;
+  }
+
+  char* log = malloc(log_length);
+  if (pread(wal->file_descriptor, log, log_length, 0) != (ssize_t)log_length) {
+    printf("Error reading log: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+
+  // Page records are applied once the commit record that follows is found;
+  // a torn or corrupt tail ends recovery
+  uint64_t committed = 0;
+  uint64_t offset = 0;
+  while (offset + sizeof(WalRecordHeader) <= log_length) {
+    WalRecordHeader header;
+    memcpy(&header, log + offset, sizeof(header));
+    char* payload = log + offset + sizeof(header);
+    if (offset + sizeof(header) + header.length > log_length) {
+      break;
+    }
+    uint32_t checksum = crc32_update(0, &header.type, sizeof(uint32_t) * 2);
+    checksum = crc32_update(checksum, payload, header.length);
+    if (checksum != header.checksum) {
+      break;
+    }
+    offset += sizeof(header) + header.length;
+
+    if (header.type != WAL_RECORD_COMMIT) {
+      continue;
+    }
+
+    while (committed < offset) {
+      WalRecordHeader record;
+      memcpy(&record, log + committed, sizeof(record));
+      char* body = log + committed + sizeof(record);
+      committed += sizeof(record) + record.length;
+
+      if (record.type == WAL_RECORD_PAGE) {
+        wal_apply_page(schema, body);
+      }
+    }
+  }
+
+  // Writers take turns, so the records after the last commit belong to one
+  // transaction, which logged the old image of each page at most once
+  while (committed < offset) {
+    WalRecordHeader record;
+    memcpy(&record, log + committed, sizeof(record));
+    if (record.type == WAL_RECORD_UNDO) {
+      wal_apply_page(schema, log + committed + sizeof(record));
+    }
+    committed += sizeof(record) + record.length;
+  }
+
+  free(log);
+}
+
+// Opens the files of a table. Their pages are read once the log has been
+// replayed into them.
+void table_open_files(Schema* schema, Table* table) {
+  table->pager = pager_open(schema->buffer_pool, table->filename);
+  table->pager->file_id = table->file_id;
+  if (table->compressed) {
+    pager_use_compression(table->pager, table->filename);
+  } else if (table->mmapped) {
+    pager_use_mmap(table->pager);
+  }
+
+  if (table->overflow_filename != NULL) {
+    table->overflow_pager =
+        pager_open(schema->buffer_pool, table->overflow_filename);
+    table->overflow_pager->file_id = table->file_id + 2;
+    if (table->mmapped) {
+      pager_use_mmap(table->overflow_pager);
+    }
+    for (uint32_t j = 0; j < table->num_columns; j++) {
+      if (table->columns[j].cell_size < table->columns[j].size) {
+        table->columns[j].overflow = table->overflow_pager;
+      }
+    }
+  }
+  if (table->zone_filename != NULL) {
+    table->zone_pager = index_pager_open(table, table->zone_filename,
+                                         table->file_id + 3);
+  }
+  index_open(table);
+  for (uint32_t j = 0; j < table->num_indexes; j++) {
+    Index* index = &table->indexes[j];
+    index->pager = index_pager_open(table, index->filename, index->file_id);
+  }
+
+  schema->open_tables =
+      realloc(schema->open_tables,
+              (schema->num_open_tables + 1) * sizeof(Table*));
+  schema->open_tables[schema->num_open_tables++] = table;
+}
+
+// Reads the header of a table whose files are open and rebuilds the index
+// and zone map files that are missing
+void table_load(Table* table) {
+  table_load_header(table);
+  if (table->index_pager != NULL && table->index_pager->num_pages == 0) {
+    index_build(table, table->key_column, table->index_pager);
+  }
+  for (uint32_t j = 0; j < table->num_indexes; j++) {
+    Index* index = &table->indexes[j];
+    if (index->pager->num_pages == 0) {
+      index_build(table, index->column, index->pager);
+    }
+  }
+  if (table->zone_pager != NULL && table->zone_pager->num_pages == 0) {
+    zone_build(table);
+  }
+  __atomic_store_n(&table->opened, true, __ATOMIC_RELEASE);
+}
+
+// Opens a table for a caller that holds the commit lock, which covers
+// committing the files that were rebuilt
+void table_open_locked(Schema* schema, Table* table) {
+  if (table->opened) {
+    return;
+  }
+  // Pages written while a table opens are not undone by rollback. They
+  // only follow from committed rows, so a transaction writes them straight
+  // to the table files instead of committing them early.
+  Transaction* transaction = current_transaction;
+  current_transaction = NULL;
+  table_open_files(schema, table);
+  table_load(table);
+  current_transaction = transaction;
+  if (transaction == NULL) {
+    db_commit(schema);
+  } else {
+    table_flush(table);
+  }
+}
+
+// Opens a table the first time a statement uses it
+void table_open(Schema* schema, Table* table) {
+  if (__atomic_load_n(&table->opened, __ATOMIC_ACQUIRE)) {
+    return;
+  }
+  // The transaction already holds the commit lock
+  if (current_transaction != NULL) {
+    table_open_locked(schema, table);
+    return;
+  }
+  pthread_mutex_lock(&schema->commit_lock);
+  table_open_locked(schema, table);
+  pthread_mutex_unlock(&schema->commit_lock);
+}
+
+Schema* db_open(const char* filename, uint64_t buffer_pool_size,
+                uint32_t sync_window_ms, bool use_mmap,
+                uint32_t new_page_size) {
+  Schema* schema = schema_open(filename, use_mmap, new_page_size);
+  schema->buffer_pool = buffer_pool_new(buffer_pool_size);
+  schema->wal = wal_open(WAL_FILENAME, sync_window_ms);
+  pthread_mutex_init(&schema->commit_lock, NULL);
+  catalog_load(schema);
+  statistics_load(schema);
+
+  // The log can hold pages of any table, so replaying it opens them all
+  bool recover = schema->wal->end_lsn > 0;
+  for (uint32_t i = 0; recover && i < schema->num_tables; i++) {
+    table_open_files(schema, schema->tables[i]);
+  }
+  wal_recover(schema);
+  schema->buffer_pool->wal = schema->wal;
+  for (uint32_t i = 0; recover && i < schema->num_tables; i++) {
+    table_load(schema->tables[i]);
+  }
+  db_commit(schema);
+  db_checkpoint(schema);
+
+  return schema;
+}
+
+void table_close(Table* table) {
+  table_statistics_free(table->statistics);
+  table->statistics = NULL;
+  pthread_rwlock_destroy(&table->lock);
+  if (table->pager == NULL) {
+    return;
+  }
+  index_close(table);
+  pager_close(table->pager);
+  if (table->overflow_pager != NULL) {
+    pager_close(table->overflow_pager);
+    table->overflow_pager = NULL;
+  }
+  if (table->zone_pager != NULL) {
+    pager_close(table->zone_pager);
+    table->zone_pager = NULL;
+  }
+}
+
+void db_close(Schema* schema) {
+  db_checkpoint(schema);
+  wal_close(schema->wal);
+
+  for (uint32_t i = 0; i < schema->num_tables; i++) {
+    table_close(schema->tables[i]);
+  }
+
+  free(schema->open_tables);
+  pthread_mutex_destroy(&schema->commit_lock);
+  pthread_rwlock_destroy(&schema->catalog_lock);
+  buffer_pool_free(schema->buffer_pool);
+  free_schema(schema);
+}
+
+void* get_page(Pager* pager, uint32_t page_num) {
+  if (page_num == INVALID_PAGE_NUM) {
+    printf("Tried to fetch page number out of bounds. %u\n", page_num);
+    exit(EXIT_FAILURE);
+  }
+
+  pager_reserve(pager, page_num);
+  STATS_ADD(pages_fetched, 1);
+
+  if (pager->mmapped) {
+    // Mapped pages are never read by us, the kernel pages them in
+    STATS_ADD(page_hits, 1);
+    uint64_t end = ((uint64_t)page_num + 1) * page_size;
+    if (end > pager->mapped_length) {
+      // Grow geometrically to keep ftruncate and mmap calls rare
+      uint64_t length = 2 * pager->mapped_length;
+      if (length < PAGER_INITIAL_PAGES * page_size) {
+        length = PAGER_INITIAL_PAGES * page_size;
+      }
+      pager_map_resize(pager, length > end ? length : end);
+    }
+    if (page_num >= pager->num_pages) {
+      pager->num_pages = page_num + 1;
+    }
+    return pager->map + (uint64_t)page_num * page_size;
+  }
+
+  BufferPool* pool = pager->pool;
+  // Read ahead first, so the claims it makes cannot evict the page returned
+  if (pager->sequential_scans > 0 && !pager->compressed) {
+    pager_read_ahead(pager, page_num);
+  }
+  Frame* frame = pager_frame(pager, page_num);
+  if (frame == NULL) {
+    // Cache miss. Claim a frame and load from file.
+    STATS_ADD(page_misses, 1);
+    uint32_t frame_num = buffer_pool_claim(pool);
+    frame = &pool->frames[frame_num];
+
+    if (pager->compressed) {
+      ssize_t bytes_read = pager_read_record(pager, page_num, frame->data);
+      memset(frame->data + bytes_read, 0, page_size - bytes_read);
+    } else {
+      pager_read_page(pager, page_num, frame->data);
+    }
+
+    frame->pager = pager;
+    frame->page_num = page_num;
+    frame->pin_count = 0;
+    frame->dirty = false;
+    frame->unlogged = false;
+    frame->reading = false;
+    frame->lsn = 0;
+    pager->page_frames[page_num] = frame_num;
+
+    if (page_num >= pager->num_pages) {
+      pager->num_pages = page_num + 1;
+    }
+  } else {
+    STATS_ADD(page_hits, 1);
+    while (frame->reading) {
+      buffer_pool_reap(pool, 1);
+    }
+  }
+
+  frame->referenced = true;
+  return frame->data;
+}
+
+// Like get_page, but the page stays in memory until pager_unpin
+void* pager_pin(Pager* pager, uint32_t page_num) {
+  if (pager->mmapped) {
+    return get_page(pager, page_num);
+  }
+  pthread_mutex_lock(&pager->pool->lock);
+  void* page = get_page(pager, page_num);
+  pager_frame(pager, page_num)->pin_count += 1;
+  pthread_mutex_unlock(&pager->pool->lock);
+  return page;
+}
+
+void pager_unpin(Pager* pager, uint32_t page_num) {
+  if (pager->mmapped) {
+    return;
+  }
+  pthread_mutex_lock(&pager->pool->lock);
+  Frame* frame = pager_frame(pager, page_num);
+  if (frame == NULL || frame->pin_count == 0) {
+    printf("Tried to unpin a page that is not pinned\n");
+    exit(EXIT_FAILURE);
+  }
+  frame->pin_count -= 1;
+  pthread_mutex_unlock(&pager->pool->lock);
+}
+
+uint32_t row_page_num(Table* table, uint32_t row_num) {
+  return 1 + row_num / table->rows_per_page;
+}
+
+uint8_t* page_live_bitmap(void* page) { return page + DATA_PAGE_HEADER_SIZE; }
+
+bool page_slot_live(void* page, uint32_t slot) {
+  return page_live_bitmap(page)[slot / 8] & (1 << (slot % 8));
+}
+
+void page_set_slot_live(void* page, uint32_t slot, bool live) {
+  if (live) {
+    page_live_bitmap(page)[slot / 8] |= (1 << (slot % 8));
+  } else {
+    page_live_bitmap(page)[slot / 8] &= ~(1 << (slot % 8));
+  }
+}
+
+uint32_t* page_next_free_page(void* page) {
+  return page + DATA_PAGE_NEXT_FREE_PAGE_OFFSET;
+}
+
+uint8_t* page_in_free_list(void* page) {
+  return page + DATA_PAGE_IN_FREE_LIST_OFFSET;
+}
+
+uint16_t* page_num_live_rows(void* page) {
+  return page + DATA_PAGE_NUM_LIVE_ROWS_OFFSET;
+}
+
+void initialize_data_page(Table* table, void* page) {
+  memset(page, 0, table->rows_offset);
+}
+
+// Positions a cursor on a given row, live or not
+Cursor* table_row(Table* table, uint32_t row_num) {
+  Cursor* cursor = malloc(sizeof(Cursor));
+  cursor->table = table;
+  cursor->row_num = row_num;
+  cursor->end_of_table = (row_num >= table->num_rows);
+  cursor->pinned_page_num = INVALID_PAGE_NUM;
+  cursor->sequential = false;
+  cursor->zone_filter = NULL;
+
+  return cursor;
+}
+
+void cursor_mark_dirty(Cursor* cursor) {
+  pager_mark_dirty(cursor->table->pager, cursor->pinned_page_num);
+}
+
+void cursor_close(Cursor* cursor) {
+  if (cursor->pinned_page_num != INVALID_PAGE_NUM) {
+    pager_unpin(cursor->table->pager, cursor->pinned_page_num);
+  }
+  if (cursor->sequential) {
+    pager_end_scan(cursor->table->pager);
+  }
+  free(cursor);
+}
+
+// The cursor keeps the page of its current row pinned
+void* cursor_page(Cursor* cursor) {
+  uint32_t page_num = row_page_num(cursor->table, cursor->row_num);
+  Pager* pager = cursor->table->pager;
+  if (cursor->pinned_page_num != page_num) {
+    if (cursor->pinned_page_num != INVALID_PAGE_NUM) {
+      pager_unpin(pager, cursor->pinned_page_num);
+    }
+    pager_pin(pager, page_num);
+    cursor->pinned_page_num = page_num;
+  }
+  return get_page(pager, page_num);
+}
+
+// Rows are addressed by the start of their page's row area and their slot
+void* cursor_rows(Cursor* cursor) {
+  return cursor_page(cursor) + cursor->table->rows_offset;
+}
+
+uint32_t cursor_slot(Cursor* cursor) {
+  return cursor->row_num % cursor->table->rows_per_page;
+}
+
+void* column_value(void* rows, uint32_t slot, ColumnDefinition* column) {
+  return rows + column->page_offset + slot * column->stride;
+}
+
+void* cursor_column(Cursor* cursor, ColumnDefinition* column) {
+  return column_value(cursor_rows(cursor), cursor_slot(cursor), column);
+}
+
+uint16_t varchar_cell_length(void* cell) {
+  uint16_t length;
+  memcpy(&length, cell, sizeof(uint16_t));
+  return length;
+}
+
+uint64_t varchar_cell_overflow(void* cell) {
+  uint64_t offset;
+  memcpy(&offset, cell + VARCHAR_OVERFLOW_OFFSET, sizeof(uint64_t));
+  return offset;
+}
+
+// How many of length bytes at offset in an overflow file are on its page
+uint32_t overflow_chunk_length(uint64_t offset, uint32_t length) {
+  uint32_t chunk = page_size - offset % page_size;
+  return chunk < length ? chunk : length;
+}
+
+// Appends a string to an overflow file and returns where it starts
+uint64_t overflow_append(Pager* pager, const void* data, uint32_t length) {
+  void* header = get_page(pager, 0);
+  uint64_t used;
+  memcpy(&used, header + OVERFLOW_HEADER_USED_OFFSET, sizeof(uint64_t));
+  if (used < page_size) {
+    used = page_size;
+  }
+  uint64_t start = used;
+  while (length > 0) {
+    uint32_t chunk = overflow_chunk_length(used, length);
+    uint32_t page_num = used / page_size;
+    void* page = get_page(pager, page_num);
+    pager_mark_dirty(pager, page_num);
+    memcpy(page + used % page_size, data, chunk);
+    data += chunk;
+    used += chunk;
+    length -= chunk;
+  }
+  // Appending may have evicted the header
+  header = get_page(pager, 0);
+  pager_mark_dirty(pager, 0);
+  memcpy(header + OVERFLOW_HEADER_USED_OFFSET, &used, sizeof(uint64_t));
+  return start;
+}
+
+void overflow_read(Pager* pager, uint64_t offset, void* destination,
+                   uint32_t length) {
+  while (length > 0) {
+    uint32_t chunk = overflow_chunk_length(offset, length);
+    uint32_t page_num = offset / page_size;
+    memcpy(destination, pager_pin(pager, page_num) + offset % page_size,
+           chunk);
+    pager_unpin(pager, page_num);
+    destination += chunk;
+    offset += chunk;
+    length -= chunk;
+  }
+}
+
+bool overflow_equal(Pager* pager, uint64_t offset, const void* data,
+                    uint32_t length) {
+  bool equal = true;
+  while (equal && length > 0) {
+    uint32_t chunk = overflow_chunk_length(offset, length);
+    uint32_t page_num = offset / page_size;
+    equal = memcmp(pager_pin(pager, page_num) + offset % page_size, data,
+                   chunk) == 0;
+    pager_unpin(pager, page_num);
+    data += chunk;
+    offset += chunk;
+    length -= chunk;
+  }
+  return equal;
+}
+
+uint32_t overflow_hash(Pager* pager, uint64_t offset, uint32_t length) {
+  uint32_t hash = hash_bytes(NULL, 0);
+  while (length > 0) {
+    uint32_t chunk = overflow_chunk_length(offset, length);
+    uint32_t page_num = offset / page_size;
+    hash = hash_continue(
+        hash, pager_pin(pager, page_num) + offset % page_size, chunk);
+    pager_unpin(pager, page_num);
+    offset += chunk;
+    length -= chunk;
+  }
+  return hash;
+}
+
+// Copies a value out of its cell into the column's zero-padded row format
+void column_read(ColumnDefinition* column, void* cell, void* destination) {
+  if (column->overflow == NULL) {
+    memcpy(destination, cell, column->size);
+    return;
+  }
+  uint16_t length = varchar_cell_length(cell);
+  memset(destination, 0, column->size);
+  if (length <= VARCHAR_INLINE_SIZE) {
+    memcpy(destination, cell + VARCHAR_LENGTH_SIZE, length);
+  } else {
+    overflow_read(column->overflow, varchar_cell_overflow(cell), destination,
+                  length);
+  }
+}
+
+// Stores a value in the row format into its cell, spilling a long string
+void column_write(ColumnDefinition* column, void* cell, const void* source) {
+  if (column->overflow == NULL) {
+    memcpy(cell, source, column->size);
+    return;
+  }
+  uint16_t length = strnlen(source, column->size);
+  memset(cell, 0, VARCHAR_CELL_SIZE);
+  memcpy(cell, &length, sizeof(uint16_t));
+  if (length <= VARCHAR_INLINE_SIZE) {
+    memcpy(cell + VARCHAR_LENGTH_SIZE, source, length);
+  } else {
+    memcpy(cell + VARCHAR_LENGTH_SIZE, source, VARCHAR_PREFIX_SIZE);
+    uint64_t offset = overflow_append(column->overflow, source, length);
+    memcpy(cell + VARCHAR_OVERFLOW_OFFSET, &offset, sizeof(uint64_t));
+  }
+}
+
+// Compares a cell with a value in the row format
+bool column_equal(ColumnDefinition* column, void* cell, const void* value) {
+  if (column->overflow == NULL) {
+    return strncmp(cell, value, column->size) == 0;
+  }
+  uint16_t length = varchar_cell_length(cell);
+  if (length != strnlen(value, column->size)) {
+    return false;
+  }
+  if (length <= VARCHAR_INLINE_SIZE) {
+    return memcmp(cell + VARCHAR_LENGTH_SIZE, value, length) == 0;
+  }
+  return memcmp(cell + VARCHAR_LENGTH_SIZE, value, VARCHAR_PREFIX_SIZE) == 0 &&
+         overflow_equal(column->overflow, varchar_cell_overflow(cell), value,
+                        length);
+}
+
+bool cursor_row_live(Cursor* cursor) {
+  return page_slot_live(cursor_page(cursor),
+                        cursor->row_num % cursor->table->rows_per_page);
+}
+
+// Moves a cursor at the start of a page past the pages ruled out by its
+// zone filter
+void cursor_skip_pages(Cursor* cursor) {
+  Table* table = cursor->table;
+  while (cursor->zone_filter != NULL && cursor->row_num < table->num_rows &&
+         cursor->row_num % table->rows_per_page == 0 &&
+         zone_skip_page(table, cursor->zone_filter,
+                        row_page_num(table, cursor->row_num))) {
+    cursor->row_num += table->rows_per_page;
+  }
+}
+
+// Moves to the next live row, skipping deleted slots
+void cursor_advance(Cursor* cursor) {
+  do {
+    cursor->row_num += 1;
+    cursor_skip_pages(cursor);
+    if (cursor->row_num >= cursor->table->num_rows) {
+      cursor->end_of_table = true;
+      return;
+    }
+  } while (!cursor_row_live(cursor));
+}
+
+// Starts a full scan at the first live row on a page whose zone map does
+// not rule out the where clause
+Cursor* table_start_where(Table* table, WhereClause* where_clause) {
+  Cursor* cursor = table_row(table, 0);
+  cursor->sequential = true;
+  cursor->zone_filter = where_clause;
+  pager_begin_scan(table->pager);
+  cursor_skip_pages(cursor);
+  cursor->end_of_table = cursor->row_num >= table->num_rows;
+  if (!(cursor->end_of_table) && !cursor_row_live(cursor)) {
+    cursor_advance(cursor);
+  }
+
+  return cursor;
+}
+
+// Starts a full scan at the first live row
+Cursor* table_start(Table* table) { return table_start_where(table, NULL); }
+
+// Picks a slot for a new row, reusing deleted slots before growing the table
+uint32_t table_allocate_row(Table* table) {
+  Pager* pager = table->pager;
+  uint32_t page_num = table->free_page_head;
+  if (page_num == 0) {
+    uint32_t row_num = table->num_rows++;
+    if (row_num % table->rows_per_page == 0) {
+      void* page = get_page(pager, row_page_num(table, row_num));
+      pager_mark_dirty(pager, row_page_num(table, row_num));
+      initialize_data_page(table, page);
+    }
+    return row_num;
+  }
+
+  void* page = get_page(pager, page_num);
+  uint32_t first_row = (page_num - 1) * table->rows_per_page;
+  uint32_t num_slots = table->num_rows - first_row;
+  if (num_slots > table->rows_per_page) {
+    num_slots = table->rows_per_page;
+  }
+
+  uint32_t slot = 0;
+  while (slot < num_slots && page_slot_live(page, slot)) {
+    slot++;
+  }
+  if (slot == num_slots) {
+    printf("Free list page %u has no free slot\n", page_num);
+    exit(EXIT_FAILURE);
+  }
+
+  // The page leaves the free list once its last hole is taken
+  if (*page_num_live_rows(page) + 1u == num_slots) {
+    pager_mark_dirty(pager, page_num);
+    table->free_page_head = *page_next_free_page(page);
+    *page_next_free_page(page) = 0;
+    *page_in_free_list(page) = 0;
+  }
+
+  return first_row + slot;
+}
+
+void cursor_insert_row(Cursor* cursor, Row* row) {
+  Table* table = cursor->table;
+  void* page = cursor_page(cursor);
+  cursor_mark_dirty(cursor);
+  page_set_slot_live(page, cursor->row_num % table->rows_per_page, true);
+  *page_num_live_rows(page) += 1;
+  table->num_live_rows += 1;
+  serialize_row(row, cursor_rows(cursor), cursor_slot(cursor), table);
+}
+
+// Marks the cursor's row deleted and puts its page on the free list
+void cursor_delete_row(Cursor* cursor) {
+  Table* table = cursor->table;
+  void* page = cursor_page(cursor);
+  cursor_mark_dirty(cursor);
+  page_set_slot_live(page, cursor->row_num % table->rows_per_page, false);
+  *page_num_live_rows(page) -= 1;
+  table->num_live_rows -= 1;
+
+  if (!*page_in_free_list(page)) {
+    *page_next_free_page(page) = table->free_page_head;
+    *page_in_free_list(page) = 1;
+    table->free_page_head = cursor->pinned_page_num;
+  }
+}
+
+NodeType get_node_type(void* node) {
+  return (NodeType) * ((uint8_t*)(node + NODE_TYPE_OFFSET));
+}
+
+void set_node_type(void* node, NodeType type) {
+  *((uint8_t*)(node + NODE_TYPE_OFFSET)) = (uint8_t)type;
+}
+
+uint32_t* node_num_cells(void* node) { return node + NODE_NUM_CELLS_OFFSET; }
+
+uint32_t* leaf_node_next_leaf(void* node) {
+  return node + LEAF_NODE_NEXT_LEAF_OFFSET;
+}
+
+uint32_t* internal_node_right_child(void* node) {
+  return node + INTERNAL_NODE_RIGHT_CHILD_OFFSET;
+}
+
+void* leaf_node_cell(void* node, uint32_t cell_num) {
+  return node + NODE_HEADER_SIZE + cell_num * LEAF_NODE_CELL_SIZE;
+}
+
+void* internal_node_cell(void* node, uint32_t cell_num) {
+  return node + NODE_HEADER_SIZE + cell_num * INTERNAL_NODE_CELL_SIZE;
+}
+
+uint32_t* internal_node_child(void* node, uint32_t child_num) {
+  if (child_num == *node_num_cells(node)) {
+    return internal_node_right_child(node);
+  }
+  return internal_node_cell(node, child_num);
+}
+
+IndexEntry read_index_entry(void* source) {
+  IndexEntry entry;
+  memcpy(&entry.key, source, sizeof(IndexKey));
+  memcpy(&entry.row_num, source + sizeof(IndexKey), sizeof(uint32_t));
+  return entry;
+}
+
+void write_index_entry(void* destination, IndexEntry entry) {
+  memcpy(destination, &entry.key, sizeof(IndexKey));
+  memcpy(destination + sizeof(IndexKey), &entry.row_num, sizeof(uint32_t));
+}
+
+IndexEntry leaf_node_entry(void* node, uint32_t cell_num) {
+  return read_index_entry(leaf_node_cell(node, cell_num));
+}
+
+IndexEntry internal_node_entry(void* node, uint32_t cell_num) {
+  return read_index_entry(internal_node_cell(node, cell_num) + sizeof(uint32_t));
+}
+
+int compare_index_entries(IndexEntry a, IndexEntry b) {
+  if (a.key != b.key) {
+    return a.key < b.key ? -1 : 1;
+  }
+  if (a.row_num != b.row_num) {
+    return a.row_num < b.row_num ? -1 : 1;
+  }
+  return 0;
+}
+
+void initialize_leaf_node(void* node) {
+  memset(node, 0, NODE_HEADER_SIZE);
+  set_node_type(node, NODE_LEAF);
+}
+
+void initialize_internal_node(void* node) {
+  memset(node, 0, NODE_HEADER_SIZE);
+  set_node_type(node, NODE_INTERNAL);
+}
+
+uint32_t get_unused_page_num(Pager* pager) { return pager->num_pages; }
+
+// Returns the first cell whose entry is >= target (num_cells if none)
+uint32_t leaf_node_find(void* node, IndexEntry target) {
+  uint32_t min_index = 0;
+  uint32_t max_index = *node_num_cells(node);
+  while (min_index != max_index) {
+    uint32_t index = (min_index + max_index) / 2;
+    if (compare_index_entries(leaf_node_entry(node, index), target) < 0) {
+      min_index = index + 1;
+    } else {
+      max_index = index;
+    }
+  }
+  return min_index;
+}
+
+// Returns the child that may contain target (num_cells for the right child)
+uint32_t internal_node_find_child(void* node, IndexEntry target) {
+  uint32_t min_index = 0;
+  uint32_t max_index = *node_num_cells(node);
+  while (min_index != max_index) {
+    uint32_t index = (min_index + max_index) / 2;
+    if (compare_index_entries(internal_node_entry(node, index), target) < 0) {
+      min_index = index + 1;
+    } else {
+      max_index = index;
+    }
+  }
+  return min_index;
+}
+
+bool leaf_node_insert(Pager* pager, uint32_t page_num, IndexEntry entry,
+                      IndexEntry* split_entry, uint32_t* split_page_num) {
+  void* node = get_page(pager, page_num);
+  uint32_t num_cells = *node_num_cells(node);
+  uint32_t cell_num = leaf_node_find(node, entry);
+
+  if (num_cells < LEAF_NODE_MAX_CELLS) {
+    pager_mark_dirty(pager, page_num);
+    memmove(leaf_node_cell(node, cell_num + 1), leaf_node_cell(node, cell_num),
+            (num_cells - cell_num) * LEAF_NODE_CELL_SIZE);
+    write_index_entry(leaf_node_cell(node, cell_num), entry);
+    *node_num_cells(node) = num_cells + 1;
+    return false;
+  }
+
+  char cells[(LEAF_NODE_MAX_CELLS + 1) * LEAF_NODE_CELL_SIZE];
+  memcpy(cells, leaf_node_cell(node, 0), cell_num * LEAF_NODE_CELL_SIZE);
+  write_index_entry(cells + cell_num * LEAF_NODE_CELL_SIZE, entry);
+  memcpy(cells + (cell_num + 1) * LEAF_NODE_CELL_SIZE,
+         leaf_node_cell(node, cell_num),
+         (num_cells - cell_num) * LEAF_NODE_CELL_SIZE);
+
+  // Appending to the last leaf keeps it full, so ascending keys pack densely
+  uint32_t total_cells = num_cells + 1;
+  uint32_t left_cells = total_cells / 2;
+  if (cell_num == num_cells && *leaf_node_next_leaf(node) == 0) {
+    left_cells = num_cells;
+  }
+
+  pager_pin(pager, page_num);
+  uint32_t new_page_num = get_unused_page_num(pager);
+  void* new_node = get_page(pager, new_page_num);
+  pager_mark_dirty(pager, page_num);
+  pager_mark_dirty(pager, new_page_num);
+  initialize_leaf_node(new_node);
+
+  memcpy(leaf_node_cell(node, 0), cells, left_cells * LEAF_NODE_CELL_SIZE);
+  *node_num_cells(node) = left_cells;
+  memcpy(leaf_node_cell(new_node, 0), cells + left_cells * LEAF_NODE_CELL_SIZE,
+         (total_cells - left_cells) * LEAF_NODE_CELL_SIZE);
+  *node_num_cells(new_node) = total_cells - left_cells;
+
+  *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(node);
+  *leaf_node_next_leaf(node) = new_page_num;
+  pager_unpin(pager, page_num);
+
+  *split_entry = leaf_node_entry(node, left_cells - 1);
+  *split_page_num = new_page_num;
+  return true;
+}
+
+void internal_node_write(void* node, uint32_t* children, IndexEntry* entries,
+                         uint32_t num_keys) {
+  *node_num_cells(node) = num_keys;
+  for (uint32_t i = 0; i < num_keys; i++) {
+    void* cell = internal_node_cell(node, i);
+    memcpy(cell, &children[i], sizeof(uint32_t));
+    write_index_entry(cell + sizeof(uint32_t), entries[i]);
+  }
+  *internal_node_right_child(node) = children[num_keys];
+}
+
+// Records that child_index split into itself (up to entry) and right_page_num
+bool internal_node_insert(Pager* pager, uint32_t page_num, uint32_t child_index,
+                          IndexEntry entry, uint32_t right_page_num,
+                          IndexEntry* split_entry, uint32_t* split_page_num) {
+  void* node = get_page(pager, page_num);
+  uint32_t num_keys = *node_num_cells(node);
+
+  uint32_t children[INTERNAL_NODE_MAX_CELLS + 2];
+  IndexEntry entries[INTERNAL_NODE_MAX_CELLS + 1];
+  for (uint32_t i = 0, j = 0; i <= num_keys; i++, j++) {
+    if (i == child_index) {
+      children[j] = *internal_node_child(node, i);
+      entries[j] = entry;
+      j++;
+      children[j] = right_page_num;
+    } else {
+      children[j] = *internal_node_child(node, i);
+    }
+    if (i < num_keys) {
+      entries[j] = internal_node_entry(node, i);
+    }
+  }
+  num_keys += 1;
+
+  pager_mark_dirty(pager, page_num);
+  if (num_keys <= INTERNAL_NODE_MAX_CELLS) {
+    internal_node_write(node, children, entries, num_keys);
+    return false;
+  }
+
+  uint32_t left_keys = num_keys / 2;
+  internal_node_write(node, children, entries, left_keys);
+
+  uint32_t new_page_num = get_unused_page_num(pager);
+  void* new_node = get_page(pager, new_page_num);
+  pager_mark_dirty(pager, new_page_num);
+  initialize_internal_node(new_node);
+  internal_node_write(new_node, children + left_keys + 1,
+                      entries + left_keys + 1, num_keys - left_keys - 1);
+
+  *split_entry = entries[left_keys];
+  *split_page_num = new_page_num;
+  return true;
+}
+
+bool btree_insert_into(Pager* pager, uint32_t page_num, IndexEntry entry,
+                       IndexEntry* split_entry, uint32_t* split_page_num) {
+  void* node = get_page(pager, page_num);
+  if (get_node_type(node) == NODE_LEAF) {
+    return leaf_node_insert(pager, page_num, entry, split_entry,
+                            split_page_num);
+  }
+
+  uint32_t child_index = internal_node_find_child(node, entry);
+  uint32_t child_page_num = *internal_node_child(node, child_index);
+
+  IndexEntry child_split_entry;
+  uint32_t child_split_page_num;
+  if (!btree_insert_into(pager, child_page_num, entry, &child_split_entry,
+                         &child_split_page_num)) {
+    return false;
+  }
+
+  return internal_node_insert(pager, page_num, child_index, child_split_entry,
+                              child_split_page_num, split_entry,
+                              split_page_num);
+}
+
+void btree_insert(Pager* pager, IndexEntry entry) {
+
+  IndexEntry split_entry;
+  uint32_t split_page_num;
+  if (!btree_insert_into(pager, 0, entry, &split_entry, &split_page_num)) {
+    return;
+  }
+
+  // The root always lives in page 0, so move its left half to a new page
+  uint32_t left_page_num = get_unused_page_num(pager);
+  void* left = pager_pin(pager, left_page_num);
+  void* root = get_page(pager, 0);
+  pager_mark_dirty(pager, left_page_num);
+  pager_mark_dirty(pager, 0);
+  memcpy(left, root, page_size);
+  pager_unpin(pager, left_page_num);
+
+  initialize_internal_node(root);
+  uint32_t children[2] = {left_page_num, split_page_num};
+  internal_node_write(root, children, &split_entry, 1);
+}
+
+void btree_delete(Pager* pager, IndexEntry entry) {
+  uint32_t page_num = 0;
+  void* node = get_page(pager, page_num);
+  while (get_node_type(node) == NODE_INTERNAL) {
+    uint32_t child_index = internal_node_find_child(node, entry);
+    page_num = *internal_node_child(node, child_index);
+    node = get_page(pager, page_num);
+  }
+
+  // Leaves are allowed to underflow; separators stay valid upper bounds
+  uint32_t num_cells = *node_num_cells(node);
+  uint32_t cell_num = leaf_node_find(node, entry);
+  if (cell_num == num_cells ||
+      compare_index_entries(leaf_node_entry(node, cell_num), entry) != 0) {
+    return;
+  }
+
+  pager_mark_dirty(pager, page_num);
+  memmove(leaf_node_cell(node, cell_num), leaf_node_cell(node, cell_num + 1),
+          (num_cells - cell_num - 1) * LEAF_NODE_CELL_SIZE);
+  *node_num_cells(node) = num_cells - 1;
+}
+
+void index_cursor_settle(IndexCursor* cursor) {
+  void* node = get_page(cursor->pager, cursor->page_num);
+  while (cursor->cell_num >= *node_num_cells(node)) {
+    uint32_t next_leaf = *leaf_node_next_leaf(node);
+    if (next_leaf == 0) {
+      cursor->end_of_index = true;
+      return;
+    }
+    cursor->page_num = next_leaf;
+    cursor->cell_num = 0;
+    node = get_page(cursor->pager, next_leaf);
+  }
+}
+
+// Positions a cursor at the first entry >= target
+IndexCursor* index_find(Pager* pager, IndexEntry target) {
+  uint32_t page_num = 0;
+  void* node = get_page(pager, page_num);
+  while (get_node_type(node) == NODE_INTERNAL) {
+    uint32_t child_index = internal_node_find_child(node, target);
+    page_num = *internal_node_child(node, child_index);
+    node = get_page(pager, page_num);
+  }
+
+  IndexCursor* cursor = malloc(sizeof(IndexCursor));
+  cursor->pager = pager;
+  cursor->page_num = page_num;
+  cursor->cell_num = leaf_node_find(node, target);
+  cursor->end_of_index = false;
+  index_cursor_settle(cursor);
+
+  return cursor;
+}
+
+IndexEntry index_cursor_entry(IndexCursor* cursor) {
+  void* node = get_page(cursor->pager, cursor->page_num);
+  return leaf_node_entry(node, cursor->cell_num);
+}
+
+void index_cursor_advance(IndexCursor* cursor) {
+  cursor->cell_num += 1;
+  index_cursor_settle(cursor);
+}
+
+// Ints are their own keys and reals are mapped to ints in the same order,
+// so both can be looked up by range. Strings are keyed by their hash and
+// can only be looked up by equality.
+IndexKey column_key(ColumnDefinition* column, void* data) {
+  if (column->type == INTEGER) {
+    int value;
+    memcpy(&value, data, sizeof(int));
+    return value;
+  }
+  if (column->type == REAL) {
+    double value;
+    memcpy(&value, data, sizeof(double));
+    if (value == 0) {
+      value = 0;
+    }
+    IndexKey key;
+    memcpy(&key, &value, sizeof(IndexKey));
+    return key < 0 ? key ^ INT64_MAX : key;
+  }
+  if (column->overflow == NULL) {
+    return hash_bytes(data, strnlen(data, column->size));
+  }
+  uint16_t length = varchar_cell_length(data);
+  if (length <= VARCHAR_INLINE_SIZE) {
+    return hash_bytes(data + VARCHAR_LENGTH_SIZE, length);
+  }
+  return overflow_hash(column->overflow, varchar_cell_overflow(data), length);
+}
+
+// Returns the index on a column, the primary key's or a secondary one
+Pager* table_column_index(Table* table, ColumnDefinition* column) {
+  if (column == table->key_column) {
+    return table->index_pager;
+  }
+  for (uint32_t i = 0; i < table->num_indexes; i++) {
+    if (table->indexes[i].column == column) {
+      return table->indexes[i].pager;
+    }
+  }
+  return NULL;
+}
+
+// Adds a row to, or removes it from, every index of its table
+void index_row(Table* table, Cursor* cursor, bool insert) {
+  for (int32_t i = -1; i < (int32_t)table->num_indexes; i++) {
+    ColumnDefinition* column =
+        i < 0 ? table->key_column : table->indexes[i].column;
+    if (column == NULL) {
+      continue;
+    }
+    Pager* pager = i < 0 ? table->index_pager : table->indexes[i].pager;
+    IndexEntry entry = {column_key(column, cursor_column(cursor, column)),
+                        cursor->row_num};
+    if (insert) {
+      btree_insert(pager, entry);
+    } else {
+      btree_delete(pager, entry);
+    }
+  }
+}
+
+int compare_index_entry_ptrs(const void* a, const void* b) {
+  return compare_index_entries(*(const IndexEntry*)a, *(const IndexEntry*)b);
+}
+
+// Builds an index on column from the rows in the table. The entries are
+// sorted first, so they fill the leaves from left to right.
+void index_build(Table* table, ColumnDefinition* column, Pager* pager) {
+  void* root = get_page(pager, 0);
+  pager_mark_dirty(pager, 0);
+  initialize_leaf_node(root);
+
+  IndexEntry* entries = malloc(((size_t)table->num_live_rows + 1) *
+                               sizeof(IndexEntry));
+  uint32_t num_entries = 0;
+  Cursor* cursor = table_start(table);
+  while (!(cursor->end_of_table)) {
+    entries[num_entries].key =
+        column_key(column, cursor_column(cursor, column));
+    entries[num_entries].row_num = cursor->row_num;
+    num_entries++;
+    cursor_advance(cursor);
+  }
+  cursor_close(cursor);
+
+  qsort(entries, num_entries, sizeof(IndexEntry), compare_index_entry_ptrs);
+  for (uint32_t i = 0; i < num_entries; i++) {
+    btree_insert(pager, entries[i]);
+  }
+  free(entries);
+}
+
+Pager* index_pager_open(Table* table, const char* filename, uint32_t file_id) {
+  Pager* pager = pager_open(table->pager->pool, filename);
+  pager->file_id = file_id;
+  if (table->mmapped) {
+    pager_use_mmap(pager);
+  }
+  return pager;
+}
+
+void index_open(Table* table) {
+  if (table->key_column == NULL) {
+    return;
+  }
+  table->index_pager =
+      index_pager_open(table, table->index_filename, table->file_id + 1);
+}
+
+Index* table_add_index(Schema* schema, Table* table, const char* name,
+                       ColumnDefinition* column) {
+  table->indexes = arena_realloc(schema->arena, table->indexes,
+                                 table->num_indexes * sizeof(Index),
+                                 (table->num_indexes + 1) * sizeof(Index));
+  Index* index = &table->indexes[table->num_indexes++];
+  index->name = arena_strdup(schema->arena, name);
+  index->column = column;
+  index->filename = arena_alloc(
+      schema->arena,
+      strlen(DIR_PREFIX) + strlen(table->table_name) + strlen(name) + 8);
+  sprintf(index->filename, "%s%s.%s.index", DIR_PREFIX, table->table_name,
+          name);
+  index->file_id = SECONDARY_INDEX_FILE_ID + schema->num_indexes++;
+  index->pager = table->pager != NULL ? index_pager_open(table, index->filename,
+                                                         index->file_id)
+                                      : NULL;
+  return index;
+}
+
+// The catalog has a line per secondary index: <index>;<table>;<column>.
+// Indexes are added in catalog order, which gives them their file ids.
+void catalog_load(Schema* schema) {
+  FILE* file = fopen(CATALOG_FILENAME, "r");
+  if (file == NULL) {
+    return;
+  }
+
+  char line[MAX_LINE_LENGTH];
+  while (fgets(line, sizeof(line), file) != NULL) {
+    line[strcspn(line, "\n")] = '\0';
+    if (line[0] == '\0') {
+      continue;
+    }
+    char* save_ptr = NULL;
+    char* name = strtok_r(line, ";", &save_ptr);
+    char* table_name = strtok_r(NULL, ";", &save_ptr);
+    char* column_name = strtok_r(NULL, ";", &save_ptr);
+    Table* table =
+        table_name != NULL ? schema_find_table(schema, table_name) : NULL;
+    ColumnDefinition* column = table != NULL && column_name != NULL
+                                   ? table_find_column(table, column_name)
+                                   : NULL;
+    if (column == NULL) {
+      printf("Invalid index in catalog: %s\n", line);
+      exit(EXIT_FAILURE);
+    }
+    table_add_index(schema, table, name, column);
+  }
+  fclose(file);
+}
+
+void catalog_append(Table* table, Index* index) {
+  FILE* file = fopen(CATALOG_FILENAME, "a");
+  if (file == NULL) {
+    printf("Unable to open catalog\n");
+    exit(EXIT_FAILURE);
+  }
+  fprintf(file, "%s;%s;%s\n", index->name, table->table_name,
+          index->column->name);
+  if (fflush(file) != 0 || fsync(fileno(file)) < 0) {
+    printf("Error syncing catalog: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  fclose(file);
+}
+
+void table_statistics_free(TableStatistics* statistics) {
+  if (statistics != NULL) {
+    free(statistics->columns);
+    free(statistics);
+  }
+}
+
+// The statistics of analyzed tables are kept apart from the catalog, one
+// line per column: <table>;<column>;<rows>;<distinct>;<correlation>, then
+// ;<bound>,<bound>,... for int and real columns. Lines for tables or
+// columns that are gone are skipped, since statistics are only estimates.
+void statistics_load(Schema* schema) {
+  FILE* file = fopen(STATISTICS_FILENAME, "r");
+  if (file == NULL) {
+    return;
+  }
+
+  char line[MAX_LINE_LENGTH];
+  while (fgets(line, sizeof(line), file) != NULL) {
+    line[strcspn(line, "\n")] = '\0';
+    char* save_ptr = NULL;
+    char* table_name = strtok_r(line, ";", &save_ptr);
+    char* column_name = strtok_r(NULL, ";", &save_ptr);
+    char* num_rows = strtok_r(NULL, ";", &save_ptr);
+    char* num_distinct = strtok_r(NULL, ";", &save_ptr);
+    char* correlation = strtok_r(NULL, ";", &save_ptr);
+    char* bounds = strtok_r(NULL, ";", &save_ptr);
+    Table* table =
+        table_name != NULL ? schema_find_table(schema, table_name) : NULL;
+    ColumnDefinition* column = table != NULL && column_name != NULL
+                                   ? table_find_column(table, column_name)
+                                   : NULL;
+    if (column == NULL || correlation == NULL) {
+      continue;
+    }
+    if (table->statistics == NULL) {
+      table->statistics = malloc(sizeof(TableStatistics));
+      table->statistics->num_rows = strtoul(num_rows, NULL, 10);
+      table->statistics->columns =
+          calloc(table->num_columns, sizeof(ColumnStatistics));
+    }
+    ColumnStatistics* statistics =
+        &table->statistics->columns[column - table->columns];
+    statistics->num_distinct = strtod(num_distinct, NULL);
+    statistics->correlation = strtod(correlation, NULL);
+    statistics->has_range = bounds != NULL;
+    for (uint32_t i = 0; bounds != NULL && i <= HISTOGRAM_BUCKETS; i++) {
+      statistics->bounds[i] = strtod(bounds, &bounds);
+      bounds = *bounds == ',' ? bounds + 1 : NULL;
+    }
+  }
+  fclose(file);
+}
+
+// Writes the statistics of every analyzed table to a new file, which
+// replaces the old one once it is on disk
+void statistics_save(Schema* schema) {
+  FILE* file = fopen(STATISTICS_FILENAME ".tmp", "w");
+  if (file == NULL) {
+    printf("Unable to open statistics\n");
+    exit(EXIT_FAILURE);
+  }
+  for (uint32_t i = 0; i < schema->num_tables; i++) {
+    Table* table = schema->tables[i];
+    if (table->statistics == NULL) {
+      continue;
+    }
+    for (uint32_t j = 0; j < table->num_columns; j++) {
+      ColumnStatistics* statistics = &table->statistics->columns[j];
+      fprintf(file, "%s;%s;%u;%.17g;%.17g", table->table_name,
+              table->columns[j].name, table->statistics->num_rows,
+              statistics->num_distinct, statistics->correlation);
+      for (uint32_t k = 0; statistics->has_range && k <= HISTOGRAM_BUCKETS;
+           k++) {
+        fprintf(file, "%c%.17g", k == 0 ? ';' : ',', statistics->bounds[k]);
+      }
+      fprintf(file, "\n");
+    }
+  }
+  if (fflush(file) != 0 || fsync(fileno(file)) < 0 ||
+      rename(STATISTICS_FILENAME ".tmp", STATISTICS_FILENAME) < 0) {
+    printf("Error syncing statistics: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  fclose(file);
+}
+
+// Throws an index away and rebuilds it from the rows in the table
+void index_rebuild(Table* table, ColumnDefinition* column, Pager* pager) {
+  // Stale pages past the new tree are cut off at the next checkpoint
+  pager_drop(pager);
+  pager->num_pages = 0;
+
+  index_build(table, column, pager);
+}
+
+double column_number(ColumnDefinition* column, void* data) {
+  if (column->type == INTEGER) {
+    int value;
+    memcpy(&value, data, sizeof(int));
+    return value;
+  }
+  double value;
+  memcpy(&value, data, sizeof(double));
+  return value;
+}
+
+// A zone map has an entry per data page with the minimum and maximum of
+// each int and real column. Entries only ever widen, so after updates and
+// deletes they still bound every value on their page. An entry that was
+// never written holds no bounds. Returns NULL for an entry past the end of
+// the file unless it is created.
+char* zone_entry(Table* table, uint32_t page_num, bool create) {
+  Pager* pager = table->zone_pager;
+  uint32_t entries_per_page = page_size / table->zone_entry_size;
+  uint32_t zone_page_num = (page_num - 1) / entries_per_page;
+  char* page;
+  if (zone_page_num >= pager->num_pages) {
+    if (!create) {
+      return NULL;
+    }
+    // The page may still hold entries from before the map was rebuilt
+    page = get_page(pager, zone_page_num);
+    pager_mark_dirty(pager, zone_page_num);
+    memset(page, 0, page_size);
+  } else {
+    page = get_page(pager, zone_page_num);
+  }
+  return page + (page_num - 1) % entries_per_page * table->zone_entry_size;
+}
+
+// Widens the zone map entry of a page to the values of one of its rows
+void zone_add_row(Table* table, void* rows, uint32_t slot, uint32_t page_num) {
+  if (table->zone_pager == NULL) {
+    return;
+  }
+  char* entry = zone_entry(table, page_num, true);
+  // The entry is widened in a copy, so its page is only marked dirty when
+  // it changes
+  char widened[table->zone_entry_size];
+  memcpy(widened, entry, table->zone_entry_size);
+  uint64_t written;
+  memcpy(&written, entry, sizeof(uint64_t));
+  bool changed = !written;
+  for (uint32_t i = 0; i < table->num_columns; i++) {
+    ColumnDefinition* column = &table->columns[i];
+    if (column->type == VARCHAR) {
+      continue;
+    }
+    double value = column_number(column, column_value(rows, slot, column));
+    double bounds[2];
+    memcpy(bounds, entry + column->zone_offset, sizeof(bounds));
+    if (isnan(value)) {
+      // A NaN matches != but none of the bounds
+      bounds[0] = -INFINITY;
+      bounds[1] = INFINITY;
+    } else if (!written) {
+      bounds[0] = bounds[1] = value;
+    } else if (value < bounds[0]) {
+      bounds[0] = value;
+    } else if (value > bounds[1]) {
+      bounds[1] = value;
+    } else {
+      continue;
+    }
+    memcpy(widened + column->zone_offset, bounds, sizeof(bounds));
+    changed = true;
+  }
+  if (changed) {
+    written = 1;
+    memcpy(widened, &written, sizeof(uint64_t));
+    pager_mark_dirty(table->zone_pager,
+                     (page_num - 1) / (page_size / table->zone_entry_size));
+    memcpy(entry, widened, table->zone_entry_size);
+  }
+}
+
+void zone_build(Table* table) {
+  Cursor* cursor = table_start(table);
+  while (!(cursor->end_of_table)) {
+    zone_add_row(table, cursor_rows(cursor), cursor_slot(cursor),
+                 row_page_num(table, cursor->row_num));
+    cursor_advance(cursor);
+  }
+  cursor_close(cursor);
+}
+
+// Whether the bounds of a zone map entry rule out every row of the clause
+bool zone_excludes(WhereClause* where_clause, char* entry) {
+  if (where_clause->matches == where_and) {
+    return zone_excludes(where_clause->left, entry) ||
+           zone_excludes(where_clause->right, entry);
+  }
+  if (where_clause->matches == where_or) {
+    return zone_excludes(where_clause->left, entry) &&
+           zone_excludes(where_clause->right, entry);
+  }
+  ColumnDefinition* column = where_clause->column;
+  if (column->type == VARCHAR) {
+    return false;
+  }
+  double bounds[2];
+  memcpy(bounds, entry + column->zone_offset, sizeof(bounds));
+  double value = column->type == INTEGER ? where_clause->int_value
+                                         : where_clause->real_value;
+  switch (where_clause->op) {
+    case OP_EQUAL:
+      return value < bounds[0] || value > bounds[1];
+    case OP_NOT_EQUAL:
+      return bounds[0] == value && bounds[1] == value;
+    case OP_GREATER_THAN:
+      return bounds[1] <= value;
+    case OP_GREATER_THAN_OR_EQUAL:
+      return bounds[1] < value;
+    case OP_LESS_THAN:
+      return bounds[0] >= value;
+    case OP_LESS_THAN_OR_EQUAL:
+      return bounds[0] > value;
+  }
+  return false;
+}
+
+// Whether a scan can pass over a data page without reading it. Safe to call
+// from the workers of a parallel scan.
+bool zone_skip_page(Table* table, WhereClause* where_clause,
+                    uint32_t page_num) {
+  if (where_clause == NULL || table->zone_pager == NULL) {
+    return false;
+  }
+  uint32_t zone_page_num =
+      (page_num - 1) / (page_size / table->zone_entry_size);
+  if (zone_page_num >= table->zone_pager->num_pages) {
+    return false;
+  }
+  char* entry = pager_pin(table->zone_pager, zone_page_num);
+  entry += (page_num - 1) % (page_size / table->zone_entry_size) *
+           table->zone_entry_size;
+  uint64_t written;
+  memcpy(&written, entry, sizeof(uint64_t));
+  bool skip = written && zone_excludes(where_clause, entry);
+  pager_unpin(table->zone_pager, zone_page_num);
+  if (skip) {
+    STATS_ADD(pages_skipped, 1);
+  }
+  return skip;
+}
+
+void index_close(Table* table) {
+  for (uint32_t i = 0; i < table->num_indexes; i++) {
+    pager_close(table->indexes[i].pager);
+    table->indexes[i].pager = NULL;
+  }
+  if (table->index_pager == NULL) {
+    return;
+  }
+
+  pager_close(table->index_pager);
+  table->index_pager = NULL;
+}
+
+// Rewrites the strings that live rows still point to, dropping the ones
+// left behind by updates and deletes
+void overflow_compact(Table* table) {
+  Pager* pager = table->overflow_pager;
+  char* values = NULL;
+  uint64_t values_length = 0;
+  uint64_t values_capacity = 0;
+  Cursor* cursor = table_start(table);
+  while (!(cursor->end_of_table)) {
+    for (uint32_t i = 0; i < table->num_columns; i++) {
+      ColumnDefinition* column = &table->columns[i];
+      void* cell = cursor_column(cursor, column);
+      if (column->overflow == NULL ||
+          varchar_cell_length(cell) <= VARCHAR_INLINE_SIZE) {
+        continue;
+      }
+      uint16_t length = varchar_cell_length(cell);
+      if (values_length + length > values_capacity) {
+        values_capacity = 2 * values_capacity + length;
+        values = realloc(values, values_capacity);
+      }
+      overflow_read(pager, varchar_cell_overflow(cell), values + values_length,
+                    length);
+      values_length += length;
+    }
+    cursor_advance(cursor);
+  }
+  cursor_close(cursor);
+
+  // Stale pages past the new end are cut off at the next checkpoint
+  pager_drop(pager);
+  pager->num_pages = 0;
+  uint64_t used = page_size;
+  void* header = get_page(pager, 0);
+  pager_mark_dirty(pager, 0);
+  memcpy(header + OVERFLOW_HEADER_USED_OFFSET, &used, sizeof(uint64_t));
+
+  uint64_t position = 0;
+  cursor = table_start(table);
+  while (!(cursor->end_of_table)) {
+    for (uint32_t i = 0; i < table->num_columns; i++) {
+      ColumnDefinition* column = &table->columns[i];
+      void* cell = cursor_column(cursor, column);
+      if (column->overflow == NULL ||
+          varchar_cell_length(cell) <= VARCHAR_INLINE_SIZE) {
+        continue;
+      }
+      uint16_t length = varchar_cell_length(cell);
+      uint64_t offset = overflow_append(pager, values + position, length);
+      cursor_mark_dirty(cursor);
+      memcpy(cell + VARCHAR_OVERFLOW_OFFSET, &offset, sizeof(uint64_t));
+      position += length;
+    }
+    cursor_advance(cursor);
+  }
+  cursor_close(cursor);
+  free(values);
+}
+
+// Slides the live rows down over deleted slots, compacts the overflow file
+// and rebuilds the index
+void table_vacuum(Table* table) {
+  Cursor* source = table_start(table);
+  Cursor* destination = table_row(table, 0);
+  while (!(source->end_of_table)) {
+    if (source->row_num != destination->row_num) {
+      for (uint32_t i = 0; i < table->num_columns; i++) {
+        ColumnDefinition* column = &table->columns[i];
+        void* cell = cursor_column(destination, column);
+        cursor_mark_dirty(destination);
+        memcpy(cell, cursor_column(source, column), column->cell_size);
+      }
+    }
+    cursor_advance(source);
+    destination->row_num += 1;
+  }
+  cursor_close(source);
+  cursor_close(destination);
+
+  table->num_rows = table->num_live_rows;
+  table->free_page_head = 0;
+  for (uint32_t page_num = 1; page_num < table_num_pages(table); page_num++) {
+    void* page = get_page(table->pager, page_num);
+    pager_mark_dirty(table->pager, page_num);
+    initialize_data_page(table, page);
+    uint32_t first_row = (page_num - 1) * table->rows_per_page;
+    uint32_t num_slots = table->num_rows - first_row;
+    if (num_slots > table->rows_per_page) {
+      num_slots = table->rows_per_page;
+    }
+    for (uint32_t slot = 0; slot < num_slots; slot++) {
+      page_set_slot_live(page, slot, true);
+    }
+    *page_num_live_rows(page) = num_slots;
+  }
+  table_write_header(table);
+
+  if (table->overflow_pager != NULL) {
+    overflow_compact(table);
+  }
+  if (table->zone_pager != NULL) {
+    // Stale pages past the new entries are cut off at the next checkpoint
+    pager_drop(table->zone_pager);
+    table->zone_pager->num_pages = 0;
+    zone_build(table);
+  }
+  if (table->key_column != NULL) {
+    index_rebuild(table, table->key_column, table->index_pager);
+  }
+  for (uint32_t i = 0; i < table->num_indexes; i++) {
+    index_rebuild(table, table->indexes[i].column, table->indexes[i].pager);
+  }
+}
+
+void serialize_row(Row* source, void* rows, uint32_t slot, Table* table) {
+  for (uint32_t i = 0; i < table->num_columns; i++) {
+    ColumnDefinition* column = &table->columns[i];
+    column_write(column, column_value(rows, slot, column),
+                 source->data + column->offset);
+  }
+}
+
+// Copies a row out of its page, for results that must outlive the page pin.
+// Scans read columns in place through column_value instead.
+void copy_row_out(void* rows, uint32_t slot, Table* table, char* destination) {
+  for (uint32_t i = 0; i < table->num_columns; i++) {
+    ColumnDefinition* column = &table->columns[i];
+    column_read(column, column_value(rows, slot, column),
+                destination + column->offset);
+  }
+}
+
+void deserialize_row(void* rows, uint32_t slot, Row* destination,
+                     Table* table) {
+  destination->length = table->row_size;
+  destination->data = malloc(table->row_size);
+  copy_row_out(rows, slot, table, destination->data);
+}
+
+InputBuffer* new_input_buffer() {
+  InputBuffer* input_buffer = malloc(sizeof(InputBuffer));
+  input_buffer->buffer = NULL;
+  input_buffer->buffer_length = 0;
+  input_buffer->input_length = 0;
+
+  return input_buffer;
+}
+
+// Returns false at the end of the input
+bool read_input(InputBuffer* input_buffer) {
+  ssize_t bytes_read =
+      getline(&(input_buffer->buffer), &(input_buffer->buffer_length), stdin);
+
+  if (bytes_read <= 0) {
+    return false;
+  }
+
+  // Ignore trailing newline
+  input_buffer->input_length = bytes_read - 1;
+  input_buffer->buffer[bytes_read - 1] = 0;
+  return true;
+}
+
+// Cuts the next field off a CSV line in place, undoing "" escapes in quoted
+// fields. Returns NULL once the line is used up.
+char* csv_next_field(char** line) {
+  char* field = *line;
+  if (field == NULL) {
+    return NULL;
+  }
+  if (*field != '"') {
+    char* comma = strchr(field, ',');
+    if (comma != NULL) {
+      *comma = '\0';
+    }
+    *line = comma != NULL ? comma + 1 : NULL;
+    return field;
+  }
+
+  char* read = field + 1;
+  char* write = field;
+  while (*read != '\0') {
+    if (*read == '"') {
+      if (read[1] != '"') {
+        read++;
+        break;
+      }
+      read++;
+    }
+    *write++ = *read++;
+  }
+  char* comma = strchr(read, ',');
+  *line = comma != NULL ? comma + 1 : NULL;
+  *write = '\0';
+  return field;
+}
+
+// Returns whether a CSV line is a header naming the table's columns
+bool csv_is_header(char* line, Table* table) {
+  char* cpy = strdup(line);
+  char* pos = cpy;
+  uint32_t i = 0;
+  for (char* field = csv_next_field(&pos); field != NULL;
+       field = csv_next_field(&pos), i++) {
+    trim(field);
+    if (i == table->num_columns || strcmp(field, table->columns[i].name) != 0) {
+      free(cpy);
+      return false;
+    }
+  }
+  free(cpy);
+  return i == table->num_columns;
+}
+
+// .import <table> <file.csv> streams the file into the table in batches of
+// rows, each batch is inserted page by page and committed at once
+void table_import(Schema* schema, Table* table, const char* filename,
+                  FILE* out) {
+  FILE* file = fopen(filename, "r");
+  if (file == NULL) {
+    fprintf(out, "Unable to open file %s.\n", filename);
+    return;
+  }
+
+  char* rows = malloc(IMPORT_BATCH_ROWS * table->row_size);
+  uint32_t num_rows = 0;
+  uint32_t num_imported = 0;
+  uint64_t commit_position = 0;
+  char* line = NULL;
+  size_t line_capacity = 0;
+  ssize_t line_length;
+  uint32_t line_num = 0;
+  while ((line_length = getline(&line, &line_capacity, file)) != -1) {
+    line_num++;
+    while (line_length > 0 &&
+           (line[line_length - 1] == '\n' || line[line_length - 1] == '\r')) {
+      line[--line_length] = '\0';
+    }
+    if (line_length == 0 || (line_num == 1 && csv_is_header(line, table))) {
+      continue;
+    }
+
+    char* row = rows + num_rows * table->row_size;
+    memset(row, 0, table->row_size);
+    PrepareResult result = PREPARE_SUCCESS;
+    char* pos = line;
+    uint32_t i = 0;
+    for (char* field = csv_next_field(&pos); field != NULL;
+         field = csv_next_field(&pos), i++) {
+      if (i == table->num_columns) {
+        result = PREPARE_SYNTAX_ERROR;
+        break;
+      }
+      trim(field);
+      result = copy_value_into_row(&table->columns[i], row, field);
+      if (result != PREPARE_SUCCESS) {
+        break;
+      }
+    }
+    if (result == PREPARE_SUCCESS && i != table->num_columns) {
+      result = PREPARE_SYNTAX_ERROR;
+    }
+    if (result != PREPARE_SUCCESS) {
+      fprintf(out, "Error on line %u of %s.\n", line_num, filename);
+      break;
+    }
+
+    if (++num_rows == IMPORT_BATCH_ROWS) {
+      Transaction* transaction = implicit_transaction_begin(schema);
+      ExecuteResult insert_result = table_insert_rows(table, rows, num_rows);
+      commit_position = implicit_transaction_commit(schema, transaction);
+      if (insert_result != EXECUTE_SUCCESS) {
+        fprintf(out, "Error: Table full.\n");
+        num_rows = 0;
+        break;
+      }
+      num_imported += num_rows;
+      num_rows = 0;
+    }
+  }
+
+  if (num_rows > 0) {
+    Transaction* transaction = implicit_transaction_begin(schema);
+    ExecuteResult insert_result = table_insert_rows(table, rows, num_rows);
+    commit_position = implicit_transaction_commit(schema, transaction);
+    if (insert_result != EXECUTE_SUCCESS) {
+      fprintf(out, "Error: Table full.\n");
+    } else {
+      num_imported += num_rows;
+    }
+  }
+  wal_sync(schema->wal, commit_position);
+  fprintf(out, "Imported %u rows.\n", num_imported);
+
+  free(line);
+  free(rows);
+  fclose(file);
+}
+
+// Prints the counters summed over every statement since the start
+void print_stats(FILE* out) {
+  const char* names[] = {"statements",    "rows_scanned",  "rows_matched",
+                         "pages_fetched", "page_hits",     "page_misses",
+                         "pages_skipped", "bytes_read",    "bytes_written",
+                         "pages_prefetched", "sort_runs"};
+  uint64_t* counters = (uint64_t*)&stats;
+  for (uint32_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    fprintf(out, "%s %" PRIu64 "\n", names[i],
+            __atomic_load_n(&counters[i], __ATOMIC_RELAXED));
+  }
+}
+
+MetaCommandResult do_meta_cmd(InputBuffer* input_buffer, Session* session) {
+  Schema* schema = session->schema;
+  if (strcmp(input_buffer->buffer, ".exit") == 0) {
+    return META_COMMAND_EXIT;
+  } else if (strcmp(input_buffer->buffer, ".mode text") == 0) {
+    session->out.mode = OUTPUT_TEXT;
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input_buffer->buffer, ".mode binary") == 0) {
+    session->out.mode = OUTPUT_BINARY;
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input_buffer->buffer, ".timer on") == 0) {
+    session->timer = true;
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input_buffer->buffer, ".timer off") == 0) {
+    session->timer = false;
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input_buffer->buffer, ".stats") == 0) {
+    print_stats(session->out.file);
+    return META_COMMAND_SUCCESS;
+  } else if (strncmp(input_buffer->buffer, ".vacuum", 7) == 0) {
+    char* table_name = input_buffer->buffer + 7;
+    while (isspace(*table_name)) {
+      table_name++;
+    }
+    if (session->transaction != NULL) {
+      fprintf(session->out.file, "Error: Not allowed in a transaction.\n");
+      return META_COMMAND_SUCCESS;
+    }
+    bool found = false;
+    pthread_mutex_lock(&schema->commit_lock);
+    for (uint32_t i = 0; i < schema->num_tables; i++) {
+      Table* table = schema->tables[i];
+      if (*table_name == '\0' || strcmp(table->table_name, table_name) == 0) {
+        table_open_locked(schema, table);
+        pthread_rwlock_wrlock(&table->lock);
+        Transaction* transaction = implicit_transaction_begin(schema);
+        table_vacuum(table);
+        implicit_transaction_commit(schema, transaction);
+        pthread_rwlock_unlock(&table->lock);
+        found = true;
+      }
+    }
+    if (found) {
+      db_checkpoint(schema);
+    } else {
+      fprintf(session->out.file, "Table not found.\n");
+    }
+    pthread_mutex_unlock(&schema->commit_lock);
+    return META_COMMAND_SUCCESS;
+  } else if (strncmp(input_buffer->buffer, ".import ", 8) == 0) {
+    if (schema->serving) {
+      fprintf(session->out.file, "Error: .import cannot be served.\n");
+      return META_COMMAND_SUCCESS;
+    }
+    if (session->transaction != NULL) {
+      fprintf(session->out.file, "Error: Not allowed in a transaction.\n");
+      return META_COMMAND_SUCCESS;
+    }
+    char table_name[MAX_NAME_LENGTH];
+    char filename[MAX_LINE_LENGTH];
+    if (sscanf(input_buffer->buffer + 8, "%255s %1023s", table_name,
+               filename) != 2) {
+      fprintf(session->out.file, "Usage: .import <table> <file.csv>\n");
+      return META_COMMAND_SUCCESS;
+    }
+    Table* table = schema_open_table(schema, table_name);
+    if (table == NULL) {
+      fprintf(session->out.file, "Table not found.\n");
+      return META_COMMAND_SUCCESS;
+    }
+    pthread_mutex_lock(&schema->commit_lock);
+    pthread_rwlock_wrlock(&table->lock);
+    table_import(schema, table, filename, session->out.file);
+    pthread_rwlock_unlock(&table->lock);
+    pthread_mutex_unlock(&schema->commit_lock);
+    return META_COMMAND_SUCCESS;
+  } else {
+    return META_COMMAND_UNRECOGNIZED_COMMAND;
+  }
+}
+
+Operator string_to_operator(char* str_op) {
+  if (strcmp(str_op, "=") == 0) {
+    return OP_EQUAL;
+  } else if (strcmp(str_op, "!=") == 0) {
+    return OP_NOT_EQUAL;
+  } else if (strcmp(str_op, ">") == 0) {
+    return OP_GREATER_THAN;
+  } else if (strcmp(str_op, "<") == 0) {
+    return OP_LESS_THAN;
+  } else if (strcmp(str_op, ">=") == 0) {
+    return OP_GREATER_THAN_OR_EQUAL;
+  } else if (strcmp(str_op, "<=") == 0) {
+    return OP_LESS_THAN_OR_EQUAL;
+  } else {
+    return -1;
+  }
+}
+
+// Parses a value into bytes, whose column->size bytes are allocated by the
+// caller and reused by every value bound to a parameter
+PrepareResult copy_value_into_bytes(ColumnDefinition* column, Bytes* bytes,
+                                    char* value) {
+  memset(bytes->data, 0, bytes->length);
+
+  switch (column->type) {
+    case INTEGER: {
+      int int_value = atoi(value);
+      memcpy(bytes->data, &int_value, sizeof(int));
+      return PREPARE_SUCCESS;
+    }
+    case VARCHAR: {
+      size_t length = strlen(value);
+      if (length < 2 || value[0] != '\'' || value[length - 1] != '\'') {
+        return PREPARE_SYNTAX_ERROR;
+      }
+      if (length - 2 > column->size) {
+        return PREPARE_STRING_TOO_LONG;
+      }
+
+      memcpy(bytes->data, value + 1, length - 2);
+      return PREPARE_SUCCESS;
+    }
+    case REAL: {
+      double real_value = atof(value);
+      memcpy(bytes->data, &real_value, sizeof(double));
+      return PREPARE_SUCCESS;
+    }
+  }
+}
+
+PrepareResult copy_value_into_row(ColumnDefinition* column, char* row,
+                                  char* value) {
+  char* destination = row + column->offset;
+  if (column->type == INTEGER) {
+    int int_value = atoi(value);
+    if (int_value <= 0 && strcmp(column->name, "id") == 0) {
+      return PREPARE_NEGATIVE_ID;
+    }
+
+    memcpy(destination, &int_value, sizeof(int));
+  } else if (column->type == VARCHAR) {
+    size_t length = strlen(value);
+    if (length > column->size) {
+      return PREPARE_STRING_TOO_LONG;
+    }
+
+    memset(destination, 0, column->size);
+    memcpy(destination, value, length);
+  } else if (column->type == REAL) {
+    double real_value = atof(value);
+
+    memcpy(destination, &real_value, sizeof(double));
+  }
+  return PREPARE_SUCCESS;
+}
+
+void statement_add_parameter(Statement* statement, ParameterKind kind,
+                             ColumnDefinition* column, void* target) {
+  statement->params = arena_realloc(
+      statement->arena, statement->params,
+      statement->num_params * sizeof(Parameter),
+      (statement->num_params + 1) * sizeof(Parameter));
+  Parameter* param = &statement->params[statement->num_params++];
+  param->kind = kind;
+  param->column = column;
+  param->target = target;
+}
+
+bool is_parameter(const char* value) { return strcmp(value, "?") == 0; }
+
+#define WHERE_COMPARE(name, type, constant, cmp)                        \
+  bool name(void* rows, uint32_t slot, WhereClause* where_clause) {      \
+    type value;                                                          \
+    memcpy(&value,                                                       \
+           rows + where_clause->offset + slot * where_clause->stride,    \
+           sizeof(type));                                                \
+    return value cmp where_clause->constant;                             \
+  }
+
+WHERE_COMPARE(where_int_equal, int, int_value, ==)
+WHERE_COMPARE(where_int_not_equal, int, int_value, !=)
+WHERE_COMPARE(where_int_greater, int, int_value, >)
+WHERE_COMPARE(where_int_less, int, int_value, <)
+WHERE_COMPARE(where_int_greater_equal, int, int_value, >=)
+WHERE_COMPARE(where_int_less_equal, int, int_value, <=)
+WHERE_COMPARE(where_real_equal, double, real_value, ==)
+WHERE_COMPARE(where_real_not_equal, double, real_value, !=)
+WHERE_COMPARE(where_real_greater, double, real_value, >)
+WHERE_COMPARE(where_real_less, double, real_value, <)
+WHERE_COMPARE(where_real_greater_equal, double, real_value, >=)
+WHERE_COMPARE(where_real_less_equal, double, real_value, <=)
+
+bool where_varchar_equal(void* rows, uint32_t slot, WhereClause* where_clause) {
+  return column_equal(where_clause->column,
+                      rows + where_clause->offset + slot * where_clause->stride,
+                      where_clause->value.data);
+}
+
+bool where_varchar_not_equal(void* rows, uint32_t slot, WhereClause* where_clause) {
+  return !column_equal(where_clause->column,
+                       rows + where_clause->offset + slot * where_clause->stride,
+                       where_clause->value.data);
+}
+
+bool where_and(void* rows, uint32_t slot, WhereClause* where_clause) {
+  return where_clause->left->matches(rows, slot, where_clause->left) &&
+         where_clause->right->matches(rows, slot, where_clause->right);
+}
+
+bool where_or(void* rows, uint32_t slot, WhereClause* where_clause) {
+  return where_clause->left->matches(rows, slot, where_clause->left) ||
+         where_clause->right->matches(rows, slot, where_clause->right);
+}
+
+// Indexed by Operator
+RowPredicate int_predicates[] = {
+    where_int_equal, where_int_not_equal,     where_int_greater,
+    where_int_less,  where_int_greater_equal, where_int_less_equal};
+RowPredicate real_predicates[] = {
+    where_real_equal, where_real_not_equal,     where_real_greater,
+    where_real_less,  where_real_greater_equal, where_real_less_equal};
+
+void where_decode_constant(WhereClause* where_clause) {
+  if (where_clause->column->type == INTEGER) {
+    memcpy(&where_clause->int_value, where_clause->value.data, sizeof(int));
+  } else if (where_clause->column->type == REAL) {
+    memcpy(&where_clause->real_value, where_clause->value.data, sizeof(double));
+  }
+}
+
+Table* schema_find_table(Schema* schema, const char* table_name) {
+  pthread_rwlock_rdlock(&schema->catalog_lock);
+  Table* table = NULL;
+  uint32_t mask = schema->table_capacity - 1;
+  for (uint32_t slot = hash_string(table_name) & mask;
+       schema->table_capacity > 0 && schema->table_slots[slot] != NULL;
+       slot = (slot + 1) & mask) {
+    if (strcmp(schema->table_slots[slot]->table_name, table_name) == 0) {
+      table = schema->table_slots[slot];
+      break;
+    }
+  }
+  pthread_rwlock_unlock(&schema->catalog_lock);
+  return table;
+}
+
+// Finds a table for a statement, opening it the first time one uses it.
+// Statements copy column definitions, which point to the open files.
+Table* schema_open_table(Schema* schema, const char* table_name) {
+  Table* table = schema_find_table(schema, table_name);
+  if (table != NULL) {
+    table_open(schema, table);
+  }
+  return table;
+}
+
+// Finds a column by name. The columns of a join are named
+// <table>.<column> and can also be found by their bare name, unless both
+// tables have a column of that name, which sets ambiguous.
+ColumnDefinition* table_lookup_column(Table* table, const char* name,
+                                      bool* ambiguous) {
+  *ambiguous = false;
+  uint32_t mask = table->column_capacity - 1;
+  for (uint32_t slot = hash_string(name) & mask;
+       table->column_capacity > 0 && table->column_slots[slot] != 0;
+       slot = (slot + 1) & mask) {
+    ColumnDefinition* column = &table->columns[table->column_slots[slot] - 1];
+    if (strcmp(column->name, name) == 0) {
+      return column;
+    }
+  }
+  if (strchr(name, '.') != NULL) {
+    return NULL;
+  }
+  ColumnDefinition* found = NULL;
+  for (uint32_t i = 0; i < table->num_columns; i++) {
+    char* dot = strchr(table->columns[i].name, '.');
+    if (dot != NULL && strcmp(dot + 1, name) == 0) {
+      if (found != NULL) {
+        *ambiguous = true;
+        return NULL;
+      }
+      found = &table->columns[i];
+    }
+  }
+  return found;
+}
+
+ColumnDefinition* table_find_column(Table* table, const char* name) {
+  bool ambiguous;
+  return table_lookup_column(table, name, &ambiguous);
+}
+
+// Finds a column a statement names, telling an ambiguous name from one
+// that is not there
+PrepareResult prepare_column(Table* table, const char* name,
+                             ColumnDefinition** column) {
+  bool ambiguous;
+  *column = table_lookup_column(table, name, &ambiguous);
+  if (*column != NULL) {
+    return PREPARE_SUCCESS;
+  }
+  return ambiguous ? PREPARE_AMBIGUOUS_COLUMN : PREPARE_SYNTAX_ERROR;
+}
+
+// Points a column at its value in a whole row of row_size bytes
+void whole_row_column(ColumnDefinition* column, uint32_t row_size) {
+  column->page_offset = column->offset;
+  column->stride = row_size;
+  column->cell_size = column->size;
+  column->overflow = NULL;
+}
+
+// Builds the table of a join's output rows, left columns first
+Table* join_tables(Arena* arena, Table* left, Table* right) {
+  Table* joined = arena_calloc(arena, 1, sizeof(Table));
+  joined->num_columns = left->num_columns + right->num_columns;
+  joined->row_size = left->row_size + right->row_size;
+  joined->columns =
+      arena_alloc(arena, joined->num_columns * sizeof(ColumnDefinition));
+  for (uint32_t i = 0; i < joined->num_columns; i++) {
+    bool is_left = i < left->num_columns;
+    Table* table = is_left ? left : right;
+    ColumnDefinition column =
+        table->columns[is_left ? i : i - left->num_columns];
+    column.name =
+        arena_alloc(arena, strlen(table->table_name) + strlen(column.name) + 2);
+    sprintf(column.name, "%s.%s", table->table_name,
+            table->columns[is_left ? i : i - left->num_columns].name);
+    column.offset += is_left ? 0 : left->row_size;
+    whole_row_column(&column, joined->row_size);
+    joined->columns[i] = column;
+  }
+  table_map_columns(arena, joined);
+  return joined;
+}
+
+// Parses "<table> join <table> on <column> = <column>"
+PrepareResult parse_join(char* from_part, Schema* schema, Statement* statement,
+                         SelectStatement* select_statement) {
+  char* join_pos = strstr(from_part, " join ");
+  char* on_pos = strstr(from_part, " on ");
+  if (on_pos == NULL || on_pos < join_pos) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  *join_pos = '\0';
+  *on_pos = '\0';
+  char* condition = on_pos + 4;
+  char* equals = strchr(condition, '=');
+  if (equals == NULL) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  *equals = '\0';
+  char* first_name = condition;
+  char* second_name = equals + 1;
+  trim(from_part);
+  trim(join_pos + 6);
+  trim(first_name);
+  trim(second_name);
+
+  Table* left = schema_open_table(schema, from_part);
+  Table* right = schema_open_table(schema, join_pos + 6);
+  if (left == NULL || right == NULL) {
+    return PREPARE_TABLE_NOT_FOUND;
+  }
+
+  Table* joined = join_tables(statement->arena, left, right);
+  ColumnDefinition* first;
+  ColumnDefinition* second;
+  PrepareResult result = prepare_column(joined, first_name, &first);
+  if (result == PREPARE_SUCCESS) {
+    result = prepare_column(joined, second_name, &second);
+  }
+  if (result != PREPARE_SUCCESS) {
+    return result;
+  }
+  if (first - joined->columns > second - joined->columns) {
+    ColumnDefinition* tmp = first;
+    first = second;
+    second = tmp;
+  }
+
+  // One key from each side, compared byte for byte
+  uint32_t left_index = first - joined->columns;
+  uint32_t right_index = second - joined->columns;
+  if (left_index >= left->num_columns || right_index < left->num_columns ||
+      first->type != second->type || first->size != second->size) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+
+  statement->table = left;
+  select_statement->join_table = right;
+  select_statement->left_key = &left->columns[left_index];
+  select_statement->right_key = &right->columns[right_index - left->num_columns];
+  select_statement->joined = joined;
+  return PREPARE_SUCCESS;
+}
+
+PrepareResult parse_comparison(char** tokens, uint32_t num_tokens,
+                               uint32_t* pos, WhereClause* where_clause,
+                               Table* table, Statement* statement) {
+  if (*pos + 3 > num_tokens) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  char* column_name = tokens[(*pos)++];
+  char* op = tokens[(*pos)++];
+  char* value = tokens[(*pos)++];
+
+  memset(where_clause, 0, sizeof(WhereClause));
+  PrepareResult result =
+      prepare_column(table, column_name, &where_clause->column);
+  if (result != PREPARE_SUCCESS) {
+    return result;
+  }
+
+  where_clause->op = string_to_operator(op);
+  if (where_clause->op == -1) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+
+  where_clause->value.length = where_clause->column->size;
+  where_clause->value.data =
+      arena_alloc(statement->arena, where_clause->value.length);
+  if (is_parameter(value)) {
+    memset(where_clause->value.data, 0, where_clause->value.length);
+    statement_add_parameter(statement, PARAMETER_WHERE, where_clause->column,
+                            where_clause);
+  } else {
+    PrepareResult copy_result =
+        copy_value_into_bytes(where_clause->column, &where_clause->value, value);
+    if (copy_result != PREPARE_SUCCESS) {
+      return copy_result;
+    }
+  }
+
+  where_clause->offset = where_clause->column->page_offset;
+  where_clause->stride = where_clause->column->stride;
+  where_decode_constant(where_clause);
+  switch (where_clause->column->type) {
+    case INTEGER:
+      where_clause->matches = int_predicates[where_clause->op];
+      break;
+    case REAL:
+      where_clause->matches = real_predicates[where_clause->op];
+      break;
+    case VARCHAR:
+      if (where_clause->op == OP_EQUAL) {
+        where_clause->matches = where_varchar_equal;
+      } else if (where_clause->op == OP_NOT_EQUAL) {
+        where_clause->matches = where_varchar_not_equal;
+      } else {
+        return PREPARE_SYNTAX_ERROR;
+      }
+      break;
+  }
+
+  return PREPARE_SUCCESS;
+}
+
+// Parses "<term> [and|or <term>]...", where and binds tighter than or
+PrepareResult parse_connective(char** tokens, uint32_t num_tokens,
+                               uint32_t* pos, WhereClause* where_clause,
+                               Table* table, Statement* statement,
+                               const char* keyword) {
+  bool is_or = strcmp(keyword, "or") == 0;
+  PrepareResult result =
+      is_or ? parse_connective(tokens, num_tokens, pos, where_clause, table,
+                               statement, "and")
+            : parse_comparison(tokens, num_tokens, pos, where_clause, table,
+                               statement);
+  while (result == PREPARE_SUCCESS && *pos < num_tokens &&
+         strcasecmp(tokens[*pos], keyword) == 0) {
+    (*pos)++;
+    WhereClause* left = arena_alloc(statement->arena, sizeof(WhereClause));
+    WhereClause* right = arena_alloc(statement->arena, sizeof(WhereClause));
+    *left = *where_clause;
+    for (uint32_t i = 0; i < statement->num_params; i++) {
+      if (statement->params[i].target == where_clause) {
+        statement->params[i].target = left;
+      }
+    }
+    result = is_or ? parse_connective(tokens, num_tokens, pos, right, table,
+                                      statement, "and")
+                   : parse_comparison(tokens, num_tokens, pos, right, table,
+                                      statement);
+
+    memset(where_clause, 0, sizeof(WhereClause));
+    where_clause->matches = is_or ? where_or : where_and;
+    where_clause->left = left;
+    where_clause->right = right;
+  }
+  return result;
+}
+
+PrepareResult parse_where_clause(char* where_part, WhereClause* where_clause,
+                                 Table* table, Statement* statement) {
+  uint32_t num_tokens = 0;
+  char** tokens = arena_alloc(statement->arena,
+                              sizeof(char*) * (strlen(where_part) / 2 + 1));
+  char* outer_ptr = NULL;
+  for (char* token = strtok_r(where_part, " ", &outer_ptr); token != NULL;
+       token = strtok_r(NULL, " ", &outer_ptr)) {
+    tokens[num_tokens++] = token;
+  }
+
+  uint32_t pos = 0;
+  PrepareResult result =
+      parse_connective(tokens, num_tokens, &pos, where_clause, table,
+                       statement, "or");
+  if (result == PREPARE_SUCCESS && pos != num_tokens) {
+    result = PREPARE_SYNTAX_ERROR;
+  }
+  return result;
+}
+
+// Batch filters compare one numeric column of a whole page against a
+// comparison's constant and set a bit in the selection bitmap per match
+typedef void (*FilterKernel)(void* rows, uint32_t num_rows,
+                             WhereClause* where_clause, uint8_t* selection);
+
+void filter_rows_scalar(void* rows, uint32_t from, uint32_t to,
+                        WhereClause* where_clause, uint8_t* selection) {
+  for (uint32_t i = from; i < to; i++) {
+    if (where_clause->matches(rows, i, where_clause)) {
+      selection[i / 8] |= (1 << (i % 8));
+    } else {
+      selection[i / 8] &= ~(1 << (i % 8));
+    }
+  }
+}
+
+void filter_scalar(void* rows, uint32_t num_rows, WhereClause* where_clause,
+                   uint8_t* selection) {
+  filter_rows_scalar(rows, 0, num_rows, where_clause, selection);
+}
+
+#ifdef HAVE_X86_SIMD
+// Every operator is a union of ==, > and <, optionally negated so that
+// != also matches NaN like its scalar counterpart
+typedef struct {
+  int64_t equal;
+  int64_t greater;
+  int64_t less;
+  int64_t invert;
+} FilterMasks;
+
+FilterMasks filter_masks(Operator op) {
+  FilterMasks masks = {0, 0, 0, 0};
+  switch (op) {
+    case OP_EQUAL:
+      masks.equal = -1;
+      break;
+    case OP_NOT_EQUAL:
+      masks.equal = masks.invert = -1;
+      break;
+    case OP_GREATER_THAN:
+      masks.greater = -1;
+      break;
+    case OP_LESS_THAN:
+      masks.less = -1;
+      break;
+    case OP_GREATER_THAN_OR_EQUAL:
+      masks.greater = masks.equal = -1;
+      break;
+    case OP_LESS_THAN_OR_EQUAL:
+      masks.less = masks.equal = -1;
+      break;
+  }
+  return masks;
+}
+
+__attribute__((target("avx2"))) void filter_int_avx2(
+    void* rows, uint32_t num_rows, WhereClause* where_clause,
+    uint8_t* selection) {
+  uint32_t stride = where_clause->stride;
+  FilterMasks masks = filter_masks(where_clause->op);
+  __m256i equal = _mm256_set1_epi32(masks.equal);
+  __m256i greater = _mm256_set1_epi32(masks.greater);
+  __m256i less = _mm256_set1_epi32(masks.less);
+  __m256i invert = _mm256_set1_epi32(masks.invert);
+  __m256i constant = _mm256_set1_epi32(where_clause->int_value);
+  __m256i index = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+                                     _mm256_set1_epi32(stride));
+
+  uint32_t i = 0;
+  for (; i + 8 <= num_rows; i += 8) {
+    void* base = rows + where_clause->offset + i * stride;
+    // PAX minipages hold the values back to back
+    __m256i values = stride == sizeof(int)
+                         ? _mm256_loadu_si256(base)
+                         : _mm256_i32gather_epi32(base, index, 1);
+    __m256i match = _mm256_or_si256(
+        _mm256_and_si256(_mm256_cmpeq_epi32(values, constant), equal),
+        _mm256_or_si256(
+            _mm256_and_si256(_mm256_cmpgt_epi32(values, constant), greater),
+            _mm256_and_si256(_mm256_cmpgt_epi32(constant, values), less)));
+    match = _mm256_xor_si256(match, invert);
+    selection[i / 8] = _mm256_movemask_ps(_mm256_castsi256_ps(match));
+  }
+  filter_rows_scalar(rows, i, num_rows, where_clause, selection);
+}
+
+__attribute__((target("avx2"))) void filter_real_avx2(
+    void* rows, uint32_t num_rows, WhereClause* where_clause,
+    uint8_t* selection) {
+  uint32_t stride = where_clause->stride;
+  FilterMasks masks = filter_masks(where_clause->op);
+  __m256d equal = _mm256_castsi256_pd(_mm256_set1_epi64x(masks.equal));
+  __m256d greater = _mm256_castsi256_pd(_mm256_set1_epi64x(masks.greater));
+  __m256d less = _mm256_castsi256_pd(_mm256_set1_epi64x(masks.less));
+  __m256d invert = _mm256_castsi256_pd(_mm256_set1_epi64x(masks.invert));
+  __m256d constant = _mm256_set1_pd(where_clause->real_value);
+  __m128i index = _mm_mullo_epi32(_mm_setr_epi32(0, 1, 2, 3),
+                                  _mm_set1_epi32(stride));
+
+  uint32_t i = 0;
+  for (; i + 8 <= num_rows; i += 8) {
+    uint32_t bits = 0;
+    for (uint32_t half = 0; half < 2; half++) {
+      void* base = rows + where_clause->offset + (i + 4 * half) * stride;
+      __m256d values = stride == sizeof(double)
+                           ? _mm256_loadu_pd(base)
+                           : _mm256_i32gather_pd(base, index, 1);
+      __m256d match = _mm256_or_pd(
+          _mm256_and_pd(_mm256_cmp_pd(values, constant, _CMP_EQ_OQ), equal),
+          _mm256_or_pd(
+              _mm256_and_pd(_mm256_cmp_pd(values, constant, _CMP_GT_OQ),
+                            greater),
+              _mm256_and_pd(_mm256_cmp_pd(values, constant, _CMP_LT_OQ),
+                            less)));
+      match = _mm256_xor_pd(match, invert);
+      bits |= _mm256_movemask_pd(match) << (4 * half);
+    }
+    selection[i / 8] = bits;
+  }
+  filter_rows_scalar(rows, i, num_rows, where_clause, selection);
+}
+#endif
+
+FilterKernel int_filter_kernel = filter_scalar;
+FilterKernel real_filter_kernel = filter_scalar;
+
+// Picks the widest filter kernels the CPU supports
+void filter_kernels_init() {
+#ifdef HAVE_X86_SIMD
+  if (__builtin_cpu_supports("avx2")) {
+    int_filter_kernel = filter_int_avx2;
+    real_filter_kernel = filter_real_avx2;
+  }
+#endif
+}
+
+// Finds a numeric comparison that every matching row must satisfy
+WhereClause* batch_predicate(WhereClause* where_clause) {
+  if (where_clause == NULL) {
+    return NULL;
+  }
+  if (where_clause->matches == where_and) {
+    WhereClause* left = batch_predicate(where_clause->left);
+    return left != NULL ? left : batch_predicate(where_clause->right);
+  }
+  if (where_clause->column != NULL &&
+      (where_clause->column->type == INTEGER ||
+       where_clause->column->type == REAL)) {
+    return where_clause;
+  }
+  return NULL;
+}
+
+PrepareResult prepare_delete(InputBuffer* input_buffer, Statement* statement,
+                             Schema* schema) {
+  statement->type = STATEMENT_DELETE;
+  DeleteStatement* delete_statement =
+      arena_calloc(statement->arena, 1, sizeof(DeleteStatement));
+
+  char* cpy = arena_strdup(statement->arena, input_buffer->buffer);
+  trim(cpy);
+  char* lower_sql = str_to_lower(statement->arena, cpy);
+
+  if (strncmp(lower_sql, "delete from", 11) != 0) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+
+  char* where_pos = strstr(lower_sql, " where ");
+  if (!where_pos) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+
+  size_t table_name_length = where_pos - (lower_sql + 12);
+  char* table_name =
+      arena_strndup(statement->arena, cpy + 12, table_name_length);
+  trim(table_name);
+
+  Table* table = schema_open_table(schema, table_name);
+  if (table == NULL) {
+    return PREPARE_TABLE_NOT_FOUND;
+  }
+
+  statement->table = table;
+
+  char* where_part = where_pos + 7;
+  WhereClause* where_clause =
+      arena_alloc(statement->arena, sizeof(WhereClause));
+  PrepareResult prepare_result =
+      parse_where_clause(where_part, where_clause, table, statement);
+  if (prepare_result != PREPARE_SUCCESS) {
+    return prepare_result;
+  }
+
+  delete_statement->where_clause = where_clause;
+  statement->statementDetail = delete_statement;
+
+  return PREPARE_SUCCESS;
+}
+
+PrepareResult prepare_update(InputBuffer* input_buffer, Statement* statement,
+                             Schema* schema) {
+  statement->type = STATEMENT_UPDATE;
+  UpdateStatement* update_statement =
+      arena_calloc(statement->arena, 1, sizeof(UpdateStatement));
+
+  char* cpy = arena_strdup(statement->arena, input_buffer->buffer);
+  trim(cpy);
+  char* lower_sql = str_to_lower(statement->arena, cpy);
+
+  if (strncmp(lower_sql, "update", 6) != 0) {
+    printf("update\n");
+    return PREPARE_SYNTAX_ERROR;
+  }
+
+  char* set_pos = strstr(lower_sql, " set ");
+  if (!set_pos) {
+    printf("set_pos\n");
+    return PREPARE_SYNTAX_ERROR;
+  }
+
+  char* where_pos = strstr(lower_sql, " where ");
+  if (!where_pos) {
+    printf("where_pos\n");
+    return PREPARE_SYNTAX_ERROR;
+  }
+
+  size_t table_name_length = set_pos - (lower_sql + 7);
+  char* table_name =
+      arena_strndup(statement->arena, cpy + 7, table_name_length);
+  trim(table_name);
+
+  Table* table = schema_open_table(schema, table_name);
+  if (table == NULL) {
+    return PREPARE_TABLE_NOT_FOUND;
+  }
+
+  statement->table = table;
+
+  char* set_part = set_pos + 5;
+  char* where_part = where_pos + 7;
+
+  // assume only update one column
+  char* column_name = strtok(set_part, " = ");
+  char* value = strtok(NULL, " = ");
+
+  ColumnDefinition* column = NULL;
+  for (uint32_t i = 0; i < table->num_columns; i++) {
+    if (strcmp(table->columns[i].name, column_name) == 0) {
+      column = &table->columns[i];
+      break;
+    }
+  }
+
+  if (column == NULL) {
+    printf("column\n");
+    return PREPARE_SYNTAX_ERROR;
+  }
+
+  update_statement->column = column;
+
+  if (value == NULL) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+
+  // Copy the value before the where clause so parameters follow the text,
+  // taking it from the original input to keep its case
+  value = cpy + (value - lower_sql);
+  value[strcspn(value, " ")] = '\0';
+  update_statement->value.length = column->size;
+  update_statement->value.data =
+      arena_calloc(statement->arena, 1, column->size);
+  PrepareResult copy_result = PREPARE_SUCCESS;
+  if (is_parameter(value)) {
+    statement_add_parameter(statement, PARAMETER_VALUE, column,
+                            &update_statement->value);
+  } else {
+    copy_result = copy_value_into_bytes(column, &update_statement->value, value);
+  }
+  if (copy_result != PREPARE_SUCCESS) {
+    return copy_result;
+  }
+
+  WhereClause* where_clause =
+      arena_alloc(statement->arena, sizeof(WhereClause));
+  PrepareResult prepare_result =
+      parse_where_clause(where_part, where_clause, table, statement);
+  if (prepare_result != PREPARE_SUCCESS) {
+    return prepare_result;
+  }
+
+  update_statement->where_clause = where_clause;
+
+  statement->statementDetail = update_statement;
+
+  return PREPARE_SUCCESS;
+}
+
+// Parses the value lists of an insert, "(1, a, b), (2, c, d)", in place.
+// The rows are copied into one buffer that is allocated up front.
+PrepareResult parse_insert_rows(char* values, Table* table,
+                                Statement* statement, Row* rows,
+                                uint32_t* num_rows) {
+  uint32_t capacity = 0;
+  for (char* p = strchr(values, ')'); p != NULL; p = strchr(p + 1, ')')) {
+    capacity++;
+  }
+  rows->length = table->row_size;
+  rows->data = arena_calloc(statement->arena, capacity, table->row_size);
+  *num_rows = 0;
+
+  char* pos = values;
+  while (true) {
+    while (isspace(*pos)) pos++;
+    char* end = strchr(pos, ')');
+    if (*pos != '(' || end == NULL) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    *end = '\0';
+
+    char* row = rows->data + (*num_rows)++ * table->row_size;
+    uint32_t num_values = 0;
+    for (char* value = pos + 1; value != NULL;) {
+      char* comma = strchr(value, ',');
+      if (comma != NULL) {
+        *comma = '\0';
+      }
+      trim(value);
+      if (num_values == table->num_columns) {
+        return PREPARE_SYNTAX_ERROR;
+      }
+
+      ColumnDefinition* column = &table->columns[num_values++];
+      if (is_parameter(value)) {
+        statement_add_parameter(statement, PARAMETER_ROW, column, row);
+      } else {
+        PrepareResult result = copy_value_into_row(column, row, value);
+        if (result != PREPARE_SUCCESS) {
+          return result;
+        }
+      }
+      value = comma != NULL ? comma + 1 : NULL;
+    }
+    if (num_values != table->num_columns) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+
+    pos = end + 1;
+    while (isspace(*pos)) pos++;
+    if (*pos == '\0') {
+      return PREPARE_SUCCESS;
+    }
+    if (*pos != ',') {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    pos++;
+  }
+}
+
+PrepareResult prepare_insert(InputBuffer* input_buffer, Statement* statement,
+                             Schema* schema) {
+  statement->type = STATEMENT_INSERT;
+  InsertStatement* insert_statement =
+      arena_calloc(statement->arena, 1, sizeof(InsertStatement));
+
+  char* cpy = arena_strdup(statement->arena, input_buffer->buffer);
+  trim(cpy);
+  char* lower_sql = str_to_lower(statement->arena, cpy);
+
+  if (strncmp(lower_sql, "insert into", 11) != 0) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+
+  char* values_pos = strstr(lower_sql, " values ");
+  if (!values_pos) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+
+  size_t table_name_length = values_pos - (lower_sql + 12);
+  char* table_name =
+      arena_strndup(statement->arena, cpy + 12, table_name_length);
+  trim(table_name);
+
+  Table* table = schema_open_table(schema, table_name);
+  if (table == NULL) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+
+  statement->table = table;
+
+  PrepareResult result =
+      parse_insert_rows(cpy + (values_pos - lower_sql) + 8, table, statement,
+                        &insert_statement->rows, &insert_statement->num_rows);
+  if (result != PREPARE_SUCCESS) {
+    return result;
+  }
+
+  statement->statementDetail = insert_statement;
+
+  return PREPARE_SUCCESS;
+}
+
+// Recognizes an aggregate such as sum(balance) in a select list, and
+// points argument at the name of its column, or "*"
+AggregateFunction parse_aggregate(char* item, char** argument) {
+  char* open = strchr(item, '(');
+  char* close = strrchr(item, ')');
+  if (open == NULL || close == NULL || close < open || close[1] != '\0') {
+    return AGGREGATE_NONE;
+  }
+
+  AggregateFunction function = AGGREGATE_NONE;
+  size_t name_length = open - item;
+  while (name_length > 0 && isspace(item[name_length - 1])) {
+    name_length--;
+  }
+  const char* names[] = {NULL, "count", "sum", "min", "max", "avg"};
+  for (uint32_t i = AGGREGATE_COUNT; i <= AGGREGATE_AVG; i++) {
+    if (name_length == strlen(names[i]) &&
+        strncasecmp(item, names[i], name_length) == 0) {
+      function = i;
+    }
+  }
+  if (function == AGGREGATE_NONE) {
+    return AGGREGATE_NONE;
+  }
+
+  *close = '\0';
+  *argument = open + 1;
+  trim(*argument);
+  return function;
+}
+
+// Resolves the group by columns. Plain columns of the select list must be
+// among them.
+PrepareResult parse_group_by(char* group_part, Table* table,
+                             SelectStatement* select_statement, Arena* arena) {
+  if (select_statement->is_select_all) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  if (group_part != NULL) {
+    char* outer_ptr = NULL;
+    for (char* name = strtok_r(group_part, ",", &outer_ptr); name != NULL;
+         name = strtok_r(NULL, ",", &outer_ptr)) {
+      trim(name);
+      ColumnDefinition* column;
+      PrepareResult result = prepare_column(table, name, &column);
+      if (result != PREPARE_SUCCESS) {
+        return result;
+      }
+      select_statement->group_by = arena_realloc(
+          arena, select_statement->group_by,
+          select_statement->num_group_by * sizeof(ColumnDefinition),
+          (select_statement->num_group_by + 1) * sizeof(ColumnDefinition));
+      select_statement->group_by[select_statement->num_group_by++] = *column;
+    }
+  }
+
+  for (uint32_t i = 0; i < select_statement->num_columns; i++) {
+    Aggregate* aggregate = &select_statement->aggregates[i];
+    if (aggregate->function != AGGREGATE_NONE) {
+      continue;
+    }
+    uint32_t j = 0;
+    while (j < select_statement->num_group_by &&
+           select_statement->group_by[j].offset !=
+               select_statement->columns[i].offset) {
+      j++;
+    }
+    if (j == select_statement->num_group_by) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    aggregate->group_column = j;
+  }
+  return PREPARE_SUCCESS;
+}
+
+// Resolves "<column> [asc|desc]" and describes the rows it sorts
+PrepareResult parse_order_by(char* order_part, Table* table,
+                             SelectStatement* select_statement, Arena* arena) {
+  char name[MAX_NAME_LENGTH];
+  char direction[MAX_NAME_LENGTH] = "asc";
+  char extra[2];
+  int num_words = sscanf(order_part, "%255s %255s %1s", name, direction, extra);
+  if (num_words < 1 || num_words > 2) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  ColumnDefinition* column;
+  PrepareResult result = prepare_column(table, name, &column);
+  if (result != PREPARE_SUCCESS) {
+    return result;
+  }
+  if (strcasecmp(direction, "asc") != 0 &&
+      strcasecmp(direction, "desc") != 0) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  select_statement->order_by = column;
+  select_statement->descending = strcasecmp(direction, "desc") == 0;
+
+  Table* sorted = arena_calloc(arena, 1, sizeof(Table));
+  sorted->table_name = table->table_name;
+  sorted->num_columns = table->num_columns;
+  sorted->row_size = table->row_size;
+  sorted->columns =
+      arena_alloc(arena, table->num_columns * sizeof(ColumnDefinition));
+  for (uint32_t i = 0; i < table->num_columns; i++) {
+    sorted->columns[i] = table->columns[i];
+    whole_row_column(&sorted->columns[i], table->row_size);
+  }
+  select_statement->sorted = sorted;
+  select_statement->sorted_columns = arena_alloc(
+      arena, select_statement->num_columns * sizeof(ColumnDefinition));
+  for (uint32_t i = 0; i < select_statement->num_columns; i++) {
+    select_statement->sorted_columns[i] = select_statement->columns[i];
+    whole_row_column(&select_statement->sorted_columns[i], table->row_size);
+  }
+  return PREPARE_SUCCESS;
+}
+
+// Parses "<n> [offset <m>]"
+PrepareResult parse_limit(char* limit_part, SelectStatement* select_statement) {
+  unsigned int limit = 0;
+  unsigned int offset = 0;
+  int end = 0;
+  trim(limit_part);
+  if (!isdigit(limit_part[0]) ||
+      sscanf(limit_part, "%u %n", &limit, &end) != 1) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  char* offset_part = limit_part + end;
+  if (*offset_part != '\0') {
+    if (strncmp(offset_part, "offset ", 7) != 0 || !isdigit(offset_part[7]) ||
+        sscanf(offset_part + 7, "%u %n", &offset, &end) != 1 ||
+        offset_part[7 + end] != '\0') {
+      return PREPARE_SYNTAX_ERROR;
+    }
+  }
+  // UINT32_MAX is taken to mean there is no limit
+  select_statement->limit = limit < UINT32_MAX ? limit : UINT32_MAX - 1;
+  select_statement->offset = offset;
+  return PREPARE_SUCCESS;
+}
+
+PrepareResult prepare_select(InputBuffer* input_buffer, Statement* statement,
+                             Schema* schema) {
+  statement->type = STATEMENT_SELECT;
+  Arena* arena = statement->arena;
+  SelectStatement* select_statement =
+      arena_calloc(arena, 1, sizeof(SelectStatement));
+
+  char* cpy = arena_strdup(arena, input_buffer->buffer);
+  trim(cpy);
+  char* lower_sql = str_to_lower(arena, cpy);
+
+  if (strncmp(lower_sql, "select", 6) != 0) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+
+  char* from_pos = strstr(lower_sql, " from ");
+  if (!from_pos) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+
+  size_t columns_length = from_pos - (lower_sql + 7);
+  char* columns_part = arena_strndup(arena, cpy + 7, columns_length);
+  trim(columns_part);
+
+  char** columns = NULL;
+  uint32_t num_columns = 0;
+  if (strcmp(columns_part, "*") == 0) {
+    select_statement->is_select_all = true;
+  } else {
+    select_statement->is_select_all = false;
+    char* column = strtok(columns_part, ",");
+    while (column) {
+      num_columns++;
+      columns = arena_realloc(arena, columns,
+                              sizeof(char*) * (num_columns - 1),
+                              sizeof(char*) * num_columns);
+      columns[num_columns - 1] = column;
+      trim(columns[num_columns - 1]);
+      column = strtok(NULL, ",");
+    }
+  }
+
+  // limit, order by and group by come last, in that order from the end.
+  // They are cut off before the table and where clause.
+  select_statement->limit = UINT32_MAX;
+  char* limit_part = NULL;
+  char* limit_pos = strstr(lower_sql, " limit ");
+  if (limit_pos) {
+    limit_part = arena_strdup(arena, limit_pos + 7);
+    *limit_pos = '\0';
+  }
+  char* order_part = NULL;
+  char* order_pos = strstr(lower_sql, " order by ");
+  if (order_pos) {
+    order_part = arena_strndup(arena, cpy + (order_pos - lower_sql) + 10,
+                               strlen(order_pos + 10));
+    *order_pos = '\0';
+  }
+  char* group_part = NULL;
+  char* group_pos = strstr(lower_sql, " group by ");
+  if (group_pos) {
+    group_part = arena_strndup(arena, cpy + (group_pos - lower_sql) + 10,
+                               strlen(group_pos + 10));
+    *group_pos = '\0';
+  }
+
+  // parse where clause
+  char* where_pos = strstr(lower_sql, " where ");
+  size_t table_name_length = 0;
+  if (where_pos) {
+    table_name_length = where_pos - (from_pos + 6);
+  } else {
+    table_name_length = strlen(from_pos + 6);
+  }
+
+  char* table_name = arena_strndup(arena, from_pos + 6, table_name_length);
+  trim(table_name);
+
+  // A join is scanned through its own tables, and its columns and where
+  // clause refer to the joined rows
+  Table* table = NULL;
+  PrepareResult table_result = PREPARE_TABLE_NOT_FOUND;
+  if (strstr(table_name, " join ") != NULL) {
+    table_result = parse_join(table_name, schema, statement, select_statement);
+    table = select_statement->joined;
+  } else {
+    table = schema_open_table(schema, table_name);
+    statement->table = table;
+  }
+  if (table == NULL) {
+    return table_result;
+  }
+
+  // check whether the columns are all valid
+  select_statement->num_columns = num_columns;
+  select_statement->columns =
+      arena_alloc(arena, sizeof(ColumnDefinition) * num_columns);
+  Aggregate* aggregates = arena_calloc(arena, num_columns, sizeof(Aggregate));
+  select_statement->aggregates = aggregates;
+  bool has_aggregates = group_part != NULL;
+  for (uint32_t i = 0; i < num_columns; i++) {
+    char* name = columns[i];
+    AggregateFunction function = parse_aggregate(columns[i], &name);
+    aggregates[i].function = function;
+    has_aggregates = has_aggregates || function != AGGREGATE_NONE;
+
+    ColumnDefinition* column = NULL;
+    if (function == AGGREGATE_COUNT && strcmp(name, "*") == 0) {
+      column = &table->columns[0];
+    } else {
+      PrepareResult column_result = prepare_column(table, name, &column);
+      if (column_result != PREPARE_SUCCESS) {
+        return column_result;
+      }
+    }
+    if (function > AGGREGATE_COUNT && column->type == VARCHAR) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    select_statement->columns[i] = *column;
+  }
+  if (has_aggregates) {
+    PrepareResult group_result =
+        parse_group_by(group_part, table, select_statement, arena);
+    if (group_result != PREPARE_SUCCESS) {
+      return group_result;
+    }
+  } else {
+    select_statement->aggregates = NULL;
+  }
+
+  // Aggregates and joins are not sorted or limited
+  if ((order_part != NULL || limit_part != NULL) &&
+      (has_aggregates || select_statement->joined != NULL)) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  if (order_part != NULL) {
+    PrepareResult order_result =
+        parse_order_by(order_part, table, select_statement, arena);
+    if (order_result != PREPARE_SUCCESS) {
+      return order_result;
+    }
+  }
+  if (limit_part != NULL) {
+    PrepareResult limit_result = parse_limit(limit_part, select_statement);
+    if (limit_result != PREPARE_SUCCESS) {
+      return limit_result;
+    }
+  }
+
+  if (where_pos) {
+    WhereClause* where_clause = arena_alloc(arena, sizeof(WhereClause));
+    char* where_part = arena_strdup(arena, where_pos + 7);
+    PrepareResult prepare_result =
+        parse_where_clause(where_part, where_clause, table, statement);
+    if (prepare_result != PREPARE_SUCCESS) {
+      return prepare_result;
+    }
+
+    select_statement->where_clause = where_clause;
+  }
+
+  statement->statementDetail = select_statement;
+
+  return PREPARE_SUCCESS;
+}
+
+// CREATE INDEX <name> ON <table>(<column>)
+PrepareResult prepare_create_index(InputBuffer* input_buffer,
+                                   Statement* statement, Schema* schema) {
+  char name[MAX_NAME_LENGTH];
+  char table_name[MAX_NAME_LENGTH];
+  char column_name[MAX_NAME_LENGTH];
+  int end = 0;
+  if (sscanf(input_buffer->buffer,
+             "create index %255s on %255[^( ] ( %255[^) ] ) %n", name,
+             table_name, column_name, &end) != 3 ||
+      input_buffer->buffer[end] != '\0') {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  // The name is part of the index's file name
+  for (char* c = name; *c != '\0'; c++) {
+    if (!isalnum(*c) && *c != '_') {
+      return PREPARE_SYNTAX_ERROR;
+    }
+  }
+
+  Table* table = schema_open_table(schema, table_name);
+  if (table == NULL) {
+    return PREPARE_TABLE_NOT_FOUND;
+  }
+  ColumnDefinition* column = table_find_column(table, column_name);
+  if (column == NULL) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+
+  CreateIndexStatement* create_index =
+      arena_alloc(statement->arena, sizeof(CreateIndexStatement));
+  create_index->name = arena_strdup(statement->arena, name);
+  create_index->column = column;
+  statement->type = STATEMENT_CREATE_INDEX;
+  statement->table = table;
+  statement->statementDetail = create_index;
+  return PREPARE_SUCCESS;
+}
+
+// CREATE TABLE <name> (<column> int|real|varchar(<size>) [key], ...)
+// [rows|pax] [compressed] [mmap]
+PrepareResult prepare_create_table(InputBuffer* input_buffer,
+                                   Statement* statement) {
+  char name[MAX_NAME_LENGTH];
+  int start = 0;
+  if (sscanf(input_buffer->buffer, "create table %255[A-Za-z0-9_] ( %n", name,
+             &start) != 1 ||
+      start == 0) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+
+  Table* definition = arena_calloc(statement->arena, 1, sizeof(Table));
+  definition->table_name = arena_strdup(statement->arena, name);
+  definition->layout = LAYOUT_ROWS;
+  definition->flags = TABLE_FLAG_CREATED;
+  uint32_t key = UINT32_MAX;
+  char* cursor = input_buffer->buffer + start;
+  while (true) {
+    char column_name[MAX_NAME_LENGTH];
+    char type[16];
+    int end = 0;
+    if (sscanf(cursor, " %255[A-Za-z0-9_] %15[a-z] %n", column_name, type,
+               &end) != 2 ||
+        end == 0) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    cursor += end;
+    ColumnDefinition column = {0};
+    column.name = arena_strdup(statement->arena, column_name);
+    if (strcmp(type, "int") == 0) {
+      column.type = INTEGER;
+      column.size = sizeof(int);
+    } else if (strcmp(type, "real") == 0) {
+      column.type = REAL;
+      column.size = sizeof(double);
+    } else if (strcmp(type, "varchar") == 0) {
+      column.type = VARCHAR;
+      if (sscanf(cursor, "( %u ) %n", &column.size, &end) != 1 || end == 0 ||
+          column.size == 0 || column.size > VARCHAR_MAX_SIZE) {
+        return PREPARE_SYNTAX_ERROR;
+      }
+      cursor += end;
+    } else {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    for (uint32_t j = 0; j < definition->num_columns; j++) {
+      if (strcmp(definition->columns[j].name, column.name) == 0) {
+        return PREPARE_SYNTAX_ERROR;
+      }
+    }
+    if (strncmp(cursor, "key", 3) == 0 && !isalnum(cursor[3])) {
+      if (column.type != INTEGER || key != UINT32_MAX) {
+        return PREPARE_SYNTAX_ERROR;
+      }
+      key = definition->num_columns;
+      cursor += 3;
+      while (isspace(*cursor)) {
+        cursor++;
+      }
+    }
+    definition->columns = arena_realloc(
+        statement->arena, definition->columns,
+        definition->num_columns * sizeof(ColumnDefinition),
+        (definition->num_columns + 1) * sizeof(ColumnDefinition));
+    definition->columns[definition->num_columns++] = column;
+
+    if (*cursor == ')') {
+      cursor++;
+      break;
+    }
+    if (*cursor != ',') {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    cursor++;
+  }
+  if (key != UINT32_MAX) {
+    definition->key_column = &definition->columns[key];
+  }
+
+  char* save_ptr = NULL;
+  for (char* option = strtok_r(cursor, " ", &save_ptr); option != NULL;
+       option = strtok_r(NULL, " ", &save_ptr)) {
+    if (strcmp(option, "rows") == 0) {
+      definition->layout = LAYOUT_ROWS;
+    } else if (strcmp(option, "pax") == 0) {
+      definition->layout = LAYOUT_PAX;
+    } else if (strcmp(option, "compressed") == 0) {
+      definition->flags |= TABLE_FLAG_COMPRESSED;
+    } else if (strcmp(option, "mmap") == 0) {
+      definition->flags |= TABLE_FLAG_MMAP;
+    } else {
+      return PREPARE_SYNTAX_ERROR;
+    }
+  }
+  if (!table_define_layout(definition)) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+
+  statement->type = STATEMENT_CREATE_TABLE;
+  statement->table = NULL;
+  statement->statementDetail = definition;
+  return PREPARE_SUCCESS;
+}
+
+// ANALYZE <table>
+PrepareResult prepare_analyze(InputBuffer* input_buffer, Statement* statement,
+                              Schema* schema) {
+  char table_name[MAX_NAME_LENGTH];
+  int end = 0;
+  if (sscanf(input_buffer->buffer, "analyze %255s %n", table_name, &end) != 1 ||
+      input_buffer->buffer[end] != '\0') {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  Table* table = schema_open_table(schema, table_name);
+  if (table == NULL) {
+    return PREPARE_TABLE_NOT_FOUND;
+  }
+  statement->type = STATEMENT_ANALYZE;
+  statement->table = table;
+  statement->statementDetail = NULL;
+  return PREPARE_SUCCESS;
+}
+
+// Parses a statement into the given arena, which then holds everything the
+// statement points to
+PrepareResult parse_statement(InputBuffer* input_buffer, Statement* statement,
+                              Schema* schema, Arena* arena) {
+  statement->arena = arena;
+  statement->params = NULL;
+  statement->num_params = 0;
+  if (strncmp(input_buffer->buffer, "insert", 6) == 0) {
+    return prepare_insert(input_buffer, statement, schema);
+  }
+  if (strncmp(input_buffer->buffer, "select", 6) == 0) {
+    return prepare_select(input_buffer, statement, schema);
+  }
+  if (strncmp(input_buffer->buffer, "update", 6) == 0) {
+    return prepare_update(input_buffer, statement, schema);
+  }
+  if (strncmp(input_buffer->buffer, "delete", 6) == 0) {
+    return prepare_delete(input_buffer, statement, schema);
+  }
+  if (strncmp(input_buffer->buffer, "create index ", 13) == 0) {
+    return prepare_create_index(input_buffer, statement, schema);
+  }
+  if (strncmp(input_buffer->buffer, "create table ", 13) == 0) {
+    return prepare_create_table(input_buffer, statement);
+  }
+  if (strncmp(input_buffer->buffer, "analyze ", 8) == 0) {
+    return prepare_analyze(input_buffer, statement, schema);
+  }
+
+  return PREPARE_UNRECOGNIZED_STATEMENT;
+}
+
+// Fills the ? of a parsed statement with the given literals
+PrepareResult bind_parameters(Statement* statement, char** values,
+                              uint32_t num_values) {
+  if (num_values != statement->num_params) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  for (uint32_t i = 0; i < num_values; i++) {
+    Parameter* param = &statement->params[i];
+    PrepareResult result = PREPARE_SUCCESS;
+    switch (param->kind) {
+      case PARAMETER_ROW:
+        result = copy_value_into_row(param->column, param->target, values[i]);
+        break;
+      case PARAMETER_VALUE:
+        result = copy_value_into_bytes(param->column, param->target, values[i]);
+        break;
+      case PARAMETER_WHERE: {
+        WhereClause* where_clause = param->target;
+        result = copy_value_into_bytes(param->column, &where_clause->value,
+                                       values[i]);
+        where_decode_constant(where_clause);
+        break;
+      }
+    }
+    if (result != PREPARE_SUCCESS) {
+      return result;
+    }
+  }
+  return PREPARE_SUCCESS;
+}
+
+// Splits a comma-separated list such as the values of an insert
+char** split_list(Arena* arena, const char* list, size_t length,
+                  uint32_t* num_items) {
+  char* cpy = arena_strndup(arena, list, length);
+  char** items = NULL;
+  *num_items = 0;
+  char* outer_ptr = NULL;
+  for (char* item = strtok_r(cpy, ",", &outer_ptr); item != NULL;
+       item = strtok_r(NULL, ",", &outer_ptr)) {
+    items = arena_realloc(arena, items, *num_items * sizeof(char*),
+                          (*num_items + 1) * sizeof(char*));
+    items[*num_items] = item;
+    trim(items[(*num_items)++]);
+  }
+  return items;
+}
+
+// Replaces the literals of a statement with ?, so statements that differ
+// only in their literals share a plan. The literals are returned in order.
+char* normalize_statement(Arena* arena, const char* sql, char*** literals,
+                          uint32_t* num_literals) {
+  *literals = NULL;
+  *num_literals = 0;
+  size_t length = strlen(sql);
+  char* key = arena_alloc(arena, 2 * length + 3);
+  key[0] = '\0';
+
+  if (strncmp(sql, "insert", 6) == 0) {
+    char* lower_sql = str_to_lower(arena, sql);
+    char* values_pos = strstr(lower_sql, " values ");
+    char* values_start = values_pos ? strchr(values_pos, '(') : NULL;
+    char* values_end = strrchr(lower_sql, ')');
+    if (values_start == NULL || values_end == NULL ||
+        values_end < values_start) {
+      return NULL;
+    }
+    size_t start = values_start - lower_sql + 1;
+    size_t end = values_end - lower_sql;
+    // Multi-row inserts are bulk loads, not worth a cached plan
+    if (memchr(sql + start, ')', end - start) != NULL) {
+      return NULL;
+    }
+
+    *literals = split_list(arena, sql + start, end - start, num_literals);
+    strncat(key, sql, start);
+    for (uint32_t i = 0; i < *num_literals; i++) {
+      strcat(key, i == 0 ? "?" : ", ?");
+    }
+    strcat(key, sql + end);
+    return key;
+  }
+
+  // Elsewhere a literal is the token after a comparison operator
+  char* cpy = arena_strdup(arena, sql);
+  char* outer_ptr = NULL;
+  bool after_operator = false;
+  for (char* token = strtok_r(cpy, " ", &outer_ptr); token != NULL;
+       token = strtok_r(NULL, " ", &outer_ptr)) {
+    if (key[0] != '\0') {
+      strcat(key, " ");
+    }
+    if (after_operator && !isalpha(token[0]) && token[0] != '_') {
+      *literals = arena_realloc(arena, *literals, *num_literals * sizeof(char*),
+                                (*num_literals + 1) * sizeof(char*));
+      (*literals)[(*num_literals)++] = token;
+      strcat(key, "?");
+      after_operator = false;
+    } else {
+      strcat(key, token);
+      after_operator = (int)string_to_operator(token) != -1;
+    }
+  }
+  return key;
+}
+
+// Hashes more bytes after the ones hashed into hash already
+uint32_t hash_continue(uint32_t hash, const void* data, uint32_t length) {
+  for (uint32_t i = 0; i < length; i++) {
+    hash = (hash ^ ((const uint8_t*)data)[i]) * 16777619u;
+  }
+  return hash;
+}
+
+uint32_t hash_bytes(const void* data, uint32_t length) {
+  return hash_continue(2166136261u, data, length);
+}
+
+uint32_t hash_string(const char* str) { return hash_bytes(str, strlen(str)); }
+
+PlanCache* plan_cache_new() {
+  PlanCache* cache = malloc(sizeof(PlanCache));
+  cache->capacity = PLAN_CACHE_CAPACITY;
+  cache->plans = calloc(cache->capacity, sizeof(CachedPlan));
+  cache->num_plans = 0;
+  cache->named_plans = NULL;
+  cache->num_named_plans = 0;
+  return cache;
+}
+
+void plan_cache_clear(PlanCache* cache) {
+  for (uint32_t i = 0; i < cache->capacity; i++) {
+    if (cache->plans[i].key != NULL) {
+      arena_free(cache->plans[i].statement.arena);
+      cache->plans[i].key = NULL;
+    }
+  }
+  cache->num_plans = 0;
+}
+
+void plan_cache_free(PlanCache* cache) {
+  plan_cache_clear(cache);
+  for (uint32_t i = 0; i < cache->num_named_plans; i++) {
+    arena_free(cache->named_plans[i].statement.arena);
+  }
+  free(cache->named_plans);
+  free(cache->plans);
+  free(cache);
+}
+
+// Finds the slot of a key, or the empty slot where it would go
+CachedPlan* plan_cache_slot(PlanCache* cache, const char* key) {
+  uint32_t i = hash_string(key) % cache->capacity;
+  while (cache->plans[i].key != NULL && strcmp(cache->plans[i].key, key) != 0) {
+    i = (i + 1) % cache->capacity;
+  }
+  return &cache->plans[i];
+}
+
+NamedPlan* plan_cache_named(PlanCache* cache, const char* name) {
+  for (uint32_t i = 0; i < cache->num_named_plans; i++) {
+    if (strcmp(cache->named_plans[i].name, name) == 0) {
+      return &cache->named_plans[i];
+    }
+  }
+  return NULL;
+}
+
+void plan_cache_remove_named(PlanCache* cache, NamedPlan* plan) {
+  arena_free(plan->statement.arena);
+  *plan = cache->named_plans[--cache->num_named_plans];
+}
+
+// PREPARE <name> AS <statement>, with ? for the values bound by EXECUTE
+PrepareResult prepare_named(InputBuffer* input_buffer, Statement* statement,
+                            Session* session) {
+  char* lower_sql = str_to_lower(session->arena, input_buffer->buffer);
+  char* as_pos = strstr(lower_sql, " as ");
+  if (as_pos == NULL) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  size_t as_offset = as_pos - lower_sql;
+
+  InputBuffer body = {input_buffer->buffer + as_offset + 4, 0, 0};
+  while (isspace(*body.buffer)) {
+    body.buffer++;
+  }
+  body.input_length = strlen(body.buffer);
+
+  Statement plan;
+  Arena* arena = arena_new();
+  PrepareResult result = parse_statement(&body, &plan, session->schema, arena);
+  if (result != PREPARE_SUCCESS) {
+    arena_free(arena);
+    return result;
+  }
+
+  char* name = arena_strndup(arena, input_buffer->buffer + 8, as_offset - 8);
+  trim(name);
+  PlanCache* cache = session->plan_cache;
+  NamedPlan* existing = plan_cache_named(cache, name);
+  if (existing != NULL) {
+    plan_cache_remove_named(cache, existing);
+  }
+  cache->named_plans = realloc(cache->named_plans, (cache->num_named_plans + 1) *
+                                                       sizeof(NamedPlan));
+  cache->named_plans[cache->num_named_plans].name = name;
+  cache->named_plans[cache->num_named_plans].statement = plan;
+  cache->num_named_plans++;
+
+  statement->type = STATEMENT_PREPARE;
+  statement->table = NULL;
+  statement->statementDetail = NULL;
+  return PREPARE_SUCCESS;
+}
+
+// EXECUTE <name>(<value>, ...)
+PrepareResult execute_named(InputBuffer* input_buffer, Statement* statement,
+                            Session* session) {
+  char* args_start = strchr(input_buffer->buffer, '(');
+  char* args_end = strrchr(input_buffer->buffer, ')');
+  if (args_start == NULL || args_end == NULL || args_end < args_start) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+
+  char* name = arena_strndup(session->arena, input_buffer->buffer + 8,
+                             args_start - (input_buffer->buffer + 8));
+  trim(name);
+  NamedPlan* plan = plan_cache_named(session->plan_cache, name);
+  if (plan == NULL) {
+    return PREPARE_STATEMENT_NOT_FOUND;
+  }
+
+  uint32_t num_args = 0;
+  char** args = split_list(session->arena, args_start + 1,
+                           args_end - args_start - 1, &num_args);
+  PrepareResult result = bind_parameters(&plan->statement, args, num_args);
+  *statement = plan->statement;
+  return result;
+}
+
+// Statements that are not cached are parsed into the session's arena,
+// cached plans into their own
+PrepareResult prepare_statement(InputBuffer* input_buffer, Statement* statement,
+                                Session* session) {
+  Schema* schema = session->schema;
+  if (strncasecmp(input_buffer->buffer, "prepare ", 8) == 0) {
+    return prepare_named(input_buffer, statement, session);
+  }
+  if (strncasecmp(input_buffer->buffer, "execute ", 8) == 0) {
+    return execute_named(input_buffer, statement, session);
+  }
+  if (strncasecmp(input_buffer->buffer, "deallocate ", 11) == 0) {
+    char* name = arena_strdup(session->arena, input_buffer->buffer + 11);
+    trim(name);
+    NamedPlan* plan = plan_cache_named(session->plan_cache, name);
+    if (plan == NULL) {
+      return PREPARE_STATEMENT_NOT_FOUND;
+    }
+    plan_cache_remove_named(session->plan_cache, plan);
+    statement->type = STATEMENT_PREPARE;
+    statement->table = NULL;
+    statement->statementDetail = NULL;
+    return PREPARE_SUCCESS;
+  }
+  const char* keywords[] = {"begin", "commit", "rollback"};
+  StatementType types[] = {STATEMENT_BEGIN, STATEMENT_COMMIT,
+                           STATEMENT_ROLLBACK};
+  for (uint32_t i = 0; i < 3; i++) {
+    if (strcasecmp(input_buffer->buffer, keywords[i]) == 0) {
+      statement->type = types[i];
+      statement->table = NULL;
+      statement->statementDetail = NULL;
+      return PREPARE_SUCCESS;
+    }
+  }
+
+  char** literals = NULL;
+  uint32_t num_literals = 0;
+  char* key = normalize_statement(session->arena, input_buffer->buffer,
+                                  &literals, &num_literals);
+  if (key == NULL) {
+    return parse_statement(input_buffer, statement, schema, session->arena);
+  }
+
+  PlanCache* cache = session->plan_cache;
+  CachedPlan* plan = plan_cache_slot(cache, key);
+  if (plan->key == NULL) {
+    InputBuffer normalized = {key, strlen(key), 0};
+    Statement parsed;
+    Arena* arena = arena_new();
+    PrepareResult result = parse_statement(&normalized, &parsed, schema, arena);
+    if (result == PREPARE_SUCCESS && parsed.num_params != num_literals) {
+      // A literal the parser does not treat as a value; skip the cache
+      arena_free(arena);
+      return parse_statement(input_buffer, statement, schema, session->arena);
+    }
+    if (result != PREPARE_SUCCESS) {
+      arena_free(arena);
+      return result;
+    }
+
+    if (cache->num_plans >= cache->capacity / 2) {
+      plan_cache_clear(cache);
+      plan = plan_cache_slot(cache, key);
+    }
+    plan->key = arena_strdup(arena, key);
+    plan->statement = parsed;
+    cache->num_plans++;
+  }
+
+  PrepareResult result = bind_parameters(&plan->statement, literals, num_literals);
+  *statement = plan->statement;
+  return result;
+}
+
+// Inserts rows stored one after another. One cursor is reused for all of
+// them, so each page is pinned once for the rows that land in it.
+ExecuteResult table_insert_rows(Table* table, char* rows, uint32_t num_rows) {
+  ExecuteResult result = EXECUTE_SUCCESS;
+  Cursor* cursor = table_row(table, 0);
+  for (uint32_t i = 0; i < num_rows; i++) {
+    if (table->num_rows >= table->max_rows) {
+      result = EXECUTE_TABLE_FULL;
+      break;
+    }
+
+    Row row = {rows + i * table->row_size, table->row_size};
+    cursor->row_num = table_allocate_row(table);
+    cursor_insert_row(cursor, &row);
+    index_row(table, cursor, true);
+    zone_add_row(table, cursor_rows(cursor), cursor_slot(cursor),
+                 row_page_num(table, cursor->row_num));
+  }
+  cursor_close(cursor);
+  table_write_header(table);
+
+  return result;
+}
+
+ExecuteResult execute_insert(Statement* statement) {
+  InsertStatement* insert_statement = statement->statementDetail;
+  return table_insert_rows(statement->table, insert_statement->rows.data,
+                           insert_statement->num_rows);
+}
+
+// Rows are formatted here and written with one fwrite, or a few when they
+// do not fit
+typedef struct {
+  FILE* file;
+  uint32_t length;
+  char data[DEFAULT_PAGE_SIZE];
+} RowBuffer;
+
+// The longest text of a value: a double printed with %f can take 317 chars
+#define MAX_REAL_TEXT_LENGTH 320
+#define MAX_INT_TEXT_LENGTH 20
+
+// A binary value of this length is NULL and has no bytes
+#define BINARY_NULL_LENGTH UINT16_MAX
+
+void row_buffer_flush(RowBuffer* buffer) {
+  fwrite(buffer->data, 1, buffer->length, buffer->file);
+  buffer->length = 0;
+}
+
+char* row_buffer_reserve(RowBuffer* buffer, uint32_t length) {
+  if (buffer->length + length > sizeof(buffer->data)) {
+    row_buffer_flush(buffer);
+  }
+  return buffer->data + buffer->length;
+}
+
+void row_buffer_append(RowBuffer* buffer, const void* data, uint32_t length) {
+  if (length > sizeof(buffer->data)) {
+    row_buffer_flush(buffer);
+    fwrite(data, 1, length, buffer->file);
+    return;
+  }
+  memcpy(row_buffer_reserve(buffer, length), data, length);
+  buffer->length += length;
+}
+
+void row_buffer_append_int(RowBuffer* buffer, int64_t value) {
+  char* destination = row_buffer_reserve(buffer, MAX_INT_TEXT_LENGTH);
+  char digits[MAX_INT_TEXT_LENGTH];
+  uint32_t num_digits = 0;
+  uint64_t magnitude = value < 0 ? -(uint64_t)value : (uint64_t)value;
+  do {
+    digits[num_digits++] = '0' + magnitude % 10;
+    magnitude /= 10;
+  } while (magnitude != 0);
+  uint32_t length = 0;
+  if (value < 0) {
+    destination[length++] = '-';
+  }
+  while (num_digits > 0) {
+    destination[length++] = digits[--num_digits];
+  }
+  buffer->length += length;
+}
+
+void row_buffer_append_real(RowBuffer* buffer, double value) {
+  char* destination = row_buffer_reserve(buffer, MAX_REAL_TEXT_LENGTH);
+  buffer->length +=
+      snprintf(destination, MAX_REAL_TEXT_LENGTH, "%f", value);
+}
+
+uint32_t varchar_length(ColumnDefinition* column, void* data) {
+  if (column->overflow != NULL) {
+    return varchar_cell_length(data);
+  }
+  // Strings fill their column when they are exactly column->size long
+  return strnlen(data, column->size);
+}
+
+// Appends a string without its padding, streaming it from its overflow file
+void row_buffer_append_varchar(RowBuffer* buffer, ColumnDefinition* column,
+                               void* data) {
+  uint32_t length = varchar_length(column, data);
+  if (column->overflow == NULL) {
+    row_buffer_append(buffer, data, length);
+    return;
+  }
+  if (length <= VARCHAR_INLINE_SIZE) {
+    row_buffer_append(buffer, data + VARCHAR_LENGTH_SIZE, length);
+    return;
+  }
+  uint64_t offset = varchar_cell_overflow(data);
+  while (length > 0) {
+    uint32_t chunk = overflow_chunk_length(offset, length);
+    uint32_t page_num = offset / page_size;
+    row_buffer_append(
+        buffer, pager_pin(column->overflow, page_num) + offset % page_size,
+        chunk);
+    pager_unpin(column->overflow, page_num);
+    offset += chunk;
+    length -= chunk;
+  }
+}
+
+// Appends a value straight from page memory
+void row_buffer_append_value(RowBuffer* buffer, ColumnDefinition* column,
+                             void* data) {
+  if (column->type == INTEGER) {
+    int value;
+    memcpy(&value, data, sizeof(int));
+    row_buffer_append_int(buffer, value);
+  } else if (column->type == VARCHAR) {
+    row_buffer_append_varchar(buffer, column, data);
+  } else if (column->type == REAL) {
+    double value;
+    memcpy(&value, data, sizeof(double));
+    row_buffer_append_real(buffer, value);
+  }
+}
+
+/*
+ * Binary results are length-prefixed. Each row is a uint32_t length followed
+ * by its values, each a uint16_t length and the bytes of the value: ints and
+ * reals as stored in the page and strings without their padding. Aggregates
+ * are 8-byte integers, or doubles for real columns and avg. A row of length
+ * 0 ends the result. Lengths and numbers are in the machine's byte order.
+ */
+uint16_t binary_value_length(ColumnDefinition* column, void* data) {
+  return column->type == VARCHAR ? varchar_length(column, data) : column->size;
+}
+
+void row_buffer_append_binary(RowBuffer* buffer, const void* data,
+                              uint16_t length) {
+  row_buffer_append(buffer, &length, sizeof(uint16_t));
+  if (length != BINARY_NULL_LENGTH) {
+    row_buffer_append(buffer, data, length);
+  }
+}
+
+void row_buffer_append_binary_value(RowBuffer* buffer,
+                                    ColumnDefinition* column, void* data) {
+  if (column->type != VARCHAR) {
+    row_buffer_append_binary(buffer, data, column->size);
+    return;
+  }
+  uint16_t length = varchar_length(column, data);
+  row_buffer_append(buffer, &length, sizeof(uint16_t));
+  row_buffer_append_varchar(buffer, column, data);
+}
+
+void print_columns(Output* out, void* rows, uint32_t slot,
+                   ColumnDefinition* columns, uint32_t num_columns) {
+  RowBuffer buffer;
+  buffer.file = out->file;
+  buffer.length = 0;
+  if (out->mode == OUTPUT_BINARY) {
+    uint32_t length = 0;
+    for (uint32_t i = 0; i < num_columns; i++) {
+      length += sizeof(uint16_t) +
+                binary_value_length(&columns[i],
+                                    column_value(rows, slot, &columns[i]));
+    }
+    row_buffer_append(&buffer, &length, sizeof(uint32_t));
+    for (uint32_t i = 0; i < num_columns; i++) {
+      row_buffer_append_binary_value(&buffer, &columns[i],
+                                     column_value(rows, slot, &columns[i]));
+    }
+    row_buffer_flush(&buffer);
+    return;
+  }
+
+  row_buffer_append(&buffer, "(", 1);
+  for (uint32_t i = 0; i < num_columns; i++) {
+    row_buffer_append_value(&buffer, &columns[i],
+                            column_value(rows, slot, &columns[i]));
+    if (i < num_columns - 1) {
+      row_buffer_append(&buffer, ", ", 2);
+    }
+  }
+  row_buffer_append(&buffer, ")\n", 2);
+  row_buffer_flush(&buffer);
+}
+
+void print_row(Output* out, void* rows, uint32_t slot, Table* table,
+               SelectStatement* select_statement) {
+  if (select_statement->is_select_all) {
+    print_columns(out, rows, slot, table->columns, table->num_columns);
+  } else {
+    print_columns(out, rows, slot, select_statement->columns,
+                  select_statement->num_columns);
+  }
+}
+
+bool valid_where_clause(void* rows, uint32_t slot, WhereClause* where_clause) {
+  return where_clause->matches(rows, slot, where_clause);
+}
+
+uint32_t table_num_data_pages(Table* table) {
+  return (table->num_rows + table->rows_per_page - 1) / table->rows_per_page;
+}
+
+ColumnStatistics* column_statistics(Table* table, ColumnDefinition* column) {
+  if (table->statistics == NULL) {
+    return NULL;
+  }
+  return &table->statistics->columns[column - table->columns];
+}
+
+// Rows of the table holding each value of a column
+double rows_per_value(Table* table, ColumnDefinition* column) {
+  double num_rows = table->num_live_rows > 0 ? table->num_live_rows : 1;
+  ColumnStatistics* statistics = column_statistics(table, column);
+  if (column == table->key_column) {
+    return 1;
+  }
+  if (statistics != NULL) {
+    return num_rows / (statistics->num_distinct > 1 ? statistics->num_distinct
+                                                    : 1);
+  }
+  return num_rows < DEFAULT_ROWS_PER_KEY ? num_rows : DEFAULT_ROWS_PER_KEY;
+}
+
+// Share of the rows with a value below the given one, interpolated
+// within the histogram's buckets
+double histogram_fraction(ColumnStatistics* statistics, double value) {
+  double* bounds = statistics->bounds;
+  if (value <= bounds[0]) {
+    return 0;
+  }
+  for (uint32_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    if (value < bounds[i + 1]) {
+      return (i + (value - bounds[i]) / (bounds[i + 1] - bounds[i])) /
+             HISTOGRAM_BUCKETS;
+    }
+  }
+  return 1;
+}
+
+// Estimates the share of a table's rows that satisfy a where clause. The
+// parts of and/or are taken to be independent.
+double clause_selectivity(Table* table, WhereClause* where_clause) {
+  if (where_clause == NULL) {
+    return 1;
+  }
+  if (where_clause->matches == where_and) {
+    return clause_selectivity(table, where_clause->left) *
+           clause_selectivity(table, where_clause->right);
+  }
+  if (where_clause->matches == where_or) {
+    double left = clause_selectivity(table, where_clause->left);
+    double right = clause_selectivity(table, where_clause->right);
+    return left + right - left * right;
+  }
+
+  ColumnDefinition* column = where_clause->column;
+  double num_rows = table->num_live_rows > 0 ? table->num_live_rows : 1;
+  double equal = rows_per_value(table, column) / num_rows;
+  ColumnStatistics* statistics = column_statistics(table, column);
+  if (statistics == NULL || !statistics->has_range) {
+    switch (where_clause->op) {
+      case OP_EQUAL:
+        return equal;
+      case OP_NOT_EQUAL:
+        return 1 - equal;
+      default:
+        return DEFAULT_RANGE_SELECTIVITY;
+    }
+  }
+
+  double value = column->type == INTEGER ? where_clause->int_value
+                                         : where_clause->real_value;
+  if (value < statistics->bounds[0] ||
+      value > statistics->bounds[HISTOGRAM_BUCKETS]) {
+    equal = 0;
+  }
+  double below = histogram_fraction(statistics, value);
+  double selectivity = 0;
+  switch (where_clause->op) {
+    case OP_EQUAL:
+      selectivity = equal;
+      break;
+    case OP_NOT_EQUAL:
+      selectivity = 1 - equal;
+      break;
+    case OP_LESS_THAN:
+      selectivity = below;
+      break;
+    case OP_LESS_THAN_OR_EQUAL:
+      selectivity = below + equal;
+      break;
+    case OP_GREATER_THAN:
+      selectivity = 1 - below - equal;
+      break;
+    case OP_GREATER_THAN_OR_EQUAL:
+      selectivity = 1 - below;
+      break;
+  }
+  return selectivity < 0 ? 0 : selectivity > 1 ? 1 : selectivity;
+}
+
+double scan_cost(Table* table) {
+  return table_num_data_pages(table) + table->num_live_rows * CPU_ROW_COST;
+}
+
+// Cost of fetching rows found through the index on a column. Rows of a
+// correlated column are read a page at a time in file order, others from
+// pages all over the table.
+double index_fetch_cost(Table* table, ColumnDefinition* column,
+                        double num_matches) {
+  ColumnStatistics* statistics = column_statistics(table, column);
+  double correlation = 0;
+  if (statistics != NULL && statistics->has_range) {
+    correlation = statistics->correlation;
+  } else if (statistics == NULL && column == table->key_column) {
+    // Rows are usually inserted in key order
+    correlation = 1;
+  }
+  double num_pages = table_num_data_pages(table);
+  double sequential = num_matches / table->rows_per_page;
+  double random =
+      (num_matches < num_pages ? num_matches : num_pages) * RANDOM_PAGE_COST;
+  double weight = correlation * correlation;
+  return INDEX_PROBE_COST + weight * sequential + (1 - weight) * random +
+         num_matches * CPU_ROW_COST;
+}
+
+// The keys an index lookup reads: the bounds that every comparison and-ed
+// into the where clause puts on one column, with the comparisons that set
+// the bounds, or NULL when a side is unbounded
+typedef struct {
+  IndexKey low;
+  IndexKey high;
+  WhereClause* lower;
+  WhereClause* upper;
+} KeyRange;
+
+// Narrows a range to the comparisons on column that every matching row
+// must satisfy
+void key_range_narrow(KeyRange* range, WhereClause* where_clause,
+                      ColumnDefinition* column) {
+  if (where_clause->matches == where_and) {
+    key_range_narrow(range, where_clause->left, column);
+    key_range_narrow(range, where_clause->right, column);
+    return;
+  }
+  if (where_clause->matches == where_or || where_clause->column != column) {
+    return;
+  }
+  // Strings are indexed by hash, which only finds equal values
+  if (column->type == VARCHAR && where_clause->op != OP_EQUAL) {
+    return;
+  }
+
+  IndexKey value;
+  if (column->type == VARCHAR) {
+    uint32_t length = where_clause->value.length < column->size
+                          ? where_clause->value.length
+                          : column->size;
+    value = hash_bytes(where_clause->value.data,
+                       strnlen(where_clause->value.data, length));
+  } else {
+    value = column_key(column, where_clause->value.data);
+  }
+
+  // Rows are checked against the clause again, so the bounds only need to
+  // hold every match
+  IndexKey low = INT64_MIN;
+  IndexKey high = INT64_MAX;
+  switch (where_clause->op) {
+    case OP_EQUAL:
+      low = high = value;
+      break;
+    case OP_GREATER_THAN:
+      low = value < INT64_MAX ? value + 1 : value;
+      break;
+    case OP_GREATER_THAN_OR_EQUAL:
+      low = value;
+      break;
+    case OP_LESS_THAN:
+      high = value > INT64_MIN ? value - 1 : value;
+      break;
+    case OP_LESS_THAN_OR_EQUAL:
+      high = value;
+      break;
+    case OP_NOT_EQUAL:
+      return;
+  }
+  if (low != INT64_MIN && (range->lower == NULL || low > range->low)) {
+    range->low = low;
+    range->lower = where_clause;
+  }
+  if (high != INT64_MAX && (range->upper == NULL || high < range->high)) {
+    range->high = high;
+    range->upper = where_clause;
+  }
+}
+
+KeyRange key_range(WhereClause* where_clause, ColumnDefinition* column) {
+  KeyRange range = {INT64_MIN, INT64_MAX, NULL, NULL};
+  key_range_narrow(&range, where_clause, column);
+  return range;
+}
+
+// Estimates the share of a table's rows within a key range. The two sides
+// of a range overlap, so with a histogram their shares are added and the
+// rows outside both taken away.
+double key_range_selectivity(Table* table, ColumnDefinition* column,
+                             KeyRange* range) {
+  if (range->lower == NULL || range->upper == NULL ||
+      range->lower == range->upper) {
+    return clause_selectivity(table, range->lower != NULL ? range->lower
+                                                          : range->upper);
+  }
+  if (range->low > range->high) {
+    return 0;
+  }
+  double lower = clause_selectivity(table, range->lower);
+  double upper = clause_selectivity(table, range->upper);
+  ColumnStatistics* statistics = column_statistics(table, column);
+  if (statistics == NULL || !statistics->has_range) {
+    return lower * upper;
+  }
+  double selectivity = lower + upper - 1;
+  return selectivity > 0 ? selectivity : 0;
+}
+
+// Finds the cheapest comparison on an indexed column that every matching
+// row of the clause root must satisfy, and sets cost to the cost of looking
+// up the range that all such comparisons on its column bound
+WhereClause* cheapest_index_predicate(Table* table, WhereClause* root,
+                                      WhereClause* where_clause,
+                                      double* cost) {
+  if (where_clause == NULL) {
+    return NULL;
+  }
+  if (where_clause->matches == where_and) {
+    double left_cost = 0;
+    double right_cost = 0;
+    WhereClause* left = cheapest_index_predicate(
+        table, root, where_clause->left, &left_cost);
+    WhereClause* right = cheapest_index_predicate(
+        table, root, where_clause->right, &right_cost);
+    if (left == NULL || (right != NULL && right_cost < left_cost)) {
+      *cost = right_cost;
+      return right;
+    }
+    *cost = left_cost;
+    return left;
+  }
+  if (where_clause->matches == where_or || where_clause->op == OP_NOT_EQUAL ||
+      table_column_index(table, where_clause->column) == NULL) {
+    return NULL;
+  }
+  // Strings are indexed by hash, which only finds equal values
+  if (where_clause->column->type == VARCHAR && where_clause->op != OP_EQUAL) {
+    return NULL;
+  }
+  KeyRange range = key_range(root, where_clause->column);
+  double num_matches =
+      key_range_selectivity(table, where_clause->column, &range) *
+      table->num_live_rows;
+  *cost = index_fetch_cost(table, where_clause->column, num_matches);
+  return where_clause;
+}
+
+// Picks the comparison whose rows are looked up in an index and checked
+// against the rest of the clause, or NULL when scanning the table is
+// estimated to be cheaper. Runs once the statement's values are bound, so
+// prepared and cached plans are costed with the values they run with.
+WhereClause* index_predicate(Table* table, WhereClause* where_clause) {
+  double cost = 0;
+  WhereClause* predicate =
+      cheapest_index_predicate(table, where_clause, where_clause, &cost);
+  if (predicate == NULL || cost >= scan_cost(table)) {
+    return NULL;
+  }
+  return predicate;
+}
+
+// Collects the rows in the key range that the where clause bounds on the
+// column of an index predicate, in key order
+uint32_t* index_lookup(Table* table, WhereClause* where_clause,
+                       WhereClause* predicate, uint32_t* num_matches) {
+  ColumnDefinition* column = predicate->column;
+  KeyRange range = key_range(where_clause, column);
+  IndexKey low = range.low;
+  IndexKey high = range.high;
+
+  ProfileOperator* step = profile_begin("Index lookup", table);
+  uint32_t capacity = 16;
+  uint32_t* row_nums = malloc(capacity * sizeof(uint32_t));
+  *num_matches = 0;
+
+  IndexEntry start = {low, 0};
+  IndexCursor* cursor = index_find(table_column_index(table, column), start);
+  while (!(cursor->end_of_index)) {
+    IndexEntry entry = index_cursor_entry(cursor);
+    if (entry.key > high) {
+      break;
+    }
+    if (*num_matches == capacity) {
+      capacity *= 2;
+      row_nums = realloc(row_nums, capacity * sizeof(uint32_t));
+    }
+    row_nums[(*num_matches)++] = entry.row_num;
+    index_cursor_advance(cursor);
+  }
+  free(cursor);
+  profile_end(step, *num_matches);
+
+  return row_nums;
+}
+
+typedef struct {
+  uint64_t count;
+  // Sums, minimums and maximums of int columns
+  int64_t int_value;
+  // Sums, minimums and maximums of real columns
+  double real_value;
+} AggregateState;
+
+// Groups are found through an open-addressing table of group numbers. The
+// keys and aggregate states of group g are at keys[g] and states[g].
+typedef struct {
+  SelectStatement* select_statement;
+  uint32_t key_size;
+  uint32_t* key_offsets;
+  char* key;
+  uint32_t* slots;
+  uint32_t num_slots;
+  char* keys;
+  uint32_t* hashes;
+  AggregateState* states;
+  // The first row of each group, to merge parallel scans in table order
+  uint32_t* first_rows;
+  uint32_t num_groups;
+  uint32_t groups_capacity;
+  // The slots of the batch being aggregated, and the group of each. Slot s
+  // of the batch is row base_row + s.
+  uint32_t base_row;
+  uint32_t* selected;
+  uint32_t* selected_groups;
+  uint32_t num_selected;
+} Aggregation;
+
+AggregateState* aggregation_state(Aggregation* aggregation, uint32_t group,
+                                  uint32_t column) {
+  SelectStatement* select_statement = aggregation->select_statement;
+  return &aggregation
+              ->states[group * select_statement->num_columns + column];
+}
+
+uint32_t aggregation_add_group(Aggregation* aggregation, uint32_t hash,
+                               uint32_t first_row) {
+  uint32_t num_columns = aggregation->select_statement->num_columns;
+  if (aggregation->num_groups == aggregation->groups_capacity) {
+    aggregation->groups_capacity *= 2;
+    aggregation->keys = realloc(
+        aggregation->keys, aggregation->groups_capacity * aggregation->key_size);
+    aggregation->hashes = realloc(aggregation->hashes,
+                                  aggregation->groups_capacity * sizeof(uint32_t));
+    aggregation->first_rows =
+        realloc(aggregation->first_rows,
+                aggregation->groups_capacity * sizeof(uint32_t));
+    aggregation->states =
+        realloc(aggregation->states, aggregation->groups_capacity *
+                                         num_columns * sizeof(AggregateState));
+  }
+
+  uint32_t group = aggregation->num_groups++;
+  memcpy(aggregation->keys + group * aggregation->key_size, aggregation->key,
+         aggregation->key_size);
+  aggregation->hashes[group] = hash;
+  aggregation->first_rows[group] = first_row;
+  memset(aggregation_state(aggregation, group, 0), 0,
+         num_columns * sizeof(AggregateState));
+  return group;
+}
+
+void aggregation_rehash(Aggregation* aggregation) {
+  memset(aggregation->slots, 0xff, aggregation->num_slots * sizeof(uint32_t));
+  for (uint32_t group = 0; group < aggregation->num_groups; group++) {
+    uint32_t i = aggregation->hashes[group] & (aggregation->num_slots - 1);
+    while (aggregation->slots[i] != UINT32_MAX) {
+      i = (i + 1) & (aggregation->num_slots - 1);
+    }
+    aggregation->slots[i] = group;
+  }
+}
+
+void aggregation_grow(Aggregation* aggregation) {
+  aggregation->num_slots *= 2;
+  aggregation->slots =
+      realloc(aggregation->slots, aggregation->num_slots * sizeof(uint32_t));
+  aggregation_rehash(aggregation);
+}
+
+// Finds the group of the key in aggregation->key, adding it when it is new
+uint32_t aggregation_find(Aggregation* aggregation, uint32_t hash,
+                          uint32_t first_row) {
+  uint32_t i = hash & (aggregation->num_slots - 1);
+  while (aggregation->slots[i] != UINT32_MAX) {
+    uint32_t group = aggregation->slots[i];
+    if (aggregation->hashes[group] == hash &&
+        memcmp(aggregation->keys + group * aggregation->key_size,
+               aggregation->key, aggregation->key_size) == 0) {
+      // A worker that steals morsels sees them out of order
+      if (first_row < aggregation->first_rows[group]) {
+        aggregation->first_rows[group] = first_row;
+      }
+      return group;
+    }
+    i = (i + 1) & (aggregation->num_slots - 1);
+  }
+
+  uint32_t group = aggregation_add_group(aggregation, hash, first_row);
+  aggregation->slots[i] = group;
+  if (2 * aggregation->num_groups > aggregation->num_slots) {
+    aggregation_grow(aggregation);
+  }
+  return group;
+}
+
+// Finds the group of a row, adding it when it is new
+uint32_t aggregation_group(Aggregation* aggregation, void* rows,
+                           uint32_t slot) {
+  SelectStatement* select_statement = aggregation->select_statement;
+  for (uint32_t i = 0; i < select_statement->num_group_by; i++) {
+    ColumnDefinition* column = &select_statement->group_by[i];
+    column_read(column, column_value(rows, slot, column),
+                aggregation->key + aggregation->key_offsets[i]);
+  }
+
+  uint32_t hash = hash_bytes(aggregation->key, aggregation->key_size);
+  return aggregation_find(aggregation, hash, aggregation->base_row + slot);
+}
+
+Aggregation* aggregation_new(SelectStatement* select_statement,
+                             uint32_t batch_size) {
+  Aggregation* aggregation = calloc(1, sizeof(Aggregation));
+  aggregation->select_statement = select_statement;
+  aggregation->key_offsets =
+      malloc((select_statement->num_group_by + 1) * sizeof(uint32_t));
+  for (uint32_t i = 0; i < select_statement->num_group_by; i++) {
+    aggregation->key_offsets[i] = aggregation->key_size;
+    aggregation->key_size += select_statement->group_by[i].size;
+  }
+  aggregation->key = calloc(1, aggregation->key_size + 1);
+  aggregation->num_slots = 64;
+  aggregation->slots = malloc(aggregation->num_slots * sizeof(uint32_t));
+  memset(aggregation->slots, 0xff, aggregation->num_slots * sizeof(uint32_t));
+  aggregation->groups_capacity = 16;
+  aggregation->keys =
+      malloc(aggregation->groups_capacity * (aggregation->key_size + 1));
+  aggregation->hashes = malloc(aggregation->groups_capacity * sizeof(uint32_t));
+  aggregation->first_rows =
+      malloc(aggregation->groups_capacity * sizeof(uint32_t));
+  aggregation->states =
+      malloc(aggregation->groups_capacity * select_statement->num_columns *
+             sizeof(AggregateState));
+  aggregation->selected = malloc(batch_size * sizeof(uint32_t));
+  aggregation->selected_groups = calloc(batch_size, sizeof(uint32_t));
+
+  // Without group by, all rows are in one group that exists even when no
+  // row matches
+  if (select_statement->num_group_by == 0) {
+    aggregation_add_group(aggregation, 0, 0);
+  }
+  return aggregation;
+}
+
+void aggregation_free(Aggregation* aggregation) {
+  free(aggregation->key_offsets);
+  free(aggregation->key);
+  free(aggregation->slots);
+  free(aggregation->keys);
+  free(aggregation->hashes);
+  free(aggregation->first_rows);
+  free(aggregation->states);
+  free(aggregation->selected);
+  free(aggregation->selected_groups);
+  free(aggregation);
+}
+
+// Folds one column of the selected rows into their groups' states
+#define AGGREGATE_COLUMN(name, type, field)                                  \
+  void name(Aggregation* aggregation, uint32_t column_num, void* rows) {     \
+    SelectStatement* select_statement = aggregation->select_statement;       \
+    ColumnDefinition* column = &select_statement->columns[column_num];       \
+    AggregateFunction function =                                             \
+        select_statement->aggregates[column_num].function;                  \
+    for (uint32_t i = 0; i < aggregation->num_selected; i++) {               \
+      AggregateState* state = aggregation_state(                             \
+          aggregation, aggregation->selected_groups[i], column_num);         \
+      type value;                                                            \
+      memcpy(&value, column_value(rows, aggregation->selected[i], column),   \
+             sizeof(type));                                                  \
+      if (function == AGGREGATE_MIN) {                                       \
+        if (state->count == 0 || value < state->field) state->field = value; \
+      } else if (function == AGGREGATE_MAX) {                                \
+        if (state->count == 0 || value > state->field) state->field = value; \
+      } else {                                                               \
+        state->field += value;                                               \
+      }                                                                      \
+      state->count++;                                                        \
+    }                                                                        \
+  }
+
+AGGREGATE_COLUMN(aggregate_int_column, int, int_value)
+AGGREGATE_COLUMN(aggregate_real_column, double, real_value)
+
+// Aggregates the selected slots of a batch, finding all their groups first
+// and then folding in one column at a time
+void aggregate_selected(Aggregation* aggregation, void* rows) {
+  SelectStatement* select_statement = aggregation->select_statement;
+  if (select_statement->num_group_by > 0) {
+    for (uint32_t i = 0; i < aggregation->num_selected; i++) {
+      aggregation->selected_groups[i] =
+          aggregation_group(aggregation, rows, aggregation->selected[i]);
+    }
+  }
+
+  for (uint32_t i = 0; i < select_statement->num_columns; i++) {
+    switch (select_statement->aggregates[i].function) {
+      case AGGREGATE_NONE:
+        break;
+      case AGGREGATE_COUNT:
+        for (uint32_t j = 0; j < aggregation->num_selected; j++) {
+          aggregation_state(aggregation, aggregation->selected_groups[j], i)
+              ->count++;
+        }
+        break;
+      default:
+        if (select_statement->columns[i].type == INTEGER) {
+          aggregate_int_column(aggregation, i, rows);
+        } else {
+          aggregate_real_column(aggregation, i, rows);
+        }
+        break;
+    }
+  }
+  aggregation->num_selected = 0;
+}
+
+void aggregate_row(Aggregation* aggregation, void* rows, uint32_t slot) {
+  aggregation->selected[0] = slot;
+  aggregation->num_selected = 1;
+  aggregate_selected(aggregation, rows);
+}
+
+void merge_aggregate_state(Aggregate* aggregate, ColumnDefinition* column,
+                           AggregateState* into, AggregateState* from) {
+  if (from->count == 0) {
+    return;
+  }
+  bool is_int = column->type == INTEGER;
+  bool take = into->count == 0;
+  switch (aggregate->function) {
+    case AGGREGATE_MIN:
+      take = take || (is_int ? from->int_value < into->int_value
+                             : from->real_value < into->real_value);
+      break;
+    case AGGREGATE_MAX:
+      take = take || (is_int ? from->int_value > into->int_value
+                             : from->real_value > into->real_value);
+      break;
+    case AGGREGATE_SUM:
+    case AGGREGATE_AVG:
+      into->int_value += from->int_value;
+      into->real_value += from->real_value;
+      take = false;
+      break;
+    case AGGREGATE_NONE:
+    case AGGREGATE_COUNT:
+      take = false;
+      break;
+  }
+  if (take) {
+    into->int_value = from->int_value;
+    into->real_value = from->real_value;
+  }
+  into->count += from->count;
+}
+
+// Adds the groups of another aggregation of the same statement
+void aggregation_merge(Aggregation* into, Aggregation* from) {
+  SelectStatement* select_statement = into->select_statement;
+  for (uint32_t group = 0; group < from->num_groups; group++) {
+    uint32_t into_group = 0;
+    if (select_statement->num_group_by > 0) {
+      memcpy(into->key, from->keys + group * from->key_size, from->key_size);
+      into_group =
+          aggregation_find(into, from->hashes[group], from->first_rows[group]);
+    } else if (from->first_rows[group] < into->first_rows[into_group]) {
+      into->first_rows[into_group] = from->first_rows[group];
+    }
+    for (uint32_t i = 0; i < select_statement->num_columns; i++) {
+      merge_aggregate_state(&select_statement->aggregates[i],
+                            &select_statement->columns[i],
+                            aggregation_state(into, into_group, i),
+                            aggregation_state(from, group, i));
+    }
+  }
+}
+
+typedef struct {
+  uint32_t first_row;
+  uint32_t group;
+} GroupOrder;
+
+int compare_group_orders(const void* a, const void* b) {
+  const GroupOrder* x = a;
+  const GroupOrder* y = b;
+  return (x->first_row > y->first_row) - (x->first_row < y->first_row);
+}
+
+// Puts the groups in the order of their first rows
+void aggregation_sort(Aggregation* aggregation) {
+  uint32_t num_groups = aggregation->num_groups;
+  uint32_t num_columns = aggregation->select_statement->num_columns;
+  uint32_t key_size = aggregation->key_size;
+  GroupOrder* orders = malloc(num_groups * sizeof(GroupOrder));
+  for (uint32_t i = 0; i < num_groups; i++) {
+    orders[i].first_row = aggregation->first_rows[i];
+    orders[i].group = i;
+  }
+  qsort(orders, num_groups, sizeof(GroupOrder), compare_group_orders);
+
+  char* keys = malloc(aggregation->groups_capacity * (key_size + 1));
+  uint32_t* hashes = malloc(aggregation->groups_capacity * sizeof(uint32_t));
+  AggregateState* states = malloc(aggregation->groups_capacity * num_columns *
+                                  sizeof(AggregateState));
+  for (uint32_t i = 0; i < num_groups; i++) {
+    uint32_t group = orders[i].group;
+    memcpy(keys + i * key_size, aggregation->keys + group * key_size, key_size);
+    hashes[i] = aggregation->hashes[group];
+    aggregation->first_rows[i] = orders[i].first_row;
+    memcpy(states + i * num_columns, aggregation_state(aggregation, group, 0),
+           num_columns * sizeof(AggregateState));
+  }
+  free(aggregation->keys);
+  free(aggregation->hashes);
+  free(aggregation->states);
+  free(orders);
+  aggregation->keys = keys;
+  aggregation->hashes = hashes;
+  aggregation->states = states;
+  aggregation_rehash(aggregation);
+}
+
+bool aggregate_is_null(Aggregate* aggregate, AggregateState* state) {
+  return state->count == 0 && (aggregate->function == AGGREGATE_SUM ||
+                               aggregate->function == AGGREGATE_MIN ||
+                               aggregate->function == AGGREGATE_MAX ||
+                               aggregate->function == AGGREGATE_AVG);
+}
+
+void print_aggregate(RowBuffer* buffer, OutputMode mode,
+                     ColumnDefinition* column, Aggregate* aggregate,
+                     AggregateState* state) {
+  if (aggregate_is_null(aggregate, state)) {
+    if (mode == OUTPUT_BINARY) {
+      row_buffer_append_binary(buffer, NULL, BINARY_NULL_LENGTH);
+    } else {
+      row_buffer_append(buffer, "NULL", 4);
+    }
+    return;
+  }
+
+  bool is_real = aggregate->function == AGGREGATE_AVG ||
+                 (aggregate->function != AGGREGATE_COUNT &&
+                  column->type != INTEGER);
+  int64_t int_value = aggregate->function == AGGREGATE_COUNT
+                          ? (int64_t)state->count
+                          : state->int_value;
+  double real_value = state->real_value;
+  if (aggregate->function == AGGREGATE_AVG) {
+    real_value = (column->type == INTEGER ? (double)state->int_value
+                                          : state->real_value) /
+                 state->count;
+  }
+
+  if (mode == OUTPUT_BINARY) {
+    row_buffer_append_binary(buffer, is_real ? (void*)&real_value : &int_value,
+                             sizeof(int64_t));
+  } else if (is_real) {
+    row_buffer_append_real(buffer, real_value);
+  } else {
+    row_buffer_append_int(buffer, int_value);
+  }
+}
+
+// Prints one group: key holds its grouped columns, states its aggregates
+void print_aggregate_row(Output* out, SelectStatement* select_statement,
+                         char* key, uint32_t* key_offsets,
+                         AggregateState* states) {
+  RowBuffer buffer;
+  buffer.file = out->file;
+  buffer.length = 0;
+  if (out->mode == OUTPUT_BINARY) {
+    uint32_t length = 0;
+    for (uint32_t i = 0; i < select_statement->num_columns; i++) {
+      Aggregate* aggregate = &select_statement->aggregates[i];
+      length += sizeof(uint16_t);
+      if (aggregate->function == AGGREGATE_NONE) {
+        ColumnDefinition column = select_statement->columns[i];
+        column.overflow = NULL;
+        length += binary_value_length(
+            &column, key + key_offsets[aggregate->group_column]);
+      } else if (!aggregate_is_null(aggregate, &states[i])) {
+        length += sizeof(int64_t);
+      }
+    }
+    row_buffer_append(&buffer, &length, sizeof(uint32_t));
+  } else {
+    row_buffer_append(&buffer, "(", 1);
+  }
+
+  for (uint32_t i = 0; i < select_statement->num_columns; i++) {
+    Aggregate* aggregate = &select_statement->aggregates[i];
+    // Group keys hold whole values
+    ColumnDefinition column = select_statement->columns[i];
+    column.overflow = NULL;
+    if (aggregate->function != AGGREGATE_NONE) {
+      print_aggregate(&buffer, out->mode, &column, aggregate, &states[i]);
+    } else if (out->mode == OUTPUT_BINARY) {
+      row_buffer_append_binary_value(
+          &buffer, &column, key + key_offsets[aggregate->group_column]);
+    } else {
+      row_buffer_append_value(&buffer, &column,
+                              key + key_offsets[aggregate->group_column]);
+    }
+    if (out->mode == OUTPUT_TEXT && i < select_statement->num_columns - 1) {
+      row_buffer_append(&buffer, ", ", 2);
+    }
+  }
+  if (out->mode == OUTPUT_TEXT) {
+    row_buffer_append(&buffer, ")\n", 2);
+  }
+  row_buffer_flush(&buffer);
+}
+
+void print_aggregation(Output* out, Aggregation* aggregation) {
+  for (uint32_t group = 0; group < aggregation->num_groups; group++) {
+    print_aggregate_row(out, aggregation->select_statement,
+                        aggregation->keys + group * aggregation->key_size,
+                        aggregation->key_offsets,
+                        aggregation_state(aggregation, group, 0));
+  }
+}
+
+// Fills selection with the live slots of a page that match the where
+// clause. filter is a part of the clause that can be checked a page at a time.
+void page_select(Table* table, void* page, uint32_t num_slots,
+                 WhereClause* where_clause, WhereClause* filter,
+                 uint8_t* selection) {
+  void* rows = page + table->rows_offset;
+  uint8_t* live = page_live_bitmap(page);
+  uint32_t bitmap_size = (num_slots + 7) / 8;
+  if (filter != NULL) {
+    FilterKernel kernel = filter->column->type == INTEGER ? int_filter_kernel
+                                                          : real_filter_kernel;
+    kernel(rows, num_slots, filter, selection);
+  } else {
+    memset(selection, 0xff, bitmap_size);
+  }
+
+  for (uint32_t i = 0; i < bitmap_size; i++) {
+    selection[i] &= live[i];
+    if (where_clause == NULL || filter == where_clause) {
+      continue;
+    }
+    uint8_t bits = selection[i];
+    while (bits != 0) {
+      uint32_t slot = i * 8 + __builtin_ctz(bits);
+      if (slot < num_slots && !valid_where_clause(rows, slot, where_clause)) {
+        selection[i] &= ~(1 << (slot % 8));
+      }
+      bits &= bits - 1;
+    }
+  }
+  if (num_slots % 8 != 0) {
+    selection[bitmap_size - 1] &= (1 << (num_slots % 8)) - 1;
+  }
+
+  uint64_t num_matched = 0;
+  for (uint32_t i = 0; i < bitmap_size; i++) {
+    num_matched += __builtin_popcount(selection[i]);
+  }
+  STATS_ADD(rows_scanned, *page_num_live_rows(page));
+  STATS_ADD(rows_matched, num_matched);
+}
+
+// Rows of a join are printed, or aggregated when aggregation is set.
+// Returns whether the row matched the where clause.
+bool print_joined_row(Output* out, char* joined_row,
+                      SelectStatement* select_statement,
+                      Aggregation* aggregation) {
+  WhereClause* where_clause = select_statement->where_clause;
+  if (where_clause != NULL && !valid_where_clause(joined_row, 0, where_clause)) {
+    return false;
+  }
+  if (aggregation != NULL) {
+    aggregate_row(aggregation, joined_row, 0);
+  } else {
+    print_row(out, joined_row, 0, select_statement->joined, select_statement);
+  }
+  return true;
+}
+
+// Scans the outer table and looks up each key in the inner table's index.
+// outer_row and inner_row are the parts of joined_row for each table.
+void index_nested_loop_join(Output* out, SelectStatement* select_statement,
+                            Aggregation* aggregation, Table* outer,
+                            ColumnDefinition* outer_key, Table* inner,
+                            ColumnDefinition* inner_key, char* joined_row,
+                            char* outer_row, char* inner_row) {
+  ProfileOperator* join = profile_begin("Index join", outer);
+  Pager* index = table_column_index(inner, inner_key);
+  Cursor* cursor = table_start(outer);
+  Cursor* inner_cursor = table_row(inner, 0);
+  uint64_t num_scanned = 0;
+  uint64_t num_matched = 0;
+  while (!(cursor->end_of_table)) {
+    num_scanned++;
+    void* rows = cursor_rows(cursor);
+    uint32_t slot = cursor_slot(cursor);
+    void* value = column_value(rows, slot, outer_key);
+    IndexKey key = column_key(outer_key, value);
+
+    bool copied = false;
+    IndexEntry target = {key, 0};
+    IndexCursor* index_cursor = index_find(index, target);
+    while (!(index_cursor->end_of_index)) {
+      IndexEntry entry = index_cursor_entry(index_cursor);
+      if (entry.key != key) {
+        break;
+      }
+      inner_cursor->row_num = entry.row_num;
+      if (!copied) {
+        copy_row_out(rows, slot, outer, outer_row);
+        copied = true;
+      }
+      // Strings with the same hash may still differ
+      if (outer_key->type == VARCHAR &&
+          !column_equal(inner_key, cursor_column(inner_cursor, inner_key),
+                        outer_row + outer_key->offset)) {
+        index_cursor_advance(index_cursor);
+        continue;
+      }
+      copy_row_out(cursor_rows(inner_cursor), cursor_slot(inner_cursor), inner,
+                   inner_row);
+      if (print_joined_row(out, joined_row, select_statement, aggregation)) {
+        num_matched++;
+      }
+      index_cursor_advance(index_cursor);
+    }
+    free(index_cursor);
+    cursor_advance(cursor);
+  }
+  cursor_close(inner_cursor);
+  cursor_close(cursor);
+  STATS_ADD(rows_scanned, num_scanned);
+  STATS_ADD(rows_matched, num_matched);
+  profile_end(join, num_matched);
+}
+
+// Copies the build table's rows into memory, chained by the hash of their
+// key, then scans the probe table and looks each of its keys up
+void hash_join(Output* out, SelectStatement* select_statement,
+               Aggregation* aggregation, Table* build,
+               ColumnDefinition* build_key, Table* probe,
+               ColumnDefinition* probe_key, char* joined_row, char* build_row,
+               char* probe_row) {
+  uint32_t num_rows = build->num_live_rows;
+  if (num_rows == 0) {
+    return;
+  }
+  uint32_t num_buckets = 1;
+  while (num_buckets < 2 * num_rows) {
+    num_buckets *= 2;
+  }
+  ProfileOperator* build_step = profile_begin("Hash join build", build);
+  char* rows = malloc((size_t)num_rows * build->row_size);
+  uint32_t* buckets = malloc(num_buckets * sizeof(uint32_t));
+  uint32_t* next = malloc(num_rows * sizeof(uint32_t));
+  memset(buckets, 0xff, num_buckets * sizeof(uint32_t));
+
+  Cursor* cursor = table_start(build);
+  for (uint32_t i = 0; i < num_rows && !(cursor->end_of_table); i++) {
+    copy_row_out(cursor_rows(cursor), cursor_slot(cursor), build,
+                 rows + (size_t)i * build->row_size);
+    cursor_advance(cursor);
+  }
+  cursor_close(cursor);
+  // Chain backwards so that matches come out in table order
+  for (uint32_t i = num_rows; i-- > 0;) {
+    char* key = rows + (size_t)i * build->row_size + build_key->offset;
+    uint32_t bucket = hash_bytes(key, build_key->size) & (num_buckets - 1);
+    next[i] = buckets[bucket];
+    buckets[bucket] = i;
+  }
+  profile_end(build_step, num_rows);
+
+  ProfileOperator* probe_step = profile_begin("Hash join probe", probe);
+  uint64_t num_scanned = num_rows;
+  uint64_t num_matched = 0;
+  cursor = table_start(probe);
+  while (!(cursor->end_of_table)) {
+    num_scanned++;
+    void* page_rows = cursor_rows(cursor);
+    uint32_t slot = cursor_slot(cursor);
+    void* key = column_value(page_rows, slot, probe_key);
+    if (probe_key->overflow != NULL) {
+      column_read(probe_key, key, probe_row + probe_key->offset);
+      key = probe_row + probe_key->offset;
+    }
+    uint32_t bucket = hash_bytes(key, probe_key->size) & (num_buckets - 1);
+    bool copied = false;
+    for (uint32_t i = buckets[bucket]; i != UINT32_MAX; i = next[i]) {
+      char* row = rows + (size_t)i * build->row_size;
+      if (memcmp(row + build_key->offset, key, build_key->size) != 0) {
+        continue;
+      }
+      if (!copied) {
+        copy_row_out(page_rows, slot, probe, probe_row);
+        copied = true;
+      }
+      memcpy(build_row, row, build->row_size);
+      if (print_joined_row(out, joined_row, select_statement, aggregation)) {
+        num_matched++;
+      }
+    }
+    cursor_advance(cursor);
+  }
+  cursor_close(cursor);
+  STATS_ADD(rows_scanned, num_scanned);
+  STATS_ADD(rows_matched, num_matched);
+  profile_end(probe_step, num_matched);
+
+  free(next);
+  free(buckets);
+  free(rows);
+}
 
-  statement->table = table;
-
-  // check whether the columns are all valid
-  select_statement->num_columns = num_columns;
-  select_statement->columns = malloc(sizeof(ColumnDefinition) * num_columns);
-  for (uint32_t i = 0; i < num_columns; i++) {
-    bool valid = false;
-    for (uint32_t j = 0; j < table->num_columns; j++) {
-      if (strcmp(columns[i], table->columns[j].name) == 0) {
-        valid = true;
-        select_statement->columns[i] = table->columns[j];
+// Scans the outer table and probes the inner table's index for each row.
+// Inner pages stay in the buffer pool once they are read.
+double index_join_cost(Table* outer, Table* inner,
+                       ColumnDefinition* inner_key) {
+  double num_probes = outer->num_live_rows;
+  double num_matches = num_probes * rows_per_value(inner, inner_key);
+  double num_pages = table_num_data_pages(inner);
+  return scan_cost(outer) + num_probes * INDEX_PROBE_COST +
+         (num_matches < num_pages ? num_matches : num_pages) *
+             RANDOM_PAGE_COST +
+         num_matches * CPU_ROW_COST;
+}
+
+// Scans both tables, hashing the rows of one and probing with the other
+double hash_join_cost(Table* left, Table* right) {
+  return scan_cost(left) + scan_cost(right) +
+         (left->num_live_rows + right->num_live_rows) * CPU_ROW_COST;
+}
+
+// Picks the cheapest of looking rows up through the index of either side
+// on its join column and hash joining, which builds on the smaller side
+ExecuteResult execute_join(Statement* statement, Output* out) {
+  SelectStatement* select_statement = statement->statementDetail;
+  Table* left = statement->table;
+  Table* right = select_statement->join_table;
+  ColumnDefinition* left_key = select_statement->left_key;
+  ColumnDefinition* right_key = select_statement->right_key;
+
+  char* joined_row = malloc(select_statement->joined->row_size);
+  char* left_row = joined_row;
+  char* right_row = joined_row + left->row_size;
+  bool left_smaller = left->num_live_rows <= right->num_live_rows;
+  double hash_cost = hash_join_cost(left, right);
+  double left_outer_cost = table_column_index(right, right_key) != NULL
+                               ? index_join_cost(left, right, right_key)
+                               : INFINITY;
+  double right_outer_cost = table_column_index(left, left_key) != NULL
+                                ? index_join_cost(right, left, left_key)
+                                : INFINITY;
+
+  Aggregation* aggregation = NULL;
+  if (select_statement->aggregates != NULL) {
+    aggregation = aggregation_new(select_statement, 1);
+  }
+
+  if (left_outer_cost <= right_outer_cost && left_outer_cost < hash_cost) {
+    index_nested_loop_join(out, select_statement, aggregation, left, left_key,
+                           right, right_key, joined_row, left_row, right_row);
+  } else if (right_outer_cost < hash_cost) {
+    index_nested_loop_join(out, select_statement, aggregation, right,
+                           right_key, left, left_key, joined_row, right_row,
+                           left_row);
+  } else if (left_smaller) {
+    hash_join(out, select_statement, aggregation, left, left_key, right,
+              right_key, joined_row, left_row, right_row);
+  } else {
+    hash_join(out, select_statement, aggregation, right, right_key, left,
+              left_key, joined_row, right_row, left_row);
+  }
+
+  if (aggregation != NULL) {
+    ProfileOperator* aggregate = profile_begin("Aggregate", NULL);
+    print_aggregation(out, aggregation);
+    profile_end(aggregate, aggregation->num_groups);
+    aggregation_free(aggregation);
+  }
+  free(joined_row);
+  return EXECUTE_SUCCESS;
+}
+
+bool use_parallel_scan(Table* table) {
+  return thread_pool != NULL && thread_pool->num_workers > 1 &&
+         table_num_data_pages(table) >= PARALLEL_SCAN_MIN_PAGES;
+}
+
+// A full scan split into morsels of MORSEL_PAGES pages. Each worker
+// aggregates into its own Aggregation, or each morsel prints its rows to
+// its own buffer so they can be written out in table order.
+typedef struct {
+  Table* table;
+  SelectStatement* select_statement;
+  WhereClause* filter;
+  uint8_t** selections;
+  Aggregation** aggregations;
+  uint32_t first_morsel;
+  OutputMode mode;
+  char** outputs;
+  size_t* output_lengths;
+  // The profile of the statement, taken on by the workers, and the number
+  // of rows they selected
+  Profile* profile;
+  uint64_t num_selected;
+} ParallelScan;
+
+void parallel_scan_morsel(void* context, uint32_t worker, uint32_t morsel) {
+  ParallelScan* scan = context;
+  Table* table = scan->table;
+  SelectStatement* select_statement = scan->select_statement;
+  uint8_t* selection = scan->selections[worker];
+  Profile* worker_profile = current_profile;
+  current_profile = scan->profile;
+  uint64_t num_selected = 0;
+  Aggregation* aggregation =
+      scan->aggregations != NULL ? scan->aggregations[worker] : NULL;
+  Output out = {NULL, scan->mode};
+  if (aggregation == NULL) {
+    out.file =
+        open_memstream(&scan->outputs[morsel], &scan->output_lengths[morsel]);
+  }
+
+  uint32_t first_page = 1 + (scan->first_morsel + morsel) * MORSEL_PAGES;
+  uint32_t end_page = 1 + table_num_data_pages(table);
+  if (end_page > first_page + MORSEL_PAGES) {
+    end_page = first_page + MORSEL_PAGES;
+  }
+  for (uint32_t page_num = first_page; page_num < end_page; page_num++) {
+    uint32_t first_row = (page_num - 1) * table->rows_per_page;
+    uint32_t num_slots = table->num_rows - first_row;
+    if (num_slots > table->rows_per_page) {
+      num_slots = table->rows_per_page;
+    }
+    if (zone_skip_page(table, select_statement->where_clause, page_num)) {
+      continue;
+    }
+
+    void* page = pager_pin(table->pager, page_num);
+    void* rows = page + table->rows_offset;
+    page_select(table, page, num_slots, select_statement->where_clause,
+                scan->filter, selection);
+    for (uint32_t i = 0; i < (num_slots + 7) / 8; i++) {
+      uint8_t bits = selection[i];
+      while (bits != 0) {
+        uint32_t slot = i * 8 + __builtin_ctz(bits);
+        bits &= bits - 1;
+        num_selected++;
+        if (aggregation != NULL) {
+          aggregation->selected[aggregation->num_selected++] = slot;
+        } else {
+          print_row(&out, rows, slot, table, select_statement);
+        }
+      }
+    }
+    if (aggregation != NULL) {
+      aggregation->base_row = first_row;
+      aggregate_selected(aggregation, rows);
+    }
+    pager_unpin(table->pager, page_num);
+  }
+
+  if (out.file != NULL) {
+    fclose(out.file);
+  }
+  __atomic_fetch_add(&scan->num_selected, num_selected, __ATOMIC_RELAXED);
+  current_profile = worker_profile;
+}
+
+ParallelScan* parallel_scan_new(Table* table,
+                                SelectStatement* select_statement) {
+  ParallelScan* scan = calloc(1, sizeof(ParallelScan));
+  scan->table = table;
+  scan->select_statement = select_statement;
+  scan->filter = batch_predicate(select_statement->where_clause);
+  scan->profile = current_profile;
+  pager_begin_scan(table->pager);
+  scan->selections = malloc(thread_pool->num_workers * sizeof(uint8_t*));
+  for (uint32_t i = 0; i < thread_pool->num_workers; i++) {
+    scan->selections[i] = malloc((table->rows_per_page + 7) / 8);
+  }
+  return scan;
+}
+
+void parallel_scan_free(ParallelScan* scan) {
+  for (uint32_t i = 0; i < thread_pool->num_workers; i++) {
+    free(scan->selections[i]);
+  }
+  free(scan->selections);
+  pager_end_scan(scan->table->pager);
+  free(scan);
+}
+
+// Prints the rows of a full scan in table order. Morsels are scanned in
+// windows of a few per worker, which bounds the buffered output.
+void parallel_select(Output* out, Table* table,
+                     SelectStatement* select_statement) {
+  ProfileOperator* step = profile_begin("Parallel scan", table);
+  ParallelScan* scan = parallel_scan_new(table, select_statement);
+  scan->mode = out->mode;
+  uint32_t num_morsels =
+      (table_num_data_pages(table) + MORSEL_PAGES - 1) / MORSEL_PAGES;
+  uint32_t window = 4 * thread_pool->num_workers;
+  scan->outputs = malloc(window * sizeof(char*));
+  scan->output_lengths = malloc(window * sizeof(size_t));
+  for (scan->first_morsel = 0; scan->first_morsel < num_morsels;
+       scan->first_morsel += window) {
+    uint32_t num_window_morsels = num_morsels - scan->first_morsel;
+    if (num_window_morsels > window) {
+      num_window_morsels = window;
+    }
+    thread_pool_run(thread_pool, parallel_scan_morsel, scan,
+                    num_window_morsels);
+    for (uint32_t i = 0; i < num_window_morsels; i++) {
+      fwrite(scan->outputs[i], 1, scan->output_lengths[i], out->file);
+      free(scan->outputs[i]);
+    }
+  }
+  free(scan->outputs);
+  free(scan->output_lengths);
+  profile_end(step, scan->num_selected);
+  parallel_scan_free(scan);
+}
+
+// Aggregates a full scan with one Aggregation per worker, then merges them
+// and puts the groups back in the order a single scan would find them
+Aggregation* parallel_aggregate(Table* table,
+                                SelectStatement* select_statement) {
+  ProfileOperator* step = profile_begin("Parallel scan", table);
+  ParallelScan* scan = parallel_scan_new(table, select_statement);
+  uint32_t num_workers = thread_pool->num_workers;
+  scan->aggregations = malloc(num_workers * sizeof(Aggregation*));
+  for (uint32_t i = 0; i < num_workers; i++) {
+    scan->aggregations[i] =
+        aggregation_new(select_statement, table->rows_per_page);
+  }
+
+  uint32_t num_morsels =
+      (table_num_data_pages(table) + MORSEL_PAGES - 1) / MORSEL_PAGES;
+  thread_pool_run(thread_pool, parallel_scan_morsel, scan, num_morsels);
+  profile_end(step, scan->num_selected);
+
+  ProfileOperator* merge = profile_begin("Merge groups", NULL);
+  Aggregation* aggregation = scan->aggregations[0];
+  for (uint32_t i = 1; i < num_workers; i++) {
+    aggregation_merge(aggregation, scan->aggregations[i]);
+    aggregation_free(scan->aggregations[i]);
+  }
+  if (select_statement->num_group_by > 0) {
+    aggregation_sort(aggregation);
+  }
+  profile_end(merge, aggregation->num_groups);
+  free(scan->aggregations);
+  parallel_scan_free(scan);
+  return aggregation;
+}
+
+bool only_counts(SelectStatement* select_statement) {
+  for (uint32_t i = 0; i < select_statement->num_columns; i++) {
+    if (select_statement->aggregates[i].function != AGGREGATE_COUNT) {
+      return false;
+    }
+  }
+  return true;
+}
+
+ExecuteResult execute_aggregate(Statement* statement, Output* out) {
+  SelectStatement* select_statement = statement->statementDetail;
+  Table* table = statement->table;
+  WhereClause* where_clause = select_statement->where_clause;
+
+  // The table header already knows count(*)
+  if (where_clause == NULL && select_statement->num_group_by == 0 &&
+      only_counts(select_statement)) {
+    ProfileOperator* step = profile_begin("Count from header", table);
+    AggregateState* states =
+        calloc(select_statement->num_columns, sizeof(AggregateState));
+    for (uint32_t i = 0; i < select_statement->num_columns; i++) {
+      states[i].count = table->num_live_rows;
+    }
+    print_aggregate_row(out, select_statement, NULL, NULL, states);
+    free(states);
+    profile_end(step, 1);
+    return EXECUTE_SUCCESS;
+  }
+
+  WhereClause* key_predicate = index_predicate(table, where_clause);
+  if (key_predicate == NULL && use_parallel_scan(table)) {
+    Aggregation* aggregation = parallel_aggregate(table, select_statement);
+    ProfileOperator* step = profile_begin("Aggregate", NULL);
+    print_aggregation(out, aggregation);
+    profile_end(step, aggregation->num_groups);
+    aggregation_free(aggregation);
+    return EXECUTE_SUCCESS;
+  }
+
+  Aggregation* aggregation =
+      aggregation_new(select_statement, table->rows_per_page);
+  if (key_predicate != NULL) {
+    Cursor* cursor = table_row(table, 0);
+    uint32_t num_matches = 0;
+    uint32_t* row_nums =
+        index_lookup(table, where_clause, key_predicate, &num_matches);
+    ProfileOperator* fetch = profile_begin("Fetch rows", table);
+    uint64_t num_selected = 0;
+    for (uint32_t i = 0; i < num_matches; i++) {
+      cursor->row_num = row_nums[i];
+      void* rows = cursor_rows(cursor);
+      uint32_t slot = cursor_slot(cursor);
+      if (valid_where_clause(rows, slot, where_clause)) {
+        aggregate_row(aggregation, rows, slot);
+        num_selected++;
+      }
+    }
+    STATS_ADD(rows_scanned, num_matches);
+    STATS_ADD(rows_matched, num_selected);
+    profile_end(fetch, num_selected);
+    free(row_nums);
+    cursor_close(cursor);
+  } else {
+    ProfileOperator* scan = profile_begin("Scan", table);
+    uint64_t num_selected = 0;
+    Cursor* cursor = table_start(table);
+    WhereClause* filter = batch_predicate(where_clause);
+    uint8_t* selection = malloc((table->rows_per_page + 7) / 8);
+    for (uint32_t first_row = 0; first_row < table->num_rows;
+         first_row += table->rows_per_page) {
+      if (zone_skip_page(table, where_clause, row_page_num(table, first_row))) {
+        continue;
+      }
+      cursor->row_num = first_row;
+      void* page = cursor_page(cursor);
+      uint32_t num_slots = table->num_rows - first_row;
+      if (num_slots > table->rows_per_page) {
+        num_slots = table->rows_per_page;
+      }
+
+      page_select(table, page, num_slots, where_clause, filter, selection);
+      for (uint32_t i = 0; i < (num_slots + 7) / 8; i++) {
+        uint8_t bits = selection[i];
+        while (bits != 0) {
+          aggregation->selected[aggregation->num_selected++] =
+              i * 8 + __builtin_ctz(bits);
+          bits &= bits - 1;
+        }
+      }
+      num_selected += aggregation->num_selected;
+      aggregation->base_row = first_row;
+      aggregate_selected(aggregation, page + table->rows_offset);
+    }
+    free(selection);
+    cursor_close(cursor);
+    profile_end(scan, num_selected);
+  }
+
+  ProfileOperator* step = profile_begin("Aggregate", NULL);
+  print_aggregation(out, aggregation);
+  profile_end(step, aggregation->num_groups);
+  aggregation_free(aggregation);
+  return EXECUTE_SUCCESS;
+}
+
+// The order a sorted row came in and, for an int or real sort column, its
+// key. Each is followed by the whole row.
+typedef struct {
+  IndexKey key;
+  uint64_t seq;
+} SortHeader;
+
+// Sorts the rows of an order by as records of a SortHeader and a row.
+// With a limit whose rows fit in sort_memory, only the first offset +
+// limit are kept, in a heap topped by the one that sorts last. Otherwise
+// records fill sort_memory, are sorted and written to a temporary file as
+// a run, and the runs are merged at the end.
+typedef struct {
+  Table* table;
+  // The sort column in the table's pages and in a whole row
+  ColumnDefinition* page_key;
+  ColumnDefinition* key;
+  bool descending;
+  bool top_n;
+  uint32_t record_size;
+  char* records;
+  // Record numbers, sorted or kept as a heap
+  uint32_t* order;
+  uint32_t num_records;
+  uint32_t records_capacity;
+  uint32_t capacity;
+  char* scratch;
+  uint64_t num_added;
+  FILE** runs;
+  uint32_t num_runs;
+} Sorter;
+
+char* sorter_record(Sorter* sorter, char* base, uint32_t record_num) {
+  return base + (size_t)record_num * sorter->record_size;
+}
+
+// Rows with equal keys stay in the order they came in
+int sorter_compare(Sorter* sorter, const char* a, const char* b) {
+  SortHeader x;
+  SortHeader y;
+  memcpy(&x, a, sizeof(SortHeader));
+  memcpy(&y, b, sizeof(SortHeader));
+  int order = 0;
+  if (sorter->key->type == VARCHAR) {
+    uint32_t offset = sizeof(SortHeader) + sorter->key->offset;
+    order = strncmp(a + offset, b + offset, sorter->key->size);
+  } else {
+    order = (x.key > y.key) - (x.key < y.key);
+  }
+  if (sorter->descending) {
+    order = -order;
+  }
+  if (order == 0) {
+    order = (x.seq > y.seq) - (x.seq < y.seq);
+  }
+  return order;
+}
+
+int compare_sort_records(const void* a, const void* b, void* context) {
+  Sorter* sorter = context;
+  return sorter_compare(sorter,
+                        sorter_record(sorter, sorter->records, *(uint32_t*)a),
+                        sorter_record(sorter, sorter->records, *(uint32_t*)b));
+}
+
+// Whether heap entry i belongs above entry j. The top of a max heap sorts
+// last, the top of a min heap first.
+bool sort_heap_above(Sorter* sorter, char* base, uint32_t* heap, uint32_t i,
+                     uint32_t j, bool max_heap) {
+  int order = sorter_compare(sorter, sorter_record(sorter, base, heap[i]),
+                             sorter_record(sorter, base, heap[j]));
+  return max_heap ? order > 0 : order < 0;
+}
+
+void sort_heap_down(Sorter* sorter, char* base, uint32_t* heap,
+                    uint32_t num_entries, uint32_t i, bool max_heap) {
+  while (true) {
+    uint32_t top = i;
+    for (uint32_t child = 2 * i + 1; child <= 2 * i + 2; child++) {
+      if (child < num_entries &&
+          sort_heap_above(sorter, base, heap, child, top, max_heap)) {
+        top = child;
+      }
+    }
+    if (top == i) {
+      return;
+    }
+    uint32_t swap = heap[i];
+    heap[i] = heap[top];
+    heap[top] = swap;
+    i = top;
+  }
+}
+
+void sort_heap_up(Sorter* sorter, char* base, uint32_t* heap, uint32_t i,
+                  bool max_heap) {
+  while (i > 0 && sort_heap_above(sorter, base, heap, i, (i - 1) / 2,
+                                  max_heap)) {
+    uint32_t parent = (i - 1) / 2;
+    uint32_t swap = heap[i];
+    heap[i] = heap[parent];
+    heap[parent] = swap;
+    i = parent;
+  }
+}
+
+Sorter* sorter_new(Table* table, SelectStatement* select_statement) {
+  Sorter* sorter = calloc(1, sizeof(Sorter));
+  sorter->table = table;
+  sorter->page_key = select_statement->order_by;
+  sorter->key = &select_statement->sorted
+                     ->columns[select_statement->order_by - table->columns];
+  sorter->descending = select_statement->descending;
+  sorter->record_size = (sizeof(SortHeader) + table->row_size + 7) & ~7u;
+
+  uint64_t fit = sort_memory / (sorter->record_size + sizeof(uint32_t));
+  fit = fit < 2 ? 2 : fit > UINT32_MAX / 2 ? UINT32_MAX / 2 : fit;
+  uint64_t wanted =
+      (uint64_t)select_statement->offset + select_statement->limit;
+  sorter->top_n = select_statement->limit != UINT32_MAX && wanted <= fit;
+  sorter->capacity = sorter->top_n ? wanted : fit;
+  sorter->scratch = malloc(sorter->record_size);
+  return sorter;
+}
+
+void sorter_free(Sorter* sorter) {
+  free(sorter->records);
+  free(sorter->order);
+  free(sorter->scratch);
+  free(sorter->runs);
+  free(sorter);
+}
+
+// Sorts the records in memory and writes them to a new run
+void sorter_spill(Sorter* sorter) {
+  qsort_r(sorter->order, sorter->num_records, sizeof(uint32_t),
+          compare_sort_records, sorter);
+  FILE* run = tmpfile();
+  if (run == NULL) {
+    printf("Unable to create sort run: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  for (uint32_t i = 0; i < sorter->num_records; i++) {
+    fwrite(sorter_record(sorter, sorter->records, sorter->order[i]),
+           sorter->record_size, 1, run);
+  }
+  if (ferror(run)) {
+    printf("Error writing sort run: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  sorter->runs =
+      realloc(sorter->runs, (sorter->num_runs + 1) * sizeof(FILE*));
+  sorter->runs[sorter->num_runs++] = run;
+  sorter->num_records = 0;
+  STATS_ADD(sort_runs, 1);
+}
+
+void sorter_add(Sorter* sorter, void* rows, uint32_t slot) {
+  if (sorter->capacity == 0) {
+    return;
+  }
+  SortHeader header = {0, sorter->num_added++};
+  char* record = sorter->scratch;
+  void* cell = column_value(rows, slot, sorter->page_key);
+  if (sorter->key->type == VARCHAR) {
+    column_read(sorter->page_key, cell,
+                record + sizeof(SortHeader) + sorter->key->offset);
+  } else {
+    header.key = column_key(sorter->page_key, cell);
+  }
+  memcpy(record, &header, sizeof(SortHeader));
+
+  // A full heap only takes rows that sort before its top, in its place
+  uint32_t record_num = sorter->num_records;
+  if (sorter->top_n && sorter->num_records == sorter->capacity) {
+    record_num = sorter->order[0];
+    if (sorter_compare(sorter, record,
+                       sorter_record(sorter, sorter->records, record_num)) >=
+        0) {
+      return;
+    }
+  } else if (sorter->num_records == sorter->capacity) {
+    sorter_spill(sorter);
+    record_num = 0;
+  }
+  if (record_num == sorter->records_capacity) {
+    uint32_t capacity = sorter->records_capacity == 0
+                            ? 256
+                            : sorter->records_capacity * 2;
+    if (capacity > sorter->capacity) {
+      capacity = sorter->capacity;
+    }
+    sorter->records =
+        realloc(sorter->records, (size_t)capacity * sorter->record_size);
+    sorter->order = realloc(sorter->order, capacity * sizeof(uint32_t));
+    sorter->records_capacity = capacity;
+  }
+
+  char* destination = sorter_record(sorter, sorter->records, record_num);
+  memcpy(destination, &header, sizeof(SortHeader));
+  copy_row_out(rows, slot, sorter->table, destination + sizeof(SortHeader));
+  if (!sorter->top_n) {
+    sorter->order[sorter->num_records++] = record_num;
+  } else if (sorter->num_records < sorter->capacity) {
+    sorter->order[sorter->num_records] = record_num;
+    sort_heap_up(sorter, sorter->records, sorter->order,
+                 sorter->num_records++, true);
+  } else {
+    sort_heap_down(sorter, sorter->records, sorter->order,
+                   sorter->num_records, 0, true);
+  }
+}
+
+typedef struct RowSink RowSink;
+bool sink_sorted_row(RowSink* sink, char* record);
+
+// Merges runs into one, written to into, or passed to the sink when into
+// is NULL. Stops early once the sink wants no more rows.
+void sorter_merge(Sorter* sorter, FILE** runs, uint32_t num_runs, FILE* into,
+                  RowSink* sink) {
+  char* heads = malloc((size_t)num_runs * sorter->record_size);
+  uint32_t* heap = malloc(num_runs * sizeof(uint32_t));
+  uint32_t num_entries = 0;
+  for (uint32_t i = 0; i < num_runs; i++) {
+    rewind(runs[i]);
+    if (fread(sorter_record(sorter, heads, i), sorter->record_size, 1,
+              runs[i]) == 1) {
+      heap[num_entries] = i;
+      sort_heap_up(sorter, heads, heap, num_entries++, false);
+    }
+  }
+  while (num_entries > 0) {
+    uint32_t run = heap[0];
+    char* record = sorter_record(sorter, heads, run);
+    if (into != NULL) {
+      fwrite(record, sorter->record_size, 1, into);
+    } else if (!sink_sorted_row(sink, record)) {
+      break;
+    }
+    if (fread(record, sorter->record_size, 1, runs[run]) != 1) {
+      heap[0] = heap[--num_entries];
+    }
+    sort_heap_down(sorter, heads, heap, num_entries, 0, false);
+  }
+  if (into != NULL && ferror(into)) {
+    printf("Error writing sort run: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  for (uint32_t i = 0; i < num_runs; i++) {
+    fclose(runs[i]);
+  }
+  free(heap);
+  free(heads);
+}
+
+// Passes the records to the sink in order
+void sorter_finish(Sorter* sorter, RowSink* sink) {
+  if (sorter->num_runs == 0) {
+    qsort_r(sorter->order, sorter->num_records, sizeof(uint32_t),
+            compare_sort_records, sorter);
+    for (uint32_t i = 0; i < sorter->num_records; i++) {
+      if (!sink_sorted_row(
+              sink, sorter_record(sorter, sorter->records, sorter->order[i]))) {
         break;
       }
     }
-    if (!valid) {
-      for (uint32_t i = 0; i < num_columns; i++) {
-        free(columns[i]);
+    return;
+  }
+
+  if (sorter->num_records > 0) {
+    sorter_spill(sorter);
+  }
+  free(sorter->records);
+  sorter->records = NULL;
+  while (sorter->num_runs > SORT_MERGE_WAYS) {
+    FILE* run = tmpfile();
+    if (run == NULL) {
+      printf("Unable to create sort run: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+    sorter_merge(sorter, sorter->runs, SORT_MERGE_WAYS, run, NULL);
+    sorter->num_runs -= SORT_MERGE_WAYS;
+    memmove(sorter->runs, sorter->runs + SORT_MERGE_WAYS,
+            sorter->num_runs * sizeof(FILE*));
+    sorter->runs[sorter->num_runs++] = run;
+    STATS_ADD(sort_runs, 1);
+  }
+  sorter_merge(sorter, sorter->runs, sorter->num_runs, NULL, sink);
+  sorter->num_runs = 0;
+}
+
+// Takes the rows a select finds. Rows are printed as they come, or once
+// they are all sorted, passing over the first offset of them and stopping
+// after limit.
+struct RowSink {
+  Output* out;
+  Table* table;
+  SelectStatement* select_statement;
+  Sorter* sorter;
+  uint64_t num_rows;
+  uint64_t end;
+};
+
+RowSink sink_new(Output* out, Table* table,
+                 SelectStatement* select_statement) {
+  RowSink sink = {out, table, select_statement, NULL, 0, UINT64_MAX};
+  if (select_statement->limit != UINT32_MAX) {
+    sink.end = (uint64_t)select_statement->offset + select_statement->limit;
+  }
+  return sink;
+}
+
+// Whether the rows printed so far are all the select wants
+bool sink_done(RowSink* sink) {
+  return sink->num_rows >= sink->end;
+}
+
+void sink_row(RowSink* sink, void* rows, uint32_t slot) {
+  if (sink->sorter != NULL) {
+    sorter_add(sink->sorter, rows, slot);
+  } else if (sink->num_rows++ >= sink->select_statement->offset) {
+    print_row(sink->out, rows, slot, sink->table, sink->select_statement);
+  }
+}
+
+// Returns false once the limit is reached
+bool sink_sorted_row(RowSink* sink, char* record) {
+  if (sink->num_rows >= sink->end) {
+    return false;
+  }
+  SelectStatement* select_statement = sink->select_statement;
+  if (sink->num_rows++ >= select_statement->offset) {
+    Table* sorted = select_statement->sorted;
+    if (select_statement->is_select_all) {
+      print_columns(sink->out, record + sizeof(SortHeader), 0,
+                    sorted->columns, sorted->num_columns);
+    } else {
+      print_columns(sink->out, record + sizeof(SortHeader), 0,
+                    select_statement->sorted_columns,
+                    select_statement->num_columns);
+    }
+  }
+  return sink->num_rows < sink->end;
+}
+
+// Passes a row to the sink if it matches, returning whether it did
+bool sink_fetch(RowSink* sink, Cursor* cursor, uint32_t row_num,
+                WhereClause* where_clause) {
+  cursor->row_num = row_num;
+  void* rows = cursor_rows(cursor);
+  uint32_t slot = cursor_slot(cursor);
+  if (where_clause != NULL && !valid_where_clause(rows, slot, where_clause)) {
+    return false;
+  }
+  sink_row(sink, rows, slot);
+  return true;
+}
+
+// The index of an int or real column gives its rows in order. Equal keys
+// are in row order, so only the unique key column is read backwards.
+bool index_gives_order(Table* table, SelectStatement* select_statement) {
+  ColumnDefinition* column = select_statement->order_by;
+  return column->type != VARCHAR && table_column_index(table, column) != NULL &&
+         (!select_statement->descending || column == table->key_column);
+}
+
+// Cost of reading rows in the order of the index until the limit, taking
+// the matching rows to be spread evenly over it. Read backwards, the whole
+// index is read first.
+double index_order_cost(Table* table, SelectStatement* select_statement) {
+  double num_rows = table->num_live_rows;
+  double wanted = num_rows;
+  double selectivity =
+      clause_selectivity(table, select_statement->where_clause);
+  if (select_statement->limit != UINT32_MAX && selectivity > 0) {
+    wanted = ((double)select_statement->offset + select_statement->limit) /
+             selectivity;
+  }
+  if (wanted > num_rows) {
+    wanted = num_rows;
+  }
+  double cost = index_fetch_cost(table, select_statement->order_by, wanted);
+  if (select_statement->descending) {
+    cost += num_rows / LEAF_NODE_MAX_CELLS + num_rows * CPU_ROW_COST;
+  }
+  return cost;
+}
+
+// Comparisons to sort num_rows rows, or keep the first of them in a heap,
+// and the pages of any runs written and read back
+double sort_cost(Table* table, SelectStatement* select_statement,
+                 double num_rows) {
+  double kept = num_rows;
+  if (select_statement->limit != UINT32_MAX &&
+      (double)select_statement->offset + select_statement->limit < kept) {
+    kept = (double)select_statement->offset + select_statement->limit;
+  }
+  double cost = num_rows * CPU_ROW_COST * log2(kept + 2);
+  double bytes = kept * (sizeof(SortHeader) + table->row_size);
+  if (bytes > sort_memory) {
+    cost += 2 * bytes / page_size;
+  }
+  return cost;
+}
+
+// Reads the rows in the order of the index on the order by column, so they
+// need no sort. Read forwards, it stops at the limit.
+void index_order_select(RowSink* sink, Table* table,
+                        WhereClause* where_clause) {
+  SelectStatement* select_statement = sink->select_statement;
+  ProfileOperator* step = profile_begin("Index order", table);
+  IndexEntry start = {INT64_MIN, 0};
+  IndexCursor* index_cursor = index_find(
+      table_column_index(table, select_statement->order_by), start);
+  Cursor* cursor = table_row(table, 0);
+  uint32_t* row_nums = NULL;
+  uint32_t num_row_nums = 0;
+  uint32_t capacity = 0;
+  uint64_t num_scanned = 0;
+  uint64_t num_selected = 0;
+  while (!(index_cursor->end_of_index) && !sink_done(sink)) {
+    uint32_t row_num = index_cursor_entry(index_cursor).row_num;
+    index_cursor_advance(index_cursor);
+    if (select_statement->descending) {
+      if (num_row_nums == capacity) {
+        capacity = capacity == 0 ? 1024 : capacity * 2;
+        row_nums = realloc(row_nums, capacity * sizeof(uint32_t));
       }
-      free(columns);
-      free(cpy);
-      free(lower_sql);
-      free(columns_part);
-      free(select_statement);
-      return PREPARE_SYNTAX_ERROR;
+      row_nums[num_row_nums++] = row_num;
+      continue;
     }
+    num_scanned++;
+    num_selected += sink_fetch(sink, cursor, row_num, where_clause);
+  }
+  for (uint32_t i = num_row_nums; i-- > 0 && !sink_done(sink);) {
+    num_scanned++;
+    num_selected += sink_fetch(sink, cursor, row_nums[i], where_clause);
   }
+  free(row_nums);
+  free(index_cursor);
+  cursor_close(cursor);
+  STATS_ADD(rows_scanned, num_scanned);
+  STATS_ADD(rows_matched, num_selected);
+  profile_end(step, num_selected);
+}
 
-  if (where_pos) {
-    WhereClause* where_clause = malloc(sizeof(WhereClause));
-    if (where_clause == NULL) {
-      for (uint32_t i = 0; i < num_columns; i++) {
-        free(columns[i]);
+ExecuteResult execute_select(Statement* statement, Output* out) {
+  SelectStatement* select_statement = statement->statementDetail;
+  Table* table = statement->table;
+  WhereClause* where_clause = select_statement->where_clause;
+  if (select_statement->joined != NULL) {
+    return execute_join(statement, out);
+  }
+  if (select_statement->aggregates != NULL) {
+    return execute_aggregate(statement, out);
+  }
+
+  RowSink sink = sink_new(out, table, select_statement);
+  ColumnDefinition* order_by = select_statement->order_by;
+  WhereClause* key_predicate = index_predicate(table, where_clause);
+  bool index_order = false;
+  if (order_by != NULL && index_gives_order(table, select_statement)) {
+    // Rows found through the index on the order by column come sorted
+    double num_rows =
+        clause_selectivity(table, where_clause) * table->num_live_rows;
+    index_order = key_predicate != NULL
+                      ? key_predicate->column == order_by
+                      : index_order_cost(table, select_statement) <
+                            scan_cost(table) +
+                                sort_cost(table, select_statement, num_rows);
+  }
+  if (index_order && key_predicate == NULL) {
+    index_order_select(&sink, table, where_clause);
+    return EXECUTE_SUCCESS;
+  }
+  if (order_by != NULL && !index_order) {
+    sink.sorter = sorter_new(table, select_statement);
+  }
+
+  if (key_predicate != NULL) {
+    Cursor* cursor = table_row(table, 0);
+    uint32_t num_matches = 0;
+    uint32_t* row_nums =
+        index_lookup(table, where_clause, key_predicate, &num_matches);
+    ProfileOperator* fetch = profile_begin("Fetch rows", table);
+    uint64_t num_scanned = 0;
+    uint64_t num_selected = 0;
+    bool backwards = index_order && select_statement->descending;
+    for (uint32_t i = 0; i < num_matches && !sink_done(&sink); i++) {
+      num_scanned++;
+      num_selected += sink_fetch(
+          &sink, cursor, row_nums[backwards ? num_matches - 1 - i : i],
+          where_clause);
+    }
+    STATS_ADD(rows_scanned, num_scanned);
+    STATS_ADD(rows_matched, num_selected);
+    profile_end(fetch, num_selected);
+
+    free(row_nums);
+    cursor_close(cursor);
+  } else if (order_by == NULL && select_statement->limit == UINT32_MAX &&
+             use_parallel_scan(table)) {
+    parallel_select(out, table, select_statement);
+  } else {
+    // Pages are filtered a batch at a time, then the matching rows printed
+    ProfileOperator* scan = profile_begin("Scan", table);
+    uint64_t num_selected = 0;
+    Cursor* cursor = table_start(table);
+    WhereClause* filter = batch_predicate(where_clause);
+    uint8_t* selection = malloc((table->rows_per_page + 7) / 8);
+    for (uint32_t first_row = 0;
+         first_row < table->num_rows && !sink_done(&sink);
+         first_row += table->rows_per_page) {
+      if (zone_skip_page(table, where_clause,
+                         row_page_num(table, first_row))) {
+        continue;
+      }
+      cursor->row_num = first_row;
+      void* page = cursor_page(cursor);
+      uint32_t num_slots = table->num_rows - first_row;
+      if (num_slots > table->rows_per_page) {
+        num_slots = table->rows_per_page;
+      }
+
+      void* rows = page + table->rows_offset;
+      page_select(table, page, num_slots, where_clause, filter, selection);
+      for (uint32_t i = 0; i < (num_slots + 7) / 8; i++) {
+        uint8_t bits = selection[i];
+        while (bits != 0 && !sink_done(&sink)) {
+          sink_row(&sink, rows, i * 8 + __builtin_ctz(bits));
+          bits &= bits - 1;
+          num_selected++;
+        }
       }
-      free(columns);
-      free(cpy);
-      free(lower_sql);
-      free(columns_part);
-      free(select_statement);
-      return PREPARE_INTERNAL_ERROR;
     }
 
-    char* where_part = strdup(where_pos + 7);
-    if (!where_part) {
-      for (uint32_t i = 0; i < num_columns; i++) {
-        free(columns[i]);
+    free(selection);
+    cursor_close(cursor);
+    profile_end(scan, num_selected);
+  }
+
+  if (sink.sorter != NULL) {
+    ProfileOperator* sort =
+        profile_begin(sink.sorter->top_n ? "Top-N sort" : "Sort", NULL);
+    sorter_finish(sink.sorter, &sink);
+    profile_end(sort, sink.num_rows);
+    sorter_free(sink.sorter);
+  }
+  return EXECUTE_SUCCESS;
+}
+
+bool cursor_matches(Cursor* cursor, WhereClause* where_clause) {
+  return valid_where_clause(cursor_rows(cursor), cursor_slot(cursor),
+                            where_clause);
+}
+
+void update_row(Cursor* cursor, UpdateStatement* update_statement) {
+  Table* table = cursor->table;
+  ColumnDefinition* column = update_statement->column;
+  Pager* index = table_column_index(table, column);
+
+  if (index != NULL) {
+    IndexEntry old_entry = {column_key(column, cursor_column(cursor, column)),
+                            cursor->row_num};
+    btree_delete(index, old_entry);
+  }
+
+  void* cell = cursor_column(cursor, column);
+  cursor_mark_dirty(cursor);
+  column_write(column, cell, update_statement->value.data);
+  zone_add_row(table, cursor_rows(cursor), cursor_slot(cursor),
+               row_page_num(table, cursor->row_num));
+
+  if (index != NULL) {
+    IndexEntry new_entry = {column_key(column, cursor_column(cursor, column)),
+                            cursor->row_num};
+    btree_insert(index, new_entry);
+  }
+}
+
+ExecuteResult execute_update(Statement* statement) {
+  UpdateStatement* update_statement = statement->statementDetail;
+  Table* table = statement->table;
+
+  WhereClause* key_predicate =
+      index_predicate(table, update_statement->where_clause);
+  if (key_predicate != NULL) {
+    Cursor* cursor = table_row(table, 0);
+    uint32_t num_matches = 0;
+    uint32_t* row_nums = index_lookup(table, update_statement->where_clause,
+                                      key_predicate, &num_matches);
+    uint64_t num_selected = 0;
+    for (uint32_t i = 0; i < num_matches; i++) {
+      cursor->row_num = row_nums[i];
+      if (cursor_matches(cursor, update_statement->where_clause)) {
+        update_row(cursor, update_statement);
+        num_selected++;
       }
-      free(columns);
-      free(cpy);
-      free(lower_sql);
-      free(columns_part);
-      free(select_statement);
-      return PREPARE_INTERNAL_ERROR;
     }
+    STATS_ADD(rows_scanned, num_matches);
+    STATS_ADD(rows_matched, num_selected);
 
-    PrepareResult prepare_result =
-        parse_where_clause(where_part, where_clause, statement->table);
-    if (prepare_result != PREPARE_SUCCESS) {
-      for (uint32_t i = 0; i < num_columns; i++) {
-        free(columns[i]);
+    free(row_nums);
+    cursor_close(cursor);
+    return EXECUTE_SUCCESS;
+  }
+
+  uint64_t num_scanned = 0;
+  uint64_t num_selected = 0;
+  Cursor* cursor = table_start_where(table, update_statement->where_clause);
+  while (!(cursor->end_of_table)) {
+    num_scanned++;
+    if (!cursor_matches(cursor, update_statement->where_clause)) {
+      cursor_advance(cursor);
+      continue;
+    }
+
+    update_row(cursor, update_statement);
+    num_selected++;
+
+    cursor_advance(cursor);
+  }
+
+  cursor_close(cursor);
+  STATS_ADD(rows_scanned, num_scanned);
+  STATS_ADD(rows_matched, num_selected);
+
+  return EXECUTE_SUCCESS;
+}
+
+void delete_row(Cursor* cursor) {
+  index_row(cursor->table, cursor, false);
+  cursor_delete_row(cursor);
+}
+
+ExecuteResult execute_delete(Statement* statement) {
+  DeleteStatement* delete_statement = statement->statementDetail;
+  Table* table = statement->table;
+
+  WhereClause* key_predicate =
+      index_predicate(table, delete_statement->where_clause);
+  if (key_predicate != NULL) {
+    Cursor* cursor = table_row(table, 0);
+    uint32_t num_matches = 0;
+    uint32_t* row_nums = index_lookup(table, delete_statement->where_clause,
+                                      key_predicate, &num_matches);
+    uint64_t num_selected = 0;
+    for (uint32_t i = 0; i < num_matches; i++) {
+      cursor->row_num = row_nums[i];
+      if (cursor_matches(cursor, delete_statement->where_clause)) {
+        delete_row(cursor);
+        num_selected++;
       }
-      free(columns);
-      free(cpy);
-      free(lower_sql);
-      free(columns_part);
-      free(select_statement);
-      free(where_clause);
-      free(where_part);
-      return prepare_result;
     }
+    STATS_ADD(rows_scanned, num_matches);
+    STATS_ADD(rows_matched, num_selected);
 
-    select_statement->where_clause = where_clause;
+    free(row_nums);
+    cursor_close(cursor);
+    table_write_header(table);
+    return EXECUTE_SUCCESS;
   }
 
-  statement->statementDetail = select_statement;
+  uint64_t num_scanned = 0;
+  uint64_t num_selected = 0;
+  Cursor* cursor = table_start_where(table, delete_statement->where_clause);
+  while (!(cursor->end_of_table)) {
+    num_scanned++;
+    if (!cursor_matches(cursor, delete_statement->where_clause)) {
+      cursor_advance(cursor);
+      continue;
+    }
 
-  free(cpy);
-  free(lower_sql);
-  free(columns_part);
-  for (uint32_t i = 0; i < num_columns; i++) {
-    free(columns[i]);
+    delete_row(cursor);
+    num_selected++;
+    cursor_advance(cursor);
   }
-  free(columns);
+  cursor_close(cursor);
+  STATS_ADD(rows_scanned, num_scanned);
+  STATS_ADD(rows_matched, num_selected);
+  table_write_header(table);
 
-  return PREPARE_SUCCESS;
+  return EXECUTE_SUCCESS;
 }
 
-PrepareResult prepare_statement(InputBuffer* input_buffer, Statement* statement,
-                                Schema* schema) {
-  if (strncmp(input_buffer->buffer, "insert", 6) == 0) {
-    return prepare_insert(input_buffer, statement, schema);
-  }
-  if (strncmp(input_buffer->buffer, "select", 6) == 0) {
-    return prepare_select(input_buffer, statement, schema);
-  }
-  if (strncmp(input_buffer->buffer, "update", 6) == 0) {
-    return prepare_update(input_buffer, statement, schema);
-  }
-  if (strncmp(input_buffer->buffer, "delete", 6) == 0) {
-    return prepare_delete(input_buffer, statement, schema);
+Index* schema_find_index(Schema* schema, const char* name) {
+  for (uint32_t i = 0; i < schema->num_tables; i++) {
+    Table* table = schema->tables[i];
+    for (uint32_t j = 0; j < table->num_indexes; j++) {
+      if (strcmp(table->indexes[j].name, name) == 0) {
+        return &table->indexes[j];
+      }
+    }
   }
-
-  return PREPARE_UNRECOGNIZED_STATEMENT;
+  return NULL;
 }
 
-ExecuteResult execute_insert(Statement* statement) {
-  InsertStatement* insert_statement = statement->statementDetail;
+// Builds the index and records it in the catalog. The index's pages are
+// committed with the statement.
+ExecuteResult execute_create_index(Statement* statement, Schema* schema) {
+  CreateIndexStatement* create_index = statement->statementDetail;
   Table* table = statement->table;
-
-  if (table->num_rows >= table->max_rows) {
-    return EXECUTE_TABLE_FULL;
+  if (schema_find_index(schema, create_index->name) != NULL ||
+      table_column_index(table, create_index->column) != NULL) {
+    return EXECUTE_INDEX_EXISTS;
   }
 
-  Row* row_to_insert = &(insert_statement->row_to_insert);
-  Cursor* cursor = table_end(table);
-
-  serialize_row(row_to_insert, cursor_value(cursor), table);
-  table->num_rows += 1;
+  Index* index = table_add_index(schema, table, create_index->name,
+                                 create_index->column);
+  // A file left behind by an index that was never recorded is rebuilt
+  index_rebuild(table, index->column, index->pager);
+  catalog_append(table, index);
+  return EXECUTE_SUCCESS;
+}
 
-  free(cursor);
+// Adds the table to the schema and records it in the table catalog. Its
+// files are made when a statement first uses it.
+ExecuteResult execute_create_table(Statement* statement, Schema* schema) {
+  Table* definition = statement->statementDetail;
+  if (schema_find_table(schema, definition->table_name) != NULL) {
+    return EXECUTE_TABLE_EXISTS;
+  }
+  if (schema->serving && (definition->flags & TABLE_FLAG_COMPRESSED)) {
+    return EXECUTE_COMPRESSED_SERVED;
+  }
 
+  // Files left behind by a table of the same name that is gone are removed
+  Table* table = schema_add_table(schema, definition);
+  const char* filenames[] = {table->filename, table->index_filename,
+                             table->overflow_filename, table->zone_filename};
+  for (uint32_t i = 0; i < sizeof(filenames) / sizeof(char*); i++) {
+    if (filenames[i] != NULL) {
+      unlink(filenames[i]);
+    }
+  }
+  table_catalog_save(schema);
   return EXECUTE_SUCCESS;
 }
 
-void print_row(Row* row, Table* table, SelectStatement* select_statement) {
-  uint32_t num_columns = select_statement->is_select_all
-                             ? table->num_columns
-                             : select_statement->num_columns;
-  ColumnDefinition* columns = select_statement->is_select_all
-                                  ? table->columns
-                                  : select_statement->columns;
+// Spreads the bits of a key over the whole hash, as HyperLogLog expects
+uint64_t hash_mix(uint64_t x) {
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+  return x ^ (x >> 31);
+}
 
-  printf("(");
-  for (uint32_t i = 0; i < num_columns; i++) {
-    ColumnDefinition column = columns[i];
-    if (column.type == INTEGER) {
-      int value;
-      memcpy(&value, row->data + column.offset, column.size);
-      printf("%d", value);
-    } else if (column.type == VARCHAR) {
-      char* value = malloc(column.size + 1);
-      memcpy(value, row->data + column.offset, column.size);
-      value[column.size] = '\0';
-      printf("%s", value);
-    } else if (column.type == REAL) {
-      float value;
-      memcpy(&value, row->data + column.offset, column.size);
-      printf("%f", value);
-    }
-    if (i < num_columns - 1) {
-      printf(", ");
-    }
+// A HyperLogLog register keeps the longest run of leading zeros seen in
+// the hashes of its bucket
+void hll_add(uint8_t* registers, uint64_t hash) {
+  uint32_t bucket = hash >> (64 - HLL_BITS);
+  // The low bit bounds the run when the rest of the hash is zero
+  uint8_t rank = __builtin_clzll((hash << HLL_BITS) | 1) + 1;
+  if (rank > registers[bucket]) {
+    registers[bucket] = rank;
   }
+}
 
-  printf(")\n");
+double hll_estimate(uint8_t* registers) {
+  double num_registers = 1 << HLL_BITS;
+  double sum = 0;
+  uint32_t num_zeros = 0;
+  for (uint32_t i = 0; i < 1 << HLL_BITS; i++) {
+    sum += ldexp(1, -registers[i]);
+    num_zeros += registers[i] == 0;
+  }
+  double estimate = 0.7213 / (1 + 1.079 / num_registers) * num_registers *
+                    num_registers / sum;
+  // Small counts are better estimated from the registers still unused
+  if (estimate <= 2.5 * num_registers && num_zeros > 0) {
+    estimate = num_registers * log(num_registers / num_zeros);
+  }
+  return estimate;
 }
 
-bool valid_where_clause(Row* row, WhereClause* where_clause) {
-  ColumnDefinition* column = where_clause->column;
-  Operator op = where_clause->op;
-  Bytes value = where_clause->value;
+int compare_doubles(const void* a, const void* b) {
+  double x = *(const double*)a;
+  double y = *(const double*)b;
+  return (x > y) - (x < y);
+}
 
-  switch (column->type) {
-    case INTEGER: {
-      int int_value;
-      memcpy(&int_value, row->data + column->offset, column->size);
-      int where_int_value;
-      memcpy(&where_int_value, value.data, value.length);
-
-      switch (op) {
-        case OP_EQUAL:
-          return int_value == where_int_value;
-        case OP_NOT_EQUAL:
-          return int_value != where_int_value;
-        case OP_GREATER_THAN:
-          return int_value > where_int_value;
-        case OP_LESS_THAN:
-          return int_value < where_int_value;
-        case OP_GREATER_THAN_OR_EQUAL:
-          return int_value >= where_int_value;
-        case OP_LESS_THAN_OR_EQUAL:
-          return int_value <= where_int_value;
-      }
+// What analyze gathers about a column while it scans the table
+typedef struct {
+  uint8_t registers[1 << HLL_BITS];
+  double* sample;
+  double min;
+  double max;
+  double previous;
+  uint64_t num_ordered;
+} ColumnSketch;
+
+// Scans the table once, counting distinct values with HyperLogLog and
+// building histograms from a sample of the rows, chosen the same way for
+// every column. The statistics replace the table's old ones.
+ExecuteResult execute_analyze(Statement* statement, Schema* schema) {
+  Table* table = statement->table;
+  ColumnSketch* sketches = calloc(table->num_columns, sizeof(ColumnSketch));
+  for (uint32_t i = 0; i < table->num_columns; i++) {
+    if (table->columns[i].type != VARCHAR) {
+      sketches[i].sample = malloc(STATISTICS_SAMPLE_SIZE * sizeof(double));
     }
-    case VARCHAR: {
-      char* str_value = malloc(column->size + 1);
-      memcpy(str_value, row->data + column->offset, column->size);
-      str_value[column->size] = '\0';
+  }
 
-      switch (op) {
-        case OP_EQUAL:
-          return strcmp(str_value, value.data) == 0;
-        case OP_NOT_EQUAL:
-          return strcmp(str_value, value.data) != 0;
+  // A fixed seed, so analyzing the same rows gives the same statistics
+  uint64_t random = 0;
+  uint32_t num_rows = 0;
+  Cursor* cursor = table_start(table);
+  while (!(cursor->end_of_table)) {
+    uint32_t sample_slot = num_rows;
+    if (num_rows >= STATISTICS_SAMPLE_SIZE) {
+      random += 0x9E3779B97F4A7C15ULL;
+      sample_slot = hash_mix(random) % (num_rows + 1);
+    }
+    for (uint32_t i = 0; i < table->num_columns; i++) {
+      ColumnDefinition* column = &table->columns[i];
+      ColumnSketch* sketch = &sketches[i];
+      void* data = cursor_column(cursor, column);
+      hll_add(sketch->registers, hash_mix(column_key(column, data)));
+      if (column->type == VARCHAR) {
+        continue;
+      }
+      double value = column_number(column, data);
+      if (num_rows == 0 || value < sketch->min) {
+        sketch->min = value;
+      }
+      if (num_rows == 0 || value > sketch->max) {
+        sketch->max = value;
+      }
+      sketch->num_ordered += num_rows > 0 && value >= sketch->previous;
+      sketch->previous = value;
+      if (sample_slot < STATISTICS_SAMPLE_SIZE) {
+        sketch->sample[sample_slot] = value;
       }
     }
-    case REAL: {
-      double real_value;
-      memcpy(&real_value, row->data + column->offset, column->size);
-      double where_real_value;
-      memcpy(&where_real_value, value.data, value.length);
+    num_rows++;
+    cursor_advance(cursor);
+  }
+  cursor_close(cursor);
 
-      switch (op) {
-        case OP_EQUAL:
-          return real_value == where_real_value;
-        case OP_NOT_EQUAL:
-          return real_value != where_real_value;
-        case OP_GREATER_THAN:
-          return real_value > where_real_value;
-        case OP_LESS_THAN:
-          return real_value < where_real_value;
-        case OP_GREATER_THAN_OR_EQUAL:
-          return real_value >= where_real_value;
-        case OP_LESS_THAN_OR_EQUAL:
-          return real_value <= where_real_value;
+  TableStatistics* statistics = malloc(sizeof(TableStatistics));
+  statistics->num_rows = num_rows;
+  statistics->columns = calloc(table->num_columns, sizeof(ColumnStatistics));
+  uint32_t sample_size =
+      num_rows < STATISTICS_SAMPLE_SIZE ? num_rows : STATISTICS_SAMPLE_SIZE;
+  for (uint32_t i = 0; i < table->num_columns; i++) {
+    ColumnStatistics* column = &statistics->columns[i];
+    ColumnSketch* sketch = &sketches[i];
+    column->num_distinct = hll_estimate(sketch->registers);
+    if (column->num_distinct > num_rows ||
+        &table->columns[i] == table->key_column) {
+      column->num_distinct = num_rows;
+    }
+    column->has_range = sketch->sample != NULL && num_rows > 0;
+    if (column->has_range) {
+      column->correlation =
+          num_rows > 1 ? 2.0 * sketch->num_ordered / (num_rows - 1) - 1 : 1;
+      qsort(sketch->sample, sample_size, sizeof(double), compare_doubles);
+      for (uint32_t j = 0; j <= HISTOGRAM_BUCKETS; j++) {
+        column->bounds[j] =
+            sketch->sample[(uint64_t)j * (sample_size - 1) / HISTOGRAM_BUCKETS];
       }
+      column->bounds[0] = sketch->min;
+      column->bounds[HISTOGRAM_BUCKETS] = sketch->max;
     }
+    free(sketch->sample);
   }
-}
-
-ExecuteResult execute_select(Statement* statement) {
-  SelectStatement* select_statement = statement->statementDetail;
-  Table* table = statement->table;
-  WhereClause* where_clause = select_statement->where_clause;
+  free(sketches);
 
-  Cursor* cursor = table_start(table);
+  table_statistics_free(table->statistics);
+  table->statistics = statistics;
+  statistics_save(schema);
+  return EXECUTE_SUCCESS;
+}
 
-  Row row;
-  while (!(cursor->end_of_table)) {
-    deserialize_row(cursor_value(cursor), &row, table);
+ExecuteResult execute_statement(Statement* statement, Schema* schema,
+                                Output* out) {
+  switch (statement->type) {
+    case STATEMENT_INSERT:
+      return execute_insert(statement);
+    case STATEMENT_SELECT:
+      return execute_select(statement, out);
+    case STATEMENT_UPDATE:
+      return execute_update(statement);
+    case STATEMENT_DELETE:
+      return execute_delete(statement);
+    case STATEMENT_CREATE_INDEX:
+      return execute_create_index(statement, schema);
+    case STATEMENT_CREATE_TABLE:
+      return execute_create_table(statement, schema);
+    case STATEMENT_ANALYZE:
+      return execute_analyze(statement, schema);
+    case STATEMENT_PREPARE:
+    case STATEMENT_BEGIN:
+    case STATEMENT_COMMIT:
+    case STATEMENT_ROLLBACK:
+      return EXECUTE_SUCCESS;
+  }
+}
 
-    if (where_clause && !valid_where_clause(&row, where_clause)) {
-      cursor_advance(cursor);
-      continue;
+bool transaction_holds(Transaction* transaction, Table* table) {
+  if (transaction == NULL) {
+    return false;
+  }
+  for (uint32_t i = 0; i < transaction->num_tables; i++) {
+    if (transaction->tables[i] == table) {
+      return true;
     }
+  }
+  return false;
+}
 
-    print_row(&row, table, select_statement);
-    cursor_advance(cursor);
+// Writes the saved pages back and rereads the counts of the tables they
+// belong to. Pages the transaction added past the end of a file stay,
+// as zeroed pages no row or index points to.
+void transaction_undo(Transaction* transaction) {
+  for (uint32_t i = 0; i < transaction->num_pages; i++) {
+    UndoPage* undo = &transaction->pages[i];
+    void* page = get_page(undo->pager, undo->page_num);
+    pager_mark_dirty(undo->pager, undo->page_num);
+    memcpy(page, undo->data, page_size);
+  }
+  for (uint32_t i = 0; i < transaction->num_tables; i++) {
+    table_read_header(transaction->tables[i]);
   }
+}
 
-  free(cursor);
+// Commits or rolls back the session's transaction and lets other writers in
+void transaction_end(Session* session, bool commit) {
+  Schema* schema = session->schema;
+  Transaction* transaction = session->transaction;
+  current_transaction = NULL;
+  if (!commit) {
+    transaction_undo(transaction);
+  }
+  uint64_t commit_position = db_commit(schema);
+  schema->buffer_pool->transaction = NULL;
+  for (uint32_t i = 0; i < transaction->num_tables; i++) {
+    pthread_rwlock_unlock(&transaction->tables[i]->lock);
+  }
+  pthread_mutex_unlock(&schema->commit_lock);
+  wal_sync(schema->wal, commit_position);
+  arena_free(transaction->arena);
+  free(transaction);
+  session->transaction = NULL;
+}
 
+ExecuteResult execute_transaction(Statement* statement, Session* session) {
+  if (statement->type == STATEMENT_BEGIN) {
+    if (session->transaction != NULL) {
+      return EXECUTE_TRANSACTION_OPEN;
+    }
+    pthread_mutex_lock(&session->schema->commit_lock);
+    Transaction* transaction = calloc(1, sizeof(Transaction));
+    transaction->arena = arena_new();
+    session->transaction = transaction;
+    session->schema->buffer_pool->transaction = transaction;
+    return EXECUTE_SUCCESS;
+  }
+  if (session->transaction == NULL) {
+    return EXECUTE_NO_TRANSACTION;
+  }
+  transaction_end(session, statement->type == STATEMENT_COMMIT);
   return EXECUTE_SUCCESS;
 }
 
-ExecuteResult execute_update(Statement* statement) {
-  UpdateStatement* update_statement = statement->statementDetail;
-  Table* table = statement->table;
-
-  Cursor* cursor = table_start(table);
-
-  Row row;
-  while (!(cursor->end_of_table)) {
-    deserialize_row(cursor_value(cursor), &row, table);
+// Takes the read locks of a select, which may be NULL for tables its
+// transaction already holds. With two, the first is waited for and the
+// second only tried, since the other may be held by a transaction that
+// waits for the first.
+void lock_shared(Table* first, Table* second) {
+  while (true) {
+    if (first == NULL || second == NULL) {
+      Table* table = first != NULL ? first : second;
+      if (table != NULL) {
+        pthread_rwlock_rdlock(&table->lock);
+      }
+      return;
+    }
+    pthread_rwlock_rdlock(&first->lock);
+    if (pthread_rwlock_tryrdlock(&second->lock) == 0) {
+      return;
+    }
+    pthread_rwlock_unlock(&first->lock);
+    Table* swap = first;
+    first = second;
+    second = swap;
+  }
+}
 
-    if (!valid_where_clause(&row, update_statement->where_clause)) {
-      cursor_advance(cursor);
-      continue;
+// Selects share the locks of the tables they read. Writers take the commit
+// lock and their table's lock for themselves, and keep them until the
+// statement is committed, or in a transaction until it ends.
+void lock_statement(Schema* schema, Statement* statement) {
+  Table* table = statement->table;
+  Transaction* transaction = current_transaction;
+  if (statement->type == STATEMENT_CREATE_TABLE) {
+    pthread_mutex_lock(&schema->commit_lock);
+    return;
+  }
+  if (statement->type != STATEMENT_SELECT) {
+    if (transaction == NULL) {
+      pthread_mutex_lock(&schema->commit_lock);
+      pthread_rwlock_wrlock(&table->lock);
+    } else if (!transaction_holds(transaction, table)) {
+      pthread_rwlock_wrlock(&table->lock);
+      if (transaction->num_tables == transaction->tables_capacity) {
+        uint32_t capacity = transaction->tables_capacity == 0
+                                ? 4
+                                : transaction->tables_capacity * 2;
+        transaction->tables = arena_realloc(
+            transaction->arena, transaction->tables,
+            transaction->tables_capacity * sizeof(Table*),
+            capacity * sizeof(Table*));
+        transaction->tables_capacity = capacity;
+      }
+      transaction->tables[transaction->num_tables++] = table;
     }
+    return;
+  }
+  Table* other = ((SelectStatement*)statement->statementDetail)->join_table;
+  lock_shared(transaction_holds(transaction, table) ? NULL : table,
+              other == table || transaction_holds(transaction, other)
+                  ? NULL
+                  : other);
+}
 
-    ColumnDefinition* column = update_statement->column;
-    memcpy(row.data + column->offset, update_statement->value.data,
-           column->size);
+void unlock_statement(Schema* schema, Statement* statement) {
+  Table* table = statement->table;
+  Transaction* transaction = current_transaction;
+  if (statement->type == STATEMENT_CREATE_TABLE) {
+    pthread_mutex_unlock(&schema->commit_lock);
+    return;
+  }
+  if (statement->type != STATEMENT_SELECT) {
+    if (transaction == NULL) {
+      pthread_rwlock_unlock(&table->lock);
+      pthread_mutex_unlock(&schema->commit_lock);
+    }
+    return;
+  }
+  if (!transaction_holds(transaction, table)) {
+    pthread_rwlock_unlock(&table->lock);
+  }
+  Table* other = ((SelectStatement*)statement->statementDetail)->join_table;
+  if (other != NULL && other != table &&
+      !transaction_holds(transaction, other)) {
+    pthread_rwlock_unlock(&other->lock);
+  }
+}
 
-    serialize_row(&row, cursor_value(cursor), table);
+// Prints what each step of an explained statement did, then its totals
+void print_profile(FILE* out, Profile* profile, uint64_t elapsed_ns) {
+  for (uint32_t i = 0; i < profile->num_operators; i++) {
+    ProfileOperator* step = &profile->operators[i];
+    fprintf(out, "%s", step->name);
+    if (step->table_name != NULL) {
+      fprintf(out, " on %s", step->table_name);
+    }
+    fprintf(out, ": rows=%" PRIu64 " time=%.3f ms\n", step->rows,
+            step->elapsed_ns / 1e6);
+  }
+  Stats* stats = &profile->stats;
+  fprintf(out, "Rows scanned: %" PRIu64 ", matched: %" PRIu64 "\n",
+          stats->rows_scanned, stats->rows_matched);
+  fprintf(out,
+          "Pages fetched: %" PRIu64 ", hits: %" PRIu64 ", misses: %" PRIu64
+          ", skipped: %" PRIu64 "\n",
+          stats->pages_fetched, stats->page_hits, stats->page_misses,
+          stats->pages_skipped);
+  fprintf(out, "Bytes read: %" PRIu64 ", written: %" PRIu64 "\n",
+          stats->bytes_read, stats->bytes_written);
+  fprintf(out, "Total time: %.3f ms\n", elapsed_ns / 1e6);
+}
 
-    cursor_advance(cursor);
+// Prepares and executes one statement, printing how it went. A select
+// run under explain analyze prints its profile instead of its rows.
+void run_statement(Session* session, InputBuffer* input_buffer) {
+  FILE* out = session->out.file;
+  InputBuffer body = *input_buffer;
+  bool analyze = strncasecmp(body.buffer, "explain analyze ", 16) == 0;
+  if (analyze) {
+    body.buffer += 16;
+    body.input_length -= 16;
+    input_buffer = &body;
+  }
+  // Set before prepare, which opens the tables a statement uses
+  current_transaction = session->transaction;
+  Statement statement;
+  PrepareResult prepare_result =
+      prepare_statement(input_buffer, &statement, session);
+  if (prepare_result == PREPARE_SUCCESS && analyze &&
+      statement.type != STATEMENT_SELECT) {
+    prepare_result = PREPARE_SYNTAX_ERROR;
+  }
+  switch (prepare_result) {
+    case PREPARE_SUCCESS:
+      break;
+    case PREPARE_NEGATIVE_ID:
+      fprintf(out, "ID must be positive.\n");
+      return;
+    case PREPARE_STRING_TOO_LONG:
+      fprintf(out, "String is too long.\n");
+      return;
+    case PREPARE_UNRECOGNIZED_STATEMENT:
+      fprintf(out, "Unrecognized keyword at start of '%s'.\n",
+              input_buffer->buffer);
+      return;
+    case PREPARE_INTERNAL_ERROR:
+      fprintf(out, "Internal error.\n");
+      return;
+    case PREPARE_SYNTAX_ERROR:
+      fprintf(out, "Syntax error.\n");
+      return;
+    case PREPARE_TABLE_NOT_FOUND:
+      fprintf(out, "Table not found.\n");
+      return;
+    case PREPARE_STATEMENT_NOT_FOUND:
+      fprintf(out, "Prepared statement not found.\n");
+      return;
+    case PREPARE_AMBIGUOUS_COLUMN:
+      fprintf(out, "Ambiguous column name.\n");
+      return;
   }
 
-  free(cursor);
+  ExecuteResult execute_result = EXECUTE_SUCCESS;
+  bool in_transaction = session->transaction != NULL;
+  if (statement.type == STATEMENT_BEGIN ||
+      statement.type == STATEMENT_COMMIT ||
+      statement.type == STATEMENT_ROLLBACK) {
+    execute_result = execute_transaction(&statement, session);
+  } else if (in_transaction && (statement.type == STATEMENT_CREATE_INDEX ||
+                                statement.type == STATEMENT_CREATE_TABLE ||
+                                statement.type == STATEMENT_ANALYZE)) {
+    execute_result = EXECUTE_IN_TRANSACTION;
+  } else if (analyze) {
+    Profile profile = {0};
+    Output discard = {fopen("/dev/null", "w"), OUTPUT_TEXT};
+    Schema* schema = session->schema;
+    uint64_t start = now_ns();
+    lock_statement(schema, &statement);
+    current_profile = &profile;
+    execute_result = execute_statement(&statement, schema, &discard);
+    current_profile = NULL;
+    unlock_statement(schema, &statement);
+    fclose(discard.file);
+    STATS_ADD(statements, 1);
+    print_profile(out, &profile, now_ns() - start);
+  } else if (statement.type != STATEMENT_PREPARE) {
+    Schema* schema = session->schema;
+    uint64_t commit_position = 0;
+    lock_statement(schema, &statement);
+    bool implicit = !in_transaction && (statement.type == STATEMENT_INSERT ||
+                                        statement.type == STATEMENT_UPDATE ||
+                                        statement.type == STATEMENT_DELETE);
+    Transaction* transaction =
+        implicit ? implicit_transaction_begin(schema) : NULL;
+    execute_result = execute_statement(&statement, schema, &session->out);
+    if (implicit) {
+      commit_position = implicit_transaction_commit(schema, transaction);
+    } else if (statement.type != STATEMENT_SELECT) {
+      if (!in_transaction) {
+        commit_position = db_commit(schema);
+      }
+    } else if (session->out.mode == OUTPUT_BINARY) {
+      uint32_t end_of_result = 0;
+      fwrite(&end_of_result, sizeof(uint32_t), 1, out);
+    }
+    unlock_statement(schema, &statement);
+    // Other writers can commit while this one waits, and share its fsync
+    wal_sync(schema->wal, commit_position);
+    STATS_ADD(statements, 1);
+  }
+  switch (execute_result) {
+    case EXECUTE_SUCCESS:
+      fprintf(out, "Executed.\n");
+      break;
+    case EXECUTE_TABLE_FULL:
+      fprintf(out, "Error: Table full.\n");
+      break;
+    case EXECUTE_INDEX_EXISTS:
+      fprintf(out, "Error: Index already exists.\n");
+      break;
+    case EXECUTE_TABLE_EXISTS:
+      fprintf(out, "Error: Table already exists.\n");
+      break;
+    case EXECUTE_TRANSACTION_OPEN:
+      fprintf(out, "Error: A transaction is already open.\n");
+      break;
+    case EXECUTE_NO_TRANSACTION:
+      fprintf(out, "Error: No transaction is open.\n");
+      break;
+    case EXECUTE_IN_TRANSACTION:
+      fprintf(out, "Error: Not allowed in a transaction.\n");
+      break;
+    case EXECUTE_COMPRESSED_SERVED:
+      fprintf(out, "Error: Compressed tables cannot be served.\n");
+      break;
+  }
+  current_transaction = NULL;
+}
 
-  return EXECUTE_SUCCESS;
+double timeval_seconds(struct timeval time) {
+  return time.tv_sec + time.tv_usec / 1e6;
 }
 
-ExecuteResult execute_delete(Statement* statement) {
-  DeleteStatement* delete_statement = statement->statementDetail;
-  Table* table = statement->table;
+// Runs one line of input and writes its results to the session's output.
+// Returns false on .exit.
+bool run_command(Session* session, InputBuffer* input_buffer) {
+  FILE* out = session->out.file;
+  if (input_buffer->buffer[0] == '.') {
+    MetaCommandResult meta_command_result =
+        do_meta_cmd(input_buffer, session);
+    switch (meta_command_result) {
+      case META_COMMAND_SUCCESS:
+        return true;
+      case META_COMMAND_EXIT:
+        return false;
+      case META_COMMAND_UNRECOGNIZED_COMMAND:
+        fprintf(out, "Unrecognized command '%s'\n", input_buffer->buffer);
+        return true;
+    }
+  }
 
-  Cursor* cursor = table_start(table);
+  uint64_t start = now_ns();
+  struct rusage usage_start;
+  getrusage(RUSAGE_SELF, &usage_start);
+  run_statement(session, input_buffer);
+  // Frees everything the statement was parsed into at once
+  arena_reset(session->arena);
+  if (session->timer) {
+    struct rusage usage_end;
+    getrusage(RUSAGE_SELF, &usage_end);
+    fprintf(out, "Run Time: real %.3f user %.3f sys %.3f\n",
+            (now_ns() - start) / 1e9,
+            timeval_seconds(usage_end.ru_utime) -
+                timeval_seconds(usage_start.ru_utime),
+            timeval_seconds(usage_end.ru_stime) -
+                timeval_seconds(usage_start.ru_stime));
+  }
+  return true;
+}
 
-  int num_deleted_rows = 0;
+// Connections accepted by the server, waiting for a free worker
+typedef struct Connection {
+  int socket;
+  struct Connection* next;
+} Connection;
 
-  Row row;
-  while (!(cursor->end_of_table)) {
-    deserialize_row(cursor_value(cursor), &row, table);
+typedef struct {
+  Schema* schema;
+  pthread_mutex_t lock;
+  pthread_cond_t available;
+  Connection* head;
+  Connection* tail;
+} ConnectionQueue;
+
+// Serves one client: each line it sends is run like a line typed at the
+// REPL, and the output is sent back once the line is done
+void serve_connection(Schema* schema, int socket) {
+  FILE* in = fdopen(socket, "r");
+  FILE* out = fdopen(dup(socket), "w");
+  setvbuf(out, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+  Session session = {schema, plan_cache_new(), {out, OUTPUT_TEXT},
+                     arena_new(), false, NULL};
+  InputBuffer* input_buffer = new_input_buffer();
+  ssize_t bytes_read;
+  while ((bytes_read = getline(&input_buffer->buffer,
+                               &input_buffer->buffer_length, in)) > 0) {
+    while (bytes_read > 0 && (input_buffer->buffer[bytes_read - 1] == '\n' ||
+                              input_buffer->buffer[bytes_read - 1] == '\r')) {
+      input_buffer->buffer[--bytes_read] = '\0';
+    }
+    input_buffer->input_length = bytes_read;
+    if (bytes_read > 0 && !run_command(&session, input_buffer)) {
+      break;
+    }
+    if (fflush(out) != 0) {
+      break;
+    }
+  }
+  // A client that goes away in a transaction did not commit it
+  if (session.transaction != NULL) {
+    transaction_end(&session, false);
+  }
+  plan_cache_free(session.plan_cache);
+  arena_free(session.arena);
+  free(input_buffer->buffer);
+  free(input_buffer);
+  fclose(out);
+  fclose(in);
+}
 
-    if (!valid_where_clause(&row, delete_statement->where_clause)) {
-      cursor_advance(cursor);
-      continue;
+void* server_worker(void* arg) {
+  ConnectionQueue* queue = arg;
+  while (true) {
+    pthread_mutex_lock(&queue->lock);
+    while (queue->head == NULL) {
+      pthread_cond_wait(&queue->available, &queue->lock);
     }
+    Connection* connection = queue->head;
+    queue->head = connection->next;
+    if (queue->head == NULL) {
+      queue->tail = NULL;
+    }
+    pthread_mutex_unlock(&queue->lock);
 
-    memset(cursor_value(cursor), 0, table->row_size);
-    cursor_advance(cursor);
-    num_deleted_rows++;
+    serve_connection(queue->schema, connection->socket);
+    free(connection);
   }
+  return NULL;
+}
 
-  cursor = table_start(table);
-  Cursor* cursor2 = malloc(sizeof(Cursor));
-  cursor2->table = table;
-  cursor2->row_num = -1;
-  cursor2->end_of_table = false;
+// --listen [host]:port accepts clients and hands them to SERVER_WORKERS
+// threads, each serving one connection at a time
+void serve(Schema* schema, const char* address) {
+  // Compressed tables always go through the buffer pool, whose frames one
+  // session could evict from under another
+  for (uint32_t i = 0; i < schema->num_tables; i++) {
+    if (schema->tables[i]->compressed) {
+      printf("Compressed table %s cannot be served.\n",
+             schema->tables[i]->table_name);
+      exit(EXIT_FAILURE);
+    }
+  }
+  schema->serving = true;
 
-  unsigned char* empty_row = malloc(table->row_size);
-  memset(empty_row, 0, table->row_size);
+  char* colon = strrchr(address, ':');
+  if (colon == NULL) {
+    printf("Listen address must be [host]:port.\n");
+    exit(EXIT_FAILURE);
+  }
+  struct sockaddr_in socket_address;
+  memset(&socket_address, 0, sizeof(socket_address));
+  socket_address.sin_family = AF_INET;
+  socket_address.sin_port = htons(atoi(colon + 1));
+  socket_address.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (colon != address) {
+    char* host = strndup(address, colon - address);
+    if (inet_pton(AF_INET, host, &socket_address.sin_addr) != 1) {
+      printf("Invalid listen address %s.\n", host);
+      exit(EXIT_FAILURE);
+    }
+    free(host);
+  }
 
-  while (!(cursor->end_of_table)) {
-    deserialize_row(cursor_value(cursor), &row, table);
+  int server = socket(AF_INET, SOCK_STREAM, 0);
+  int reuse = 1;
+  setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  if (server < 0 ||
+      bind(server, (struct sockaddr*)&socket_address,
+           sizeof(socket_address)) < 0 ||
+      listen(server, SOMAXCONN) < 0) {
+    printf("Unable to listen on %s: %d\n", address, errno);
+    exit(EXIT_FAILURE);
+  }
+  // A client that hangs up should not take the server down with it
+  signal(SIGPIPE, SIG_IGN);
+
+  ConnectionQueue queue = {schema};
+  pthread_mutex_init(&queue.lock, NULL);
+  pthread_cond_init(&queue.available, NULL);
+  for (uint32_t i = 0; i < SERVER_WORKERS; i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, server_worker, &queue) != 0) {
+      printf("Unable to start worker thread\n");
+      exit(EXIT_FAILURE);
+    }
+    pthread_detach(thread);
+  }
 
-    if ((memcmp(cursor_value(cursor), empty_row, table->row_size) == 0) &&
-        cursor2->row_num == -1) {
-      cursor2->row_num = cursor->row_num;
-      cursor2->end_of_table = cursor->end_of_table;
-      cursor_advance(cursor);
+  printf("Listening on %s\n", address);
+  fflush(stdout);
+  while (true) {
+    int client = accept(server, NULL, NULL);
+    if (client < 0) {
       continue;
     }
-
-    if (memcmp(cursor_value(cursor), empty_row, table->row_size) != 0) {
-      if (cursor2->row_num != -1) {
-        memcpy(cursor_value(cursor2), cursor_value(cursor), table->row_size);
-        memset(cursor_value(cursor), 0, table->row_size);
-        cursor_advance(cursor);
-        cursor_advance(cursor2);
-      } else {
-        cursor_advance(cursor);
-      }
+    Connection* connection = malloc(sizeof(Connection));
+    connection->socket = client;
+    connection->next = NULL;
+    pthread_mutex_lock(&queue.lock);
+    if (queue.tail != NULL) {
+      queue.tail->next = connection;
+    } else {
+      queue.head = connection;
     }
+    queue.tail = connection;
+    pthread_cond_signal(&queue.available);
+    pthread_mutex_unlock(&queue.lock);
   }
-
-  table->num_rows -= num_deleted_rows;
-  free(cursor);
-
-  return EXECUTE_SUCCESS;
 }
 
-ExecuteResult execute_statement(Statement* statement) {
-  switch (statement->type) {
-    case STATEMENT_INSERT:
-      return execute_insert(statement);
-    case STATEMENT_SELECT:
-      return execute_select(statement);
-    case STATEMENT_UPDATE:
-      return execute_update(statement);
-    case STATEMENT_DELETE:
-      return execute_delete(statement);
+void print_prompt() { printf("db > "); }
+
+// Parses sizes such as 4096, 512K, 64M or 1G
+uint64_t parse_size(const char* str) {
+  char* end = NULL;
+  uint64_t size = strtoull(str, &end, 10);
+  switch (tolower(*end)) {
+    case 'g':
+      size *= 1024;
+      // fall through
+    case 'm':
+      size *= 1024;
+      // fall through
+    case 'k':
+      size *= 1024;
   }
+  return size;
 }
 
-void print_prompt() { printf("db > "); }
-
+// bench.c includes this file for the engine and has its own main
+#ifndef DB_NO_MAIN
 int main(int argc, char* argv[]) {
-  if (argc < 2) {
+  char* filename = NULL;
+  uint64_t buffer_pool_size = DEFAULT_BUFFER_POOL_SIZE;
+  uint32_t sync_window_ms = WAL_DEFAULT_SYNC_WINDOW_MS;
+  bool use_mmap = false;
+  uint32_t new_page_size = 0;
+  char* listen_address = NULL;
+  long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--buffer-pool") == 0 && i + 1 < argc) {
+      buffer_pool_size = parse_size(argv[++i]);
+    } else if (strcmp(argv[i], "--wal-sync-window") == 0 && i + 1 < argc) {
+      sync_window_ms = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--mmap") == 0) {
+      use_mmap = true;
+    } else if (strcmp(argv[i], "--page-size") == 0 && i + 1 < argc) {
+      uint64_t size = parse_size(argv[++i]);
+      new_page_size = size <= MAX_PAGE_SIZE ? size : UINT32_MAX;
+    } else if (strcmp(argv[i], "--sort-memory") == 0 && i + 1 < argc) {
+      sort_memory = parse_size(argv[++i]);
+    } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      num_threads = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--listen") == 0 && i + 1 < argc) {
+      listen_address = argv[++i];
+      // Readers on other threads use page pointers without pinning them,
+      // mapped pages cannot be evicted from under them. Compressed tables
+      // always go through the buffer pool, so serve refuses them.
+      use_mmap = true;
+    } else {
+      filename = argv[i];
+    }
+  }
+
+  if (filename == NULL) {
     printf("Must supply a database filename.\n");
     exit(EXIT_FAILURE);
   }
 
-  char* filename = argv[1];
-  Schema* schema = db_open(filename);
+  filter_kernels_init();
+  Schema* schema = db_open(filename, buffer_pool_size, sync_window_ms, use_mmap,
+                           new_page_size);
+  // Every worker of a scan pins a page, leave most frames to other pages
+  if (num_threads > MAX_THREADS) {
+    num_threads = MAX_THREADS;
+  }
+  if (num_threads > schema->buffer_pool->num_frames / 4) {
+    num_threads = schema->buffer_pool->num_frames / 4;
+  }
+  thread_pool = thread_pool_new(num_threads > 1 ? num_threads : 1);
+
+  if (listen_address != NULL) {
+    serve(schema, listen_address);
+  }
 
+  // Results are written in large blocks and flushed once per command
+  setvbuf(stdout, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+  Session session = {schema, plan_cache_new(), {stdout, OUTPUT_TEXT},
+                     arena_new(), false, NULL};
   InputBuffer* input_buffer = new_input_buffer();
   while (true) {
     print_prompt();
-    read_input(input_buffer);
-
-    if (input_buffer->buffer[0] == '.') {
-      MetaCommandResult meta_command_result = do_meta_cmd(input_buffer, schema);
-      switch (meta_command_result) {
-        case META_COMMAND_SUCCESS:
-          continue;
-        case META_COMMAND_UNRECOGNIZED_COMMAND:
-          printf("Unrecognized command '%s'\n", input_buffer->buffer);
-          continue;
-      }
-    }
-
-    Statement statement;
-    PrepareResult prepare_result =
-        prepare_statement(input_buffer, &statement, schema);
-    switch (prepare_result) {
-      case PREPARE_SUCCESS:
-        break;
-      case PREPARE_NEGATIVE_ID:
-        printf("ID must be positive.\n");
-        continue;
-      case PREPARE_STRING_TOO_LONG:
-        printf("String is too long.\n");
-        continue;
-      case PREPARE_UNRECOGNIZED_STATEMENT:
-        printf("Unrecognized keyword at start of '%s'.\n",
-               input_buffer->buffer);
-        continue;
-      case PREPARE_INTERNAL_ERROR:
-        printf("Internal error.\n");
-        continue;
-      case PREPARE_SYNTAX_ERROR:
-        printf("Syntax error.\n");
-        continue;
-      case PREPARE_TABLE_NOT_FOUND:
-        printf("Table not found.\n");
-        continue;
+    fflush(stdout);
+    if (!read_input(input_buffer)) {
+      // Leave the files to recovery, but not the commits still buffered
+      // for the writer thread
+      wal_flush(schema->wal, UINT64_MAX);
+      printf("Error reading input\n");
+      exit(EXIT_FAILURE);
     }
-
-    ExecuteResult execute_result = execute_statement(&statement);
-    switch (execute_result) {
-      case EXECUTE_SUCCESS:
-        printf("Executed.\n");
-        break;
-      case EXECUTE_TABLE_FULL:
-        printf("Error: Table full.\n");
-        break;
+    if (!run_command(&session, input_buffer)) {
+      if (session.transaction != NULL) {
+        transaction_end(&session, false);
+      }
+      plan_cache_free(session.plan_cache);
+      arena_free(session.arena);
+      db_close(schema);
+      thread_pool_free(thread_pool);
+      exit(EXIT_SUCCESS);
     }
   }
 }
+#endif
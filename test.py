@@ -1,17 +1,21 @@
 import unittest
 import subprocess
 import os
+import re
+import socket
+import struct
+import threading
 
 class TestDatabase(unittest.TestCase):
     def setUp(self):
         # remove .table files inside data directory
         for file in os.listdir('data'):
-            if file.endswith('.table'):
+            if file.endswith(('.table', '.index', '.wal', '.catalog', '.overflow', '.stats', '.zones', '.tables')):
                 os.remove(f'data/{file}')
 
-    def run_script(self, commands):
+    def run_script(self, commands, args=[], schema='db.schema'):
         process = subprocess.Popen(
-            ['./main', 'db.schema'],
+            ['./main'] + args + [schema],
             stdin=subprocess.PIPE,
             stdout=subprocess.PIPE,
             stderr=subprocess.PIPE,
@@ -217,11 +221,871 @@ class TestDatabase(unittest.TestCase):
 
         self.assertEqual(result, expected_output)
 
-    def test_table_full_error(self):
-        script = [f"insert into users values ({i}, user{i}, person{i}@example.com)" for i in range(1, 1402)]
-        script.append(".exit\n")
+    def test_insert_reuses_deleted_slot(self):
+        script = [
+            "insert into users values (1, user1, person1@example.com)",
+            "insert into users values (2, user2, person2@example.com)",
+            "insert into users values (3, user3, person3@example.com)",
+            "delete from users where id = 2",
+            "insert into users values (4, user4, person4@example.com)",
+            "select * from users",
+            "select * from users where id = 4",
+            ".exit\n",
+        ]
         result = self.run_script(script)
-        self.assertEqual(result[-2], 'db > Error: Table full.')
+        self.assertEqual(result[-7:], [
+            "db > (1, user1, person1@example.com)",
+            "(4, user4, person4@example.com)",
+            "(3, user3, person3@example.com)",
+            "Executed.",
+            "db > (4, user4, person4@example.com)",
+            "Executed.",
+            "db >",
+        ])
+
+    def test_vacuum(self):
+        script = [f"insert into users values ({i}, user{i}, person{i}@example.com)" for i in range(1, 101)]
+        script += [
+            "delete from users where id > 3",
+            "delete from users where id = 1",
+            ".vacuum users",
+            ".exit\n",
+        ]
+        self.run_script(script)
+        self.assertEqual(os.path.getsize('data/users.table'), 2 * 4096)
+
+        result = self.run_script([
+            "select * from users",
+            "select * from users where id = 3",
+            ".exit\n",
+        ])
+        self.assertEqual(result, [
+            "db > (2, user2, person2@example.com)",
+            "(3, user3, person3@example.com)",
+            "Executed.",
+            "db > (3, user3, person3@example.com)",
+            "Executed.",
+            "db >",
+        ])
+
+    def test_real_column(self):
+        script = [
+            "insert into balance values (1, 100.5)",
+            "insert into balance values (2, 20.25)",
+            "select * from balance where balance > 50",
+            ".exit\n",
+        ]
+        result = self.run_script(script)
+        self.assertEqual(result[-3:], [
+            "db > (1, 100.500000)",
+            "Executed.",
+            "db >",
+        ])
+
+    def test_where_with_and_or(self):
+        script = [
+            "insert into users values (1, user1, a@example.com)",
+            "insert into users values (2, user2, b@example.com)",
+            "insert into users values (3, user3, a@example.com)",
+            "insert into users values (4, user4, b@example.com)",
+            "select id from users where id > 1 and email = 'a@example.com' or id = 4",
+            "delete from users where email = 'b@example.com' and id < 3",
+            "select id from users",
+            ".exit\n",
+        ]
+        result = self.run_script(script)
+        self.assertEqual(result[-9:], [
+            "db > (3)",
+            "(4)",
+            "Executed.",
+            "db > Executed.",
+            "db > (1)",
+            "(3)",
+            "(4)",
+            "Executed.",
+            "db >",
+        ])
+
+    def test_numeric_filter_across_pages(self):
+        script = [f"insert into balance values ({i}, {i}.5)" for i in range(1, 1001)]
+        script += [
+            "delete from balance where user_id = 995",
+            "select * from balance where balance >= 990 and user_id != 999",
+            "select user_id from balance where user_id < 3",
+            ".exit\n",
+        ]
+        result = self.run_script(script)
+        expected = [f"({i}, {i}.500000)" for i in (990, 991, 992, 993, 994, 996, 997, 998, 1000)]
+        expected[0] = "db > " + expected[0]
+        self.assertEqual(result[-14:], expected + [
+            "Executed.",
+            "db > (1)",
+            "(2)",
+            "Executed.",
+            "db >",
+        ])
+
+    def test_pax_layout(self):
+        schema = 'data/test_pax.schema'
+        with open(schema, 'w') as f:
+            f.write("1\nevents;3;id:4:int,name:16:varchar,amount:8:real;pax\n")
+        self.addCleanup(os.remove, schema)
+
+        script = [f"insert into events values ({i}, event{i}, {i}.25)" for i in range(1, 1001)]
+        script += [
+            "update events set name = 'renamed' where id = 2",
+            "delete from events where amount > 3 and amount < 999",
+            ".exit\n",
+        ]
+        self.run_script(script, schema=schema)
+
+        result = self.run_script([
+            "select * from events",
+            "select name from events where id = 2",
+            ".exit\n",
+        ], schema=schema)
+        self.assertEqual(result, [
+            "db > (1, event1, 1.250000)",
+            "(2, renamed, 2.250000)",
+            "(999, event999, 999.250000)",
+            "(1000, event1000, 1000.250000)",
+            "Executed.",
+            "db > (renamed)",
+            "Executed.",
+            "db >",
+        ])
+
+        # The layout is recorded in the table file, which is read when the
+        # table is first used
+        with open(schema, 'w') as f:
+            f.write("1\nevents;3;id:4:int,name:16:varchar,amount:8:real\n")
+        result = self.run_script(["select * from events", ".exit\n"], schema=schema)
+        self.assertEqual(result, ["db > Table events is stored in a different layout"])
+
+    def test_compressed_table(self):
+        schema = 'data/test_compressed.schema'
+        with open(schema, 'w') as f:
+            f.write("1\nevents;3;id:4:int,name:16:varchar,amount:8:real;pax;compressed\n")
+        self.addCleanup(os.remove, schema)
+
+        script = [f"insert into events values ({i}, event{i % 10}, {i}.25)" for i in range(1, 3001)]
+        script += [
+            "update events set name = 'renamed' where id = 2",
+            "delete from events where amount > 3 and amount < 2999",
+            ".exit\n",
+        ]
+        self.run_script(script, ['--buffer-pool', '8'], schema=schema)
+
+        expected = [
+            "db > (1, event1, 1.250000)",
+            "(2, renamed, 2.250000)",
+            "(2999, event9, 2999.250000)",
+            "(3000, event0, 3000.250000)",
+            "Executed.",
+            "db >",
+        ]
+        self.assertEqual(self.run_script(["select * from events", ".exit\n"], schema=schema), expected)
+        self.assertEqual(self.run_script([".vacuum", "select * from events", ".exit\n"], ['--mmap'], schema=schema),
+                         ["db > " + expected[0]] + expected[1:])
+        # .vacuum leaves two pages, and the stale records are dropped
+        self.assertLess(os.path.getsize('data/events.table'), 4096)
+        self.assertEqual(self.run_script(["select * from events", ".exit\n"], schema=schema), expected)
+
+        # A compressed file cannot be read as a plain one
+        with open(schema, 'w') as f:
+            f.write("1\nevents;3;id:4:int,name:16:varchar,amount:8:real;pax\n")
+        result = self.run_script(["select * from events", ".exit\n"], schema=schema)
+        self.assertEqual(result, ["db > Unsupported table file format: data/events.table"])
+
+    def test_mmap_mode(self):
+        script = [f"insert into users values ({i}, user{i}, person{i}@example.com)" for i in range(1, 201)]
+        script += [
+            "delete from users where id > 2",
+            "update users set username = 'mapped' where id = 2",
+            ".exit\n",
+        ]
+        self.run_script(script, ['--mmap'])
+
+        # The files are the same in both modes
+        expected = [
+            "db > (1, user1, person1@example.com)",
+            "(2, mapped, person2@example.com)",
+            "Executed.",
+            "db >",
+        ]
+        self.assertEqual(self.run_script(["select * from users", ".exit\n"]), expected)
+        self.assertEqual(self.run_script(["select * from users", ".exit\n"], ['--mmap']), expected)
+
+    def test_prepared_statements(self):
+        script = [
+            "prepare add as insert into users values (?, ?, ?)",
+            "execute add(1, user1, person1@example.com)",
+            "execute add(2, User2, person2@example.com)",
+            "execute add(3, user3)",
+            "prepare find as select * from users where id > ? and username != ?",
+            "execute find(1, 'user3')",
+            "execute missing(1)",
+            ".exit\n",
+        ]
+        result = self.run_script(script)
+        self.assertEqual(result, [
+            "db > Executed.",
+            "db > Executed.",
+            "db > Executed.",
+            "db > Syntax error.",
+            "db > Executed.",
+            "db > (2, User2, person2@example.com)",
+            "Executed.",
+            "db > Prepared statement not found.",
+            "db >",
+        ])
+
+    def test_plan_cache_binds_new_literals(self):
+        script = [f"insert into users values ({i}, user{i}, person{i}@example.com)" for i in range(1, 4)]
+        script += [
+            "update users set username = 'Renamed' where id = 2",
+            "select * from users where username = 'Renamed'",
+            "select * from users where username = 'user3'",
+            "select * from users where id = 1",
+            ".exit\n",
+        ]
+        result = self.run_script(script)
+        self.assertEqual(result[3:], [
+            "db > Executed.",
+            "db > (2, Renamed, person2@example.com)",
+            "Executed.",
+            "db > (3, user3, person3@example.com)",
+            "Executed.",
+            "db > (1, user1, person1@example.com)",
+            "Executed.",
+            "db >",
+        ])
+
+    def test_multi_row_insert(self):
+        script = [
+            "insert into users values (1, user1, person1@example.com), (2, user2, person2@example.com)",
+            "insert into users values (3, user3, person3@example.com), (4, user4)",
+            "select * from users",
+            ".exit\n",
+        ]
+        result = self.run_script(script)
+        self.assertEqual(result, [
+            "db > Executed.",
+            "db > Syntax error.",
+            "db > (1, user1, person1@example.com)",
+            "(2, user2, person2@example.com)",
+            "Executed.",
+            "db >",
+        ])
+
+    def test_key_range_uses_both_bounds(self):
+        values = ", ".join(f"({i}, user{i}, person{i}@example.com)" for i in range(1, 20001))
+        result = self.run_script([
+            f"insert into users values {values}",
+            "explain analyze select * from users where id >= 5000 and id < 5100",
+            "explain analyze select * from users where id > 5090 and username != 'x' and id <= 6000 and id < 5100",
+            "select count(*) from users where id > 5100 and id < 5000",
+            ".exit\n",
+        ])
+        scanned = [line for line in result if line.startswith("Rows scanned")]
+        self.assertEqual(scanned, ["Rows scanned: 100, matched: 100",
+                                   "Rows scanned: 9, matched: 9"])
+        self.assertEqual(result[-3:], ["db > (0)", "Executed.", "db >"])
+
+    def test_explain_analyze(self):
+        script = [
+            "insert into users values (1, user1, person1@example.com)",
+            "insert into users values (2, user2, person2@example.com)",
+            "explain analyze select * from users where id = 2",
+            "explain analyze select count(*) from users where username = 'user1'",
+            "explain analyze delete from users where id = 1",
+            ".timer on",
+            "select * from users where id = 2",
+            ".timer off",
+            ".stats",
+            ".exit\n",
+        ]
+        result = [re.sub(r"time=[0-9.]+", "time=T", line)
+                  for line in self.run_script(script)]
+        self.assertEqual(result[2:8], [
+            "db > Index lookup on users: rows=1 time=T ms",
+            "Fetch rows on users: rows=1 time=T ms",
+            "Rows scanned: 1, matched: 1",
+        ] + result[5:8])
+        self.assertRegex(result[5], r"^Pages fetched: \d+, hits: \d+, misses: \d+, skipped: 0$")
+        self.assertEqual(result[6], "Bytes read: 0, written: 0")
+        self.assertRegex(result[7], r"^Total time: [0-9.]+ ms$")
+        self.assertEqual(result[8:11], [
+            "Executed.",
+            "db > Scan on users: rows=1 time=T ms",
+            "Aggregate: rows=1 time=T ms",
+        ])
+        self.assertEqual(result[11], "Rows scanned: 2, matched: 1")
+        self.assertEqual(result[15:17], ["Executed.", "db > Syntax error."])
+        self.assertEqual(result[17:19], ["db > db > (2, user2, person2@example.com)",
+                                         "Executed."])
+        self.assertRegex(result[19],
+                         r"^Run Time: real [0-9.]+ user [0-9.]+ sys [0-9.]+$")
+        self.assertEqual(result[20], "db > db > statements 5")
+        self.assertEqual(result[21:23], ["rows_scanned 4", "rows_matched 3"])
+        self.assertEqual([line.split()[0] for line in result[23:29]], [
+            "pages_fetched", "page_hits", "page_misses", "pages_skipped",
+            "bytes_read", "bytes_written",
+        ])
+
+    def test_statements_reuse_memory(self):
+        # Plans outlive the memory of the statements run between them,
+        # including one too large for the arena's blocks
+        script = ["prepare find as select username from users where id = ?"]
+        for batch in range(20):
+            values = ", ".join(f"({i}, user{i}, person{i}@example.com)"
+                               for i in range(batch * 100 + 1, batch * 100 + 101))
+            script += [
+                f"insert into users values {values}",
+                "select * from users where nope = 1",
+                f"execute find({batch * 100 + 1})",
+            ]
+        values = ", ".join(f"({i}, user{i}, person{i}@example.com)"
+                           for i in range(2001, 12001))
+        script += [
+            f"insert into users values {values}",
+            "execute find(11999)",
+            "select count(*) from users",
+            ".exit\n",
+        ]
+        result = self.run_script(script)
+        self.assertEqual(result[1:4], [
+            "db > Executed.",
+            "db > Syntax error.",
+            "db > (user1)",
+        ])
+        self.assertEqual(result[-8:], [
+            "db > (user1901)",
+            "Executed.",
+            "db > Executed.",
+            "db > (user11999)",
+            "Executed.",
+            "db > (12000)",
+            "Executed.",
+            "db >",
+        ])
+
+    def test_import_csv(self):
+        csv = 'data/test_import.csv'
+        with open(csv, 'w') as f:
+            f.write("id,username,email\n")
+            for i in range(1, 1001):
+                f.write(f'{i},user{i},"person{i}@example.com"\n')
+        script = [
+            f".import users {csv}",
+            "select * from users where id = 1000",
+            ".exit\n",
+        ]
+        result = self.run_script(script)
+        os.remove(csv)
+        self.assertEqual(result, [
+            "db > Imported 1000 rows.",
+            "db > (1000, user1000, person1000@example.com)",
+            "Executed.",
+            "db >",
+        ])
+
+    def test_join(self):
+        script = [
+            "insert into users values (1, user1, person1@example.com), (2, user2, person2@example.com)",
+            "insert into balance values (2, 20.5), (1, 10), (2, 7), (3, 30)",
+            "select * from users join balance on users.id = balance.user_id",
+            "select username, balance from users join balance on user_id = id where balance > 8",
+            ".exit\n",
+        ]
+        result = self.run_script(script)
+        self.assertEqual(result[2:], [
+            "db > (2, user2, person2@example.com, 2, 20.500000)",
+            "(1, user1, person1@example.com, 1, 10.000000)",
+            "(2, user2, person2@example.com, 2, 7.000000)",
+            "Executed.",
+            "db > (user2, 20.500000)",
+            "(user1, 10.000000)",
+            "Executed.",
+            "db >",
+        ])
+
+    def test_hash_join(self):
+        schema = 'data/test_join.schema'
+        with open(schema, 'w') as f:
+            f.write("2\ncustomers;2;cust:4:int,name:16:varchar\norders;2;customer:4:int,amount:8:real\n")
+        script = [
+            "insert into customers values (1, ann), (2, ben)",
+            "insert into orders values (2, 1.5), (3, 2.5), (2, 3.5), (1, 1)",
+            "select name, amount from orders join customers on cust = customer",
+            ".exit\n",
+        ]
+        result = self.run_script(script, schema=schema)
+        for file in ['customers.table', 'orders.table', 'test_join.schema']:
+            os.remove(f'data/{file}')
+        self.assertEqual(result[2:], [
+            "db > (ben, 1.500000)",
+            "(ben, 3.500000)",
+            "(ann, 1.000000)",
+            "Executed.",
+            "db >",
+        ])
+
+    def test_join_ambiguous_column(self):
+        schema = 'data/test_ambiguous.schema'
+        with open(schema, 'w') as f:
+            f.write("2\nusers;3;id:4:int,username:32:varchar,email:255:varchar\norders;3;id:4:int,user_id:4:int,total:8:real\n")
+        self.addCleanup(os.remove, schema)
+        script = [
+            "insert into users values (1, user1, person1@example.com)",
+            "insert into orders values (10, 1, 2.5)",
+            "select id from users join orders on users.id = user_id",
+            "select username from users join orders on users.id = user_id where id = 10",
+            "select orders.id, total from users join orders on users.id = user_id where orders.id = 10",
+            ".exit\n",
+        ]
+        result = self.run_script(script, schema=schema)
+        self.assertEqual(result[2:], [
+            "db > Ambiguous column name.",
+            "db > Ambiguous column name.",
+            "db > (10, 2.500000)",
+            "Executed.",
+            "db >",
+        ])
+
+    def test_aggregates(self):
+        script = [
+            "insert into balance values (2, 20.5), (1, 10), (2, 7), (3, 30), (9, 1)",
+            "delete from balance where user_id = 9",
+            "select count(*) from balance",
+            "select count(*), sum(balance), min(balance), max(user_id), avg(balance) from balance where balance > 8",
+            "select user_id, count(*), sum(balance) from balance group by user_id",
+            "select user_id, count(*) from balance",
+            "select count(*), sum(balance), sum(user_id), min(balance), avg(balance) from balance where user_id > 100",
+            ".exit\n",
+        ]
+        result = self.run_script(script)
+        self.assertEqual(result[2:], [
+            "db > (4)",
+            "Executed.",
+            "db > (3, 60.500000, 10.000000, 3, 20.166667)",
+            "Executed.",
+            "db > (2, 2, 27.500000)",
+            "(1, 1, 10.000000)",
+            "(3, 1, 30.000000)",
+            "Executed.",
+            "db > Syntax error.",
+            "db > (0, NULL, NULL, NULL, NULL)",
+            "Executed.",
+            "db >",
+        ])
+
+    def test_parallel_scan(self):
+        values = ", ".join(f"({i}, user{i % 7}, person{i}@example.com)" for i in range(1, 2001))
+        self.run_script([f"insert into users values {values}", "delete from users where id > 100 and id < 200", ".exit\n"])
+
+        script = [
+            "select * from users where email != 'person5@example.com'",
+            "select username, count(*), min(id), max(id), sum(id) from users group by username",
+            "select count(*), avg(id) from users where id > 1000",
+            ".exit\n",
+        ]
+        sequential = self.run_script(script, ['--threads', '1'])
+        parallel = self.run_script(script, ['--threads', '4'])
+        self.assertEqual(len(sequential), 1900 + 1 + 8 + 2 + 1)
+        self.assertEqual(parallel, sequential)
+
+    def test_secondary_index(self):
+        self.run_script([
+            "insert into users values (1, user1, person1@example.com), (2, user2, person2@example.com), (3, user1, person3@example.com)",
+            "create index users_email on users(email)",
+            "create index users_username on users(username)",
+            "create index users_email on users(id)",
+            "create index users_name on users(username)",
+            ".exit\n",
+        ])
+        with open('data/db.catalog') as catalog:
+            self.assertEqual(catalog.read(), "users_email;users;email\nusers_username;users;username\n")
+
+        result = self.run_script([
+            "select * from users where email = 'person2@example.com'",
+            "update users set email = 'new@example.com' where id = 2",
+            "select id from users where email = 'person2@example.com'",
+            "select id from users where email = 'new@example.com'",
+            "insert into users values (4, user1, person4@example.com)",
+            "delete from users where id = 3",
+            "select id, email from users where username = 'user1'",
+            "select count(*) from users where username = 'user1' and id > 1",
+            ".exit\n",
+        ])
+        self.assertEqual(result, [
+            "db > (2, user2, person2@example.com)",
+            "Executed.",
+            "db > Executed.",
+            "db > Executed.",
+            "db > (2)",
+            "Executed.",
+            "db > Executed.",
+            "db > Executed.",
+            "db > (1, person1@example.com)",
+            "(4, person4@example.com)",
+            "Executed.",
+            "db > (1)",
+            "Executed.",
+            "db >",
+        ])
+
+        os.remove('data/users.users_email.index')
+        result = self.run_script([
+            "create index users_email on users(email)",
+            ".vacuum",
+            "select id from users where email = 'person4@example.com'",
+            ".exit\n",
+        ])
+        self.assertEqual(result, [
+            "db > Error: Index already exists.",
+            "db > db > (4)",
+            "Executed.",
+            "db >",
+        ])
+
+    def test_recovery_after_schema_change(self):
+        schema = 'data/test_renumber.schema'
+        with open(schema, 'w') as f:
+            f.write("1\nusers;3;id:4:int,username:32:varchar,email:255:varchar\n")
+        self.addCleanup(os.remove, schema)
+
+        # No .exit, so the rows of t are only in the log
+        result = self.run_script([
+            "create table t (id int key, label varchar(16))",
+            "insert into t values (1, one), (2, two)",
+            "",
+        ], schema=schema)
+        self.assertEqual(result[-1], "db > Error reading input")
+
+        # A table added before t in the schema file must not take over its
+        # pages in the log
+        with open(schema, 'w') as f:
+            f.write("2\nusers;3;id:4:int,username:32:varchar,email:255:varchar\n"
+                    "extra;2;id:4:int,label:16:varchar\n")
+        result = self.run_script([
+            "select * from t",
+            "select * from extra",
+            "insert into t values (3, three)",
+            "insert into extra values (1, new)",
+            ".exit\n",
+        ], schema=schema)
+        self.assertEqual(result, [
+            "db > (1, one)",
+            "(2, two)",
+            "Executed.",
+            "db > Executed.",
+            "db > Executed.",
+            "db > Executed.",
+            "db >",
+        ])
+        result = self.run_script([
+            "select * from t",
+            "select * from extra",
+            ".exit\n",
+        ], schema=schema)
+        self.assertEqual(result, [
+            "db > (1, one)",
+            "(2, two)",
+            "(3, three)",
+            "Executed.",
+            "db > (1, new)",
+            "Executed.",
+            "db >",
+        ])
+
+    def test_create_table(self):
+        schema = 'data/test_create.schema'
+        with open(schema, 'w') as f:
+            f.write("1\nusers;3;id:4:int,username:32:varchar,email:255:varchar\n")
+        self.addCleanup(os.remove, schema)
+
+        result = self.run_script([
+            "create table events (seq int key, name varchar(64), amount real) pax",
+            "create table events (id int)",
+            "create table bad (name varchar(0))",
+            "create table bad (name text)",
+            "insert into events values (1, first, 1.5), (2, second, 2.5)",
+            "select * from events where seq = 2",
+            ".exit\n",
+        ], schema=schema)
+        self.assertEqual(result, [
+            "db > Executed.",
+            "db > Error: Table already exists.",
+            "db > Syntax error.",
+            "db > Syntax error.",
+            "db > Executed.",
+            "db > (2, second, 2.500000)",
+            "Executed.",
+            "db >",
+        ])
+        # Tables are opened when first used, so users has no files yet
+        self.assertTrue(os.path.exists('data/events.index'))
+        self.assertFalse(os.path.exists('data/users.table'))
+
+        # Tables made with create table outlive changes to the schema file
+        with open(schema, 'w') as f:
+            f.write("2\nusers;3;id:4:int,username:32:varchar,email:255:varchar\n"
+                    "items;2;id:4:int,label:16:varchar\n")
+        result = self.run_script([
+            "insert into items values (1, box)",
+            "select name, amount from events where seq = 1",
+            "select * from items",
+            ".exit\n",
+        ], schema=schema)
+        self.assertEqual(result, [
+            "db > Executed.",
+            "db > (first, 1.500000)",
+            "Executed.",
+            "db > (1, box)",
+            "Executed.",
+            "db >",
+        ])
+
+    def test_analyze(self):
+        # Half of the rows share each username, so once the table is
+        # analyzed its index is not worth looking rows up in
+        values = ", ".join(f"({i}, user{i % 2}, person{i}@example.com)"
+                           for i in range(1, 2001))
+        explain = "explain analyze select id from users where username = 'user1'"
+        result = self.run_script([
+            f"insert into users values {values}",
+            "create index users_username on users(username)",
+            explain,
+            "analyze users",
+            explain,
+            "explain analyze select id from users where id > 1990",
+            "analyze nope",
+            "analyze",
+            ".exit\n",
+        ])
+        steps = [line for line in result if " on users: " in line]
+        self.assertEqual([step.split(":")[0].removeprefix("db > ")
+                          for step in steps], [
+            "Index lookup on users",
+            "Fetch rows on users",
+            "Scan on users",
+            "Index lookup on users",
+            "Fetch rows on users",
+        ])
+        self.assertEqual(result[-3:], [
+            "db > Table not found.",
+            "db > Unrecognized keyword at start of 'analyze'.",
+            "db >",
+        ])
+
+        with open('data/db.stats') as statistics:
+            lines = statistics.read().splitlines()
+        self.assertEqual([line.split(";")[:3] for line in lines], [
+            ["users", "id", "2000"],
+            ["users", "username", "2000"],
+            ["users", "email", "2000"],
+        ])
+        self.assertEqual(lines[0].split(";")[3:5], ["2000", "1"])
+        self.assertEqual(lines[0].split(";")[5].split(",")[::16], ["1", "2000"])
+        self.assertAlmostEqual(float(lines[1].split(";")[3]), 2, places=1)
+        self.assertAlmostEqual(float(lines[2].split(";")[3]), 2000, delta=60)
+
+        # The statistics are loaded with the database
+        result = self.run_script([explain, ".exit\n"])
+        self.assertTrue(result[0].startswith("db > Scan on users: rows=1000 "))
+
+    def test_zone_maps(self):
+        # Balances grow with the rows, so a range only needs the last page
+        values = ", ".join(f"({i}, {i}.5)" for i in range(1, 3001))
+        explain = "explain analyze select * from balance where balance > 2990"
+        result = self.run_script([
+            f"insert into balance values {values}",
+            explain,
+            "update balance set balance = 0.25 where balance >= 2999",
+            "select * from balance where balance < 1 or user_id = 2996",
+            "delete from balance where user_id > 10 and balance < 2996",
+            ".exit\n",
+        ])
+        self.assertTrue(result[1].startswith("db > Scan on balance: rows=11 "))
+        self.assertTrue(result[3].endswith(", skipped: 8"))
+        self.assertEqual(result[7:], [
+            "db > Executed.",
+            "db > (2996, 2996.500000)",
+            "(2999, 0.250000)",
+            "(3000, 0.250000)",
+            "Executed.",
+            "db > Executed.",
+            "db >",
+        ])
+
+        # The zone maps are kept with the table, and rebuilt by .vacuum
+        result = self.run_script([
+            explain,
+            "select count(*) from balance where user_id < 11",
+            ".vacuum balance",
+            "select * from balance where balance > 2996",
+            ".exit\n",
+        ])
+        self.assertTrue(result[0].startswith("db > Scan on balance: rows=3 "))
+        self.assertTrue(result[2].endswith(", skipped: 8"))
+        self.assertEqual(result[6:], [
+            "db > (10)",
+            "Executed.",
+            "db > db > (2996, 2996.500000)",
+            "(2997, 2997.500000)",
+            "(2998, 2998.500000)",
+            "Executed.",
+            "db >",
+        ])
+
+    def test_overflow_strings(self):
+        emails = {i: f"{i}" + "x" * (i * 37 % 240) + "@example.com" for i in range(1, 101)}
+        values = ", ".join(f"({i}, user{i % 3}, {email})" for i, email in emails.items())
+        long_email = "a" * 255
+        self.run_script([
+            f"insert into users values {values}",
+            f"update users set email = '{long_email}' where id = 7",
+            "delete from users where id > 10 and id < 95",
+            ".vacuum",
+            ".exit\n",
+        ])
+
+        result = self.run_script([
+            "select id, email from users where id < 4",
+            f"select id from users where email = '{emails[99]}'",
+            f"select id from users where email != '{emails[99]}' and id > 95",
+            f"select id from users where email = '{long_email}'",
+            "create index users_email on users(email)",
+            f"select id from users where email = '{emails[97]}'",
+            "select username, count(*) from users where id > 95 group by username",
+            ".exit\n",
+        ])
+        self.assertEqual(result, [
+            f"db > (1, {emails[1]})",
+            f"(2, {emails[2]})",
+            f"(3, {emails[3]})",
+            "Executed.",
+            "db > (99)",
+            "Executed.",
+            "db > (96)",
+            "(97)",
+            "(98)",
+            "(100)",
+            "Executed.",
+            "db > (7)",
+            "Executed.",
+            "db > Executed.",
+            "db > (97)",
+            "Executed.",
+            "db > (user0, 2)",
+            "(user1, 2)",
+            "(user2, 1)",
+            "Executed.",
+            "db >",
+        ])
+
+    def test_binary_mode(self):
+        self.run_script([
+            "insert into users values (1, user1, person1@example.com), (2, u2, person2@example.com)",
+            ".exit\n",
+        ])
+        process = subprocess.run(
+            ['./main', 'db.schema'],
+            input=b".mode binary\nselect id, username from users\nselect count(*) from users\n.exit\n",
+            stdout=subprocess.PIPE
+        )
+        output = process.stdout
+        self.assertTrue(output.startswith(b"db > db > "))
+        pos = len(b"db > db > ")
+
+        def read_rows():
+            nonlocal pos
+            rows = []
+            while True:
+                (length,) = struct.unpack_from('=I', output, pos)
+                pos += 4
+                if length == 0:
+                    return rows
+                end = pos + length
+                values = []
+                while pos < end:
+                    (value_length,) = struct.unpack_from('=H', output, pos)
+                    values.append(output[pos + 2:pos + 2 + value_length])
+                    pos += 2 + value_length
+                rows.append(values)
+
+        self.assertEqual(read_rows(), [
+            [struct.pack('=i', 1), b"user1"],
+            [struct.pack('=i', 2), b"u2"],
+        ])
+        self.assertEqual(output[pos:pos + 15], b"Executed.\ndb > ")
+        pos += 15
+        self.assertEqual(read_rows(), [[struct.pack('=q', 2)]])
+        self.assertEqual(output[pos:], b"Executed.\ndb > ")
+
+    def test_server(self):
+        with socket.socket() as probe:
+            probe.bind(('127.0.0.1', 0))
+            port = probe.getsockname()[1]
+        server = subprocess.Popen(
+            ['./main', '--listen', f'127.0.0.1:{port}', 'db.schema'],
+            stdout=subprocess.PIPE,
+            text=True
+        )
+        try:
+            self.assertEqual(server.stdout.readline(), f"Listening on 127.0.0.1:{port}\n")
+
+            def run_client(commands):
+                with socket.create_connection(('127.0.0.1', port)) as client:
+                    client.sendall(('\n'.join(commands) + '\n.exit\n').encode())
+                    output = b''
+                    while chunk := client.recv(65536):
+                        output += chunk
+                return output.decode().strip().split('\n')
+
+            results = {}
+            def writer(client_id):
+                results[client_id] = run_client([
+                    f"insert into users values ({client_id * 100 + i}, user{client_id}, person{i}@example.com)"
+                    for i in range(50)
+                ] + [f"select count(*) from users where username = 'user{client_id}'"])
+
+            threads = [threading.Thread(target=writer, args=(i,)) for i in range(1, 5)]
+            for thread in threads:
+                thread.start()
+            for thread in threads:
+                thread.join()
+            for client_id in range(1, 5):
+                self.assertEqual(results[client_id], ["Executed."] * 50 + ["(50)", "Executed."])
+
+            self.assertEqual(run_client([
+                "select count(*) from users",
+                "prepare by_id as select username from users where id = ?",
+                "execute by_id(301)",
+                "select * from missing",
+            ]), ["(200)", "Executed.", "Executed.", "(user3)", "Executed.", "Table not found."])
+            self.assertEqual(run_client(["create table packed (id int) compressed"]),
+                             ["Error: Compressed tables cannot be served."])
+            self.assertEqual(run_client([".import users /etc/passwd"]),
+                             ["Error: .import cannot be served."])
+        finally:
+            server.kill()
+            server.wait()
+            server.stdout.close()
+
+    def test_insert_beyond_initial_page_directory(self):
+        script = [f"insert into users values ({i}, user{i}, person{i}@example.com)" for i in range(1, 5001)]
+        script += [
+            "select * from users where id = 5000",
+            ".exit\n",
+        ]
+        result = self.run_script(script)
+        self.assertEqual(result[-3:], [
+            "db > (5000, user5000, person5000@example.com)",
+            "Executed.",
+            "db >",
+        ])
 
     def test_max_length_strings(self):
         long_username = "a" * 32
@@ -294,6 +1158,383 @@ class TestDatabase(unittest.TestCase):
         ]
         self.assertEqual(result2, expected_output)
 
+    def test_select_by_id_range(self):
+        script = [f"insert into users values ({i}, user{i}, person{i}@example.com)" for i in range(1000, 0, -1)]
+        script += [
+            "select id from users where id = 500",
+            "select id from users where id < 3",
+            "select id from users where id >= 999",
+            ".exit\n",
+        ]
+        result = self.run_script(script)
+        expected_output = [
+            "db > (500)",
+            "Executed.",
+            "db > (1)",
+            "(2)",
+            "Executed.",
+            "db > (999)",
+            "(1000)",
+            "Executed.",
+            "db >",
+        ]
+        self.assertEqual(result[-len(expected_output):], expected_output)
+
+    def test_index_follows_updates_and_deletes(self):
+        script1 = [
+            "insert into users values (1, user1, person1@example.com)",
+            "insert into users values (2, user2, person2@example.com)",
+            "insert into users values (3, user3, person3@example.com)",
+            "update users set id = 7 where id = 1",
+            "delete from users where id = 2",
+            ".exit\n",
+        ]
+        self.run_script(script1)
+
+        script2 = [
+            "select * from users where id = 1",
+            "select * from users where id > 2",
+            ".exit\n",
+        ]
+        result = self.run_script(script2)
+        expected_output = [
+            "db > Executed.",
+            "db > (3, user3, person3@example.com)",
+            "(7, user1, person1@example.com)",
+            "Executed.",
+            "db >",
+        ]
+        self.assertEqual(result, expected_output)
+
+    def test_small_buffer_pool(self):
+        script = [f"insert into users values ({i}, user{i}, person{i}@example.com)" for i in range(3000, 0, -1)]
+        script += [
+            "update users set username = 'updated' where id = 1500",
+            ".exit\n",
+        ]
+        self.run_script(script, ['--buffer-pool', '64K'])
+
+        result = self.run_script([
+            "select * from users where id = 1500",
+            "select id from users where username = 'user2999'",
+            ".exit\n",
+        ], ['--buffer-pool', '64K'])
+        self.assertEqual(result, [
+            "db > (1500, updated, person1500@example.com)",
+            "Executed.",
+            "db > (2999)",
+            "Executed.",
+            "db >",
+        ])
+
+    def test_read_ahead(self):
+        script = [f"insert into users values ({i}, user{i}, person{i}@example.com)" for i in range(1, 3001)]
+        script.append(".exit\n")
+        self.run_script(script, ['--buffer-pool', '64K'])
+
+        result = self.run_script([
+            "select id from users where username = 'user2999'",
+            ".stats",
+            ".exit\n",
+        ], ['--buffer-pool', '64K'])
+        self.assertEqual(result[:2], ["db > (2999)", "Executed."])
+        prefetched = [line for line in result if line.startswith('pages_prefetched')]
+        self.assertEqual(len(prefetched), 1)
+        self.assertGreater(int(prefetched[0].split()[1]), 0)
+
+    def test_page_size(self):
+        script = [f"insert into users values ({i}, user{i}, person{i}@example.com)" for i in range(1, 1001)]
+        script.append(".exit\n")
+        self.run_script(script, ['--page-size', '16K'])
+        self.assertEqual(os.path.getsize('data/users.table') % 16384, 0)
+
+        result = self.run_script([
+            "select * from users where id = 999",
+            "select count(*) from users",
+            ".exit\n",
+        ])
+        self.assertEqual(result, [
+            "db > (999, user999, person999@example.com)",
+            "Executed.",
+            "db > (1000)",
+            "Executed.",
+            "db >",
+        ])
+
+        result = self.run_script([".exit\n"], ['--page-size', '4K'])
+        self.assertEqual(result, ["Database has 16384 byte pages"])
+        result = self.run_script([".exit\n"], ['--page-size', '6K'])
+        self.assertEqual(result, ["Page size must be a power of two from 4096 to 65536 bytes"])
+
+    def test_transactions(self):
+        inserts = [f"insert into users values ({i}, user{i}, person{i}@example.com)" for i in range(2, 1001)]
+        result = self.run_script([
+            "insert into users values (1, user1, person1@example.com)",
+            "begin",
+            *inserts,
+            "update users set username = 'updated' where id = 1",
+            "select count(*) from users",
+            "create index users_email on users(email)",
+            "rollback",
+            "select count(*) from users",
+            "select * from users where id = 1",
+            "select * from users where id = 500",
+            "commit",
+            ".exit\n",
+        ], ['--buffer-pool', '64K'])
+        self.assertEqual(result[1002:], [
+            "db > (1000)",
+            "Executed.",
+            "db > Error: Not allowed in a transaction.",
+            "db > Executed.",
+            "db > (1)",
+            "Executed.",
+            "db > (1, user1, person1@example.com)",
+            "Executed.",
+            "db > Executed.",
+            "db > Error: No transaction is open.",
+            "db >",
+        ])
+
+        self.run_script(["begin", *inserts[:10], "commit", "begin", "begin",
+                         "delete from users where id = 1", ".exit\n"])
+        result = self.run_script([
+            "select count(*) from users",
+            "select * from users where id = 1",
+            ".exit\n",
+        ])
+        self.assertEqual(result, [
+            "db > (11)",
+            "Executed.",
+            "db > (1, user1, person1@example.com)",
+            "Executed.",
+            "db >",
+        ])
+
+    def test_order_by_and_limit(self):
+        # Ids are inserted out of order, and usernames repeat
+        ids = [(i * 7919) % 1000 + 1 for i in range(1000)]
+        script = [f"insert into users values ({i}, user{i % 10}, person{i}@example.com)" for i in ids]
+        script.append(".exit\n")
+        self.run_script(script)
+        # Equal usernames stay in the order they were inserted
+        nines = [i for i in ids if i % 10 == 9]
+
+        result = self.run_script([
+            "select id from users limit 2",
+            "select id from users limit 1 offset 2",
+            "select id from users order by id desc limit 3",
+            "select id, username from users order by username desc limit 2 offset 1",
+            "select id from users where id < 30 order by email limit 3",
+            "select id from users order by id limit 0",
+            "select id from users order by nope",
+            "select count(*) from users order by id",
+            "select id from users limit -1",
+            ".exit\n",
+        ])
+        self.assertEqual(result, [
+            f"db > ({ids[0]})", f"({ids[1]})", "Executed.",
+            f"db > ({ids[2]})", "Executed.",
+            "db > (1000)", "(999)", "(998)", "Executed.",
+            f"db > ({nines[1]}, user9)", f"({nines[2]}, user9)", "Executed.",
+            "db > (10)", "(11)", "(12)", "Executed.",
+            "db > Executed.",
+            "db > Syntax error.",
+            "db > Syntax error.",
+            "db > Syntax error.",
+            "db >",
+        ])
+
+        # The key index gives the order, so nothing is sorted
+        result = self.run_script([
+            "explain analyze select * from users order by id limit 5",
+            ".exit\n",
+        ])
+        self.assertTrue(result[0].startswith("db > Index order on users: rows=5 "))
+
+        # A sort larger than its memory spills runs and merges them
+        result = self.run_script([
+            "select id from users order by email",
+            ".stats",
+            ".exit\n",
+        ], ['--sort-memory', '8K'])
+        emails = sorted(f"person{i}@example.com" for i in ids)
+        self.assertEqual(result[:1000], [f"db > ({emails[0][6:-12]})"] + [f"({e[6:-12]})" for e in emails[1:]])
+        runs = [line for line in result if line.startswith('sort_runs')]
+        self.assertGreater(int(runs[0].split()[1]), 1)
+
+    def test_recovery_without_clean_exit(self):
+        # No .exit, so the table files are never flushed and only the log
+        # has the changes
+        script1 = [
+            "insert into users values (1, user1, person1@example.com)",
+            "insert into users values (2, user2, person2@example.com)",
+            "update users set username = 'user3' where id = 2",
+            "",
+        ]
+        result1 = self.run_script(script1)
+        self.assertEqual(result1[-1], "db > Error reading input")
+
+        result2 = self.run_script([
+            "select * from users",
+            ".exit\n",
+        ])
+        self.assertEqual(result2, [
+            "db > (1, user1, person1@example.com)",
+            "(2, user3, person2@example.com)",
+            "Executed.",
+            "db >",
+        ])
+
+    def test_recovery_after_acknowledged_insert(self):
+        # The commit must be durable by the time it is reported, even
+        # though the writer thread fsyncs the log once per sync window
+        process = subprocess.Popen(
+            ['./main', 'db.schema'],
+            stdin=subprocess.PIPE,
+            stdout=subprocess.PIPE,
+            stderr=subprocess.PIPE,
+            text=True
+        )
+        process.stdin.write("insert into users values (1, user1, person1@example.com)\n")
+        process.stdin.flush()
+        self.assertEqual(process.stdout.readline(), "db > Executed.\n")
+        process.kill()
+        process.communicate()
+
+        result = self.run_script([
+            "select * from users",
+            ".exit\n",
+        ])
+        self.assertEqual(result, [
+            "db > (1, user1, person1@example.com)",
+            "Executed.",
+            "db >",
+        ])
+
+    def test_recovery_after_acknowledged_commit(self):
+        def rows(first, last):
+            return ', '.join(f"({i}, user{i}, person{i}@example.com)" for i in range(first, last))
+        process = subprocess.Popen(
+            ['./main', 'db.schema'],
+            stdin=subprocess.PIPE,
+            stdout=subprocess.PIPE,
+            stderr=subprocess.PIPE,
+            text=True
+        )
+        inserts = [f"insert into users values {rows(i, i + 1000)}" for i in range(1, 10001, 1000)]
+        process.stdin.write('\n'.join(["begin", *inserts, "commit", ""]))
+        process.stdin.flush()
+        # One line for begin, one per insert and one for commit
+        for _ in range(len(inserts) + 2):
+            self.assertEqual(process.stdout.readline(), "db > Executed.\n")
+        process.kill()
+        process.communicate()
+
+        result = self.run_script([
+            "select count(*) from users",
+            "select * from users where id = 10000",
+            ".exit\n",
+        ])
+        self.assertEqual(result, [
+            "db > (10000)",
+            "Executed.",
+            "db > (10000, user10000, person10000@example.com)",
+            "Executed.",
+            "db >",
+        ])
+
+    def test_recovery_inside_statement(self):
+        inserts = [f"insert into balance values {', '.join(f'({i}, 1.0)' for i in range(b + 1, b + 1001))}"
+                   for b in range(0, 400000, 1000)]
+        self.run_script([*inserts, ".exit\n"])
+
+        # The buffer pool evicts pages of the update to the table file
+        # before it commits; kill the process once the first one is written
+        before = os.stat('data/balance.table').st_mtime_ns
+        process = subprocess.Popen(
+            ['./main', '--buffer-pool', '64K', 'db.schema'],
+            stdin=subprocess.PIPE,
+            stdout=subprocess.PIPE,
+            stderr=subprocess.PIPE,
+            text=True
+        )
+        process.stdin.write("update balance set balance = 7.0 where user_id > 0\n")
+        process.stdin.flush()
+        while os.stat('data/balance.table').st_mtime_ns == before and process.poll() is None:
+            pass
+        process.kill()
+        process.communicate()
+
+        # The update is undone or complete, and the zone maps agree
+        result = self.run_script([
+            "select count(*) from balance where balance = 7.0",
+            "select count(*) from balance where balance > 5.0",
+            "select count(*) from balance where balance < 5.0",
+            ".exit\n",
+        ])
+        updated = result[0][len("db > ("):-1]
+        self.assertIn(updated, ["0", "400000"])
+        self.assertEqual(result, [
+            f"db > ({updated})",
+            "Executed.",
+            f"db > ({updated})",
+            "Executed.",
+            f"db > ({400000 - int(updated)})",
+            "Executed.",
+            "db >",
+        ])
+
+    def test_recovery_inside_transaction(self):
+        def rows(first, last):
+            return ', '.join(f"({i}, user{i}, person{i}@example.com)" for i in range(first, last))
+        inserts = [f"insert into users values {rows(i, i + 100)}" for i in range(1, 3001, 100)]
+        self.run_script([*inserts, ".exit\n"], ['--buffer-pool', '256K'])
+
+        # The transaction outgrows the buffer pool, so some of its pages
+        # reach the table files before the process is killed
+        process = subprocess.Popen(
+            ['./main', '--buffer-pool', '256K', 'db.schema'],
+            stdin=subprocess.PIPE,
+            stdout=subprocess.PIPE,
+            stderr=subprocess.PIPE,
+            text=True
+        )
+        inserts = [f"insert into users values {rows(i, i + 100)}" for i in range(3001, 8001, 100)]
+        process.stdin.write('\n'.join([
+            "begin",
+            *inserts,
+            "update users set username = 'updated' where id < 3000",
+            "select count(*) from users",
+            "",
+        ]))
+        process.stdin.flush()
+        for line in process.stdout:
+            if "(8000)" in line:
+                break
+        process.kill()
+        process.communicate()
+
+        result = self.run_script([
+            "select count(*) from users",
+            "select * from users where id = 9001",
+            "select * from users where id = 7000",
+            "select count(*) from users where username = 'updated'",
+            "select * from users where id = 2999",
+            ".exit\n",
+        ])
+        self.assertEqual(result, [
+            "db > (3000)",
+            "Executed.",
+            "db > Executed.",
+            "db > Executed.",
+            "db > (0)",
+            "Executed.",
+            "db > (2999, user2999, person2999@example.com)",
+            "Executed.",
+            "db >",
+        ])
+
 if __name__ == '__main__':
     unittest.main()
 